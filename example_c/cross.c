@@ -19,6 +19,7 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 *********************************************************************/
 #include <lwpr.h>
 #include <lwpr_xml.h>
+#include <lwpr_prof.h>
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
@@ -76,6 +77,11 @@ int main() {
    /* See above definition, we either use srand() on Windows or srand48 everywhere else */
    SEED_RAND();
 
+#if LWPR_PROFILE
+   /* Collect times (and hardware counters) of the update and prediction phases */
+   lwpr_profile_start();
+#endif
+
    for (j=0;j<20;j++) {
       mse = 0.0;
 
@@ -153,6 +159,12 @@ int main() {
 
    printf("MSE on test data (%d) = %f\n",i,mse/(double) i);
 
+#if LWPR_PROFILE
+   lwpr_profile_stop();
+   printf("\n");
+   lwpr_profile_report(stdout);
+#endif
+
    printf("\nTo view the output, start gnuplot, and type:\n");
    printf("   splot \"output.txt\"\n\n");
 
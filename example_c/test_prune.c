@@ -0,0 +1,133 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+/* Checks that lwpr_prune_projections leaves a model that trains exactly like
+** one that never had the pruned projections: the pruned model is written to a
+** binary file (which only holds the remaining projections) and read back, and
+** both copies are trained further on the same data. */
+
+#include <lwpr.h>
+#include <lwpr_binio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define NUM_TRAIN    20000
+#define NUM_TEST     500
+#define NUM_IN       6
+
+static unsigned long seed = 1;
+
+static double urand(void) {
+   /* Own generator, so that both models see exactly the same data on all platforms */
+   seed = seed * 1103515245UL + 12345UL;
+   return (double) ((seed >> 16) & 0x7fff) / 32767.0;
+}
+
+static void sample(double *x, double *y) {
+   int i;
+   for (i=0;i<NUM_IN;i++) x[i] = 2.0*urand() - 1.0;
+   y[0] = sin(2*x[0]) + x[1]*x[2] + 0.5*x[3]*x[3] + 0.3*x[0]*x[3] + 0.4*x[4] - 0.3*x[5]*x[5]*x[5]
+         + 0.05*(urand()-0.5);
+}
+
+static int count_projections(const LWPR_Model *model) {
+   int n, total = 0;
+   for (n=0;n<model->sub[0].numRFS;n++) total += model->sub[0].rf[n]->nReg;
+   return total;
+}
+
+int main() {
+   LWPR_Model A, B;
+   double x[NUM_IN], y[1], ya[1], yb[1];
+   double fp, fu, sum_fp = 0.0, sum_fu = 0.0;
+   double *rf_flops;
+   int n, removed, before, mismatch = 0;
+   unsigned long seed_train;
+
+   lwpr_init_model(&A, NUM_IN, 1, "prune");
+   lwpr_set_init_D_spherical(&A, 1.0);
+   A.update_D = 1;
+   A.diag_only = 0;
+   A.add_threshold = 0.95;
+
+   for (n=0;n<NUM_TRAIN;n++) {
+      sample(x,y);
+      lwpr_update(&A, x, y, NULL, NULL);
+   }
+
+   before = count_projections(&A);
+   rf_flops = (double *) malloc(2*A.sub[0].numRFS*sizeof(double));
+   if (rf_flops == NULL) return 1;
+   removed = lwpr_prune_projections(&A, 0.03, &fp, &fu, rf_flops);
+   printf("Receptive fields: %d, projections: %d, pruned: %d\n", A.sub[0].numRFS, before, removed);
+   if (removed == 0) {
+      printf("FAIL: nothing was pruned, the test does not cover anything\n");
+      return 1;
+   }
+   for (n=0;n<A.sub[0].numRFS;n++) {
+      sum_fp += rf_flops[2*n];
+      sum_fu += rf_flops[2*n+1];
+   }
+   free(rf_flops);
+   printf("Flops saved per prediction: %g, per update: %g\n", fp, fu);
+   if (fp <= 0.0 || fu <= 0.0 || sum_fp != fp || sum_fu != fu) {
+      printf("FAIL: per-RF flop savings do not add up to the totals\n");
+      return 1;
+   }
+
+   if (!lwpr_write_binary(&A, "test_prune.bin") || !lwpr_read_binary(&B, "test_prune.bin")) {
+      printf("FAIL: could not write or read test_prune.bin\n");
+      return 1;
+   }
+   remove("test_prune.bin");
+
+   /* Retrain both; the projections grow back into the slots that were pruned */
+   seed_train = seed;
+   for (n=0;n<NUM_TRAIN;n++) {
+      sample(x,y);
+      lwpr_update(&A, x, y, ya, NULL);
+   }
+   seed = seed_train;
+   for (n=0;n<NUM_TRAIN;n++) {
+      sample(x,y);
+      lwpr_update(&B, x, y, yb, NULL);
+   }
+   printf("Projections after retraining: %d / %d\n", count_projections(&A), count_projections(&B));
+
+   if (A.sub[0].numRFS != B.sub[0].numRFS || count_projections(&A) != count_projections(&B)) mismatch++;
+   for (n=0;n<NUM_TEST;n++) {
+      sample(x,y);
+      lwpr_predict(&A, x, 0.001, ya, NULL, NULL);
+      lwpr_predict(&B, x, 0.001, yb, NULL, NULL);
+      if (memcmp(ya, yb, sizeof(double))) mismatch++;
+   }
+
+   lwpr_free_model(&A);
+   lwpr_free_model(&B);
+
+   if (mismatch) {
+      printf("FAIL: pruned model differs from a model without the pruned projections (%d)\n", mismatch);
+      return 1;
+   }
+   printf("PASS\n");
+   return 0;
+}
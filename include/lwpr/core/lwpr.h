@@ -139,14 +139,23 @@ typedef struct {
 
    int trustworthy;    /**< \brief This flag indicates whether a receptive field has "seen" enough data so that its predictions can be trusted */
    int slopeReady;     /**< \brief Indicates whether the vector "slope" can be used instead of doing PLS calculatations */
-   double w;           /**< \brief The current activation (weight) */
+   int boxReady;       /**< \brief Indicates whether the vector "box" matches the current distance metric */
+   int DReady;         /**< \brief Indicates whether D matches M. For full metrics, D is only formed from M on demand, see lwpr_rf_get_D */
+   double w;           /**< \brief The activation (weight) of the last update this RF took part in. Use lwpr_rf_activation to read the current activation */
+   int w_stamp;        /**< \brief Value of LWPR_Model.n_updates when LWPR_ReceptiveField.w was last written */
+   int dirty;          /**< \brief Groups of fields changed since the last replication delta (LWPR_DELTA_* flags, see lwpr_repl.h) */
+   volatile int seq;   /**< \brief Sequence number of changes by lwpr_update, odd while the RF is being changed (only maintained for concurrent predictions, see lwpr_set_concurrent) */
+   int ckpt;           /**< \brief Position + 1 of the RF in the pending checkpoint, which needs a copy before the RF is changed, or 0 (see lwpr_checkpoint_start) */
    double sum_e2;      /**< \brief The accumulated prediction error on the training data */
+   double mon_sum_e2;  /**< \brief Squared CV-errors of the updates, weighted with the activations and decayed with LWPR_Model.mon_decay (see lwpr_monitor_rf_mse) */
+   double mon_sum_w;   /**< \brief Activations of the updates, decayed like LWPR_ReceptiveField.mon_sum_e2 */
    double beta0;       /**< \brief Constant part of the PLS output */
    double SSp;         /**< \brief Sufficient statistics used for the confidence bounds */
 
-   double *D;          /**< \brief Distance metric (NxN) */
-   double *M;          /**< \brief Cholesky factorization of the distance metric (NxN) */
-   double *alpha;      /**< \brief Learning rates for updates to M (NxN) */
+   double *D;          /**< \brief Distance metric (NxN, packed, see LWPR_Model.metric_col), NULL for low-rank metrics (see LWPR_Model.rank and lwpr_rf_get_D) */
+   double *M;          /**< \brief Cholesky factorization of the distance metric (NxN, packed like D, see lwpr_rf_get_M), NULL for low-rank metrics */
+   double *L;          /**< \brief Parameters of a low-rank-plus-diagonal metric D = diag(d) + L*L' (N x (rank+1)): the first column holds sqrt(d), the others the factor L. NULL unless LWPR_Model.rank > 0 */
+   double *alpha;      /**< \brief Learning rates for updates to M (NxN, packed like D), or to LWPR_ReceptiveField.L (N x (rank+1)) */
    double *beta;       /**< \brief PLS regression coefficients (Rx1) */
    double *c;          /**< \brief The centre of the receptive field (Nx1) */
    double *SXresYres;  /**< \brief Sufficient statistics for the PLS regression axes LWPR_ReceptiveField.U (NxR) */
@@ -157,8 +166,8 @@ typedef struct {
    double *P;          /**< \brief PLS input reduction parameters (NxR) */
    double *H;          /**< \brief Sufficient statistics for distance metric updates (Rx1) */
    double *r;          /**< \brief Sufficient statistics for distance metric updates (Rx1) */
-   double *h;          /**< \brief Sufficient statistics for 2nd order distance metric updates (NxN) */
-   double *b;          /**< \brief Memory terms for 2nd order updates to M (NxN) */
+   double *h;          /**< \brief Sufficient statistics for 2nd order distance metric updates (NxN, packed like D), NULL for low-rank metrics */
+   double *b;          /**< \brief Memory terms for 2nd order updates to M (NxN, packed like D), NULL for low-rank metrics */
    double *sum_w;      /**< \brief Accumulated activation w per PLS direction (Rx1) */
    double *sum_e_cv2;  /**< \brief Accumulated CV-error on training data (Rx1) */
    double *n_data;     /**< \brief Number of training data each PLS direction has seen (Rx1) */
@@ -167,9 +176,85 @@ typedef struct {
    double *var_x;      /**< \brief Variance of the training data this RF has seen (Nx1) */
    double *s;          /**< \brief Current PLS loadings (Rx1) */
    double *slope;      /**< \brief Slope of the local model (Nx1). This avoids PLS calculations when no updates are performed anymore. */
+   double *box;        /**< \brief Half-widths of the axis-aligned bounding box of the ellipsoid (x-c)'D(x-c) <= 1 (Nx1), see LWPR_Model.use_bbox */
+   struct LWPR_Cluster *cluster; /**< \brief The cluster this RF is a member of, NULL if the model does not use clusters (see lwpr_set_clusters) */
+   struct LWPR_OutOfCoreBlock *oocBlock; /**< \brief Block of the memory-mapped arena that holds alpha, h, b and the PLS statistics of this RF, NULL if all of its memory is resident (see lwpr_set_out_of_core) */
    const struct LWPR_Model *model; /**< \brief Pointer to the LWPR_Model this RF belongs to */
 } LWPR_ReceptiveField;
 
+/** \brief A group of nearby receptive fields together with a summary of their supports.
+
+   Predictions test a query against the summary first, and skip all members of a cluster
+   if none of them can be activated above the cutoff (see lwpr_set_clusters).
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Cluster {
+   int numRFS;                /**< \brief The number of member receptive fields (at most LWPR_Model.cluster_size) */
+   int ready;                 /**< \brief Indicates whether cmin, cmax and bmax match the current members */
+   LWPR_ReceptiveField **rf;  /**< \brief Array of pointers to the members (LWPR_Model.cluster_size) */
+   double *anchor;            /**< \brief Centre of the receptive field that founded the cluster (Nx1) */
+   double *cmin;              /**< \brief Element-wise minimum of the members' centres (Nx1) */
+   double *cmax;              /**< \brief Element-wise maximum of the members' centres (Nx1) */
+   double *bmax;              /**< \brief Element-wise maximum of the members' bounding boxes LWPR_ReceptiveField.box (Nx1) */
+   double *storage;           /**< \brief Pointer to allocated memory. Do not touch. */
+} LWPR_Cluster;
+
+/** \brief Callback that reports a receptive field which the random-projection index missed,
+      see LWPR_Model.index_audit
+   \param[in] dim       Output dimension
+   \param[in] n         Index of the receptive field within LWPR_SubModel.rf
+   \param[in] w         Activation of the receptive field, which is above the cutoff
+   \param[in] userData  LWPR_Model.index_miss_data
+   \ingroup LWPR_C
+*/
+typedef void (*LWPR_IndexMissCallback)(int dim, int n, double w, void *userData);
+
+/** \brief An entry of the sorted first table of a LWPR_RFIndex */
+typedef struct {
+   double key;                /**< \brief Projection of the RF's centre onto the first random direction */
+   int n;                     /**< \brief Index of the RF within LWPR_SubModel.rf */
+} LWPR_RFIndexEntry;
+
+/** \brief Random-projection index over the receptive fields of a LWPR_SubModel, see lwpr_set_index
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_RFIndex {
+   int numRFS;                /**< \brief The number of receptive fields the index was built for */
+   int numPointers;           /**< \brief The number of RFs that can be indexed before a re-allocation is necessary */
+   int ready;                 /**< \brief Indicates whether the index was built successfully */
+   int stamp;                 /**< \brief Value of LWPR_Model.n_updates when the index was last refreshed */
+   int changed;               /**< \brief Indicates whether RFs were added or moved since the last refresh */
+   LWPR_RFIndexEntry *entry;  /**< \brief RFs sorted by the projections of their centres onto the first direction (numPointers, followed by as many entries of working memory) */
+   double *proj;              /**< \brief Projections g'c of the centres onto all directions (index_proj x numRFS, by RF) */
+   double *width;             /**< \brief Extents sqrt(g'inv(D)g) of the RFs' unit ellipsoids along all directions (index_proj x numRFS, by RF) */
+   double maxWidth;           /**< \brief Largest extent along the first direction */
+   double *xproj;             /**< \brief Projections of the current query (index_proj) */
+   char *seen;                /**< \brief Marks the candidates of the current query if LWPR_Model.index_audit is set (numRFS) */
+   char *dirty;               /**< \brief Marks the positions in LWPR_SubModel.rf that received a new or moved RF since the last refresh (numPointers) */
+   long n_queries;            /**< \brief Number of queries answered through the index */
+   long n_candidates;         /**< \brief Number of candidate RFs returned for exact evaluation */
+   long n_audited;            /**< \brief Number of queries that were checked against a full scan */
+   long n_missed;             /**< \brief Number of RFs activated above the cutoff that were not among the candidates */
+} LWPR_RFIndex;
+
+/** \brief First-order expansion of the predictions of a model around a previous
+      query point, see lwpr_set_taylor_cache and lwpr_predict_cached.
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_TaylorCache {
+   int valid;                 /**< \brief Flag that determines whether x0, y0 and J0 hold an expansion point */
+   int stamp;                 /**< \brief Value of LWPR_Model.n_updates when the expansion point was computed */
+   double cutoff;             /**< \brief Cutoff parameter the expansion point was computed with */
+   double hnorm;              /**< \brief Largest Frobenius norm of the Hessians at x0 (only used if LWPR_Model.taylor_tol > 0) */
+   double *x0;                /**< \brief Expansion point (nInRaw x 1) */
+   double *y0;                /**< \brief Prediction at x0 (nOut x 1) */
+   double *J0;                /**< \brief Jacobian at x0 (nOut x nInRaw) */
+   double *H;                 /**< \brief Working memory for Hessians (nInRaw x nInRaw x nOut), NULL if LWPR_Model.taylor_tol <= 0 */
+   long n_hits;               /**< \brief Number of queries answered from the expansion */
+   long n_misses;             /**< \brief Number of queries that required a full evaluation */
+   double *storage;           /**< \brief Pointer to the allocated memory */
+} LWPR_TaylorCache;
+
 /** \brief The structure LWPR_SubModel holds all the receptive fields (LWPR_ReceptiveField) that
     contribute to a particular output dimension of the complete LWPR_Model.
    \ingroup LWPR_C
@@ -179,6 +264,11 @@ typedef struct {
    int numPointers;           /**< \brief The number of RFs that can be stored before a re-allocation is necessary */
    int n_pruned;              /**< \brief Number of RFs that were pruned during training */
    LWPR_ReceptiveField **rf;  /**< \brief Array of pointers to LWPR_ReceptiveField */
+   int numClusters;           /**< \brief The number of clusters (see LWPR_Cluster) */
+   int numClusterPointers;    /**< \brief The number of clusters that can be stored before a re-allocation is necessary */
+   LWPR_Cluster **clusters;   /**< \brief Array of pointers to LWPR_Cluster, NULL if the receptive fields are scanned one by one */
+   LWPR_RFIndex *index;       /**< \brief Random-projection index, NULL if not used (see lwpr_set_index) */
+   volatile int seq;          /**< \brief Sequence number of adding and pruning RFs, odd while LWPR_SubModel.rf is being changed (only maintained for concurrent predictions) */
    const struct LWPR_Model *model;/**< \brief Pointer to the "mother" LWPR_Model. */
 } LWPR_SubModel;
 
@@ -193,14 +283,22 @@ typedef struct {
 */
 typedef struct LWPR_Model {
    int nIn;             /**< \brief Number N of input dimensions */
+   int nInRaw;          /**< \brief Number of input dimensions passed to lwpr_update and the prediction functions. Equal to nIn unless an input projection is used (see lwpr_set_projection) */
    int nInStore;        /**< \brief Storage-size of any N-vector, for aligment purposes */
    int nOut;            /**< \brief Number M of output dimensions */
    int n_data;          /**< \brief Number of training data the model has seen */
+   int n_updates;       /**< \brief Number of training data that were actually used for updates (i.e., not skipped by the throttling gate) */
 
    double *mean_x;      /**< \brief Mean of all training data the model has seen (Nx1) */
    double *var_x;       /**< \brief Mean of all training data the model has seen (Nx1) */
    char *name;          /**< \brief An optional description of the model (Mx1) */
    int diag_only;       /**< \brief Flag that determines whether distance matrices are handled as diagonal-only */
+   int nBlocks;         /**< \brief Number of diagonal blocks of the distance matrices (default: 1 = full matrices), see lwpr_set_blocks */
+   int *block_begin;    /**< \brief First input dimension of the block that contains dimension i (Nx1) */
+   int *block_end;      /**< \brief One past the last input dimension of the block that contains dimension i (Nx1) */
+   int *metric_col;     /**< \brief Offsets of the columns of the packed distance matrices of the RFs: element (i,j) of a block is stored at index i + metric_col[j] (Nx1) */
+   int nMetric;         /**< \brief Number of doubles of each packed distance matrix (D, M, alpha, h, b) of a RF, that is, nIn*nInStore for a single block and the sum of the squared block sizes otherwise */
+   int rank;            /**< \brief Rank of the low-rank part of distance metrics D = diag(d) + L*L' (default: 0 = use full or diagonal metrics), see lwpr_set_rank */
    int meta;            /**< \brief Flag that determines wheter 2nd order updates to LWPR_ReceptiveField.M are computed */
    double meta_rate;    /**< \brief Learning rate for 2nd order updates */
    double penalty;      /**< \brief Penalty factor used within distance metric updates */
@@ -218,12 +316,46 @@ typedef struct LWPR_Model {
    double add_threshold;/**< \brief Threshold that determines when a new PLS regression axis is added */
    LWPR_Kernel kernel;  /**< \brief Describes which kernel function is used (Gaussian or BiSquare) */
    int update_D;        /**< \brief Flag that determines whether distance metric updates are performed (default: 1) */
+   double gate_factor;  /**< \brief Throttling gate: samples whose error lies below gate_factor times the confidence bound are not trained on (default: 0 = gate disabled) */
+   int gate_keep;       /**< \brief Throttling gate: every gate_keep-th sample that would be skipped is still trained on, with gate_keep times its weight (default: 0 = skip all) */
+   double gate_run;     /**< \brief Number of samples skipped by the throttling gate since the last one that was kept (see gate_keep) */
+   double n_gate_seen;  /**< \brief Number of samples presented to the throttling gate */
+   double n_gate_accepted; /**< \brief Number of samples the throttling gate passed on to the learning algorithm */
+   double gate_weight;  /**< \brief Importance weight of the sample being trained on: gate_keep for a sample kept by the throttling gate, 1 otherwise */
+   double mon_decay;    /**< \brief Decay factor of the per-RF error statistics of an attached LWPR_Monitor (default: 0 = not collected) */
+   int use_bbox;        /**< \brief Flag that determines whether receptive fields are culled by bounding boxes of their support before computing distances (default: 0) */
+   int cluster_size;    /**< \brief Maximal number of receptive fields per cluster (default: 0 = no clusters), see lwpr_set_clusters */
+   double cluster_radius;/**< \brief Maximal distance between a new receptive field and the founder of the cluster it joins, measured in the new RF's metric, see lwpr_set_clusters */
+   int index_proj;      /**< \brief Number of random directions of the RF index (default: 0 = no index), see lwpr_set_index */
+   double index_recall; /**< \brief Target probability that an activated RF is found by the index */
+   double index_kappa;  /**< \brief Factor by which the index scales the extents of the RFs, derived from index_recall (1 = exact) */
+   double *index_dirs;  /**< \brief Random directions of the index (index_proj x N, stored with stride nInStore), NULL if not used */
+   int index_audit;     /**< \brief Flag that determines whether each indexed query is checked against a full scan of the RFs (default: 0) */
+   LWPR_IndexMissCallback index_miss; /**< \brief Called for every activated RF the index missed while index_audit is set (may be NULL) */
+   void *index_miss_data;/**< \brief Passed on to index_miss */
+   double taylor_radius;/**< \brief Maximal distance of a query from the expansion point of the Taylor cache (default: 0 = no cache), see lwpr_set_taylor_cache */
+   double taylor_tol;   /**< \brief Maximal estimated error of an answer from the Taylor cache (0 = not checked) */
+   LWPR_TaylorCache *taylor;/**< \brief Taylor cache, NULL if not used */
+   struct LWPR_Recorder *rec;/**< \brief Recorder of the update and prediction calls, NULL if not recording (see lwpr_record_start) */
+   struct LWPR_Replicator *repl;/**< \brief Leader that replicates the changes of this model to followers, NULL if not replicating (see lwpr_repl_start) */
+   struct LWPR_OutOfCore *ooc;/**< \brief Memory-mapped arena and residency manager for the receptive fields, NULL if all RFs are kept in RAM (see lwpr_set_out_of_core) */
+   struct LWPR_LazyLoad *lazy;/**< \brief State of loading the training statistics of the RFs, NULL if the model is complete (see lwpr_read_binary_lazy) */
+   struct LWPR_Concurrent *conc;/**< \brief Epochs and retired memory of concurrent predictions with LWPR_Reader, NULL if not allowed (see lwpr_set_concurrent) */
+   struct LWPR_Checkpoint *checkpoint;/**< \brief Checkpoint that still needs copies of the RFs before they are changed, NULL if none (see lwpr_checkpoint_start) */
+   struct LWPR_Dispatch *dispatch;/**< \brief Calibration for choosing between serial and multi-threaded execution per call, NULL for the modes fixed at compile time (see lwpr_calibrate_dispatch) */
+   double *proj_P;      /**< \brief Input projection z = P*x onto the N-dimensional space of the receptive fields (N x nInRaw), NULL if not used, see lwpr_set_projection */
+   double *proj_mean;   /**< \brief Mean of the raw inputs (nInRaw x 1), NULL if no projection is used */
+   double *proj_cov;    /**< \brief Covariance of the raw inputs (nInRaw x nInRaw, stored densely), NULL if no projection is used */
+   int proj_interval;   /**< \brief Number of training samples between refinements of LWPR_Model.proj_P (0 = keep the projection fixed) */
+   double *proj_work;   /**< \brief Workspace for projections and back-projected derivatives. Do not touch. */
+   double *proj_storage;/**< \brief Pointer to allocated memory for the input projection. Do not touch. */
    LWPR_SubModel *sub;  /**< \brief Array of SubModels, one for each output dimension. */
    struct LWPR_Workspace *ws;  /**< \brief Array of Workspaces, one for each thread (cf. LWPR_NUM_THREADS) */
 
    double *storage;     /**< \brief Pointer to allocated memory. Do not touch. */
 
    double *xn;          /**< \brief Used to hold a normalised input vector (Nx1) */
+   double *vn;          /**< \brief Used to hold a normalised direction in input space (Nx1), see lwpr_predict_jvp */
    double *yn;          /**< \brief Used to hold a normalised output vector (Nx1) */
 
 #ifdef MATLAB
@@ -240,7 +372,7 @@ typedef struct LWPR_Model {
       return confidence bounds and the maximal activation of all receptive fields.
 
    \param[in] model  Must point to a valid LWPR_Model structure
-   \param[in] x      Input vector, must point to an array of <em>nIn</em> doubles
+   \param[in] x      Input vector, must point to an array of <em>nInRaw</em> doubles
    \param[in] cutoff A threshold parameter. Receptive fields with activation below the cutoff are ignored
    \param[out] y     Output vector, must point to an array of <em>nOut</em> doubles
    \param[out] conf  Confidence bounds per output dimension. Must be NULL or point to an array of <em>nOut</em> doubles
@@ -254,11 +386,11 @@ void lwpr_predict(const LWPR_Model *model, const double *x,
       given an input vector x.
 
    \param[in] model  Must point to a valid LWPR_Model structure
-   \param[in] x      Input vector, must point to an array of <em>nIn</em> doubles
+   \param[in] x      Input vector, must point to an array of <em>nInRaw</em> doubles
    \param[in] cutoff A threshold parameter. Receptive fields with activation below the cutoff are ignored
    \param[out] y     Output vector, must point to an array of <em>nOut</em> doubles
    \param[out] J     Jacobian matrix, i.e. derivatives of output vector with respect to input vector.
-                     Must point to an array of <em>nOut*nIn</em> doubles. The matrix is stored in column-major
+                     Must point to an array of <em>nOut*nInRaw</em> doubles. The matrix is stored in column-major
                      order, that is, for a 3-D input x and 2-D output y the Jacobian
 \f[\mathbf{J} = \frac{\partial\mathbf{y}}{\partial\mathbf{x}}
 = \left(\begin{array}{ccc}
@@ -285,30 +417,114 @@ void lwpr_predict_J(const LWPR_Model *model, const double *x,
            the first derivatives of all the quantities.
 
    \param[in] model  Must point to a valid LWPR_Model structure
-   \param[in] x      Input vector, must point to an array of <em>nIn</em> doubles
+   \param[in] x      Input vector, must point to an array of <em>nInRaw</em> doubles
    \param[in] cutoff A threshold parameter. Receptive fields with activation below the cutoff are ignored
    \param[out] y     Output vector, must point to an array of <em>nOut</em> doubles
    \param[out] J     Jacobian matrix, i.e. derivatives of output vector with respect to input vector.
-                     Must point to an array of <em>nOut*nIn</em> doubles.
+                     Must point to an array of <em>nOut*nInRaw</em> doubles.
    \param[out] conf  Confidence intervals, must point to an array of <em>nOut</em> doubles
-   \param[out] Jconf Jacobian of the confidences, must point to an array of <em>nOut*nIn</em> doubles.
+   \param[out] Jconf Jacobian of the confidences, must point to an array of <em>nOut*nInRaw</em> doubles.
 
    \ingroup LWPR_C
 */
 void lwpr_predict_JcJ(const LWPR_Model *model, const double *x,
       double cutoff, double *y, double *J, double *conf, double *Jconf);
 
+/** \brief Computes the predictions of selected output dimensions only
+   
+   Submodels of output dimensions that are not selected by <em>outMask</em> are not
+   evaluated at all, and the corresponding elements of <em>y</em>, <em>conf</em> and
+   <em>max_w</em> are left untouched. Apart from that, this behaves like lwpr_predict.
+   \param[in] model    Pointer to an LWPR model structure
+   \param[in] x        Input vector, must point to an array of <em>nInRaw</em> doubles
+   \param[in] cutoff   A threshold parameter (default: 0.001)
+   \param[in] outMask  Array of <em>nOut</em> flags, output dimension i is predicted if outMask[i] != 0
+                       (NULL = all output dimensions)
+   \param[out] y       Output vector, must point to an array of <em>nOut</em> doubles
+   \param[out] conf    Confidence bounds per output dimension (or NULL)
+   \param[out] max_w   Maximal activations per output dimension (or NULL)
+   \ingroup LWPR_C
+*/
+void lwpr_predict_sel(const LWPR_Model *model, const double *x, double cutoff, const int *outMask, double *y, double *conf, double *max_w);
+
+/** \brief Computes selected outputs and selected columns of their Jacobian
+   
+   Submodels of output dimensions that are not selected by <em>outMask</em> are not
+   evaluated, and only the derivatives with respect to inputs selected by <em>inMask</em>
+   are computed. Only the elements y[i] and J[i + j*nOut] of selected i and j are written.
+   If the model uses an input projection (see lwpr_set_projection), all derivatives with
+   respect to the projected inputs are needed, and <em>inMask</em> only restricts the mapping
+   back to the raw inputs.
+   \param[in] model    Pointer to an LWPR model structure
+   \param[in] x        Input vector, must point to an array of <em>nInRaw</em> doubles
+   \param[in] cutoff   A threshold parameter (default: 0.001)
+   \param[in] outMask  Array of <em>nOut</em> flags selecting output dimensions (NULL = all)
+   \param[in] inMask   Array of <em>nInRaw</em> flags selecting input dimensions (NULL = all)
+   \param[out] y       Output vector, must point to an array of <em>nOut</em> doubles
+   \param[out] J       Jacobian, must point to an array of <em>nOut*nInRaw</em> doubles
+                       (column-major, as in lwpr_predict_J)
+   \ingroup LWPR_C
+*/
+void lwpr_predict_J_sel(const LWPR_Model *model, const double *x, double cutoff, const int *outMask, const int *inMask, double *y, double *J);
+
+/** \brief Computes the prediction and the product of its Jacobian with a direction vector
+   
+   The result equals J*v with J as computed by lwpr_predict_J, but the Jacobian is
+   never formed: for each receptive field, the direction is pushed through the activation
+   and the PLS projections, which costs O(nIn*nReg) instead of O(nIn*nIn*nReg) for
+   receptive fields without a cached slope.
+   \param[in] model    Pointer to an LWPR model structure
+   \param[in] x        Input vector, must point to an array of <em>nInRaw</em> doubles
+   \param[in] v        Direction vector, must point to an array of <em>nInRaw</em> doubles
+   \param[in] cutoff   A threshold parameter (default: 0.001)
+   \param[out] y       Output vector, must point to an array of <em>nOut</em> doubles
+   \param[out] Jv      Directional derivative J*v, must point to an array of <em>nOut</em> doubles
+   \ingroup LWPR_C
+*/
+void lwpr_predict_jvp(const LWPR_Model *model, const double *x, const double *v, double cutoff, double *y, double *Jv);
+
+/** \brief Computes the prediction and the product of a vector with its Jacobian
+   
+   The result equals u'*J with J as computed by lwpr_predict_J, but the Jacobian is
+   never formed: the slopes of receptive fields are obtained by propagating the
+   gradient backwards through the PLS projections in O(nIn*nReg).
+   \param[in] model    Pointer to an LWPR model structure
+   \param[in] x        Input vector, must point to an array of <em>nInRaw</em> doubles
+   \param[in] u        Weights of the output dimensions, must point to an array of <em>nOut</em> doubles
+   \param[in] cutoff   A threshold parameter (default: 0.001)
+   \param[out] y       Output vector, must point to an array of <em>nOut</em> doubles
+   \param[out] uJ      Gradient of u'*y, must point to an array of <em>nInRaw</em> doubles
+   \ingroup LWPR_C
+*/
+void lwpr_predict_vjp(const LWPR_Model *model, const double *x, const double *u, double cutoff, double *y, double *uJ);
+
+/** \brief Computes the prediction of an LWPR model, using the Taylor cache if possible
+
+   See lwpr_set_taylor_cache. Without a cache, this is equivalent to lwpr_predict.
+   \param[in] model    Pointer to an LWPR model structure
+   \param[in] x        Input vector, must point to an array of <em>nInRaw</em> doubles
+   \param[in] cutoff   A threshold parameter (default: 0.001)
+   \param[out] y       Output vector, must point to an array of <em>nOut</em> doubles
+   \param[out] err     Estimated error of y (0 for a full evaluation, -1 for a cached answer
+                       if LWPR_Model.taylor_tol is 0), or NULL
+   \return
+      - 1 if y was computed from the cache
+      - 0 if the model was evaluated
+   \ingroup LWPR_C
+*/
+int lwpr_predict_cached(const LWPR_Model *model, const double *x, double cutoff, double *y, double *err);
+
 /** \brief Computes the prediction and its first and second derivatives
            of an LWPR model given an input vector x.
 
    \param[in] model  Must point to a valid LWPR_Model structure
-   \param[in] x      Input vector, must point to an array of <em>nIn</em> doubles
+   \param[in] x      Input vector, must point to an array of <em>nInRaw</em> doubles
    \param[in] cutoff A threshold parameter. Receptive fields with activation below the cutoff are ignored
    \param[out] y     Output vector, must point to an array of <em>nOut</em> doubles
    \param[out] J     Jacobian matrix, i.e. derivatives of output vector with respect to input vector.
-                     Must point to an array of <em>nOut*nIn</em> doubles.
+                     Must point to an array of <em>nOut*nInRaw</em> doubles.
    \param[out] H     Hessian matrices, i.e. 2nd derivatives of output vector with respect to input vector.
-                     Must point to an array of <em>nIn*nIn*nOut</em> doubles.
+                     Must point to an array of <em>nInRaw*nInRaw*nOut</em> doubles.
                      The Hessians for each output dimension are stored one after another.
 
    \ingroup LWPR_C
@@ -320,13 +536,19 @@ void lwpr_predict_JH(const LWPR_Model *model, const double *x,
       returns the model's prediction for y and the maximal activation of all receptive fields.
 
    \param[in,out] model  Must point to a valid LWPR_Model structure
-   \param[in] x          Input vector, must point to an array of <em>nIn</em> doubles
+   \param[in] x          Input vector, must point to an array of <em>nInRaw</em> doubles
    \param[in] y          Output vector, must point to an array of <em>nOut</em> doubles
    \param[out] yp        Current prediction given x. Must be NULL or point to an array of <em>nOut</em> doubles
    \param[out] max_w     Maximum activation per output dimension. Must be NULL or point to an array of <em>nOut</em> doubles
    \return
       - 1 if the update was succesful
-      - 0 if a receptive field would have to be added, but the necessary memory could not be allocated.
+      - 0 if a receptive field would have to be added, but the necessary memory could not be allocated,
+        or if the training statistics of a model read by lwpr_read_binary_lazy could not be loaded.
+
+   If the throttling gate is enabled (see lwpr_set_gate), the sample is first checked against the
+   model's own prediction and confidence bounds, and only passed on to the learning algorithm if it
+   carries new information. The global input statistics are updated for every sample, and
+   <em>yp</em> and <em>max_w</em> are filled in either way.
    \ingroup LWPR_C
 */
 int lwpr_update(LWPR_Model *model, const double *x, const double *y,
@@ -417,6 +639,7 @@ int lwpr_set_init_D_diagonal(LWPR_Model *model, const double *d);
    \param[in] stride     Offset between the first element of different columns of D.
                          Pass <em>nIn</em> if the matrix is stored densely, that is, without
                          any space between adjacent columns.
+                         Elements outside the blocks set by lwpr_set_blocks are ignored.
    \return
       - 0 in case of failure (D not positive definite)
       - 1 in case of success
@@ -424,6 +647,182 @@ int lwpr_set_init_D_diagonal(LWPR_Model *model, const double *d);
 */
 int lwpr_set_init_D(LWPR_Model *model, const double *D, int stride);
 
+/** \brief Restricts the distance metrics to a block-diagonal structure.
+
+   The input dimensions are partitioned into <em>nBlocks</em> groups of consecutive
+   dimensions, and all elements of LWPR_ReceptiveField.D (and M, alpha, h, b) that couple
+   two different groups are kept at zero. Activations and distance metric updates then only
+   work on the blocks, and their cost scales with the sum of squared block sizes instead
+   of N^2 (N^3 for the derivatives). This has no effect if LWPR_Model.diag_only is set.
+   Off-block elements of the initial distance metric are set to zero.
+
+   Only the blocks of D, M, alpha, h and b are stored, one after the other, such that their
+   memory also scales with the sum of squared block sizes (see LWPR_Model.metric_col).
+   Use lwpr_rf_get_D and lwpr_rf_get_M to obtain dense copies; files still contain the
+   dense matrices.
+   \param[in,out] model  Pointer to a valid LWPR_Model without any receptive fields
+   \param[in] nBlocks    Number of blocks
+   \param[in] sizes      Sizes of the blocks, must point to an array of <em>nBlocks</em> positive integers that sum up to <em>nIn</em>
+   \return
+      - 0 in case of failure (invalid partition, the model already contains receptive fields,
+          or the masked initial distance metric is not positive definite)
+      - 1 in case of success
+   \ingroup LWPR_C
+*/
+int lwpr_set_blocks(LWPR_Model *model, int nBlocks, const int *sizes);
+
+/** \brief Switches to low-rank-plus-diagonal distance metrics D = diag(d) + L*L'.
+
+   Each receptive field then stores sqrt(d) and the (nIn x rank) factor L in
+   LWPR_ReceptiveField.L instead of the (nIn x nIn) matrices D, M, h and b, and
+   activations cost O(nIn*rank) operations. The metric is adapted by gradient descent
+   on the same cost function as full metrics; LWPR_Model.meta is ignored.
+   New receptive fields start with the diagonal of LWPR_Model.init_D, a small part of
+   which is moved into L, and with the learning rates on the diagonal of LWPR_Model.init_alpha.
+   LWPR_Model.diag_only and lwpr_set_blocks have no effect while rank > 0.
+   \param[in,out] model  Pointer to a valid LWPR_Model without any receptive fields
+   \param[in] rank       Rank of the low-rank part, 0 <= rank < nIn (0 = full or diagonal metrics)
+   \return
+      - 0 in case of failure (invalid rank, or the model already contains receptive fields)
+      - 1 in case of success
+   \ingroup LWPR_C
+*/
+int lwpr_set_rank(LWPR_Model *model, int rank);
+
+/** \brief Lets the model learn on a linear projection of high-dimensional inputs
+   
+   After this call, lwpr_update and the prediction functions expect inputs with
+   <em>nInRaw</em> elements, which are mapped onto the <em>nIn</em>-dimensional space
+   of the receptive fields by z = P*x before normalisation. Jacobians and Hessians are
+   mapped back through P, so they are returned with respect to the raw inputs.
+   
+   P is learned incrementally by online PCA: the model tracks the mean and covariance
+   of the raw inputs, and every <em>interval</em> training samples P is refined by one
+   step of orthogonal (subspace) iteration towards the leading <em>nIn</em> principal
+   directions. Since receptive fields live in the projected space, the projection should
+   settle early on; set interval to 0 to keep P fixed.
+   \param[in,out] model  Pointer to a valid LWPR_Model without any receptive fields
+   \param[in] nInRaw     Dimensionality of the raw inputs, nInRaw >= nIn
+   \param[in] P          Initial projection (nIn x nInRaw, column-major, columns are nIn doubles apart)
+                         with orthonormal rows, or NULL to start from the first nIn coordinate axes
+   \param[in] interval   Number of training samples between refinements of P (0 = fixed projection)
+   \return
+      - 0 in case of failure (invalid dimensions, the model already contains receptive fields
+        or uses a projection, or memory could not be allocated)
+      - 1 in case of success
+   \ingroup LWPR_C
+*/
+int lwpr_set_projection(LWPR_Model *model, int nInRaw, const double *P, int interval);
+
+/** \brief Groups the receptive fields into clusters for faster predictions
+
+   Each output dimension keeps its receptive fields in clusters of up to <em>size</em>
+   members, and each cluster summarises its members by the range of their centres and
+   the largest extent of their supports (see LWPR_ReceptiveField.box). Predictions test
+   the query against these summaries first, and skip the members of every cluster that
+   cannot contribute an activation above the cutoff. Queries far away from the training
+   data then cost O(number of clusters) instead of O(number of RFs).
+   
+   A new receptive field joins the nearest cluster whose founder lies within distance
+   <em>radius</em> in the new RF's metric and which is not full yet; otherwise it founds a
+   new cluster. Pruned receptive fields are removed from their cluster. Summaries are
+   refreshed lazily by the next prediction after their members changed, so predictions
+   that are interleaved with updates of the distance metrics gain less. Training itself
+   still visits all receptive fields. Predictions sum up the contributions in a different
+   order than without clusters, which may change the results by a few rounding errors.
+   
+   The clustering is not stored in model files; call this function again after loading a
+   model. lwpr_duplicate_model copies the settings and rebuilds the clusters.
+   \param[in,out] model  Pointer to a valid LWPR_Model
+   \param[in] size       Maximal number of receptive fields per cluster (0 = remove all clusters)
+   \param[in] radius     Distance of a new receptive field to the founder of a cluster it may join, e.g. 2
+   \return
+      - 0 in case of failure (invalid arguments, or memory could not be allocated, in which case
+        the model is left without clusters)
+      - 1 in case of success
+   \ingroup LWPR_C
+*/
+int lwpr_set_clusters(LWPR_Model *model, int size, double radius);
+
+/** \brief Builds an approximate random-projection index over the receptive fields
+
+   This is meant for high-dimensional inputs, where bounding boxes and clusters (see
+   lwpr_set_clusters) hardly cull anything. The centres of the receptive fields are
+   projected onto <em>nProj</em> random Gaussian directions g, and the index stores
+   how far the support of each RF extends along each direction, sqrt(qmax*g'inv(D)g).
+   An RF can only be activated above the cutoff if the projection of the query lies
+   within that extent in every direction, so the index returns exact candidates for
+   <em>recall</em> = 1. Lower recall targets shrink the extents: if the metric-whitened
+   offset u = M*(x-c) of an activated RF points in a random direction, its projection is
+   roughly normal with a standard deviation of |u|/sqrt(N) times the extent, and the
+   extents are scaled by kappa/sqrt(N), where kappa is chosen such that all directions
+   are passed with probability <em>recall</em>. This is not guaranteed for any particular
+   query, so LWPR_Model.index_audit can be used to measure the actual recall.
+   
+   Candidates are found by a binary search along the first direction and then checked
+   against the others. The index is rebuilt lazily by the first prediction after the
+   receptive fields changed, so it pays off in phases with many more predictions than
+   updates. Training always visits all receptive fields. While LWPR_Model.index_audit is
+   set, every indexed query is additionally checked against all other receptive fields,
+   and those activated above the cutoff are counted in LWPR_RFIndex.n_missed and reported
+   through LWPR_Model.index_miss. The index takes precedence over clusters. It is not stored
+   in model files, but lwpr_duplicate_model copies it.
+   \param[in,out] model  Pointer to a valid LWPR_Model
+   \param[in] nProj      Number of random directions (0 = remove the index), e.g. 4-8
+   \param[in] recall     Target recall, 0 < recall <= 1 (1 = exact)
+   \return
+      - 0 in case of failure (invalid arguments, or memory could not be allocated, in which case
+        the model is left without an index)
+      - 1 in case of success
+   \ingroup LWPR_C
+*/
+int lwpr_set_index(LWPR_Model *model, int nProj, double recall);
+
+/** \brief Enables a cache that answers queries close to a previous one by a first-order expansion
+
+   Once enabled, lwpr_predict_J and lwpr_predict_JH store their query point x0, prediction y0
+   and Jacobian J0 in the cache. lwpr_predict_cached answers queries x with |x-x0| <= <em>radius</em>
+   (Euclidean norm of the raw inputs) as y0 + J0*(x-x0), which costs O(nOut*nInRaw), and otherwise
+   computes the prediction and Jacobian at x, which then becomes the new expansion point.
+   If <em>tol</em> > 0, the expansion points are computed by lwpr_predict_JH, and queries are only
+   answered from the cache if the estimated error 0.5*|H|*|x-x0|^2 does not exceed <em>tol</em>,
+   where |H| is the largest Frobenius norm of the Hessians at x0. In this case, expansion points
+   stored by lwpr_predict_J are not used. The estimate only covers the curvature of the model:
+   receptive fields whose activation crosses the cutoff between x0 and x cause additional jumps
+   of the order of cutoff/sum(w) times the deviation of their local prediction.
+   The cache is invalidated by updates of the model (LWPR_Model.n_updates), lwpr_prune_projections
+   and lwpr_set_index, and whenever a different cutoff is used. After changing any other parameter
+   that affects predictions (e.g. the kernel), lwpr_set_taylor_cache must be called again.
+   The cache is not stored in model files, but lwpr_duplicate_model copies its settings.
+   \param[in,out] model  Pointer to a valid LWPR_Model
+   \param[in] radius     Maximal distance from the expansion point (0 = remove the cache)
+   \param[in] tol        Maximal estimated error (0 = only check the radius)
+   \return
+      - 0 in case of failure (negative arguments, or memory could not be allocated, in which case
+        the model is left without a cache)
+      - 1 in case of success
+   \ingroup LWPR_C
+*/
+int lwpr_set_taylor_cache(LWPR_Model *model, double radius, double tol);
+
+/** \brief Writes the distance metric of a receptive field into a dense matrix,
+      regardless of its parameterisation
+   \param[in] RF  Pointer to a valid LWPR_ReceptiveField
+   \param[out] D  Distance metric, must point to an array of <em>nIn*nInStore</em> doubles
+                   (columns are <em>nInStore</em> doubles apart)
+   \ingroup LWPR_C
+*/
+void lwpr_rf_get_D(const LWPR_ReceptiveField *RF, double *D);
+
+/** \brief Writes the Cholesky factor M (D = M'*M) of the distance metric of a receptive
+      field into a dense upper triangular matrix, regardless of its parameterisation
+   \param[in] RF  Pointer to a valid LWPR_ReceptiveField
+   \param[out] M  Cholesky factor, must point to an array of <em>nIn*nInStore</em> doubles
+                   (columns are <em>nInStore</em> doubles apart)
+   \ingroup LWPR_C
+*/
+void lwpr_rf_get_M(const LWPR_ReceptiveField *RF, double *M);
+
 /** \brief Creates a duplicate (deep copy) of an LWPR model structure
    \param[out] dest  Pointer to an (uninitialised) LWPR_Model
    \param[in] src    Pointer to the LWPR_Model that should be duplicated
@@ -436,6 +835,72 @@ int lwpr_set_init_D(LWPR_Model *model, const double *D, int stride);
 */
 int lwpr_duplicate_model(LWPR_Model *dest, const LWPR_Model *src);
 
+/** \brief Removes trailing PLS regression axes that contribute negligibly to the predictions
+      of the receptive fields, and reclaims their memory.
+
+   This is meant to be called after (or in pauses of) training, for faster predictions.
+   See lwpr_aux_prune_projections for the criterion that is applied to each receptive field.
+
+   \param[in,out] model        Pointer to a valid LWPR_Model
+   \param[in] threshold        Relative contribution threshold, e.g. 0.01
+   \param[out] flops_predict   Approximate number of floating point operations saved per prediction,
+                               summed over all receptive fields (may be NULL)
+   \param[out] flops_update    Approximate number of floating point operations saved per update,
+                               summed over all receptive fields (may be NULL)
+   \param[out] rf_flops        Savings of the individual receptive fields (may be NULL). Otherwise
+                               this must hold 2 values per receptive field: rf_flops[2*k] receives
+                               the savings per prediction and rf_flops[2*k+1] the savings per update
+                               of the k-th receptive field, counting those of sub[0] first, then
+                               those of sub[1], and so on.
+   \return Total number of removed PLS axes
+   \ingroup LWPR_C
+*/
+int lwpr_prune_projections(LWPR_Model *model, double threshold, double *flops_predict, double *flops_update, double *rf_flops);
+
+/** \brief Configures the throttling gate in front of lwpr_update and resets its counters.
+
+   With the gate enabled, lwpr_update first computes the prediction and confidence bounds
+   for the input x. If in every output dimension the prediction error is smaller than
+   <em>factor</em> times the confidence bound, the sample is regarded as carrying no new
+   information and the (expensive) receptive field updates are skipped. Samples in regions
+   that are not yet covered by a trustworthy receptive field always pass the gate.
+
+   The local statistics are corrected for the skipped samples by importance weighting: every
+   sample that the gate would skip is kept with probability 1/<em>keep</em> (every <em>keep</em>-th
+   one), and a kept sample is trained on with its activations multiplied by <em>keep</em>, in
+   the means, the regression statistics, LWPR_ReceptiveField.n_data and the gradient of the distance
+   metric (LWPR_Model.gate_weight). The local statistics therefore weight well-predicted regions as
+   in the raw data stream, while samples that pass the gate count once. The forgetting factors
+   still advance once per sample that is trained on. Without <em>keep</em>, no correction is possible.
+
+   \param[in,out] model  Pointer to a valid LWPR_Model
+   \param[in] factor     Multiple of the confidence bound below which samples are skipped (0 disables the gate)
+   \param[in] keep       If > 0, every <em>keep</em>-th sample that would be skipped is still used for training,
+                         such that the forgetting factors and local statistics keep tracking slow drifts
+   \return
+      - 0 in case of failure (<em>factor < 0</em> or <em>keep < 0</em>)
+      - 1 in case of success
+   \ingroup LWPR_C
+*/
+int lwpr_set_gate(LWPR_Model *model, double factor, int keep);
+
+/** \brief Returns the fraction of samples the throttling gate passed on to the learning algorithm
+   \param[in] model  Pointer to a valid LWPR_Model
+   \return Acceptance rate in [0,1], or 1 if no samples have passed through the gate yet
+   \ingroup LWPR_C
+*/
+double lwpr_gate_acceptance_rate(const LWPR_Model *model);
+
+/** \brief Returns the activation of a receptive field for the most recent training sample
+
+   Only receptive fields that are actually updated store their activation, so
+   LWPR_ReceptiveField.w may be stale. This function returns 0 in that case.
+   \param[in] RF  Pointer to a valid LWPR_ReceptiveField
+   \return Activation of RF for the last sample passed to lwpr_update
+   \ingroup LWPR_C
+*/
+double lwpr_rf_activation(const LWPR_ReceptiveField *RF);
+
 #ifdef __cplusplus
 }
 #endif
@@ -45,6 +45,14 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
    <TR><TD>mean_x             </TD><TD>nIn doubles </TD></TR>
    <TR><TD>var_x              </TD><TD>nIn doubles </TD></TR>
    <TR><TD>diag_only          </TD><TD>1 integer </TD></TR>
+   <TR><TD>nBlocks            </TD><TD>1 integer (since BINIO version -2)</TD></TR>
+   <TR><TD>block sizes        </TD><TD>nBlocks integers (since BINIO version -2)</TD></TR>
+   <TR><TD>rank               </TD><TD>1 integer (since BINIO version -3)</TD></TR>
+   <TR><TD>nInRaw             </TD><TD>1 integer, 0 if no input projection is used (since BINIO version -4)</TD></TR>
+   <TR><TD>proj_interval      </TD><TD>1 integer (only if nInRaw > 0)</TD></TR>
+   <TR><TD>proj_P             </TD><TD>nIn*nInRaw doubles (only if nInRaw > 0)</TD></TR>
+   <TR><TD>proj_mean          </TD><TD>nInRaw doubles (only if nInRaw > 0)</TD></TR>
+   <TR><TD>proj_cov           </TD><TD>nInRaw*nInRaw doubles (only if nInRaw > 0)</TD></TR>
    <TR><TD>update_D           </TD><TD>1 integer (was not present in LWPR 1.0 due to a bug)</TD></TR>
    <TR><TD>meta               </TD><TD>1 integer </TD></TR>
    <TR><TD>meta_rate          </TD><TD>1 double </TD></TR>
@@ -75,9 +83,10 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
    <TR><TH>Element description</TH><TH>Size of element</TH></TR>
    <TR><TD>"[RF]"       </TD><TD>4 bytes</TD></TR>
    <TR><TD>nReg         </TD><TD>1 integer</TD></TR>
-   <TR><TD>D            </TD><TD>1 nIn*nIn doubles</TD></TR>
-   <TR><TD>M            </TD><TD>1 nIn*nIn doubles</TD></TR>
-   <TR><TD>alpha        </TD><TD>1 nIn*nIn doubles</TD></TR>
+   <TR><TD>D            </TD><TD>1 nIn*nIn doubles (not present if rank > 0)</TD></TR>
+   <TR><TD>M            </TD><TD>1 nIn*nIn doubles (not present if rank > 0)</TD></TR>
+   <TR><TD>L            </TD><TD>nIn*(rank+1) doubles (only present if rank > 0)</TD></TR>
+   <TR><TD>alpha        </TD><TD>1 nIn*nIn doubles, or nIn*(rank+1) doubles if rank > 0</TD></TR>
    <TR><TD>beta0        </TD><TD>1 double</TD></TR>
    <TR><TD>beta         </TD><TD>nReg doubles</TD></TR>
    <TR><TD>c            </TD><TD>nIn doubles</TD></TR>
@@ -89,8 +98,8 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
    <TR><TD>P            </TD><TD>nIn*nReg doubles</TD></TR>
    <TR><TD>H            </TD><TD>nReg doubles</TD></TR>
    <TR><TD>r            </TD><TD>nReg doubles</TD></TR>
-   <TR><TD>h            </TD><TD>nIn*nIn doubles</TD></TR>
-   <TR><TD>b            </TD><TD>nIn*nIn doubles</TD></TR>
+   <TR><TD>h            </TD><TD>nIn*nIn doubles (not present if rank > 0)</TD></TR>
+   <TR><TD>b            </TD><TD>nIn*nIn doubles (not present if rank > 0)</TD></TR>
    <TR><TD>sum_w        </TD><TD>nReg doubles</TD></TR>
    <TR><TD>sum_e_cv2    </TD><TD>nReg doubles</TD></TR>
    <TR><TD>sum_e2       </TD><TD>1 double</TD></TR>
@@ -113,6 +122,12 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
    2/0...<b>[RF]</b>...RF 2/1...<em>further receptive fields</em>...<em>further 
    sub-models (output dimensions)</em>...<b>RPWL</b>
    
+   Since all records of a receptive field have a fixed size, lwpr_read_binary_lazy can read a
+   model in two phases. The first phase reads the model globals and those fields of the receptive
+   fields that predictions depend on (nReg, D, M, L, beta0, beta, c, SSs2, U, P, sum_w, sum_e_cv2,
+   SSp, n_data, trustworthy, mean_x), and skips the training statistics (alpha, SXresYres, SSYres,
+   SSXres, H, r, h, b, sum_e2, lambda, var_x, w, s). The second phase reads the skipped fields.
+   
    \ingroup LWPR_C
 */
 
@@ -167,6 +182,50 @@ int lwpr_write_binary_fp(const LWPR_Model *model, FILE *fp);
 */
 int lwpr_read_binary_fp(LWPR_Model *model, FILE *fp);
 
+/** \brief Flag of lwpr_io_read_rf_fields: fields of a receptive field that predictions depend on */
+#define LWPR_LOAD_PREDICT     1
+/** \brief Flag of lwpr_io_read_rf_fields: training statistics of a receptive field */
+#define LWPR_LOAD_TRAIN       2
+/** \brief Flag of lwpr_io_read_rf_fields: all fields of a receptive field */
+#define LWPR_LOAD_ALL         3
+
+/** \brief Reads an LWPR model from a binary file in two phases, so that it can answer predictions
+      before its training statistics are loaded
+   
+   The first phase reads everything that predictions need and returns. The training statistics
+   of the receptive fields are then read by a background thread (if <em>background</em> is set, and
+   the library was compiled with NUM_THREADS > 1), or otherwise by lwpr_finish_loading. The file
+   is kept open until then. lwpr_update, lwpr_duplicate_model, lwpr_write_binary, lwpr_write_xml,
+   lwpr_prune_projections and lwpr_set_out_of_core first call lwpr_finish_loading, so the model can
+   be used as usual. Predictions may run while the background thread is loading, but other
+   functions that change the receptive fields (e.g. lwpr_set_init_D) must not be called before
+   lwpr_finish_loading. Lazy loading is not available for XML files, which have to be parsed
+   completely.
+   \param[out] model     Pointer to an (uninitialised) LWPR_Model structure
+   \param[in] filename   Name of the file to read the model from
+   \param[in] background Flag that determines whether the second phase runs in a background thread
+   \return
+      - 0 if errors have occured
+      - 1 on success (of the first phase)
+   \ingroup LWPR_C    
+*/
+int lwpr_read_binary_lazy(LWPR_Model *model, const char *filename, int background);
+
+/** \brief Completes loading a model read by lwpr_read_binary_lazy, waiting for the background thread
+      or reading the training statistics right away. Does nothing for other models.
+   \param[in,out] model Pointer to a valid LWPR model structure
+   \return
+      - 0 if the training statistics could not be read. The model can still be used for predictions,
+        but lwpr_update fails.
+      - 1 if the model is complete
+   \ingroup LWPR_C    
+*/
+int lwpr_finish_loading(LWPR_Model *model);
+
+/** \brief Stops loading the training statistics of a model read by lwpr_read_binary_lazy, and closes
+      the file. Called by lwpr_free_model. */
+void lwpr_io_lazy_abort(LWPR_Model *model);
+
 
 /** \brief Writes a matrix of doubles into a binary file
    \param[in] fp       File descriptor
@@ -267,6 +326,17 @@ int lwpr_io_write_rf(FILE *fp, const LWPR_ReceptiveField *RF);
 */
 int lwpr_io_read_rf(FILE *fp, LWPR_SubModel *sub);
 
+/** \brief Reads the fields of a receptive field record (following nReg) from a binary file
+   \param[in] fp      File descriptor
+   \param[in,out] RF  Pointer to a receptive field structure with the right nReg
+   \param[in] phases  Fields to read (LWPR_LOAD_PREDICT, LWPR_LOAD_TRAIN, or LWPR_LOAD_ALL).
+                      The other fields are skipped.
+   \return
+      - 0 if errors have occured
+      - 1 on success
+*/
+int lwpr_io_read_rf_fields(FILE *fp, LWPR_ReceptiveField *RF, int phases);
+
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,136 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_checkpoint.h
+   \brief Prototypes for writing binary checkpoints of an LWPR model while training continues
+
+   lwpr_checkpoint_start takes a point-in-time snapshot of the model and hands it to a
+   background thread that writes it with lwpr_write_binary_fp. The model can be updated
+   again as soon as lwpr_checkpoint_start returns. The file is first written under a
+   temporary name (<em>filename</em> with ".tmp" appended) and renamed when complete,
+   such that an existing checkpoint is never left half-overwritten.
+
+   The snapshot is taken lazily: lwpr_checkpoint_start only copies the settings and input
+   statistics of the model. Each receptive field is copied (as by lwpr_duplicate_model) by
+   the background thread, or by lwpr_update / lwpr_update_batch right before they change it
+   for the first time, whichever comes first. Starting a checkpoint therefore costs as much as
+   copying the receptive fields that training touches before the thread gets to them.
+   Out-of-core models (lwpr_set_out_of_core), and models that already have a lazy checkpoint
+   pending, are copied completely by lwpr_checkpoint_start.
+
+   Until lwpr_checkpoint_wait returns, the model must only be changed by lwpr_update and
+   lwpr_update_batch. Other functions that change receptive fields, such as
+   lwpr_prune_projections or lwpr_set_blocks, and lwpr_free_model must wait for the checkpoint.
+
+   If the library is compiled with NUM_THREADS == 1 (or the thread cannot be created),
+   lwpr_checkpoint_start refuses to block the caller, unless LWPR_CHECKPOINT_SYNC is passed.
+
+   \code
+   LWPR_Checkpoint cp;
+   lwpr_checkpoint_start(&cp, &model, "model.bin", LWPR_CHECKPOINT_FSYNC, NULL, NULL);
+   ... continue training ...
+   if (!lwpr_checkpoint_wait(&cp)) error(...);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_CHECKPOINT_H
+#define __LWPR_CHECKPOINT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Flag for lwpr_checkpoint_start: flush the checkpoint to disk (fsync) before renaming it */
+#define LWPR_CHECKPOINT_FSYNC     1
+/** \brief Flag for lwpr_checkpoint_start: if no background thread is available, write the model
+      before returning (instead of failing) */
+#define LWPR_CHECKPOINT_SYNC      2
+
+/** \brief Signature of a function that is called once a checkpoint has been written (or failed).
+   \param[in] filename   Name of the checkpoint file
+   \param[in] ok         1 if the checkpoint was written successfully, 0 otherwise
+   \param[in] userData   Pointer that was passed to lwpr_checkpoint_start
+
+   The callback is executed from within the background thread, so it must not
+   touch the model that is being trained without proper synchronisation.
+   \ingroup LWPR_C
+*/
+typedef void (*LWPR_CheckpointCallback)(const char *filename, int ok, void *userData);
+
+/** \brief State of a checkpoint that is being written. Do not touch its elements
+      between lwpr_checkpoint_start and lwpr_checkpoint_wait.
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Checkpoint {
+   LWPR_Model snapshot;             /**< \brief Copy of the model at the time the checkpoint was started, receives the RF copies */
+   char *filename;                  /**< \brief Name of the checkpoint file */
+   int flags;                       /**< \brief Combination of LWPR_CHECKPOINT_* flags */
+   int ok;                          /**< \brief Result of the write: 1 if successful, 0 otherwise */
+   LWPR_CheckpointCallback callback;/**< \brief Completion callback (may be NULL) */
+   void *userData;                  /**< \brief Passed on to the completion callback */
+   struct LWPR_CheckpointThread *thread; /**< \brief Background thread state (NULL if written synchronously) */
+   LWPR_Model *model;               /**< \brief Model whose RFs are copied lazily, NULL if the snapshot is complete */
+   int numSlots;                    /**< \brief Number of RFs of the model when the checkpoint was started */
+   LWPR_ReceptiveField **orig;      /**< \brief RFs of the model, one per slot, in the order of the file */
+   LWPR_ReceptiveField **copy;      /**< \brief Copies of the RFs, one per slot (NULL if not copied yet or out of memory) */
+   volatile int *state;             /**< \brief Per slot: 0 if not copied yet, 1 while being copied, 2 when copied */
+} LWPR_Checkpoint;
+
+/** \brief Takes a snapshot of an LWPR model and starts writing it to a binary file in the background.
+   \param[out] cp        Pointer to an (unused) LWPR_Checkpoint structure
+   \param[in,out] model  The model to save. It may be updated again as soon as this function returns,
+                         but must not be changed otherwise before lwpr_checkpoint_wait (see lwpr_checkpoint.h).
+   \param[in] filename   The name of the file
+   \param[in] flags      Combination of LWPR_CHECKPOINT_FSYNC and LWPR_CHECKPOINT_SYNC
+   \param[in] callback   Function to call on completion, or NULL
+   \param[in] userData   Passed on to the callback
+   \return
+      - 1 if the checkpoint was started (lwpr_checkpoint_wait must then be called)
+      - 0 if no background thread is available and LWPR_CHECKPOINT_SYNC was not passed,
+        or if the snapshot could not be taken (insufficient memory)
+   \ingroup LWPR_C
+*/
+int lwpr_checkpoint_start(LWPR_Checkpoint *cp, LWPR_Model *model, const char *filename,
+      int flags, LWPR_CheckpointCallback callback, void *userData);
+
+/** \brief Waits until a checkpoint is completely written and releases its resources.
+   \param[in,out] cp     Pointer to an LWPR_Checkpoint that was started with lwpr_checkpoint_start
+   \return
+      - 1 if the checkpoint was written successfully
+      - 0 in case of errors
+   \ingroup LWPR_C
+*/
+int lwpr_checkpoint_wait(LWPR_Checkpoint *cp);
+
+/** \brief Makes sure that the pending checkpoint of a model holds a copy of a receptive field
+      before it is changed. Called by lwpr_update and lwpr_update_batch for RFs with LWPR_ReceptiveField.ckpt != 0.
+   \param[in] model      The model that owns the receptive field
+   \param[in,out] RF     The receptive field that is about to change
+   \ingroup LWPR_C
+*/
+void lwpr_checkpoint_preserve(const LWPR_Model *model, LWPR_ReceptiveField *RF);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
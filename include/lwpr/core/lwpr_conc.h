@@ -0,0 +1,182 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_conc.h
+   \brief Prototypes for predicting from an LWPR model while another thread trains it
+
+   lwpr_predict uses working memory of the model (LWPR_Model.xn, LWPR_Model.ws) and reads the
+   receptive fields without any synchronisation, so it must not run while lwpr_update changes
+   the model. After lwpr_set_concurrent, readers (LWPR_Reader) can predict from the model at
+   any time instead, without copying it and without ever taking a lock:
+   - Each receptive field carries a sequence number (LWPR_ReceptiveField.seq) that lwpr_update
+     makes odd before it changes the receptive field (regression, distance metric, new
+     projections), and even again afterwards. A reader notes the number, reads the receptive
+     field, and re-reads it if the number changed in between. If that happens
+     LWPR_CONC_RETRIES times in a row, the receptive field is skipped for this prediction.
+   - Adding and pruning receptive fields, including the growth of LWPR_SubModel.rf, is bracketed
+     by a sequence number of the submodel (LWPR_SubModel.seq). A reader whose pass over the
+     receptive fields of an output dimension overlapped such a change repeats the pass.
+   - Memory that readers may still be using (pruned receptive fields, the old array
+     LWPR_SubModel.rf, and the old PLS storage of a receptive field that grew) is not released
+     immediately, but retired with the current epoch. Each reader announces the epoch at the
+     beginning of a prediction, and lwpr_update releases retired memory once no reader is
+     still working in an epoch at or before it was retired (epoch-based reclamation).
+
+   Each prediction of a reader thus combines, per receptive field, a consistent state (after
+   some update), and it is the same as lwpr_predict while the model does not change, provided
+   the model does not use clusters or an index (readers always scan all receptive fields, so
+   the summation order of lwpr_predict is only kept without them).
+
+   Only one thread may call lwpr_update (which itself may be multi-threaded). Other functions
+   that change the model (e.g. lwpr_set_init_D, lwpr_prune_projections, lwpr_set_clusters,
+   reading a model, applying replication messages) must not run while readers predict.
+   A learned input projection (lwpr_set_projection with an interval > 0) is refined in place
+   and cannot be read concurrently, so lwpr_set_concurrent refuses such models. It also refuses
+   out-of-core models (lwpr_set_out_of_core), since every access to a receptive field moves its
+   block in a shared LRU list, which readers could only do under a lock.
+
+   \code
+   writer thread:                            reader thread:
+   lwpr_set_concurrent(&model, 1);           LWPR_Reader R;
+   ... lwpr_update(&model, ...) ...          lwpr_reader_init(&R, &model);
+                                             ... lwpr_reader_predict(&R, x, 0.001, y, NULL, NULL) ...
+                                             lwpr_reader_close(&R);
+   lwpr_set_concurrent(&model, 0);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_CONC_H
+#define __LWPR_CONC_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Maximal number of readers that can be attached to a model at the same time */
+#define LWPR_CONC_READERS     64
+
+/** \brief Number of times a reader re-reads a receptive field that changed, before skipping it */
+#define LWPR_CONC_RETRIES     8
+
+/** \brief Memory that is released once no reader can use it anymore */
+typedef struct {
+   void *ptr;                       /**< \brief Retired memory */
+   void (*release)(void *);         /**< \brief Function that releases ptr */
+   unsigned long epoch;             /**< \brief Epoch in which ptr was retired */
+} LWPR_Retired;
+
+/** \brief State of a model that readers predict from while it is trained, see lwpr_set_concurrent.
+      Do not touch its elements.
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Concurrent {
+   volatile unsigned long epoch;                      /**< \brief Current epoch (starts at 1) */
+   volatile int used[LWPR_CONC_READERS];              /**< \brief Indicates which reader slots are taken */
+   volatile unsigned long active[LWPR_CONC_READERS];  /**< \brief Epoch each reader is predicting in, 0 between predictions */
+   volatile int lock;                                 /**< \brief Spin lock of the retired list (updates may retire memory from several threads) */
+   LWPR_Retired *retired;           /**< \brief Retired memory, not yet released */
+   int numRetired;                  /**< \brief Number of entries in retired */
+   int numRetiredPointers;          /**< \brief Number of entries that can be stored before a re-allocation is necessary */
+   double n_retired;                /**< \brief Number of blocks of memory retired so far */
+   double n_released;               /**< \brief Number of retired blocks released so far */
+} LWPR_Concurrent;
+
+/** \brief A thread that predicts from a model while it is trained, see lwpr_reader_init.
+      Each reader must only be used by one thread at a time.
+   \ingroup LWPR_C
+*/
+typedef struct {
+   const struct LWPR_Model *model;  /**< \brief Model the reader predicts from */
+   int slot;                        /**< \brief Index of the reader in LWPR_Concurrent.active */
+   double *xn;                      /**< \brief Normalised input vector (nIn) */
+   struct LWPR_Workspace *ws;       /**< \brief Working memory of the predictions */
+   double n_predictions;            /**< \brief Number of predictions */
+   double n_retries;                /**< \brief Number of times a receptive field was re-read because it changed */
+   double n_skipped;                /**< \brief Number of receptive fields skipped after LWPR_CONC_RETRIES re-reads */
+   double n_rescans;                /**< \brief Number of passes over a submodel that were repeated after RFs were added or pruned */
+} LWPR_Reader;
+
+/** \brief Switches concurrent predictions with LWPR_Reader on or off
+   \param[in,out] model  Pointer to a valid LWPR model
+   \param[in] enable     1 to allow readers, 0 to release the state again
+   \return
+      - 1 in case of success
+      - 0 if memory could not be allocated, the model learns its input projection or is
+        out-of-core, or (enable = 0) readers are still attached
+   \ingroup LWPR_C
+*/
+int lwpr_set_concurrent(struct LWPR_Model *model, int enable);
+
+/** \brief Attaches a reader to a model that allows concurrent predictions
+   \param[out] R      Pointer to an (unused) LWPR_Reader structure
+   \param[in] model   Model with concurrent predictions switched on (see lwpr_set_concurrent)
+   \return
+      - 1 in case of success
+      - 0 if the model does not allow concurrent predictions, all LWPR_CONC_READERS slots are
+        taken, or memory could not be allocated
+   \ingroup LWPR_C
+*/
+int lwpr_reader_init(LWPR_Reader *R, const struct LWPR_Model *model);
+
+/** \brief Detaches a reader from its model and releases its memory
+   \ingroup LWPR_C
+*/
+void lwpr_reader_close(LWPR_Reader *R);
+
+/** \brief Computes the prediction of the model for an input vector, like lwpr_predict, while
+      the model may be trained by another thread
+   \param[in,out] R   A reader initialised with lwpr_reader_init
+   \param[in] x       Input vector (nInRaw)
+   \param[in] cutoff  Minimal activation for a receptive field to contribute
+   \param[out] y      Output vector (nOut)
+   \param[out] conf   Confidence bounds per output dimension (nOut), or NULL
+   \param[out] max_w  Maximal activation per output dimension (nOut), or NULL
+   \ingroup LWPR_C
+*/
+void lwpr_reader_predict(LWPR_Reader *R, const double *x, double cutoff, double *y, double *conf, double *max_w);
+
+/** \brief Called by the writer before it changes a receptive field or a submodel (makes *seq odd) */
+void lwpr_conc_write_begin(volatile int *seq);
+
+/** \brief Called by the writer after it changed a receptive field or a submodel (makes *seq even) */
+void lwpr_conc_write_end(volatile int *seq);
+
+/** \brief Called by the writer to release memory once no reader can use it anymore */
+void lwpr_conc_retire(LWPR_Concurrent *C, void *ptr, void (*release)(void *));
+
+/** \brief Called by lwpr_update to start a new epoch and release memory that no reader uses anymore */
+void lwpr_conc_collect(LWPR_Concurrent *C);
+
+/** \brief Releases a receptive field and its memory (release function for lwpr_conc_retire) */
+void lwpr_conc_release_rf(void *RF);
+
+/** \brief Releases memory allocated with LWPR_MALLOC (release function for lwpr_conc_retire) */
+void lwpr_conc_release_mem(void *ptr);
+
+/** \brief Releases all retired memory and the state, called by lwpr_free_model */
+void lwpr_conc_free(LWPR_Concurrent *C);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,3 +14,10 @@
    \ingroup LWPR_C
 */   
 #define NUM_THREADS     1
+
+/** Set LWPR_PROFILE to 1 to compile in the profiling of update and prediction phases
+   (see lwpr_prof.h). On Windows, only elapsed times are measured. Leave this at 0 for
+   normal use: the phase markers then compile to nothing.
+   \ingroup LWPR_C
+*/
+#define LWPR_PROFILE    0
@@ -0,0 +1,141 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_prof.h
+   \brief Prototypes for profiling the phases of updates and predictions with
+      hardware performance counters
+
+   If the library is compiled with LWPR_PROFILE set to 1 (see lwpr_config.h), the update and
+   prediction routines mark the transitions between their main phases (see LWPR_Phase).
+   While profiling is switched on with lwpr_profile_start, every transition reads the elapsed
+   time and, on Linux, a group of perf_event_open counters (cycles, instructions, last level cache
+   misses, branch misses; user space only) of the calling thread, and adds the differences to
+   the phase that just ended. Totals are kept per phase and per thread, where "thread" is the
+   index of the workspace (0...NUM_THREADS-1) that the update or prediction ran on.
+
+   Counters are only read when the phase actually changes, so scanning many receptive fields that
+   are not activated costs one transition. Still, each transition costs a system call, such that
+   profiled runs are noticeably slower than normal ones. The counts themselves hardly include
+   the profiling, because kernel mode is excluded.
+
+   If LWPR_PROFILE is not set, the phase markers compile to nothing, and the functions below
+   only report that profiling is not available. Using several LWPR models from different
+   threads of an application at the same time mixes up the totals.
+
+   \code
+   lwpr_profile_start();
+   ... lwpr_update / lwpr_predict ...
+   lwpr_profile_report(stdout);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_PROF_H
+#define __LWPR_PROF_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Phases of updates and predictions that are profiled separately
+   \ingroup LWPR_C
+*/
+typedef enum {
+   LWPR_PHASE_NONE = -1,      /**< \brief Outside of the profiled phases */
+   LWPR_PHASE_SCAN = 0,       /**< \brief Activation scan: candidate RFs, distances and kernel values */
+   LWPR_PHASE_REGRESSION,     /**< \brief Update of the means, PLS regression and statistics of an activated RF */
+   LWPR_PHASE_METRIC,         /**< \brief Distance metric update of an activated RF */
+   LWPR_PHASE_ADD_PRUNE,      /**< \brief Adding and pruning receptive fields after an update */
+   LWPR_PHASE_PROJECTION,     /**< \brief PLS projection (or slope) and contribution of an activated RF in a prediction */
+   LWPR_NUM_PHASES            /**< \brief Number of profiled phases */
+} LWPR_Phase;
+
+/** \brief Flag returned by lwpr_profile_start: elapsed times are measured */
+#define LWPR_PROFILE_TIME       1
+/** \brief Flag returned by lwpr_profile_start: hardware counters are available */
+#define LWPR_PROFILE_COUNTERS   2
+
+/** \brief Totals of one phase, see lwpr_profile_get
+   \ingroup LWPR_C
+*/
+typedef struct {
+   double calls;              /**< \brief Number of times the phase was entered */
+   double time;               /**< \brief Elapsed time in seconds */
+   double cycles;             /**< \brief CPU cycles */
+   double instructions;       /**< \brief Retired instructions */
+   double llc_misses;         /**< \brief Last level cache misses */
+   double branch_misses;      /**< \brief Mispredicted branches */
+} LWPR_ProfileCounters;
+
+/** \brief Clears all totals and switches profiling on
+   \return
+      - 0 if the library was compiled without LWPR_PROFILE
+      - LWPR_PROFILE_TIME, plus LWPR_PROFILE_COUNTERS if the hardware counters could
+        be opened on the calling thread
+   \ingroup LWPR_C
+*/
+int lwpr_profile_start(void);
+
+/** \brief Switches profiling off. The totals are kept until the next lwpr_profile_start.
+   \ingroup LWPR_C
+*/
+void lwpr_profile_stop(void);
+
+/** \brief Retrieves the totals of a phase
+   \param[in] phase    One of the LWPR_Phase values (except LWPR_PHASE_NONE)
+   \param[in] thread   Workspace index (0...NUM_THREADS-1), or -1 for the sum over all threads
+   \param[out] C       Totals
+   \return
+      - 1 in case of success
+      - 0 if the arguments are out of range, or profiling is not compiled in
+   \ingroup LWPR_C
+*/
+int lwpr_profile_get(int phase, int thread, LWPR_ProfileCounters *C);
+
+/** \brief Prints a table of the totals of all phases (and threads, if NUM_THREADS > 1)
+   \param[in] fp    File to print to, e.g. stdout
+   \ingroup LWPR_C
+*/
+void lwpr_profile_report(FILE *fp);
+
+/** \brief Returns a short name of a phase, such as "scan" */
+const char *lwpr_profile_phase_name(int phase);
+
+/** \brief Marks a transition to another phase. Use LWPR_PROF_PHASE instead.
+   \param[in] thread   Workspace index of the calling thread
+   \param[in] phase    The phase that starts now, or LWPR_PHASE_NONE
+*/
+void lwpr_profile_phase(int thread, int phase);
+
+#if LWPR_PROFILE
+   /** \brief Marks the transition to another phase within a routine that works on LWPR_ThreadData *TD */
+   #define LWPR_PROF_PHASE(TD, phase)  lwpr_profile_phase((int) ((TD)->ws - (TD)->model->ws), (phase))
+#else
+   #define LWPR_PROF_PHASE(TD, phase)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,306 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_record.h
+   \brief Prototypes for recording the update and prediction calls of an LWPR model,
+      and for replaying such recordings
+
+   While an LWPR_Recorder is attached to a model, every call of lwpr_update and of the
+   prediction functions (lwpr_predict, lwpr_predict_J, ..., lwpr_predict_cached) appends a
+   record with its inputs, targets, cutoff, optional arguments and a timestamp to a ring
+   buffer. Appending is lock-free (a bounded multi-producer queue with per-slot sequence
+   numbers), so the calls never wait for each other or for the file system.
+   - If a filename is given, a background thread streams the records into that file. If the
+     library is compiled with NUM_THREADS == 1, the calling thread writes the buffer whenever it
+     runs full. Records that arrive while the buffer is full are dropped and counted.
+   - Without a filename, the buffer acts as a flight recorder that keeps the most recent
+     records, overwriting the oldest ones. lwpr_record_save writes them out on demand.
+
+   Optionally, only a fraction of the calls is recorded, or only updates or predictions.
+   Each record carries the sequence number of its call, so gaps due to sampling or dropping
+   can be detected. Note that a model can only be reproduced exactly from a recording that
+   contains all of its updates, starting at the model checkpoint that lwpr_record_start
+   can write.
+
+   The file format is binary (no conversion between machine architectures, as in lwpr_binio.h):
+   <TABLE>
+   <TR><TH>Element description</TH><TH>Size of element</TH></TR>
+   <TR><TD>"LWRC"                     </TD><TD>4 bytes</TD></TR>
+   <TR><TD>version                    </TD><TD>1 integer</TD></TR>
+   <TR><TD>nInRaw, nOut               </TD><TD>2 integers</TD></TR>
+   <TR><TD>n_data of the model at the start of the recording</TD><TD>1 integer</TD></TR>
+   <TR><TD>flags                      </TD><TD>1 integer</TD></TR>
+   <TR><TD>sample                     </TD><TD>1 double</TD></TR>
+   </TABLE>
+   followed by records, each consisting of an LWPR_RecordHeader and the doubles
+   described at LWPR_CallType.
+
+   \code
+   LWPR_Recorder rec;
+   lwpr_record_start(&rec, &model, "traffic.rec", "traffic.bin", LWPR_RECORD_ALL, 1.0, 4096);
+   ... lwpr_update / lwpr_predict ...
+   lwpr_record_stop(&rec);
+
+   lwpr_read_binary(&copy, "traffic.bin");
+   lwpr_replay_open(&rp, "traffic.rec");
+   lwpr_replay_run(&rp, &copy, LWPR_REPLAY_PACED, &stats);
+   lwpr_replay_close(&rp);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_RECORD_H
+#define __LWPR_RECORD_H
+
+#include <stdio.h>
+#include <lwpr/core/lwpr_checkpoint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Flag for lwpr_record_start: record calls of lwpr_update */
+#define LWPR_RECORD_UPDATES      1
+/** \brief Flag for lwpr_record_start: record calls of the prediction functions */
+#define LWPR_RECORD_PREDICTIONS  2
+/** \brief Flag for lwpr_record_start: record all calls */
+#define LWPR_RECORD_ALL          3
+
+/** \brief Flag for LWPR_RecordHeader.args: lwpr_update was called with yp != NULL */
+#define LWPR_RECORD_ARG_YP       1
+/** \brief Flag for LWPR_RecordHeader.args: called with max_w != NULL */
+#define LWPR_RECORD_ARG_MAXW     2
+/** \brief Flag for LWPR_RecordHeader.args: lwpr_predict (or lwpr_predict_sel) was called with conf != NULL */
+#define LWPR_RECORD_ARG_CONF     4
+/** \brief Flag for LWPR_RecordHeader.args: lwpr_predict_cached was called with err != NULL */
+#define LWPR_RECORD_ARG_ERR      8
+/** \brief Flag for LWPR_RecordHeader.args: called with outMask != NULL */
+#define LWPR_RECORD_ARG_OUTMASK 16
+/** \brief Flag for LWPR_RecordHeader.args: called with inMask != NULL */
+#define LWPR_RECORD_ARG_INMASK  32
+
+/** \brief Recorded functions. Every record starts with the input vector x (nInRaw doubles),
+      followed by the elements listed below.
+   \ingroup LWPR_C
+*/
+typedef enum {
+   LWPR_CALL_UPDATE = 1,      /**< \brief lwpr_update: y (nOut) */
+   LWPR_CALL_PREDICT,         /**< \brief lwpr_predict */
+   LWPR_CALL_PREDICT_J,       /**< \brief lwpr_predict_J */
+   LWPR_CALL_PREDICT_JCJ,     /**< \brief lwpr_predict_JcJ */
+   LWPR_CALL_PREDICT_JH,      /**< \brief lwpr_predict_JH */
+   LWPR_CALL_PREDICT_SEL,     /**< \brief lwpr_predict_sel: outMask (nOut, if given) */
+   LWPR_CALL_PREDICT_J_SEL,   /**< \brief lwpr_predict_J_sel: outMask (nOut, if given), inMask (nInRaw, if given) */
+   LWPR_CALL_PREDICT_JVP,     /**< \brief lwpr_predict_jvp: v (nInRaw) */
+   LWPR_CALL_PREDICT_VJP,     /**< \brief lwpr_predict_vjp: u (nOut) */
+   LWPR_CALL_PREDICT_CACHED,  /**< \brief lwpr_predict_cached */
+   LWPR_NUM_CALLS             /**< \brief One more than the largest call type */
+} LWPR_CallType;
+
+/** \brief Fixed part of a record. Masks are stored as doubles (0 or 1).
+   \ingroup LWPR_C
+*/
+typedef struct {
+   int type;                  /**< \brief One of the LWPR_CallType values */
+   int args;                  /**< \brief Combination of LWPR_RECORD_ARG_* flags */
+   double seq;                /**< \brief Number of recordable calls before this one since lwpr_record_start */
+   double time;               /**< \brief Seconds since lwpr_record_start when the call was made */
+   double cutoff;             /**< \brief Cutoff argument (0 for lwpr_update) */
+} LWPR_RecordHeader;
+
+/** \brief Recorder attached to an LWPR model. Always initialise with lwpr_record_start
+      and release with lwpr_record_stop. The counters may be read while recording.
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Recorder {
+   LWPR_Model *model;         /**< \brief The recorded model */
+   FILE *fp;                  /**< \brief Output file, NULL for a flight recorder */
+   int flags;                 /**< \brief Combination of LWPR_RECORD_UPDATES and LWPR_RECORD_PREDICTIONS */
+   double sample;             /**< \brief Fraction of the calls that are recorded (0 < sample <= 1) */
+   int nIn;                   /**< \brief Number of raw input dimensions (LWPR_Model.nInRaw) */
+   int nOut;                  /**< \brief Number of output dimensions */
+   int n_data;                /**< \brief LWPR_Model.n_data at the start of the recording */
+   int capacity;              /**< \brief Number of slots of the ring buffer (a power of 2) */
+   int slotSize;              /**< \brief Number of doubles per slot */
+   double *slots;             /**< \brief Ring buffer */
+   volatile unsigned long *slotSeq; /**< \brief Sequence number of each slot (lock-free queue) */
+   volatile unsigned long head;     /**< \brief Position of the next slot to be filled */
+   volatile unsigned long tail;     /**< \brief Position of the next slot to be written out */
+   volatile unsigned long n_calls;  /**< \brief Number of recordable calls so far */
+   volatile unsigned long n_recorded;    /**< \brief Number of records put into the buffer */
+   volatile unsigned long n_dropped;     /**< \brief Number of records dropped because the buffer was full */
+   volatile unsigned long n_overwritten; /**< \brief Number of records a flight recorder overwrote */
+   volatile int draining;     /**< \brief Set while a calling thread writes the buffer (no background thread) */
+   int ok;                    /**< \brief 0 if writing the file failed */
+   double t0;                 /**< \brief Clock value at the start of the recording */
+   int checkpointStarted;     /**< \brief Flag that determines whether LWPR_Recorder.checkpoint must be waited for */
+   LWPR_Checkpoint checkpoint;/**< \brief Checkpoint of the model at the start of the recording */
+   struct LWPR_RecorderThread *thread; /**< \brief Background writer (NULL if none) */
+} LWPR_Recorder;
+
+/** \brief Attaches a recorder to an LWPR model
+   \param[out] rec          Pointer to an (unused) LWPR_Recorder structure
+   \param[in,out] model     The model whose calls are recorded. It must not already be recorded.
+   \param[in] filename      File to stream the records to, or NULL for a flight recorder
+   \param[in] checkpoint    If not NULL, a binary file that receives a copy of the model in its
+                            current state (written in the background, or right away if the library
+                            has no threads, see lwpr_checkpoint_start and LWPR_CHECKPOINT_SYNC)
+   \param[in] flags         LWPR_RECORD_UPDATES, LWPR_RECORD_PREDICTIONS or LWPR_RECORD_ALL
+   \param[in] sample        Fraction of the calls to record (0 < sample <= 1). Calls are picked
+                            deterministically, e.g. every 10th call for sample=0.1.
+   \param[in] capacity      Minimal number of records the buffer can hold (rounded up to a power of 2)
+   \return
+      - 1 in case of success
+      - 0 if the arguments are invalid, the file could not be opened, or memory could not be allocated
+   \ingroup LWPR_C
+*/
+int lwpr_record_start(LWPR_Recorder *rec, LWPR_Model *model, const char *filename, const char *checkpoint,
+      int flags, double sample, int capacity);
+
+/** \brief Detaches a recorder from its model, writes any buffered records, closes the file
+      and releases all resources. Must not be called while another thread uses the model.
+   \param[in,out] rec    Pointer to a started LWPR_Recorder
+   \return
+      - 1 if all records and the checkpoint were written successfully (dropped records do not count as errors)
+      - 0 otherwise
+   \ingroup LWPR_C
+*/
+int lwpr_record_stop(LWPR_Recorder *rec);
+
+/** \brief Writes all records currently in the buffer to the file of a streaming recorder
+   \param[in,out] rec    Pointer to a started LWPR_Recorder with a file
+   \return 1 in case of success, 0 otherwise
+   \ingroup LWPR_C
+*/
+int lwpr_record_flush(LWPR_Recorder *rec);
+
+/** \brief Writes the records held by a flight recorder to a new recording, and empties the buffer
+   \param[in,out] rec    Pointer to a started LWPR_Recorder without a file
+   \param[in] filename   Name of the recording
+   \return 1 in case of success, 0 otherwise
+   \ingroup LWPR_C
+*/
+int lwpr_record_save(LWPR_Recorder *rec, const char *filename);
+
+/** \brief Appends a record of a call to a recorder. Called by the update and prediction
+      functions if LWPR_Model.rec is not NULL.
+   \param[in,out] rec   The model's recorder
+   \param[in] type      One of the LWPR_CallType values
+   \param[in] args      Combination of LWPR_RECORD_ARG_* flags (without the mask flags)
+   \param[in] x         Input vector (nInRaw)
+   \param[in] cutoff    Cutoff argument
+   \param[in] a         y, v or u, depending on type (NULL otherwise)
+   \param[in] outMask   Output mask of lwpr_predict_sel and lwpr_predict_J_sel (may be NULL)
+   \param[in] inMask    Input mask of lwpr_predict_J_sel (may be NULL)
+*/
+void lwpr_record_call(LWPR_Recorder *rec, int type, int args, const double *x, double cutoff,
+      const double *a, const int *outMask, const int *inMask);
+
+
+/** \brief Flag for lwpr_replay_run: reproduce the recorded pace of the calls instead of
+      running at full speed */
+#define LWPR_REPLAY_PACED        1
+/** \brief Flag for lwpr_replay_run: replay the updates only */
+#define LWPR_REPLAY_UPDATES_ONLY 2
+/** \brief Flag for lwpr_replay_run: do not insist on LWPR_Model.n_data matching the start of the recording */
+#define LWPR_REPLAY_ANY_MODEL    4
+
+/** \brief A recording opened for replay. The current record is available in hdr, x and data.
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Replay {
+   FILE *fp;                  /**< \brief The recording */
+   int nIn;                   /**< \brief Number of raw input dimensions of the recorded model */
+   int nOut;                  /**< \brief Number of output dimensions of the recorded model */
+   int n_data;                /**< \brief LWPR_Model.n_data of the recorded model at the start of the recording */
+   int flags;                 /**< \brief Flags the recording was made with */
+   double sample;             /**< \brief Sampling fraction the recording was made with */
+   LWPR_RecordHeader hdr;     /**< \brief Header of the current record */
+   double *x;                 /**< \brief Input vector of the current record (nInRaw) */
+   double *data;              /**< \brief Remaining elements of the current record, see LWPR_CallType */
+   int *outMask;              /**< \brief Output mask of the current record, if any (nOut) */
+   int *inMask;               /**< \brief Input mask of the current record, if any (nInRaw) */
+   double *out;               /**< \brief Working memory for the outputs of replayed calls */
+   double *storage;           /**< \brief Pointer to allocated memory. Do not touch. */
+   int *maskStorage;          /**< \brief Pointer to allocated memory for the masks. Do not touch. */
+} LWPR_Replay;
+
+/** \brief Totals of lwpr_replay_run
+   \ingroup LWPR_C
+*/
+typedef struct {
+   long n_calls[LWPR_NUM_CALLS];    /**< \brief Number of replayed calls per LWPR_CallType */
+   long n_skipped;            /**< \brief Number of records that were not replayed (LWPR_REPLAY_UPDATES_ONLY) */
+   long n_gaps;               /**< \brief Number of places where calls are missing from the recording (sampling or drops) */
+   double time;               /**< \brief Seconds spent within the replayed library calls */
+   double elapsed;            /**< \brief Seconds the whole replay took */
+   double max_lag;            /**< \brief Largest delay of a call behind the recorded pace (LWPR_REPLAY_PACED) */
+} LWPR_ReplayStats;
+
+/** \brief Opens a recording for replay
+   \param[out] rp        Pointer to an (unused) LWPR_Replay structure
+   \param[in] filename   Name of the recording
+   \return 1 in case of success, 0 if the file cannot be read or is no recording
+   \ingroup LWPR_C
+*/
+int lwpr_replay_open(LWPR_Replay *rp, const char *filename);
+
+/** \brief Reads the next record of a recording into rp->hdr, rp->x, rp->data and the masks
+   \param[in,out] rp     Pointer to an opened LWPR_Replay
+   \return
+      - 1 if a record was read
+      - 0 at the end of the recording
+      - -1 if the recording is corrupt or truncated
+   \ingroup LWPR_C
+*/
+int lwpr_replay_next(LWPR_Replay *rp);
+
+/** \brief Repeats the call of the current record on a model, with the same optional arguments
+   \param[in,out] rp     Pointer to an LWPR_Replay whose current record was read by lwpr_replay_next
+   \param[in,out] model  Model with nInRaw and nOut as in the recording
+   \return The return value of lwpr_update for updates, 1 otherwise
+   \ingroup LWPR_C
+*/
+int lwpr_replay_call(LWPR_Replay *rp, LWPR_Model *model);
+
+/** \brief Replays all remaining records of a recording on a model
+   \param[in,out] rp     Pointer to an opened LWPR_Replay
+   \param[in,out] model  Model to drive, normally read from the checkpoint of the recording
+   \param[in] flags      Combination of LWPR_REPLAY_PACED, LWPR_REPLAY_UPDATES_ONLY and LWPR_REPLAY_ANY_MODEL
+   \param[out] stats     Totals of the replay (may be NULL)
+   \return
+      - 1 in case of success
+      - 0 if the model does not match the recording, or the recording is corrupt
+   \ingroup LWPR_C
+*/
+int lwpr_replay_run(LWPR_Replay *rp, LWPR_Model *model, int flags, LWPR_ReplayStats *stats);
+
+/** \brief Closes a recording and releases the memory of an LWPR_Replay
+   \param[in,out] rp     Pointer to an opened LWPR_Replay
+   \ingroup LWPR_C
+*/
+void lwpr_replay_close(LWPR_Replay *rp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
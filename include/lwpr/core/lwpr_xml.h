@@ -51,6 +51,7 @@ typedef struct {
    int M;            /**< \brief Number of rows of current data element */
    int MS;           /**< \brief Offset between columns of current data element */
    int N;            /**< \brief Number of columns of current data element */
+   int packed;       /**< \brief Flag: current data element is a packed distance matrix of a ReceptiveField (see LWPR_Model.metric_col) */
    int readM;        /**< \brief Number of already read rows of current data element */
    int readN;        /**< \brief Number of already read columns of current data element */
    int numErrors;    /**< \brief Number of errors encountered during parsing */
@@ -22,10 +22,65 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <bytesobject.h>
 #include <lwpr/core/lwpr.h>
 #include <lwpr/core/lwpr_math.h>
+#include <lwpr/core/lwpr_aux.h>
 #include <lwpr/core/lwpr_xml.h>
 #include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_conc.h>
 #include <numpy/arrayobject.h>
 
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <pthread.h>
+#endif
+
+/* Number of samples the queue of update_async can hold */
+#define ASYNC_CAPACITY     1024
+/* Number of samples after which the background thread publishes a new snapshot for predictions,
+   if the model cannot be read while it is trained (see lwpr_set_concurrent) */
+#define ASYNC_INTERVAL     256
+
+/* State of the background thread that applies the samples of update_async */
+typedef struct {
+#ifdef WIN32
+   HANDLE thread;
+   CRITICAL_SECTION lock;
+   CONDITION_VARIABLE work;   /* Signalled when samples are queued, or the thread should quit */
+   CONDITION_VARIABLE done;   /* Signalled when a sample was taken from the queue, or the thread became idle */
+#else
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t work;
+   pthread_cond_t done;
+#endif
+   LWPR_Model *model;         /* The trained model (PyLWPR.model) */
+   double *queue;             /* Ring buffer of ASYNC_CAPACITY samples (nInRaw inputs, nOut outputs) */
+   double *sample;            /* Sample being applied, followed by room for the prediction */
+   int head;                  /* Position of the oldest sample in queue */
+   int count;                 /* Number of samples in queue */
+   int busy;                  /* Set while the thread applies samples or publishes a snapshot */
+   int quit;                  /* Tells the thread to quit (queued samples are discarded) */
+   int failed;                /* Set if an update or a snapshot failed for lack of memory */
+   int want;                  /* Set by a prediction that asks the thread for a newer snapshot */
+   LWPR_Model *snap;          /* Snapshot that predictions read from (only touched with the GIL held) */
+   LWPR_Model *fresh;         /* Newer snapshot published by the thread, or NULL */
+   LWPR_Reader reader;        /* Predicts from the trained model itself (only used with the GIL held) */
+   int reader_ok;             /* Set if reader is attached to the model */
+   int conc;                  /* Set if concurrent predictions were switched on for the thread */
+} PyLWPR_Async;
+
+#ifdef WIN32
+   #define ASYNC_LOCK(A)         EnterCriticalSection(&(A)->lock)
+   #define ASYNC_UNLOCK(A)       LeaveCriticalSection(&(A)->lock)
+   #define ASYNC_WAIT(A,c)       SleepConditionVariableCS(&(A)->c, &(A)->lock, INFINITE)
+   #define ASYNC_SIGNAL(A,c)     WakeAllConditionVariable(&(A)->c)
+#else
+   #define ASYNC_LOCK(A)         pthread_mutex_lock(&(A)->lock)
+   #define ASYNC_UNLOCK(A)       pthread_mutex_unlock(&(A)->lock)
+   #define ASYNC_WAIT(A,c)       pthread_cond_wait(&(A)->c, &(A)->lock)
+   #define ASYNC_SIGNAL(A,c)     pthread_cond_broadcast(&(A)->c)
+#endif
+
 typedef struct {
     PyObject_HEAD
     LWPR_Model model;
@@ -34,12 +89,273 @@ typedef struct {
     double *extra_out2;
     double *extra_out3;
     double *extra_J;
+    PyLWPR_Async *async;
 } PyLWPR;
 
 static const char *TrueFalse[]={"False","True"};
 static const char *GaussBiSq[]={"Gaussian","BiSquare"};
 
+/** Background training *************************************************************/
+
+/* Duplicates the model into a newly allocated snapshot (NULL if memory is lacking) */
+static LWPR_Model *async_snapshot(const LWPR_Model *model) {
+   LWPR_Model *snap = (LWPR_Model *) malloc(sizeof(LWPR_Model));
+
+   if (snap == NULL) return NULL;
+   if (!lwpr_duplicate_model(snap, model)) {
+      free(snap);
+      return NULL;
+   }
+   return snap;
+}
+
+static void async_free_snapshot(LWPR_Model *snap) {
+   if (snap == NULL) return;
+   lwpr_free_model(snap);
+   free(snap);
+}
+
+/* Detaches the reader, and switches concurrent predictions off again if they were switched on for it */
+static void async_detach(PyLWPR_Async *A) {
+   if (A->reader_ok) lwpr_reader_close(&A->reader);
+   if (A->conc) (void) lwpr_set_concurrent(A->model, 0);
+   A->reader_ok = A->conc = 0;
+}
+
+/* Main loop of the background thread. It never touches Python objects, and runs without the GIL. */
+static void *async_thread(void *ptr) {
+   PyLWPR_Async *A = (PyLWPR_Async *) ptr;
+   LWPR_Model *model = A->model;
+   int nIn = model->nInRaw;
+   int nOut = model->nOut;
+   int since = 0;
+
+   ASYNC_LOCK(A);
+   while (!A->quit) {
+      int ok;
+
+      if (A->count == 0) {
+         A->busy = 0;
+         ASYNC_SIGNAL(A, done);
+         ASYNC_WAIT(A, work);
+         continue;
+      }
+      memcpy(A->sample, A->queue + A->head*(nIn+nOut), sizeof(double)*(nIn+nOut));
+      A->head = (A->head + 1) % ASYNC_CAPACITY;
+      A->count--;
+      A->busy = 1;
+      ASYNC_SIGNAL(A, done);
+      ASYNC_UNLOCK(A);
+
+      ok = lwpr_update(model, A->sample, A->sample + nIn, A->sample + nIn + nOut, NULL);
+      since++;
+
+      ASYNC_LOCK(A);
+      if (!ok) A->failed = 1;
+      /* Publish a snapshot when a prediction asked for one, and regularly if predictions
+         cannot go through the reader */
+      if (A->want || (!A->reader_ok && since >= ASYNC_INTERVAL)) {
+         LWPR_Model *snap;
+
+         A->want = 0;
+         ASYNC_UNLOCK(A);
+         snap = async_snapshot(model);
+         ASYNC_LOCK(A);
+         if (snap == NULL) {
+            A->failed = 1;
+         } else {
+            LWPR_Model *stale = A->fresh;
+
+            A->fresh = snap;
+            if (stale != NULL) {
+               ASYNC_UNLOCK(A);
+               async_free_snapshot(stale);
+               ASYNC_LOCK(A);
+            }
+         }
+         since = 0;
+         ASYNC_SIGNAL(A, done);
+      }
+   }
+   A->busy = 0;
+   ASYNC_SIGNAL(A, done);
+   ASYNC_UNLOCK(A);
+   return NULL;
+}
+
+#ifdef WIN32
+static DWORD WINAPI async_thread_win32(LPVOID ptr) {
+   (void) async_thread(ptr);
+   return 0;
+}
+#endif
+
+/* Starts the background thread of a model, returns 0 if memory is lacking or the thread cannot be created */
+static int PyLWPR_async_start(PyLWPR *self) {
+   LWPR_Model *model = &(self->model);
+   PyLWPR_Async *A = (PyLWPR_Async *) calloc(1, sizeof(PyLWPR_Async));
+
+   if (A == NULL) return 0;
+   A->model = model;
+   A->queue = (double *) malloc(sizeof(double) * (ASYNC_CAPACITY*(model->nInRaw + model->nOut) + model->nInRaw + 2*model->nOut));
+   if (A->queue != NULL) {
+      if (model->conc == NULL) A->conc = lwpr_set_concurrent(model, 1);
+      if (model->conc != NULL) A->reader_ok = lwpr_reader_init(&A->reader, model);
+      /* Without the reader, predictions need a snapshot from the start */
+      if (!A->reader_ok) A->snap = async_snapshot(model);
+   }
+   if (A->queue != NULL && (A->reader_ok || A->snap != NULL)) {
+      A->sample = A->queue + ASYNC_CAPACITY*(model->nInRaw + model->nOut);
+#ifdef WIN32
+      InitializeCriticalSection(&A->lock);
+      InitializeConditionVariable(&A->work);
+      InitializeConditionVariable(&A->done);
+      A->thread = CreateThread(NULL, 0, async_thread_win32, A, 0, NULL);
+      if (A->thread != NULL) {
+         self->async = A;
+         return 1;
+      }
+      DeleteCriticalSection(&A->lock);
+#else
+      if (pthread_mutex_init(&A->lock, NULL) == 0) {
+         if (pthread_cond_init(&A->work, NULL) == 0) {
+            if (pthread_cond_init(&A->done, NULL) == 0) {
+               if (pthread_create(&A->thread, NULL, async_thread, A) == 0) {
+                  self->async = A;
+                  return 1;
+               }
+               pthread_cond_destroy(&A->done);
+            }
+            pthread_cond_destroy(&A->work);
+         }
+         pthread_mutex_destroy(&A->lock);
+      }
+#endif
+   }
+   async_detach(A);
+   async_free_snapshot(A->snap);
+   free(A->queue);
+   free(A);
+   return 0;
+}
+
+/* Waits (without the GIL) until the background thread has applied all queued samples */
+static void PyLWPR_async_idle(PyLWPR *self) {
+   PyLWPR_Async *A = self->async;
+   int idle;
+
+   if (A == NULL) return;
+
+   ASYNC_LOCK(A);
+   idle = (A->count == 0 && !A->busy);
+   ASYNC_UNLOCK(A);
+   if (idle) return;
+
+   /* The GIL is never requested while holding the lock, since the GIL holder may wait for the lock */
+   Py_BEGIN_ALLOW_THREADS
+   ASYNC_LOCK(A);
+   while (A->count > 0 || A->busy) ASYNC_WAIT(A, done);
+   ASYNC_UNLOCK(A);
+   Py_END_ALLOW_THREADS
+}
+
+/* Stops the background thread, discarding queued samples. Returns the failure flag of the thread. */
+static int PyLWPR_async_stop(PyLWPR *self) {
+   PyLWPR_Async *A = self->async;
+   int failed;
+
+   if (A == NULL) return 0;
+
+   ASYNC_LOCK(A);
+   A->quit = 1;
+   ASYNC_SIGNAL(A, work);
+   ASYNC_UNLOCK(A);
+
+   Py_BEGIN_ALLOW_THREADS
+#ifdef WIN32
+   WaitForSingleObject(A->thread, INFINITE);
+   CloseHandle(A->thread);
+   DeleteCriticalSection(&A->lock);
+#else
+   pthread_join(A->thread, NULL);
+   pthread_cond_destroy(&A->done);
+   pthread_cond_destroy(&A->work);
+   pthread_mutex_destroy(&A->lock);
+#endif
+   Py_END_ALLOW_THREADS
+
+   failed = A->failed;
+   async_detach(A);
+   async_free_snapshot(A->snap);
+   async_free_snapshot(A->fresh);
+   free(A->queue);
+   free(A);
+   self->async = NULL;
+   return failed;
+}
+
+/* Locks the queue once it has room for another sample, waiting without the GIL while it is full */
+static void PyLWPR_async_reserve(PyLWPR_Async *A) {
+   ASYNC_LOCK(A);
+   while (A->count == ASYNC_CAPACITY) {
+      ASYNC_UNLOCK(A);
+      Py_BEGIN_ALLOW_THREADS
+      ASYNC_LOCK(A);
+      while (A->count == ASYNC_CAPACITY) ASYNC_WAIT(A, done);
+      ASYNC_UNLOCK(A);
+      Py_END_ALLOW_THREADS
+      ASYNC_LOCK(A);
+   }
+}
+
+/* Reader that predictions go through while the background thread runs, or NULL if there is none */
+static LWPR_Reader *PyLWPR_predict_reader(PyLWPR *self) {
+   PyLWPR_Async *A = self->async;
+
+   return (A != NULL && A->reader_ok) ? &A->reader : NULL;
+}
+
+/* Model that predictions the reader cannot compute read from: the trained model itself while the
+   background thread is idle, and otherwise the latest snapshot it published. Each call asks the
+   thread for a newer snapshot, which it publishes after the sample it is applying, and waits for
+   it if there is no snapshot yet. As long as the GIL is held, no new samples are queued, and the
+   snapshot is not released. */
+static LWPR_Model *PyLWPR_predict_model(PyLWPR *self) {
+   PyLWPR_Async *A = self->async;
+   LWPR_Model *stale = NULL;
+   int idle;
+
+   if (A == NULL) return &(self->model);
+
+   ASYNC_LOCK(A);
+   idle = (A->count == 0 && !A->busy);
+   if (!idle && A->fresh == NULL) {
+      A->want = 1;
+      if (A->snap == NULL) {
+         /* The GIL is never requested while holding the lock, see PyLWPR_async_idle */
+         ASYNC_UNLOCK(A);
+         Py_BEGIN_ALLOW_THREADS
+         ASYNC_LOCK(A);
+         while (A->fresh == NULL && (A->count > 0 || A->busy)) ASYNC_WAIT(A, done);
+         ASYNC_UNLOCK(A);
+         Py_END_ALLOW_THREADS
+         ASYNC_LOCK(A);
+         idle = (A->count == 0 && !A->busy);
+      }
+   }
+   if (A->fresh != NULL) {
+      stale = A->snap;
+      A->snap = A->fresh;
+      A->fresh = NULL;
+   }
+   ASYNC_UNLOCK(A);
+   async_free_snapshot(stale);
+
+   return idle ? &(self->model) : A->snap;
+}
+
 static void PyLWPR_dealloc(PyLWPR* self) {
+   PyLWPR_async_stop(self);
    lwpr_free_model(&self->model);
    free(self->extra_in);
    Py_TYPE(self)->tp_free(self);
@@ -109,6 +425,62 @@ static int set_vector_from_array(int n, double *dest, PyArrayObject *obj) {
    return -1;
 }
 
+/* Returns the number of samples in obj: 1 for a vector of n elements, or the number of rows of a
+   matrix with n columns (-1 on error) */
+static int get_num_samples(int n, PyArrayObject *obj) {
+   if (PyArray_DESCR(obj) != PyArray_DescrFromType(NPY_DOUBLE)) {
+      PyErr_SetString(PyExc_TypeError, "Expected a double precision numpy array.");
+      return -1;
+   }
+   if (PyArray_NDIM(obj) == 1 && PyArray_DIM(obj,0) == n) return 1;
+   if (PyArray_NDIM(obj) == 2 && PyArray_DIM(obj,1) == n) return (int) PyArray_DIM(obj,0);
+
+   PyErr_SetString(PyExc_TypeError, "Expected a vector, or a matrix with one sample per row.");
+   return -1;
+}
+
+/* Copies the k-th sample of an array that was checked with get_num_samples */
+static void get_sample_from_array(int n, double *dest, PyArrayObject *obj, int k) {
+   int i, last = PyArray_NDIM(obj) - 1;
+   char *row = PyArray_BYTES(obj) + (last > 0 ? PyArray_STRIDE(obj,0)*k : 0);
+
+   for (i=0;i<n;i++) {
+      dest[i] = *((double *) (row + PyArray_STRIDE(obj,last)*i));
+   }
+}
+
+/* Converts a sequence of n truth values into a newly allocated int array (NULL on error) */
+static int *get_mask_from_sequence(int n, PyObject *obj) {
+   PyObject *seq;
+   int *mask;
+   int i;
+
+   seq = PySequence_Fast(obj, "Expected a sequence of flags.");
+   if (seq == NULL) return NULL;
+   if (PySequence_Fast_GET_SIZE(seq) != n) {
+      PyErr_SetString(PyExc_TypeError, "Invalid number of elements in mask.");
+      Py_DECREF(seq);
+      return NULL;
+   }
+   mask = (int *) malloc(n * sizeof(int));
+   if (mask == NULL) {
+      Py_DECREF(seq);
+      PyErr_NoMemory();
+      return NULL;
+   }
+   for (i=0;i<n;i++) {
+      int flag = PyObject_IsTrue(PySequence_Fast_GET_ITEM(seq, i));
+      if (flag < 0) {
+         free(mask);
+         Py_DECREF(seq);
+         return NULL;
+      }
+      mask[i] = flag;
+   }
+   Py_DECREF(seq);
+   return mask;
+}
+
 static int set_matrix_from_array(int m,int ms,int n, double *dest, PyArrayObject *obj) {
    int i,j;
    if (PyArray_DESCR(obj) != PyArray_DescrFromType(NPY_DOUBLE)) {
@@ -135,11 +507,16 @@ static int set_matrix_from_array(int m,int ms,int n, double *dest, PyArrayObject
 
 /** Getters for scalar parameters *************************************************/
 static PyObject *PyLWPR_G_nIn(PyLWPR *self, void *closure) { return Py_BuildValue("i",self->model.nIn); }
+static PyObject *PyLWPR_G_nInRaw(PyLWPR *self, void *closure) { return Py_BuildValue("i",self->model.nInRaw); }
+static PyObject *PyLWPR_G_cluster_size(PyLWPR *self, void *closure) { return Py_BuildValue("i",self->model.cluster_size); }
+static PyObject *PyLWPR_G_index_audit(PyLWPR *self, void *closure) { return PyBool_FromLong(self->model.index_audit); }
+static PyObject *PyLWPR_G_cluster_radius(PyLWPR *self, void *closure) { return Py_BuildValue("d",self->model.cluster_radius); }
 static PyObject *PyLWPR_G_nOut(PyLWPR *self, void *closure) { return Py_BuildValue("i",self->model.nOut); }
 static PyObject *PyLWPR_G_n_data(PyLWPR *self, void *closure) { return Py_BuildValue("i",self->model.n_data); }
 static PyObject *PyLWPR_G_meta(PyLWPR *self, void *closure) { return PyBool_FromLong(self->model.meta); }
 static PyObject *PyLWPR_G_diag_only(PyLWPR *self, void *closure) { return PyBool_FromLong(self->model.diag_only); }
 static PyObject *PyLWPR_G_update_D(PyLWPR *self, void *closure) { return PyBool_FromLong(self->model.update_D); }
+static PyObject *PyLWPR_G_use_bbox(PyLWPR *self, void *closure) { return PyBool_FromLong(self->model.use_bbox); }
 static PyObject *PyLWPR_G_w_prune(PyLWPR *self, void *closure) { return PyFloat_FromDouble(self->model.w_prune); }
 static PyObject *PyLWPR_G_w_gen(PyLWPR *self, void *closure) { return PyFloat_FromDouble(self->model.w_gen); }
 static PyObject *PyLWPR_G_meta_rate(PyLWPR *self, void *closure) { return PyFloat_FromDouble(self->model.meta_rate); }
@@ -149,6 +526,9 @@ static PyObject *PyLWPR_G_init_lambda(PyLWPR *self, void *closure) { return PyFl
 static PyObject *PyLWPR_G_tau_lambda(PyLWPR *self, void *closure) { return PyFloat_FromDouble(self->model.tau_lambda); }
 static PyObject *PyLWPR_G_final_lambda(PyLWPR *self, void *closure) { return PyFloat_FromDouble(self->model.final_lambda); }
 static PyObject *PyLWPR_G_add_threshold(PyLWPR *self, void *closure) { return PyFloat_FromDouble(self->model.add_threshold); }
+static PyObject *PyLWPR_G_gate_factor(PyLWPR *self, void *closure) { return PyFloat_FromDouble(self->model.gate_factor); }
+static PyObject *PyLWPR_G_gate_keep(PyLWPR *self, void *closure) { return Py_BuildValue("i",self->model.gate_keep); }
+static PyObject *PyLWPR_G_gate_acceptance(PyLWPR *self, void *closure) { return PyFloat_FromDouble(lwpr_gate_acceptance_rate(&self->model)); }
 
 
 /** Getter for vector & matrix parameters *****************************************/
@@ -176,6 +556,20 @@ static PyObject *PyLWPR_G_init_M(PyLWPR *self, void *closure) {
    return get_array_from_matrix(self->model.nIn, self->model.nInStore, self->model.nIn, self->model.init_M);
 }
 
+static PyObject *PyLWPR_G_blocks(PyLWPR *self, void *closure) {
+   PyObject *sizes = PyTuple_New(self->model.nBlocks);
+   int i,k;
+   if (sizes == NULL) return NULL;
+   for (i=0,k=0;i<self->model.nIn;i=self->model.block_end[i],k++) {
+      PyTuple_SET_ITEM(sizes, k, PyLong_FromLong(self->model.block_end[i] - i));
+   }
+   return sizes;
+}
+
+static PyObject *PyLWPR_G_rank(PyLWPR *self, void *closure) {
+   return Py_BuildValue("i",self->model.rank);
+}
+
 static PyObject *PyLWPR_G_init_alpha(PyLWPR *self, void *closure) {
    return get_array_from_matrix(self->model.nIn, self->model.nInStore, self->model.nIn, self->model.init_alpha);
 }
@@ -276,6 +670,20 @@ static int PyLWPR_S_update_D(PyLWPR *self, PyObject *value, void *closure) {
    return 0;
 }
 
+static int PyLWPR_S_index_audit(PyLWPR *self, PyObject *value, void *closure) {
+   CHECK_DELETE(value,"index_audit");
+   CHECK_BOOL(value,"index_audit");
+   self->model.index_audit = (value == Py_True) ? 1 : 0;
+   return 0;
+}
+
+static int PyLWPR_S_use_bbox(PyLWPR *self, PyObject *value, void *closure) {
+   CHECK_DELETE(value,"use_bbox");
+   CHECK_BOOL(value,"use_bbox");
+   self->model.use_bbox = (value == Py_True) ? 1 : 0;
+   return 0;
+}
+
 static int PyLWPR_S_w_prune(PyLWPR *self, PyObject *value, void *closure) {
    CHECK_DELETE(value,"w_prune");
    CHECK_GET_SCALAR(value,"w_prune",self->model.w_prune);
@@ -330,6 +738,29 @@ static int PyLWPR_S_add_threshold(PyLWPR *self, PyObject *value, void *closure)
    return 0;
 }
 
+static int PyLWPR_S_gate_factor(PyLWPR *self, PyObject *value, void *closure) {
+   double factor;
+   CHECK_DELETE(value,"gate_factor");
+   CHECK_GET_SCALAR(value,"gate_factor",factor);
+   if (!lwpr_set_gate(&self->model, factor, self->model.gate_keep)) {
+      PyErr_SetString(PyExc_ValueError, "Attribute 'gate_factor' must not be negative.");
+      return -1;
+   }
+   return 0;
+}
+
+static int PyLWPR_S_gate_keep(PyLWPR *self, PyObject *value, void *closure) {
+   long keep;
+   CHECK_DELETE(value,"gate_keep");
+   keep = PyLong_AsLong(value);
+   if (keep == -1 && PyErr_Occurred()) return -1;
+   if (!lwpr_set_gate(&self->model, self->model.gate_factor, (int) keep)) {
+      PyErr_SetString(PyExc_ValueError, "Attribute 'gate_keep' must not be negative.");
+      return -1;
+   }
+   return 0;
+}
+
 static int PyLWPR_S_init_D(PyLWPR *self,PyObject *value, void *closure) {
    int err;
    LWPR_Model *m = &(self->model);
@@ -353,6 +784,55 @@ static int PyLWPR_S_init_D(PyLWPR *self,PyObject *value, void *closure) {
    /* Ok, everything was fine, init_M is already the factor,
       copy the contents again to init_D */
    set_matrix_from_array(m->nIn, m->nInStore, m->nIn, m->init_D, (PyArrayObject *)value);
+   if (m->nBlocks > 1) {
+      /* Drop the elements outside the blocks */
+      lwpr_aux_mask_blocks(m, m->init_D);
+      lwpr_math_cholesky(m->nIn, m->nInStore, m->init_M, m->init_D);
+   }
+   return 0;
+}
+
+static int PyLWPR_S_blocks(PyLWPR *self, PyObject *value, void *closure) {
+   PyObject *seq;
+   int *sizes;
+   int i,n,ok;
+
+   CHECK_DELETE(value,"blocks");
+   seq = PySequence_Fast(value, "Attribute 'blocks' must be a sequence of block sizes.");
+   if (seq == NULL) return -1;
+   n = (int) PySequence_Fast_GET_SIZE(seq);
+   sizes = (int *) malloc((n>0 ? n : 1)*sizeof(int));
+   if (sizes == NULL) {
+      Py_DECREF(seq);
+      PyErr_NoMemory();
+      return -1;
+   }
+   for (i=0;i<n;i++) {
+      sizes[i] = (int) PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+   }
+   Py_DECREF(seq);
+   if (PyErr_Occurred()) {
+      free(sizes);
+      return -1;
+   }
+   ok = lwpr_set_blocks(&self->model, n, sizes);
+   free(sizes);
+   if (!ok) {
+      PyErr_SetString(PyExc_ValueError, "Attribute 'blocks' must partition the input dimensions, and can only be set before training.");
+      return -1;
+   }
+   return 0;
+}
+
+static int PyLWPR_S_rank(PyLWPR *self, PyObject *value, void *closure) {
+   long rank;
+   CHECK_DELETE(value,"rank");
+   rank = PyLong_AsLong(value);
+   if (rank == -1 && PyErr_Occurred()) return -1;
+   if (!lwpr_set_rank(&self->model, (int) rank)) {
+      PyErr_SetString(PyExc_ValueError, "Attribute 'rank' must be in range 0..nIn-1, and can only be set before training.");
+      return -1;
+   }
    return 0;
 }
 
@@ -423,6 +903,9 @@ static PyGetSetDef PyLWPR_getseters[] = {
    {"nIn", (getter) PyLWPR_G_nIn, NULL,
       "Input dimension", NULL},
 
+   {"nInRaw", (getter) PyLWPR_G_nInRaw, NULL,
+      "Input dimension before the input projection (equal to nIn without projection)", NULL},
+
    {"nOut", (getter) PyLWPR_G_nOut, NULL,
       "Output dimension", NULL},
 
@@ -438,6 +921,9 @@ static PyGetSetDef PyLWPR_getseters[] = {
    {"update_D", (getter) PyLWPR_G_update_D, (setter) PyLWPR_S_update_D,
       "Enable distance metric updates", NULL},
 
+   {"use_bbox", (getter) PyLWPR_G_use_bbox, (setter) PyLWPR_S_use_bbox,
+      "Cull receptive fields by bounding boxes before computing distances", NULL},
+
    {"w_prune", (getter) PyLWPR_G_w_prune, (setter) PyLWPR_S_w_prune,
       "Threshold parameter for pruning receptive fields", NULL},
 
@@ -456,6 +942,15 @@ static PyGetSetDef PyLWPR_getseters[] = {
    {"add_threshold", (getter) PyLWPR_G_add_threshold, (setter) PyLWPR_S_add_threshold,
       "Threshold parameter determining when to add a new PLS regression axis", NULL},
 
+   {"gate_factor", (getter) PyLWPR_G_gate_factor, (setter) PyLWPR_S_gate_factor,
+      "Throttling gate: samples with an error below gate_factor times the confidence bound are skipped (0 = disabled)", NULL},
+
+   {"gate_keep", (getter) PyLWPR_G_gate_keep, (setter) PyLWPR_S_gate_keep,
+      "Throttling gate: every gate_keep-th skipped sample is still used for training, with gate_keep times its weight (0 = none)", NULL},
+
+   {"gate_acceptance", (getter) PyLWPR_G_gate_acceptance, NULL,
+      "Fraction of training samples that passed the throttling gate", NULL},
+
    {"init_lambda", (getter) PyLWPR_G_init_lambda, (setter) PyLWPR_S_init_lambda,
       "Initial forgetting factor", NULL},
 
@@ -483,6 +978,21 @@ static PyGetSetDef PyLWPR_getseters[] = {
    {"init_M", (getter) PyLWPR_G_init_M, (setter) PyLWPR_S_init_M,
       "Initial distance metric", NULL},
 
+   {"blocks", (getter) PyLWPR_G_blocks, (setter) PyLWPR_S_blocks,
+      "Sizes of the diagonal blocks of the distance metrics", NULL},
+
+   {"rank", (getter) PyLWPR_G_rank, (setter) PyLWPR_S_rank,
+      "Rank of low-rank-plus-diagonal distance metrics (0 = full or diagonal)", NULL},
+
+   {"cluster_size", (getter) PyLWPR_G_cluster_size, NULL,
+      "Maximal number of receptive fields per cluster (0 = no clusters), see set_clusters", NULL},
+
+   {"cluster_radius", (getter) PyLWPR_G_cluster_radius, NULL,
+      "Distance within which new receptive fields join an existing cluster, see set_clusters", NULL},
+
+   {"index_audit", (getter) PyLWPR_G_index_audit, (setter) PyLWPR_S_index_audit,
+      "Check every indexed query against a full scan and count the missed receptive fields, see index_stats", NULL},
+
    {"init_alpha", (getter) PyLWPR_G_init_alpha, (setter) PyLWPR_S_init_alpha,
       "Initial distance update learning rate", NULL},
 
@@ -529,7 +1039,7 @@ static PyObject *PyLWPR_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
          return NULL;
       }
 #endif
-      nIn = self->model.nIn;
+      nIn = self->model.nInRaw;
       nOut = self->model.nOut;
    } else {
       if (!PyArg_ParseTuple(args, "ii", &nIn,&nOut)) return NULL;
@@ -552,6 +1062,8 @@ static PyObject *PyLWPR_repr(PyLWPR *obj) {
    LWPR_Model *m = &(obj->model);
    char str[1001];
 
+   PyLWPR_async_idle(obj);
+
    snprintf(str,1000,
       "LWPR model\n"
       "          nIn : %d\n"
@@ -584,7 +1096,8 @@ static PyObject *PyLWPR_update(PyLWPR *self, PyObject *args) {
    LWPR_Model *model = &(self->model);
    PyArrayObject *x, *y;
    if (!PyArg_ParseTuple(args, "O!O!", &PyArray_Type, &x, &PyArray_Type, &y))  return NULL;
-   if (set_vector_from_array(model->nIn, self->extra_in, x)) return NULL;
+   PyLWPR_async_idle(self);
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
    if (set_vector_from_array(model->nOut, self->extra_out, y)) return NULL;
 
    lwpr_update(model,self->extra_in, self->extra_out, self->extra_out2, NULL);
@@ -599,7 +1112,8 @@ static PyObject *PyLWPR_update_maxw(PyLWPR *self, PyObject *args) {
    PyObject *o1,*o2,*result;
 
    if (!PyArg_ParseTuple(args, "O!O!", &PyArray_Type, &x, &PyArray_Type, &y))  return NULL;
-   if (set_vector_from_array(model->nIn, self->extra_in, x)) return NULL;
+   PyLWPR_async_idle(self);
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
    if (set_vector_from_array(model->nOut, self->extra_out, y)) return NULL;
 
    lwpr_update(model,self->extra_in, self->extra_out, self->extra_out2, self->extra_out3);
@@ -618,27 +1132,37 @@ static PyObject *PyLWPR_update_maxw(PyLWPR *self, PyObject *args) {
 
 static PyObject *PyLWPR_predict(PyLWPR *self, PyObject *args) {
    double cutoff = 0.0;
-   LWPR_Model *model = &(self->model);
+   LWPR_Reader *R = PyLWPR_predict_reader(self);
+   LWPR_Model *model = (R != NULL) ? &(self->model) : PyLWPR_predict_model(self);
    PyArrayObject *x;
 
    if (!PyArg_ParseTuple(args, "O!|d", &PyArray_Type, &x, &cutoff))  return NULL;
-   if (set_vector_from_array(model->nIn, self->extra_in, x)) return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
 
-   lwpr_predict(model,self->extra_in, cutoff, self->extra_out, NULL, NULL);
+   if (R != NULL) {
+      lwpr_reader_predict(R, self->extra_in, cutoff, self->extra_out, NULL, NULL);
+   } else {
+      lwpr_predict(model,self->extra_in, cutoff, self->extra_out, NULL, NULL);
+   }
 
    return get_array_from_vector(model->nOut, self->extra_out);
 }
 
 static PyObject *PyLWPR_predict_conf(PyLWPR *self, PyObject *args) {
    double cutoff = 0.0;
-   LWPR_Model *model = &(self->model);
+   LWPR_Reader *R = PyLWPR_predict_reader(self);
+   LWPR_Model *model = (R != NULL) ? &(self->model) : PyLWPR_predict_model(self);
    PyArrayObject *x;
    PyObject *o1,*o2,*result;
 
    if (!PyArg_ParseTuple(args, "O!|d", &PyArray_Type, &x, &cutoff))  return NULL;
-   if (set_vector_from_array(model->nIn, self->extra_in, x)) return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
 
-   lwpr_predict(model,self->extra_in, cutoff, self->extra_out, self->extra_out2, NULL);
+   if (R != NULL) {
+      lwpr_reader_predict(R, self->extra_in, cutoff, self->extra_out, self->extra_out2, NULL);
+   } else {
+      lwpr_predict(model,self->extra_in, cutoff, self->extra_out, self->extra_out2, NULL);
+   }
 
    o1 = get_array_from_vector(model->nOut, self->extra_out);
    o2 = get_array_from_vector(model->nOut, self->extra_out2);
@@ -653,14 +1177,19 @@ static PyObject *PyLWPR_predict_conf(PyLWPR *self, PyObject *args) {
 
 static PyObject *PyLWPR_predict_conf_maxw(PyLWPR *self, PyObject *args) {
    double cutoff = 0.0;
-   LWPR_Model *model = &(self->model);
+   LWPR_Reader *R = PyLWPR_predict_reader(self);
+   LWPR_Model *model = (R != NULL) ? &(self->model) : PyLWPR_predict_model(self);
    PyArrayObject *x;
    PyObject *o1,*o2,*o3,*result;
 
    if (!PyArg_ParseTuple(args, "O!|d", &PyArray_Type, &x, &cutoff))  return NULL;
-   if (set_vector_from_array(model->nIn, self->extra_in, x)) return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
 
-   lwpr_predict(model,self->extra_in, cutoff, self->extra_out, self->extra_out2, self->extra_out3);
+   if (R != NULL) {
+      lwpr_reader_predict(R, self->extra_in, cutoff, self->extra_out, self->extra_out2, self->extra_out3);
+   } else {
+      lwpr_predict(model,self->extra_in, cutoff, self->extra_out, self->extra_out2, self->extra_out3);
+   }
 
    o1 = get_array_from_vector(model->nOut, self->extra_out);
    o2 = get_array_from_vector(model->nOut, self->extra_out2);
@@ -677,17 +1206,114 @@ static PyObject *PyLWPR_predict_conf_maxw(PyLWPR *self, PyObject *args) {
 
 static PyObject *PyLWPR_predict_J(PyLWPR *self, PyObject *args) {
    double cutoff = 0.0;
-   LWPR_Model *model = &(self->model);
+   LWPR_Model *model = PyLWPR_predict_model(self);
    PyArrayObject *x;
    PyObject *o1,*o2,*result;
 
    if (!PyArg_ParseTuple(args, "O!|d", &PyArray_Type, &x, &cutoff))  return NULL;
-   if (set_vector_from_array(model->nIn, self->extra_in, x)) return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
 
    lwpr_predict_J(model,self->extra_in, cutoff, self->extra_out, self->extra_J);
 
    o1 = get_array_from_vector(model->nOut, self->extra_out);
-   o2 = get_array_from_matrix(model->nOut, model->nOut, model->nIn, self->extra_J);
+   o2 = get_array_from_matrix(model->nOut, model->nOut, model->nInRaw, self->extra_J);
+
+   result = Py_BuildValue("(O,O)",o1,o2);
+
+   Py_DECREF(o1);
+   Py_DECREF(o2);
+
+   return result;
+}
+
+static PyObject *PyLWPR_predict_sel(PyLWPR *self, PyObject *args) {
+   double cutoff = 0.0;
+   LWPR_Model *model = PyLWPR_predict_model(self);
+   PyArrayObject *x;
+   PyObject *om;
+   int *outMask;
+
+   if (!PyArg_ParseTuple(args, "O!O|d", &PyArray_Type, &x, &om, &cutoff))  return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
+   outMask = get_mask_from_sequence(model->nOut, om);
+   if (outMask == NULL) return NULL;
+
+   memset(self->extra_out, 0, model->nOut * sizeof(double));
+   lwpr_predict_sel(model,self->extra_in, cutoff, outMask, self->extra_out, NULL, NULL);
+   free(outMask);
+
+   return get_array_from_vector(model->nOut, self->extra_out);
+}
+
+static PyObject *PyLWPR_predict_J_sel(PyLWPR *self, PyObject *args) {
+   double cutoff = 0.0;
+   LWPR_Model *model = PyLWPR_predict_model(self);
+   PyArrayObject *x;
+   PyObject *om,*im,*o1,*o2,*result;
+   int *outMask, *inMask;
+
+   if (!PyArg_ParseTuple(args, "O!OO|d", &PyArray_Type, &x, &om, &im, &cutoff))  return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
+   outMask = get_mask_from_sequence(model->nOut, om);
+   if (outMask == NULL) return NULL;
+   inMask = get_mask_from_sequence(model->nInRaw, im);
+   if (inMask == NULL) {
+      free(outMask);
+      return NULL;
+   }
+
+   memset(self->extra_out, 0, model->nOut * sizeof(double));
+   memset(self->extra_J, 0, model->nOut * model->nInRaw * sizeof(double));
+   lwpr_predict_J_sel(model,self->extra_in, cutoff, outMask, inMask, self->extra_out, self->extra_J);
+   free(outMask);
+   free(inMask);
+
+   o1 = get_array_from_vector(model->nOut, self->extra_out);
+   o2 = get_array_from_matrix(model->nOut, model->nOut, model->nInRaw, self->extra_J);
+
+   result = Py_BuildValue("(O,O)",o1,o2);
+
+   Py_DECREF(o1);
+   Py_DECREF(o2);
+
+   return result;
+}
+
+static PyObject *PyLWPR_predict_cached(PyLWPR *self, PyObject *args) {
+   double cutoff = 0.0;
+   double err;
+   int hit;
+   LWPR_Model *model = PyLWPR_predict_model(self);
+   PyArrayObject *x;
+   PyObject *o1,*result;
+
+   if (!PyArg_ParseTuple(args, "O!|d", &PyArray_Type, &x, &cutoff))  return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
+
+   hit = lwpr_predict_cached(model,self->extra_in, cutoff, self->extra_out, &err);
+
+   o1 = get_array_from_vector(model->nOut, self->extra_out);
+   result = Py_BuildValue("(O,O,d)",o1,hit ? Py_True : Py_False,err);
+   Py_DECREF(o1);
+
+   return result;
+}
+
+static PyObject *PyLWPR_predict_jvp(PyLWPR *self, PyObject *args) {
+   double cutoff = 0.0;
+   LWPR_Model *model = PyLWPR_predict_model(self);
+   PyArrayObject *x, *v;
+   PyObject *o1,*o2,*result;
+
+   if (!PyArg_ParseTuple(args, "O!O!|d", &PyArray_Type, &x, &PyArray_Type, &v, &cutoff))  return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
+   /* extra_J is large enough to hold the direction (nOut*nInRaw >= nInRaw) */
+   if (set_vector_from_array(model->nInRaw, self->extra_J, v)) return NULL;
+
+   lwpr_predict_jvp(model,self->extra_in, self->extra_J, cutoff, self->extra_out, self->extra_out2);
+
+   o1 = get_array_from_vector(model->nOut, self->extra_out);
+   o2 = get_array_from_vector(model->nOut, self->extra_out2);
 
    result = Py_BuildValue("(O,O)",o1,o2);
 
@@ -697,11 +1323,101 @@ static PyObject *PyLWPR_predict_J(PyLWPR *self, PyObject *args) {
    return result;
 }
 
+static PyObject *PyLWPR_predict_vjp(PyLWPR *self, PyObject *args) {
+   double cutoff = 0.0;
+   LWPR_Model *model = PyLWPR_predict_model(self);
+   PyArrayObject *x, *u;
+   PyObject *o1,*o2,*result;
+
+   if (!PyArg_ParseTuple(args, "O!O!|d", &PyArray_Type, &x, &PyArray_Type, &u, &cutoff))  return NULL;
+   if (set_vector_from_array(model->nInRaw, self->extra_in, x)) return NULL;
+   if (set_vector_from_array(model->nOut, self->extra_out2, u)) return NULL;
+
+   lwpr_predict_vjp(model,self->extra_in, self->extra_out2, cutoff, self->extra_out, self->extra_J);
+
+   o1 = get_array_from_vector(model->nOut, self->extra_out);
+   o2 = get_array_from_vector(model->nInRaw, self->extra_J);
+
+   result = Py_BuildValue("(O,O)",o1,o2);
+
+   Py_DECREF(o1);
+   Py_DECREF(o2);
+
+   return result;
+}
+
+static PyObject *PyLWPR_update_async(PyLWPR *self, PyObject *args) {
+   LWPR_Model *model = &(self->model);
+   PyArrayObject *x, *y;
+   PyLWPR_Async *A;
+   int n, k, nIn = model->nInRaw, nOut = model->nOut;
+
+   if (!PyArg_ParseTuple(args, "O!O!", &PyArray_Type, &x, &PyArray_Type, &y))  return NULL;
+   n = get_num_samples(nIn, x);
+   if (n < 0) return NULL;
+   if (get_num_samples(nOut, y) != n) {
+      if (!PyErr_Occurred()) PyErr_SetString(PyExc_TypeError, "Number of input and output samples do not match.");
+      return NULL;
+   }
+
+   if (self->async == NULL && !PyLWPR_async_start(self)) {
+      PyErr_SetString(PyExc_MemoryError, "Background thread could not be started.");
+      return NULL;
+   }
+   A = self->async;
+
+   for (k=0;k<n;k++) {
+      double *slot;
+
+      PyLWPR_async_reserve(A);
+      slot = A->queue + ((A->head + A->count) % ASYNC_CAPACITY)*(nIn + nOut);
+      get_sample_from_array(nIn, slot, x, k);
+      get_sample_from_array(nOut, slot + nIn, y, k);
+      A->count++;
+      ASYNC_SIGNAL(A, work);
+      ASYNC_UNLOCK(A);
+   }
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+static PyObject *PyLWPR_flush(PyLWPR *self, PyObject *args) {
+   int failed = 0;
+
+   PyLWPR_async_idle(self);
+   if (self->async != NULL) {
+      ASYNC_LOCK(self->async);
+      failed = self->async->failed;
+      self->async->failed = 0;
+      ASYNC_UNLOCK(self->async);
+   }
+   if (failed) {
+      PyErr_SetString(PyExc_MemoryError, "Some background updates failed for lack of memory.");
+      return NULL;
+   }
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+static PyObject *PyLWPR_wait(PyLWPR *self, PyObject *args) {
+   PyLWPR_async_idle(self);
+   if (PyLWPR_async_stop(self)) {
+      PyErr_SetString(PyExc_MemoryError, "Some background updates failed for lack of memory.");
+      return NULL;
+   }
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
 static PyObject *PyLWPR_rf_center(PyLWPR *self, PyObject *args) {
    int dim, n;
    LWPR_Model *model = &(self->model);
 
    if (!PyArg_ParseTuple(args, "ii", &dim, &n))  return NULL;
+   PyLWPR_async_idle(self);
 
    if (dim<0 || dim>=model->nOut) {
       PyErr_SetString(PyExc_TypeError, "First parameter must indicate output dimension (0 <= dim < model.nOut).");
@@ -721,6 +1437,7 @@ static PyObject *PyLWPR_rf_mean_x(PyLWPR *self, PyObject *args) {
    LWPR_Model *model = &(self->model);
 
    if (!PyArg_ParseTuple(args, "ii", &dim, &n))  return NULL;
+   PyLWPR_async_idle(self);
 
    if (dim<0 || dim>=model->nOut) {
       PyErr_SetString(PyExc_TypeError, "First parameter must indicate output dimension (0 <= dim < model.nOut).");
@@ -740,6 +1457,7 @@ static PyObject *PyLWPR_beta(PyLWPR* self, PyObject* args) {
     LWPR_Model *model = &(self->model);
 
     if (!PyArg_ParseTuple(args, "ii", &dim, &n))  return NULL;
+    PyLWPR_async_idle(self);
 
     if (dim<0 || dim>=model->nOut) {
        PyErr_SetString(PyExc_TypeError, "First parameter must indicate output dimension (0 <= dim < model.nOut).");
@@ -765,6 +1483,7 @@ static PyObject *PyLWPR_beta0(PyLWPR* self, PyObject* args) {
     LWPR_Model *model = &(self->model);
 
     if (!PyArg_ParseTuple(args, "ii", &dim, &n))  return NULL;
+    PyLWPR_async_idle(self);
 
     if (dim<0 || dim>=model->nOut) {
        PyErr_SetString(PyExc_TypeError, "First parameter must indicate output dimension (0 <= dim < model.nOut).");
@@ -784,6 +1503,7 @@ static PyObject *PyLWPR_rf_trustworthy(PyLWPR* self, PyObject* args) {
     LWPR_Model *model = &(self->model);
 
     if (!PyArg_ParseTuple(args, "ii", &dim, &n))  return NULL;
+    PyLWPR_async_idle(self);
 
     if (dim<0 || dim>=model->nOut) {
        PyErr_SetString(PyExc_TypeError, "First parameter must indicate output dimension (0 <= dim < model.nOut).");
@@ -804,9 +1524,12 @@ static PyObject *PyLWPR_rf_trustworthy(PyLWPR* self, PyObject* args) {
 
 static PyObject *PyLWPR_rf_D(PyLWPR *self, PyObject *args) {
    int dim, n;
+   PyObject *D;
+   double *dense;
    LWPR_Model *model = &(self->model);
 
    if (!PyArg_ParseTuple(args, "ii", &dim, &n))  return NULL;
+   PyLWPR_async_idle(self);
 
    if (dim<0 || dim>=model->nOut) {
       PyErr_SetString(PyExc_TypeError, "First parameter must indicate output dimension (0 <= dim < model.nOut).");
@@ -818,7 +1541,13 @@ static PyObject *PyLWPR_rf_D(PyLWPR *self, PyObject *args) {
       return NULL;
    }
 
-   return get_array_from_matrix(model->nIn, model->nInStore, model->nIn, model->sub[dim].rf[n]->D);
+   /* Packed (block-diagonal) and low-rank metrics are expanded into a dense matrix */
+   dense = (double *) malloc(sizeof(double) * model->nIn * model->nInStore);
+   if (dense == NULL) return PyErr_NoMemory();
+   lwpr_rf_get_D(model->sub[dim].rf[n], dense);
+   D = get_array_from_matrix(model->nIn, model->nInStore, model->nIn, dense);
+   free(dense);
+   return D;
 }
 
 static PyObject *PyLWPR_write_XML(PyLWPR *self, PyObject *args) {
@@ -827,6 +1556,7 @@ static PyObject *PyLWPR_write_XML(PyLWPR *self, PyObject *args) {
    LWPR_Model *model = &(self->model);
 
    if (!PyArg_ParseTuple(args, "s", &filename))  return NULL;
+   PyLWPR_async_idle(self);
    fp = fopen(filename, "w");
    if (fp==NULL) {
       PyErr_SetString(PyExc_IOError, "File cannot be opened for writing.");
@@ -839,6 +1569,113 @@ static PyObject *PyLWPR_write_XML(PyLWPR *self, PyObject *args) {
    return Py_None;
 }
 
+static PyObject *PyLWPR_set_projection(PyLWPR *self, PyObject *args) {
+   LWPR_Model *model = &(self->model);
+   int nInRaw, interval = 1;
+   double *extra;
+
+   if (!PyArg_ParseTuple(args, "i|i", &nInRaw, &interval))  return NULL;
+
+   /* The queue of the background thread is sized for the old input dimension */
+   PyLWPR_async_idle(self);
+   PyLWPR_async_stop(self);
+
+   /* Input buffers grow to the raw input dimension */
+   extra = malloc(sizeof(double) * (nInRaw*(model->nOut + 1) + 3*model->nOut));
+   if (extra == NULL) return PyErr_NoMemory();
+
+   if (!lwpr_set_projection(model, nInRaw, NULL, interval)) {
+      free(extra);
+      PyErr_SetString(PyExc_ValueError, "Projection requires nInRaw >= nIn and interval >= 0, and can only be set once before training.");
+      return NULL;
+   }
+   free(self->extra_in);
+   self->extra_in = extra;
+   self->extra_out = self->extra_in + nInRaw;
+   self->extra_out2 = self->extra_out + model->nOut;
+   self->extra_out3 = self->extra_out2 + model->nOut;
+   self->extra_J = self->extra_out3 + model->nOut;
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+static PyObject *PyLWPR_set_clusters(PyLWPR *self, PyObject *args) {
+   int size;
+   double radius = 2.0;
+
+   if (!PyArg_ParseTuple(args, "i|d", &size, &radius))  return NULL;
+   PyLWPR_async_idle(self);
+
+   if (size<0 || radius<0.0) {
+      PyErr_SetString(PyExc_ValueError, "Cluster size and radius must be non-negative.");
+      return NULL;
+   }
+   if (!lwpr_set_clusters(&(self->model), size, radius)) return PyErr_NoMemory();
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+static PyObject *PyLWPR_set_index(PyLWPR *self, PyObject *args) {
+   int nProj;
+   double recall = 0.99;
+
+   if (!PyArg_ParseTuple(args, "i|d", &nProj, &recall))  return NULL;
+   PyLWPR_async_idle(self);
+
+   if (nProj<0 || (nProj>0 && (recall<=0.0 || recall>1.0))) {
+      PyErr_SetString(PyExc_ValueError, "Number of directions must be non-negative, and recall must be in (0,1].");
+      return NULL;
+   }
+   if (!lwpr_set_index(&(self->model), nProj, recall)) return PyErr_NoMemory();
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+static PyObject *PyLWPR_index_stats(PyLWPR *self, PyObject *args) {
+   int dim;
+   LWPR_Model *model = &(self->model);
+   const LWPR_RFIndex *idx;
+
+   if (!PyArg_ParseTuple(args, "i", &dim))  return NULL;
+   PyLWPR_async_idle(self);
+
+   if (dim<0 || dim>=model->nOut) {
+      PyErr_SetString(PyExc_TypeError, "Parameter must indicate output dimension (0 <= dim < model.nOut).");
+      return NULL;
+   }
+   idx = model->sub[dim].index;
+   if (idx == NULL) return Py_BuildValue("(llll)", 0L, 0L, 0L, 0L);
+   return Py_BuildValue("(llll)", idx->n_queries, idx->n_candidates, idx->n_audited, idx->n_missed);
+}
+
+static PyObject *PyLWPR_set_taylor_cache(PyLWPR *self, PyObject *args) {
+   double radius, tol = 0.0;
+
+   if (!PyArg_ParseTuple(args, "d|d", &radius, &tol))  return NULL;
+   PyLWPR_async_idle(self);
+
+   if (radius<0.0 || tol<0.0) {
+      PyErr_SetString(PyExc_ValueError, "Radius and tolerance must be non-negative.");
+      return NULL;
+   }
+   if (!lwpr_set_taylor_cache(&(self->model), radius, tol)) return PyErr_NoMemory();
+
+   Py_INCREF(Py_None);
+   return Py_None;
+}
+
+static PyObject *PyLWPR_taylor_stats(PyLWPR *self, PyObject *args) {
+   const LWPR_TaylorCache *T;
+
+   PyLWPR_async_idle(self);
+   T = self->model.taylor;
+   if (T == NULL) return Py_BuildValue("(ll)", 0L, 0L);
+   return Py_BuildValue("(ll)", T->n_hits, T->n_misses);
+}
+
 static PyObject *PyLWPR_write_binary(PyLWPR *self, PyObject *args) {
    char *filename;
    FILE *fp;
@@ -846,6 +1683,7 @@ static PyObject *PyLWPR_write_binary(PyLWPR *self, PyObject *args) {
    int ok;
 
    if (!PyArg_ParseTuple(args, "s", &filename))  return NULL;
+   PyLWPR_async_idle(self);
    fp = fopen(filename, "wb");
    if (fp==NULL) {
       PyErr_SetString(PyExc_IOError, "File cannot be opened for writing.");
@@ -864,11 +1702,40 @@ static PyObject *PyLWPR_write_binary(PyLWPR *self, PyObject *args) {
 }
 
 
+/* Attributes that do not wait for the background thread: predictions read from its snapshot */
+static int PyLWPR_async_safe(PyObject *name) {
+   const char *str = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+
+   if (str == NULL) {
+      PyErr_Clear();
+      return 0;
+   }
+   return !strncmp(str, "predict", 7) || !strcmp(str, "update_async")
+         || !strcmp(str, "flush") || !strcmp(str, "wait");
+}
+
+/* Parameters and statistics of the model are only read and written while the background thread is idle */
+static PyObject *PyLWPR_getattro(PyLWPR *self, PyObject *name) {
+   if (self->async != NULL && !PyLWPR_async_safe(name)) PyLWPR_async_idle(self);
+   return PyObject_GenericGetAttr((PyObject *) self, name);
+}
+
+static int PyLWPR_setattro(PyLWPR *self, PyObject *name, PyObject *value) {
+   PyLWPR_async_idle(self);
+   return PyObject_GenericSetAttr((PyObject *) self, name, value);
+}
+
 static PyMethodDef PyLWPR_methods[] = {
     {"update", (PyCFunction)PyLWPR_update, METH_VARARGS,
     "Update an LWPR model given an (input, output) training sample. Returns current prediction."},
     {"update_maxw", (PyCFunction)PyLWPR_update_maxw, METH_VARARGS,
     "Update an LWPR model given an (input, output) training sample. Returns current prediction and maximum activation."},
+    {"update_async", (PyCFunction)PyLWPR_update_async, METH_VARARGS,
+    "update_async(x,y) queues training samples (vectors, or matrices with one sample per row) for a background thread and returns immediately. predict, predict_conf and predict_conf_maxw then read from the model while it is trained, other predictions from a snapshot that the thread takes when they ask for it."},
+    {"flush", (PyCFunction)PyLWPR_flush, METH_NOARGS,
+    "flush() waits until the background thread has applied all samples queued by update_async."},
+    {"wait", (PyCFunction)PyLWPR_wait, METH_NOARGS,
+    "wait() waits until the background thread has applied all queued samples, and then stops it."},
     {"predict", (PyCFunction)PyLWPR_predict, METH_VARARGS,
     "Compute prediction of LWPR model for a given input sample"},
     {"predict_conf", (PyCFunction)PyLWPR_predict_conf, METH_VARARGS,
@@ -877,6 +1744,16 @@ static PyMethodDef PyLWPR_methods[] = {
     "Compute prediction, confidence bounds, and maximal activation of LWPR model for a given input sample"},
     {"predict_J", (PyCFunction)PyLWPR_predict_J, METH_VARARGS,
     "Compute prediction and Jacobi matrix of LWPR model for a given input sample"},
+    {"predict_sel", (PyCFunction)PyLWPR_predict_sel, METH_VARARGS,
+    "predict_sel(x,out_mask[,cutoff]) computes the prediction for the output dimensions selected by out_mask only (others are 0)."},
+    {"predict_J_sel", (PyCFunction)PyLWPR_predict_J_sel, METH_VARARGS,
+    "predict_J_sel(x,out_mask,in_mask[,cutoff]) computes selected outputs and the Jacobian entries of selected outputs and inputs (others are 0)."},
+    {"predict_cached", (PyCFunction)PyLWPR_predict_cached, METH_VARARGS,
+    "predict_cached(x[,cutoff]) computes the prediction using the Taylor cache if possible, and returns (y, hit, estimated error)."},
+    {"predict_jvp", (PyCFunction)PyLWPR_predict_jvp, METH_VARARGS,
+    "predict_jvp(x,v[,cutoff]) computes the prediction and the product J*v of its Jacobian with a direction v."},
+    {"predict_vjp", (PyCFunction)PyLWPR_predict_vjp, METH_VARARGS,
+    "predict_vjp(x,u[,cutoff]) computes the prediction and the product u'*J of output weights u with its Jacobian."},
     {"rf_center", (PyCFunction)PyLWPR_rf_center, METH_VARARGS,
     "rf_center(dim,n) retrieves the center of the n-th receptive field in output dimension dim."},
     {"rf_mean_x", (PyCFunction)PyLWPR_rf_mean_x, METH_VARARGS,
@@ -893,6 +1770,18 @@ static PyMethodDef PyLWPR_methods[] = {
     "write_XML(filename) writes the LWPR model to an XML file."},
     {"write_binary", (PyCFunction)PyLWPR_write_binary, METH_VARARGS,
     "write_binary(filename) writes the LWPR model to a binary, platform-dependent file."},
+    {"set_projection", (PyCFunction)PyLWPR_set_projection, METH_VARARGS,
+    "set_projection(nInRaw, interval=1) lets the model learn on an online-PCA projection of nInRaw-dimensional inputs onto nIn dimensions."},
+    {"set_clusters", (PyCFunction)PyLWPR_set_clusters, METH_VARARGS,
+    "set_clusters(size, radius=2.0) groups the receptive fields into clusters of up to size members, so that predictions can skip distant clusters (size=0 removes them)."},
+    {"set_index", (PyCFunction)PyLWPR_set_index, METH_VARARGS,
+    "set_index(nProj, recall=0.99) builds an approximate random-projection index over the receptive fields that predictions use to find candidates (nProj=0 removes it)."},
+    {"index_stats", (PyCFunction)PyLWPR_index_stats, METH_VARARGS,
+    "index_stats(dim) returns the numbers of indexed queries, candidates, audited queries, and missed receptive fields in output dimension dim."},
+    {"set_taylor_cache", (PyCFunction)PyLWPR_set_taylor_cache, METH_VARARGS,
+    "set_taylor_cache(radius, tol=0) enables a cache that answers queries within radius of a previous one by a first-order expansion (radius=0 removes it)."},
+    {"taylor_stats", (PyCFunction)PyLWPR_taylor_stats, METH_NOARGS,
+    "taylor_stats() returns the numbers of queries answered from the Taylor cache, and of full evaluations."},
     {NULL}  /* Sentinel */
 };
 
@@ -902,6 +1791,8 @@ static PyTypeObject PyLWPR_Type = {
     .tp_basicsize = sizeof(PyLWPR),
     .tp_dealloc = (destructor) PyLWPR_dealloc,
     .tp_repr = (reprfunc) PyLWPR_repr,
+    .tp_getattro = (getattrofunc) PyLWPR_getattro,
+    .tp_setattro = (setattrofunc) PyLWPR_setattro,
     .tp_flags = Py_TPFLAGS_DEFAULT,
     .tp_doc =
     "This class encapsulates an LWPR model for learning regression functions\n"
@@ -4,8 +4,8 @@ from random import *
 from math import *
 
 def cross_2D(x1,x2):
-   return max(exp(-10.0*x1*x1), exp(-50.0*x2*x2),
-               1.25*exp(-5.0*(x1*x1 + x2*x2)))
+   return max([exp(-10.0*x1*x1), exp(-50.0*x2*x2),
+               1.25*exp(-5.0*(x1*x1 + x2*x2))])
 
 model = LWPR(2,1)
 
@@ -32,3 +32,65 @@ print(model)
 print(model.kernel)
 
 model.write_XML("cross2d.xml")
+
+# Smoke tests of the extensions: every method and attribute is called once
+
+print(model.nInRaw, model.rank, model.blocks, model.use_bbox)
+print(model.predict_sel(x, [1]))
+print(model.predict_J_sel(x, [1], [1,0]))
+print(model.predict_jvp(x, ones(2)))
+print(model.predict_vjp(x, ones(1)))
+
+model.set_clusters(16)
+print(model.cluster_size, model.cluster_radius, model.predict(x))
+model.set_clusters(0)
+
+model.set_index(4)
+model.index_audit = True
+print(model.predict(x), model.index_stats(0), model.index_audit)
+model.set_index(0)
+
+model.set_taylor_cache(0.01)
+print(model.predict_cached(x), model.predict_cached(x), model.taylor_stats())
+model.set_taylor_cache(0)
+
+model.gate_factor = 1.0
+model.gate_keep = 10
+for i in range(1000):
+   x[0] = R.uniform(-1,1)
+   x[1] = R.uniform(-1,1)
+   y[0] = cross_2D(x[0],x[1])
+   model.update(x,y)
+print(model.gate_factor, model.gate_keep, model.gate_acceptance)
+model.gate_factor = 0.0
+
+# Asynchronous training: predictions read the model while it is trained
+X = zeros([100,2])
+Y = zeros([100,1])
+for k in range(5):
+   for i in range(100):
+      X[i,0] = R.uniform(-1,1)
+      X[i,1] = R.uniform(-1,1)
+      Y[i,0] = cross_2D(X[i,0],X[i,1])
+   model.update_async(X,Y)
+   print(model.predict(x), model.predict_conf(x), model.predict_conf_maxw(x), model.predict_J(x)[0])
+model.update_async(x,y)
+model.flush()
+print(model.n_data, model.num_rfs)
+model.wait()
+
+# Input projection, block metrics and low-rank metrics are set before training
+pmodel = LWPR(2,1)
+pmodel.set_projection(3)
+pmodel.update(array([0.1,0.2,0.3]), array([1.0]))
+print(pmodel.nInRaw, pmodel.predict(array([0.1,0.2,0.3])))
+
+bmodel = LWPR(3,1)
+bmodel.blocks = [1,2]
+bmodel.update(array([0.1,0.2,0.3]), array([1.0]))
+print(bmodel.blocks, bmodel.predict(array([0.1,0.2,0.3])))
+
+rmodel = LWPR(3,1)
+rmodel.rank = 1
+rmodel.update(array([0.1,0.2,0.3]), array([1.0]))
+print(rmodel.rank, rmodel.predict(array([0.1,0.2,0.3])))
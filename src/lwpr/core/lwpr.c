@@ -21,6 +21,11 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <lwpr/core/lwpr_aux.h>
 #include <lwpr/core/lwpr_mem.h>
 #include <lwpr/core/lwpr_math.h>
+#include <lwpr/core/lwpr_record.h>
+#include <lwpr/core/lwpr_repl.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_dispatch.h>
+#include <lwpr/core/lwpr_conc.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
@@ -56,7 +61,15 @@ int lwpr_init_model(LWPR_Model *model, int nIn, int nOut, const char *name) {
    }
 
    model->n_data = 0;
+   model->n_updates = 0;
    model->diag_only = 1;
+   model->nBlocks = 1;
+   model->rank = 0;
+   for (i=0;i<nIn;i++) {
+      model->block_begin[i] = 0;
+      model->block_end[i] = nIn;
+   }
+   lwpr_aux_layout_blocks(model);
    model->meta = 0;
    model->meta_rate = 250;
    model->penalty = 1e-6;
@@ -80,6 +93,24 @@ int lwpr_init_model(LWPR_Model *model, int nIn, int nOut, const char *name) {
    model->add_threshold = 0.5;
    model->kernel = LWPR_GAUSSIAN_KERNEL;
    model->update_D = 1;
+   model->gate_factor = 0.0;
+   model->gate_keep = 0;
+   model->gate_run = 0.0;
+   model->n_gate_seen = 0.0;
+   model->n_gate_accepted = 0.0;
+   model->gate_weight = 1.0;
+   model->mon_decay = 0.0;
+   model->use_bbox = 0;
+   model->cluster_size = 0;
+   model->cluster_radius = 0.0;
+   model->index_proj = 0;
+   model->index_recall = 1.0;
+   model->index_kappa = 1.0;
+   model->index_audit = 0;
+   model->index_miss = NULL;
+   model->index_miss_data = NULL;
+   model->taylor_radius = 0.0;
+   model->taylor_tol = 0.0;
    return 1;
 }
 
@@ -141,45 +172,280 @@ int lwpr_set_init_D(LWPR_Model *model, const double *D, int stride) {
    for (i=0;i<nIn;i++) {
       memcpy(model->init_D + i*nInS, D + i*stride, nIn*sizeof(double));
    }
+   if (model->nBlocks > 1) lwpr_aux_mask_blocks(model, model->init_D);
    return lwpr_math_cholesky(nIn,nInS,model->init_M,model->init_D);
 }
 
+int lwpr_set_blocks(LWPR_Model *model, int nBlocks, const int *sizes) {
+   int j,k,begin;
+   int nIn = model->nIn;
+
+   if (nBlocks<1 || nBlocks>nIn) return 0;
+   for (k=0;k<model->nOut;k++) {
+      if (model->sub[k].numRFS > 0) return 0;
+   }
+   for (k=0,begin=0;k<nBlocks;k++) {
+      if (sizes[k]<=0) return 0;
+      begin+=sizes[k];
+   }
+   if (begin!=nIn) return 0;
+
+   for (k=0,begin=0;k<nBlocks;k++) {
+      int end = begin + sizes[k];
+      for (j=begin;j<end;j++) {
+         model->block_begin[j] = begin;
+         model->block_end[j] = end;
+      }
+      begin = end;
+   }
+   model->nBlocks = nBlocks;
+   lwpr_aux_layout_blocks(model);
+
+   lwpr_aux_mask_blocks(model, model->init_D);
+   return lwpr_math_cholesky(nIn,model->nInStore,model->init_M,model->init_D);
+}
+
+int lwpr_set_rank(LWPR_Model *model, int rank) {
+   int k;
+
+   if (rank<0 || rank>=model->nIn) return 0;
+   for (k=0;k<model->nOut;k++) {
+      if (model->sub[k].numRFS > 0) return 0;
+   }
+   model->rank = rank;
+   return 1;
+}
+
+int lwpr_set_projection(LWPR_Model *model, int nInRaw, const double *P, int interval) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int i,j;
+
+   if (nInRaw<nIn || interval<0 || model->proj_P != NULL) return 0;
+   for (i=0;i<model->nOut;i++) {
+      if (model->sub[i].numRFS > 0) return 0;
+   }
+   if (!lwpr_mem_alloc_projection(model, nInRaw)) return 0;
+
+   model->proj_interval = interval;
+   if (P == NULL) {
+      for (i=0;i<nIn;i++) model->proj_P[i+i*nInS] = 1.0;
+   } else {
+      for (j=0;j<nInRaw;j++) {
+         memcpy(model->proj_P + j*nInS, P + j*nIn, nIn*sizeof(double));
+      }
+   }
+   /* The cache is sized by nInRaw */
+   if (model->taylor != NULL) return lwpr_set_taylor_cache(model, model->taylor_radius, model->taylor_tol);
+   return 1;
+}
+
+int lwpr_set_clusters(LWPR_Model *model, int size, double radius) {
+   int dim,n;
+
+   if (size<0 || radius<0.0) return 0;
+   for (dim=0;dim<model->nOut;dim++) lwpr_aux_free_clusters(&model->sub[dim]);
+   model->cluster_size = size;
+   model->cluster_radius = radius;
+   if (size == 0) return 1;
+
+   for (dim=0;dim<model->nOut;dim++) {
+      LWPR_SubModel *sub = &model->sub[dim];
+
+      sub->clusters = (LWPR_Cluster **) LWPR_MALLOC(16*sizeof(LWPR_Cluster *));
+      if (sub->clusters == NULL) break;
+      #ifdef MATLAB
+         if (model->isPersistent) mexMakeMemoryPersistent(sub->clusters);
+      #endif
+      sub->numClusterPointers = 16;
+      for (n=0;n<sub->numRFS;n++) {
+         if (!lwpr_aux_cluster_insert(sub, sub->rf[n], model->ws[0].xc)) break;
+      }
+      if (n<sub->numRFS) break;
+   }
+   if (dim<model->nOut) {
+      for (dim=0;dim<model->nOut;dim++) lwpr_aux_free_clusters(&model->sub[dim]);
+      model->cluster_size = 0;
+      return 0;
+   }
+   return 1;
+}
+
+int lwpr_set_index(LWPR_Model *model, int nProj, double recall) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   unsigned long state = 20071u;
+   int dim,i,t;
+
+   if (nProj<0 || (nProj>0 && (recall<=0.0 || recall>1.0))) return 0;
+   for (dim=0;dim<model->nOut;dim++) lwpr_aux_free_index(&model->sub[dim]);
+   if (model->taylor != NULL) model->taylor->valid = 0;
+   if (model->index_dirs != NULL) LWPR_FREE(model->index_dirs);
+   model->index_dirs = NULL;
+   model->index_proj = 0;
+   if (nProj == 0) return 1;
+
+   model->index_dirs = (double *) LWPR_MALLOC(nProj*nInS*sizeof(double));
+   if (model->index_dirs == NULL) return 0;
+   #ifdef MATLAB
+      if (model->isPersistent) mexMakeMemoryPersistent(model->index_dirs);
+   #endif
+
+   /* Gaussian directions by Box-Muller, from a fixed-seed LCG so that the index is reproducible */
+   for (t=0;t<nProj;t++) {
+      for (i=0;i<nIn;i++) {
+         double u1,u2;
+         state = (1664525u*state + 1013904223u) & 0xFFFFFFFFu;
+         u1 = (state + 0.5)/4294967296.0;
+         state = (1664525u*state + 1013904223u) & 0xFFFFFFFFu;
+         u2 = (state + 0.5)/4294967296.0;
+         model->index_dirs[i+t*nInS] = sqrt(-2.0*log(u1))*cos(6.283185307179586*u2);
+      }
+   }
+
+   for (dim=0;dim<model->nOut;dim++) {
+      LWPR_RFIndex *idx = (LWPR_RFIndex *) LWPR_CALLOC(1, sizeof(LWPR_RFIndex));
+      if (idx == NULL) {
+         lwpr_set_index(model, 0, 1.0);
+         return 0;
+      }
+      #ifdef MATLAB
+         if (model->isPersistent) mexMakeMemoryPersistent(idx);
+      #endif
+      model->sub[dim].index = idx;
+   }
+   model->index_proj = nProj;
+   model->index_recall = recall;
+   model->index_kappa = lwpr_aux_index_kappa(nIn, nProj, recall);
+   return 1;
+}
+
+int lwpr_set_taylor_cache(LWPR_Model *model, double radius, double tol) {
+   int nRaw = model->nInRaw;
+   int nOut = model->nOut;
+   size_t size = (size_t)(nRaw + nOut + nOut*nRaw);
+   LWPR_TaylorCache *T;
+
+   if (radius<0.0 || tol<0.0) return 0;
+   lwpr_aux_free_taylor(model);
+   model->taylor_radius = 0.0;
+   model->taylor_tol = 0.0;
+   if (radius == 0.0) return 1;
+
+   if (tol > 0.0) size += (size_t)(nOut*nRaw*nRaw);
+   T = (LWPR_TaylorCache *) LWPR_CALLOC(1, sizeof(LWPR_TaylorCache));
+   if (T == NULL) return 0;
+   T->storage = (double *) LWPR_CALLOC(size, sizeof(double));
+   if (T->storage == NULL) {
+      LWPR_FREE(T);
+      return 0;
+   }
+   #ifdef MATLAB
+      if (model->isPersistent) {
+         mexMakeMemoryPersistent(T);
+         mexMakeMemoryPersistent(T->storage);
+      }
+   #endif
+   T->x0 = T->storage;
+   T->y0 = T->x0 + nRaw;
+   T->J0 = T->y0 + nOut;
+   T->H = (tol > 0.0) ? T->J0 + nOut*nRaw : NULL;
+
+   model->taylor = T;
+   model->taylor_radius = radius;
+   model->taylor_tol = tol;
+   return 1;
+}
+
+void lwpr_rf_get_D(const LWPR_ReceptiveField *RF, double *D) {
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   int i,j,l;
+
+   if (RF->L == NULL) {
+      if (RF->DReady) {
+         lwpr_aux_unpack_metric(RF->model, RF->D, D);
+      } else {
+         lwpr_aux_compute_D(RF, D, 1);
+      }
+      return;
+   }
+   for (j=0;j<nIn;j++) {
+      for (i=0;i<nIn;i++) D[i+j*nInS] = 0.0;
+      D[j+j*nInS] = RF->L[j]*RF->L[j];
+      for (l=1;l<=RF->model->rank;l++) {
+         lwpr_math_add_scalar_vector(D + j*nInS, RF->L[j+l*nInS], RF->L + l*nInS, nIn);
+      }
+   }
+}
+
+void lwpr_rf_get_M(const LWPR_ReceptiveField *RF, double *M) {
+   if (RF->L == NULL) {
+      lwpr_aux_unpack_metric(RF->model, RF->M, M);
+   } else {
+      /* Low-rank metrics do not keep a Cholesky factor */
+      lwpr_rf_get_D(RF, M);
+      lwpr_math_cholesky(RF->model->nIn, RF->model->nInStore, M, NULL);
+   }
+}
+
+int lwpr_prune_projections(LWPR_Model *model, double threshold, double *flops_predict, double *flops_update, double *rf_flops) {
+   int dim,n,k = 0,removed = 0;
+   double sum_fp = 0.0, sum_fu = 0.0;
+
+   /* The background thread must not read RFs whose nReg changes */
+   if (model->lazy != NULL) (void) lwpr_finish_loading(model);
+
+   for (dim=0;dim<model->nOut;dim++) {
+      LWPR_SubModel *sub = &model->sub[dim];
+      for (n=0;n<sub->numRFS;n++) {
+         double fp, fu;
+         removed += lwpr_aux_prune_projections(sub->rf[n], threshold, &fp, &fu);
+         sum_fp += fp;
+         sum_fu += fu;
+         if (rf_flops!=NULL) {
+            rf_flops[k++] = fp;
+            rf_flops[k++] = fu;
+         }
+      }
+   }
+   if (flops_predict!=NULL) *flops_predict = sum_fp;
+   if (flops_update!=NULL) *flops_update = sum_fu;
+   if (removed > 0 && model->taylor != NULL) model->taylor->valid = 0;
+   return removed;
+}
+
+int lwpr_set_gate(LWPR_Model *model, double factor, int keep) {
+   if (factor<0.0 || keep<0) return 0;
+
+   model->gate_factor = factor;
+   model->gate_keep = keep;
+   model->gate_run = 0.0;
+   model->n_gate_seen = 0.0;
+   model->n_gate_accepted = 0.0;
+   return 1;
+}
+
+double lwpr_gate_acceptance_rate(const LWPR_Model *model) {
+   if (model->n_gate_seen == 0.0) return 1.0;
+   return model->n_gate_accepted / model->n_gate_seen;
+}
+
+double lwpr_rf_activation(const LWPR_ReceptiveField *RF) {
+   return (RF->w_stamp == RF->model->n_updates) ? RF->w : 0.0;
+}
 
 int lwpr_duplicate_model(LWPR_Model *dest, const LWPR_Model *src) {
    int dim, n;
-   int nIn = src->nIn;
-   int nInS = src->nInStore;
-
-   if (!lwpr_init_model(dest, nIn, src->nOut, src->name)) return 0;
-
-   dest->diag_only     = src->diag_only;
-   dest->meta          = src->meta;
-   dest->meta_rate     = src->meta_rate;
-   dest->penalty       = src->penalty;
-   dest->w_gen         = src->w_gen;
-   dest->w_prune       = src->w_prune;
-   dest->init_lambda   = src->init_lambda;
-   dest->final_lambda  = src->final_lambda;
-   dest->tau_lambda    = src->tau_lambda;
-   dest->init_S2       = src->init_S2;
-   dest->add_threshold = src->add_threshold;
-   dest->kernel        = src->kernel;
-   dest->update_D      = src->update_D;
-   dest->n_data        = src->n_data;
-
-   memcpy(dest->mean_x,     src->mean_x,     nIn * sizeof(double));
-   memcpy(dest->var_x,      src->var_x,      nIn * sizeof(double));
-   memcpy(dest->norm_in,    src->norm_in,    nIn * sizeof(double));
-   memcpy(dest->norm_out,   src->norm_out,   src->nOut * sizeof(double));
-   memcpy(dest->init_D,     src->init_D,     nIn * nInS * sizeof(double));
-   memcpy(dest->init_M,     src->init_M,     nIn * nInS * sizeof(double));
-   memcpy(dest->init_alpha, src->init_alpha, nIn * nInS * sizeof(double));
+
+   /* Loading the training statistics completes the source without changing its predictions */
+   if (src->lazy != NULL && !lwpr_finish_loading((LWPR_Model *) src)) return 0;
+   if (!lwpr_aux_copy_settings(dest, src)) return 0;
 
    for (dim=0;dim<src->nOut;dim++) {
       for (n=0;n<src->sub[dim].numRFS;n++) {
          LWPR_ReceptiveField *RFd;
          const LWPR_ReceptiveField *RFs = src->sub[dim].rf[n];
-         int nReg = RFs->nReg;
 
          RFd = lwpr_aux_add_rf(&(dest->sub[dim]), RFs->nReg);
          if (RFd==NULL) {
@@ -187,71 +453,266 @@ int lwpr_duplicate_model(LWPR_Model *dest, const LWPR_Model *src) {
             return 0;
          }
 
-         RFd->trustworthy = RFs->trustworthy;
-         RFd->w           = RFs->w;
-         RFd->sum_e2      = RFs->sum_e2;
-         RFd->beta0       = RFs->beta0;
-         RFd->SSp         = RFs->SSp;
-
-         memcpy(RFd->D,      RFs->D,      nInS * nIn * sizeof(double));
-         memcpy(RFd->M,      RFs->M,      nInS * nIn * sizeof(double));
-         memcpy(RFd->alpha,  RFs->alpha,  nInS * nIn * sizeof(double));
-         memcpy(RFd->beta,   RFs->beta,   nReg * sizeof(double));
-         memcpy(RFd->c,      RFs->c,      nIn * sizeof(double));
-         memcpy(RFd->SXresYres, RFs->SXresYres, nInS * nReg * sizeof(double));
-         memcpy(RFd->SSs2,   RFs->SSs2,   nReg * sizeof(double));
-         memcpy(RFd->SSYres, RFs->SSYres, nReg * sizeof(double));
-         memcpy(RFd->SSXres, RFs->SSXres, nInS * nReg * sizeof(double));
-         memcpy(RFd->U,      RFs->U,      nInS * nReg * sizeof(double));
-         memcpy(RFd->P,      RFs->P,      nInS * nReg * sizeof(double));
-         memcpy(RFd->H,      RFs->H,      nReg * sizeof(double));
-         memcpy(RFd->r,      RFs->r,      nReg * sizeof(double));
-         memcpy(RFd->h,      RFs->h,      nInS * nIn * sizeof(double));
-         memcpy(RFd->b,      RFs->b,      nInS * nIn * sizeof(double));
-         memcpy(RFd->sum_w,  RFs->sum_w,  nReg * sizeof(double));
-         memcpy(RFd->sum_e_cv2, RFs->sum_e_cv2, nReg * sizeof(double));
-         memcpy(RFd->n_data, RFs->n_data, nReg * sizeof(double));
-         memcpy(RFd->lambda, RFs->lambda, nReg * sizeof(double));
-         memcpy(RFd->s,      RFs->s,      nReg * sizeof(double));
-         memcpy(RFd->mean_x, RFs->mean_x, nIn * sizeof(double));
-         memcpy(RFd->var_x,  RFs->var_x,  nIn * sizeof(double));
+         lwpr_aux_copy_rf(RFd, RFs);
       }
       dest->sub[dim].n_pruned = src->sub[dim].n_pruned;
    }
+   if (src->cluster_size > 0 && !lwpr_set_clusters(dest, src->cluster_size, src->cluster_radius)) {
+      lwpr_free_model(dest);
+      return 0;
+   }
+   dest->index_audit     = src->index_audit;
+   dest->index_miss      = src->index_miss;
+   dest->index_miss_data = src->index_miss_data;
+   if (src->index_proj > 0 && !lwpr_set_index(dest, src->index_proj, src->index_recall)) {
+      lwpr_free_model(dest);
+      return 0;
+   }
+   if (src->taylor != NULL && !lwpr_set_taylor_cache(dest, src->taylor_radius, src->taylor_tol)) {
+      lwpr_free_model(dest);
+      return 0;
+   }
+   if (src->dispatch != NULL) {
+      LWPR_Dispatch *D = (LWPR_Dispatch *) LWPR_CALLOC(1, sizeof(LWPR_Dispatch));
+
+      if (D == NULL) {
+         lwpr_free_model(dest);
+         return 0;
+      }
+      D->spawn = src->dispatch->spawn;
+      D->update_rf = src->dispatch->update_rf;
+      D->predict_rf = src->dispatch->predict_rf;
+      D->last_update = src->dispatch->last_update;
+      D->last_predict = src->dispatch->last_predict;
+      dest->dispatch = D;
+   }
    return 1;
 }
 
 
-int lwpr_update(LWPR_Model *model, const double *x, const double *y, double *yp, double *max_w) {
-   double maxw;
+/* Updates the output dimensions first, first+incr, ... (see lwpr_aux_update_one for ws) */
+static int lwpr_update_outputs(LWPR_Model *model, int first, int incr, LWPR_Workspace *ws, double *yp, double *max_w) {
    double ypi;
 
    int i,code=0;
 
+   for (i=first;i<model->nOut;i+=incr) {
+      code |= lwpr_aux_update_one(model, i, model->xn, model->yn[i], &ypi, (max_w!=NULL) ? &max_w[i] : NULL, ws);
+      if (yp!=NULL) yp[i]=ypi * model->norm_out[i];
+   }
+   return code;
+}
+
+#if NUM_THREADS > 1
+/* Share of an output-parallel update: thread t updates the output dimensions t, t+NUM_THREADS, ...
+** using workspace t */
+typedef struct {
+   LWPR_Model *model;
+   int first;
+   double *yp;
+   double *max_w;
+   int code;
+} LWPR_UpdateShare;
+
+static void *lwpr_update_share_T(void *ptr) {
+   LWPR_UpdateShare *S = (LWPR_UpdateShare *) ptr;
+
+   S->code = lwpr_update_outputs(S->model, S->first, NUM_THREADS, &S->model->ws[S->first], S->yp, S->max_w);
+   return NULL;
+}
+
+/* Updates all output dimensions in the mode chosen by lwpr_dispatch_update */
+static int lwpr_update_dispatched(LWPR_Model *model, double *yp, double *max_w) {
+   LWPR_UpdateShare S[NUM_THREADS];
+   int i,todo,numRF=0,code=0;
+   double t0;
+
+#ifdef WIN32
+   HANDLE thread[NUM_THREADS-1];
+   DWORD ID[NUM_THREADS-1];
+#else
+   pthread_t thread[NUM_THREADS-1];
+   int rc[NUM_THREADS-1];
+#endif
+
+   switch (lwpr_dispatch_update(model)) {
+      case LWPR_DISPATCH_SERIAL:
+         for (i=0;i<model->nOut;i++) numRF += model->sub[i].numRFS;
+         t0 = lwpr_dispatch_clock();
+         code = lwpr_update_outputs(model, 0, 1, &model->ws[0], yp, max_w);
+         lwpr_dispatch_time_update(model, numRF, lwpr_dispatch_clock() - t0);
+         return code;
+      case LWPR_DISPATCH_RFS:
+         return lwpr_update_outputs(model, 0, 1, NULL, yp, max_w);
+   }
+
+   todo = (model->nOut < NUM_THREADS) ? model->nOut : NUM_THREADS;
+   for (i=0;i<todo;i++) {
+      S[i].model = model;
+      S[i].first = i;
+      S[i].yp = yp;
+      S[i].max_w = max_w;
+   }
+
+   for (i=0;i<todo-1;i++) {
+#ifdef WIN32
+      thread[i] = CreateThread(NULL,0, lwpr_update_share_T ,&S[i],0, &ID[i]);
+#else
+      rc[i] = pthread_create(&thread[i], NULL, lwpr_update_share_T, &S[i]);
+#endif
+   }
+   (void) lwpr_update_share_T(&S[todo-1]);
+   code = S[todo-1].code;
+
+   for (i=0;i<todo-1;i++) {
+#ifdef WIN32
+      if (thread[i]!=NULL) {
+         WaitForSingleObject(thread[i],INFINITE);
+         CloseHandle(thread[i]);
+#else
+      if (rc[i]==0) {
+         pthread_join(thread[i],NULL);
+#endif
+      } else {
+         /* Thread could not be started, do its calculations now */
+         (void) lwpr_update_share_T(&S[i]);
+      }
+      code |= S[i].code;
+   }
+   return code;
+}
+#endif
+
+int lwpr_update(LWPR_Model *model, const double *x, const double *y, double *yp, double *max_w) {
+   int i,code;
+
+   if (model->lazy != NULL && !lwpr_finish_loading(model)) return 0;
+
+   if (model->rec != NULL) {
+      lwpr_record_call(model->rec, LWPR_CALL_UPDATE, ((yp != NULL) ? LWPR_RECORD_ARG_YP : 0)
+            | ((max_w != NULL) ? LWPR_RECORD_ARG_MAXW : 0), x, 0.0, y, NULL, NULL);
+   }
+
+   if (model->proj_P != NULL) {
+      /* Learn the projection on the raw inputs, and train the RFs on z = P*x */
+      lwpr_aux_update_projection(model,x);
+      lwpr_aux_project_input(model,x,model->xn);
+      x = model->xn;
+   }
+
    lwpr_aux_update_model_stats(model,x);
 
    for (i=0;i<model->nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
    for (i=0;i<model->nOut;i++) model->yn[i]=y[i]/model->norm_out[i];
 
-   for (i=0;i<model->nOut;i++) {
-      code |= lwpr_aux_update_one(model, i, model->xn, model->yn[i], &ypi, &maxw);
-      if (max_w!=NULL) max_w[i]=maxw;
-      if (yp!=NULL) yp[i]=ypi * model->norm_out[i];
+   model->gate_weight = 1.0;
+   if (model->gate_factor > 0.0) {
+      model->n_gate_seen++;
+      if (!lwpr_aux_gate_sample(model, model->xn, model->yn, yp, max_w)) {
+         /* Subsample the skipped samples, if requested. Each one is kept with probability
+         ** 1/gate_keep, so it is trained on with the weight of gate_keep samples. */
+         if (model->gate_keep == 0 || ++model->gate_run < model->gate_keep) return 1;
+         model->gate_run = 0.0;
+         model->gate_weight = (double) model->gate_keep;
+      }
+      model->n_gate_accepted++;
+   }
+   model->n_updates++;
+
+#if NUM_THREADS > 1
+   if (model->dispatch != NULL) {
+      code = lwpr_update_dispatched(model, yp, max_w);
+   } else {
+      code = lwpr_update_outputs(model, 0, 1, NULL, yp, max_w);
    }
+#else
+   code = lwpr_update_outputs(model, 0, 1, NULL, yp, max_w);
+#endif
+   if (model->repl != NULL) lwpr_repl_tick(model->repl);
+   if (model->conc != NULL) lwpr_conc_collect(model->conc);
    return code;
 }
 
 
+/* Runs func for TD[0..todo-1], with one thread per entry if the library is multi-threaded
+** (unless the model chooses serial execution, see lwpr_dispatch.h) */
+static void lwpr_predict_batch(LWPR_ThreadData *TD, int todo, void *(*func)(void *)) {
+#if NUM_THREADS == 1
+   int i;
+   for (i=0;i<todo;i++) (void) func(&TD[i]);
+#else
+   const LWPR_Model *model = TD[0].model;
+   int i;
+#ifdef WIN32
+   HANDLE thread[NUM_THREADS-1];
+   DWORD ID[NUM_THREADS-1];
+#else
+   pthread_t thread[NUM_THREADS-1];
+   int rc[NUM_THREADS-1];
+#endif
+
+   if (model->dispatch != NULL) {
+      int numRF = 0, maxRF = 0;
+
+      for (i=0;i<todo;i++) {
+         int n = model->sub[TD[i].dim].numRFS;
+         numRF += n;
+         if (n > maxRF) maxRF = n;
+      }
+      if (lwpr_dispatch_predict(model, numRF, maxRF, todo) == LWPR_DISPATCH_SERIAL) {
+         double t0 = lwpr_dispatch_clock();
+
+         for (i=0;i<todo;i++) (void) func(&TD[i]);
+         lwpr_dispatch_time_predict(model, numRF, lwpr_dispatch_clock() - t0);
+         return;
+      }
+   }
+
+   for (i=0;i<todo-1;i++) {
+#ifdef WIN32
+      thread[i] = CreateThread(NULL,0, func ,&TD[i],0, &ID[i]);
+#else
+      rc[i] = pthread_create(&thread[i], NULL, func , &TD[i]);
+#endif
+   }
+   (void) func(&TD[todo-1]);
+
+   for (i=0;i<todo-1;i++) {
+#ifdef WIN32
+      if (thread[i]!=NULL) {
+         WaitForSingleObject(thread[i],INFINITE);
+         CloseHandle(thread[i]);
+#else
+      if (rc[i]==0) {
+         pthread_join(thread[i],NULL);
+#endif
+      } else {
+         /* Thread could not be started, do its calculations now */
+         (void) func(&TD[i]);
+      }
+   }
+#endif
+}
+
+/* Fills TD[0..] with the next requested output dimensions, starting at *dim */
+static int lwpr_predict_next_batch(const LWPR_Model *model, const int *outMask, LWPR_ThreadData *TD, int *dim) {
+   int todo = 0;
+
+   for (;*dim < model->nOut && todo < NUM_THREADS; (*dim)++) {
+      if (outMask == NULL || outMask[*dim]) TD[todo++].dim = *dim;
+   }
+   return todo;
+}
 
 #if NUM_THREADS == 1
 /* Predictions (and Jacobians) without multi-threading
 ** We directly use the thread-based functions anyway */
 
-void lwpr_predict(const LWPR_Model *model, const double *x, double cutoff, double *y, double *conf, double *max_w) {
+static void lwpr_predict_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *conf, double *max_w) {
    int i;
    LWPR_ThreadData TD;
 
-   for (i=0;i<model->nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   lwpr_aux_normalise_input(model, x, model->xn);
 
    TD.model = model;
    TD.xn = model->xn;
@@ -262,14 +723,16 @@ void lwpr_predict(const LWPR_Model *model, const double *x, double cutoff, doubl
       for (i=0;i<model->nOut;i++) {
          TD.dim = i;
          (void) lwpr_aux_predict_one_T(&TD);
-         if (max_w!=NULL) max_w[i]=TD.w_max;
+         if (max_w!=NULL) max_w[i] = lwpr_aux_max_activation(model, i, TD.xn, TD.w_max,
+               0, model->sub[i].numRFS, 1, TD.ws->dx);
          y[i] = TD.yn;
       }
    } else {
       for (i=0;i<model->nOut;i++) {
          TD.dim = i;
          (void) lwpr_aux_predict_conf_one_T(&TD);
-         if (max_w!=NULL) max_w[i]=TD.w_max;
+         if (max_w!=NULL) max_w[i] = lwpr_aux_max_activation(model, i, TD.xn, TD.w_max,
+               0, model->sub[i].numRFS, 1, TD.ws->dx);
          conf[i] = model->norm_out[i]*TD.w_sec; /* this holds the confidence bounds */
          y[i] = TD.yn;
       }
@@ -277,13 +740,14 @@ void lwpr_predict(const LWPR_Model *model, const double *x, double cutoff, doubl
    for (i=0;i<model->nOut;i++) y[i]*=model->norm_out[i];
 }
 
-void lwpr_predict_J(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J) {
+static void lwpr_predict_J_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J) {
    int nIn = model->nIn;
+   double *Jz = (model->proj_P == NULL) ? J : model->proj_work;
    LWPR_ThreadData TD;
    const double *dydx;
    int i,j;
 
-   for (i=0;i<nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   lwpr_aux_normalise_input(model, x, model->xn);
    TD.model = model;
    TD.xn = model->xn;
    TD.ws = &model->ws[0];
@@ -296,19 +760,27 @@ void lwpr_predict_J(const LWPR_Model *model, const double *x, double cutoff, dou
       (void) lwpr_aux_predict_one_J_T(&TD);
       y[i] = model->norm_out[i] * TD.yn;
       for (j=0;j<nIn;j++) {
-         J[i+j*model->nOut] = dydx[j]*model->norm_out[i]/model->norm_in[j];
+         Jz[i+j*model->nOut] = dydx[j]*model->norm_out[i]/model->norm_in[j];
       }
    }
+
+   if (model->proj_P != NULL) {
+      /* Map derivatives back to the raw inputs */
+      lwpr_aux_unproject_J(model, Jz, J);
+   }
+   lwpr_aux_taylor_store(model, x, cutoff, y, J, NULL);
 }
 
-void lwpr_predict_JcJ(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *conf, double *Jconf) {
+static void lwpr_predict_JcJ_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *conf, double *Jconf) {
    int nIn = model->nIn;
+   double *Jz = (model->proj_P == NULL) ? J : model->proj_work;
+   double *Jcz = (model->proj_P == NULL) ? Jconf : model->proj_work + model->nOut*model->nIn;
    LWPR_ThreadData TD;
    const double *dydx;
    const double *dcdx;
    int i,j;
 
-   for (i=0;i<nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   lwpr_aux_normalise_input(model, x, model->xn);
    TD.model = model;
    TD.xn = model->xn;
    TD.ws = &model->ws[0];
@@ -325,21 +797,29 @@ void lwpr_predict_JcJ(const LWPR_Model *model, const double *x, double cutoff, d
 
       for (j=0;j<nIn;j++) {
          double factor = model->norm_out[i]/model->norm_in[j];
-         J[i+j*model->nOut]     = dydx[j]*factor;
-         Jconf[i+j*model->nOut] = dcdx[j]*factor;
+         Jz[i+j*model->nOut]  = dydx[j]*factor;
+         Jcz[i+j*model->nOut] = dcdx[j]*factor;
       }
    }
+
+   if (model->proj_P != NULL) {
+      /* Map derivatives back to the raw inputs */
+      lwpr_aux_unproject_J(model, Jz, J);
+      lwpr_aux_unproject_J(model, Jcz, Jconf);
+   }
 }
 
-void lwpr_predict_JH(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *H) {
+static void lwpr_predict_JH_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *H) {
    int nIn = model->nIn;
    int nInS = model->nInStore;
+   double *Jz = (model->proj_P == NULL) ? J : model->proj_work;
+   double *Hz = (model->proj_P == NULL) ? H : model->proj_work + 2*model->nOut*model->nIn;
    LWPR_ThreadData TD;
    const double *dydx;
    const double *Hi;
    int i,j,k;
 
-   for (i=0;i<nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   lwpr_aux_normalise_input(model, x, model->xn);
    TD.model = model;
    TD.xn = model->xn;
    TD.ws = &model->ws[0];
@@ -355,37 +835,36 @@ void lwpr_predict_JH(const LWPR_Model *model, const double *x, double cutoff, do
       for (j=0;j<nIn;j++) {
          double factor = model->norm_out[i]/model->norm_in[j];
 
-         J[i+j*model->nOut] = dydx[j]*factor;
+         Jz[i+j*model->nOut] = dydx[j]*factor;
          for (k=0;k<nIn;k++) {
-            H[k + j*nIn + i*nIn*nIn] = Hi[k+j*nInS]*factor/model->norm_in[k];
+            Hz[k + j*nIn + i*nIn*nIn] = Hi[k+j*nInS]*factor/model->norm_in[k];
          }
       }
    }
+
+   if (model->proj_P != NULL) {
+      /* Map derivatives back to the raw inputs */
+      lwpr_aux_unproject_J(model, Jz, J);
+      lwpr_aux_unproject_H(model, Hz, H);
+   }
+   lwpr_aux_taylor_store(model, x, cutoff, y, J, H);
 }
 
 
 #else
 
 /* Multi-threaded predictions (and Jacobians)
-** Each thread is responsible for a complete submodel (output dimension)
+** Each thread is responsible for a complete submodel (output dimension), see lwpr_predict_batch
 */
-void lwpr_predict(const LWPR_Model *model, const double *x, double cutoff, double *y, double *conf, double *max_w) {
-   int i,dim;
+static void lwpr_predict_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *conf, double *max_w) {
+   int i,dim,todo;
    LWPR_ThreadData TD[NUM_THREADS];
 
    void *(*predict_func)(void *);
 
-#ifdef WIN32
-   HANDLE thread[NUM_THREADS-1];
-   DWORD ID[NUM_THREADS-1];
-#else
-   pthread_t thread[NUM_THREADS-1];
-   int rc[NUM_THREADS-1];
-#endif
-
    predict_func = (conf==NULL) ? lwpr_aux_predict_one_T : lwpr_aux_predict_conf_one_T;
 
-   for (i=0;i<model->nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   lwpr_aux_normalise_input(model, x, model->xn);
 
    for (i=0;i<NUM_THREADS;i++) {
       TD[i].model = model;
@@ -395,63 +874,66 @@ void lwpr_predict(const LWPR_Model *model, const double *x, double cutoff, doubl
    }
 
    dim = 0;
-   while (dim < model->nOut) {
-      int todo = model->nOut - dim;
-      if (todo > NUM_THREADS) todo=NUM_THREADS;
+   while ((todo = lwpr_predict_next_batch(model, NULL, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, predict_func);
 
-      for (i=0;i<todo-1;i++) {
-         TD[i].dim = dim+i;
-#ifdef WIN32
-         thread[i] = CreateThread(NULL,0, predict_func ,&TD[i],0, &ID[i]);
-#else
-         rc[i] = pthread_create(&thread[i], NULL, predict_func , &TD[i]);
-#endif
+      for (i=0;i<todo;i++) {
+         int d = TD[i].dim;
+         y[d] = TD[i].yn * model->norm_out[d];
+         if (conf!=NULL) conf[d] = model->norm_out[d] * TD[i].w_sec;
+         if (max_w!=NULL) max_w[d] = lwpr_aux_max_activation(model, d, TD[i].xn, TD[i].w_max,
+               0, model->sub[d].numRFS, 1, TD[i].ws->dx);
       }
-      i = todo-1;
-      TD[i].dim = dim + i;
-      (void) predict_func(&TD[i]);
+   }
+}
 
-      y[dim+i] = TD[i].yn;
-      if (conf!=NULL) conf[dim+i] = model->norm_out[dim+i] * TD[i].w_sec;
-      if (max_w!=NULL) max_w[dim+i] = TD[i].w_max;
 
-      for (i=0;i<todo-1;i++) {
-#ifdef WIN32
-         if (thread[i]!=NULL) {
-            WaitForSingleObject(thread[i],INFINITE);
-            CloseHandle(thread[i]);
-#else
-         if (rc[i]==0) {
-            pthread_join(thread[i],NULL);
-#endif
-         } else {
-            /* Thread could not be started, do its calculations now */
-            (void) predict_func(&TD[i]);
-         }
+static void lwpr_predict_J_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J) {
+   int i,j,dim,todo;
+   double *Jz = (model->proj_P == NULL) ? J : model->proj_work;
+   LWPR_ThreadData TD[NUM_THREADS];
+
+   lwpr_aux_normalise_input(model, x, model->xn);
+
+   for (i=0;i<NUM_THREADS;i++) {
+      TD[i].model = model;
+      TD[i].xn = model->xn;
+      TD[i].ws = &model->ws[i];
+      TD[i].cutoff = cutoff;
+   }
 
-         y[dim+i] = TD[i].yn;
-         if (conf!=NULL) conf[dim+i] = model->norm_out[dim+i] * TD[i].w_sec;
-         if (max_w!=NULL) max_w[dim+i] = TD[i].w_max;
+   dim = 0;
+   while ((todo = lwpr_predict_next_batch(model, NULL, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, lwpr_aux_predict_one_J_T);
+
+      for (i=0;i<todo;i++) {
+         const double *dydx = TD[i].ws->sum_dwdx;
+         int d = TD[i].dim;
+         double no = model->norm_out[d];
+
+         y[d] = no * TD[i].yn ;
+         for (j=0;j<model->nIn;j++) {
+            Jz[d+j*model->nOut] = dydx[j]*no/model->norm_in[j];
+         }
       }
-      dim+=todo;
    }
-   for (i=0;i<model->nOut;i++) y[i]*=model->norm_out[i];
+
+   if (model->proj_P != NULL) {
+      /* Map derivatives back to the raw inputs */
+      lwpr_aux_unproject_J(model, Jz, J);
+   }
+   lwpr_aux_taylor_store(model, x, cutoff, y, J, NULL);
 }
 
 
-void lwpr_predict_J(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J) {
-   int i,j,dim;
-   LWPR_ThreadData TD[NUM_THREADS];
 
-#ifdef WIN32
-   HANDLE thread[NUM_THREADS-1];
-   DWORD ID[NUM_THREADS-1];
-#else
-   pthread_t thread[NUM_THREADS-1];
-   int rc[NUM_THREADS-1];
-#endif
+static void lwpr_predict_JcJ_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *conf, double *Jconf) {
+   int i,j,dim,todo;
+   double *Jz = (model->proj_P == NULL) ? J : model->proj_work;
+   double *Jcz = (model->proj_P == NULL) ? Jconf : model->proj_work + model->nOut*model->nIn;
+   LWPR_ThreadData TD[NUM_THREADS];
 
-   for (i=0;i<model->nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   lwpr_aux_normalise_input(model, x, model->xn);
 
    for (i=0;i<NUM_THREADS;i++) {
       TD[i].model = model;
@@ -461,66 +943,122 @@ void lwpr_predict_J(const LWPR_Model *model, const double *x, double cutoff, dou
    }
 
    dim = 0;
-   while (dim < model->nOut) {
-      int todo = model->nOut - dim;
-      if (todo > NUM_THREADS) todo=NUM_THREADS;
+   while ((todo = lwpr_predict_next_batch(model, NULL, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, lwpr_aux_predict_one_JcJ_T);
 
-      for (i=0;i<todo-1;i++) {
-         TD[i].dim = dim+i;
-#ifdef WIN32
-         thread[i] = CreateThread(NULL,0, lwpr_aux_predict_one_J_T ,&TD[i],0, &ID[i]);
-#else
-         rc[i] = pthread_create(&thread[i], NULL, lwpr_aux_predict_one_J_T , &TD[i]);
-#endif
-      }
+      for (i=0;i<todo;i++) {
+         const double *dydx = TD[i].ws->sum_ydwdx_wdydx;
+         const double *dcdx = TD[i].ws->sum_ddRdxdx;
+         int d = TD[i].dim;
+         double no = model->norm_out[d];
 
-      i = todo-1;
-      TD[i].dim = dim + i;
-      lwpr_aux_predict_one_J_T(&TD[i]);
+         y[d] = no * TD[i].yn;
+         conf[d] = no * TD[i].w_sec;
 
-      for (i=0;i<todo-1;i++) {
-#ifdef WIN32
-         if (thread[i]!=NULL) {
-            WaitForSingleObject(thread[i],INFINITE);
-            CloseHandle(thread[i]);
-#else
-         if (rc[i]==0) {
-            pthread_join(thread[i],NULL);
-#endif
-         } else {
-            /* Thread could not be started, do its calculations now */
-            lwpr_aux_predict_one_J_T(&TD[i]);
+         for (j=0;j<model->nIn;j++) {
+            double noni = no/model->norm_in[j];
+            Jz[d+j*model->nOut]  = dydx[j]*noni;
+            Jcz[d+j*model->nOut] = dcdx[j]*noni;
          }
       }
+   }
+
+   if (model->proj_P != NULL) {
+      /* Map derivatives back to the raw inputs */
+      lwpr_aux_unproject_J(model, Jz, J);
+      lwpr_aux_unproject_J(model, Jcz, Jconf);
+   }
+}
+
+
+
+static void lwpr_predict_JH_unrecorded(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *H) {
+   int i,j,dim,todo;
+   double *Jz = (model->proj_P == NULL) ? J : model->proj_work;
+   double *Hz = (model->proj_P == NULL) ? H : model->proj_work + 2*model->nOut*model->nIn;
+   LWPR_ThreadData TD[NUM_THREADS];
+
+   lwpr_aux_normalise_input(model, x, model->xn);
+
+   for (i=0;i<NUM_THREADS;i++) {
+      TD[i].model = model;
+      TD[i].xn = model->xn;
+      TD[i].ws = &model->ws[i];
+      TD[i].cutoff = cutoff;
+   }
+
+   dim = 0;
+   while ((todo = lwpr_predict_next_batch(model, NULL, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, lwpr_aux_predict_one_gH_T);
 
       for (i=0;i<todo;i++) {
          const double *dydx = TD[i].ws->sum_dwdx;
-         double no = model->norm_out[dim+i];
+         const double *Hi = TD[i].ws->sum_ddwdxdx;
+         int d = TD[i].dim;
+         double no = model->norm_out[d];
 
-         y[dim+i] = no * TD[i].yn ;
+         y[d] = no * TD[i].yn ;
          for (j=0;j<model->nIn;j++) {
-            J[dim+i+j*model->nOut] = dydx[j]*no/model->norm_in[j];
+            double fac = no/model->norm_in[j];
+            int k;
+
+            Jz[d+j*model->nOut] = dydx[j]*fac;
+            for (k=0;k<model->nIn;k++) {
+               Hz[k+j*model->nIn+d*model->nIn*model->nIn] = Hi[k+j*model->nInStore]*fac/model->norm_in[k];
+            }
          }
       }
-      dim+=todo;
    }
+
+   if (model->proj_P != NULL) {
+      /* Map derivatives back to the raw inputs */
+      lwpr_aux_unproject_J(model, Jz, J);
+      lwpr_aux_unproject_H(model, Hz, H);
+   }
+   lwpr_aux_taylor_store(model, x, cutoff, y, J, H);
 }
 
 
+#endif
+
+/* The public entry points record the call if needed (see lwpr_record.h). lwpr_predict_cached
+** uses the unrecorded versions internally, such that only its own call is recorded. */
+void lwpr_predict(const LWPR_Model *model, const double *x, double cutoff, double *y, double *conf, double *max_w) {
+   if (model->rec != NULL) {
+      lwpr_record_call(model->rec, LWPR_CALL_PREDICT, ((conf != NULL) ? LWPR_RECORD_ARG_CONF : 0)
+            | ((max_w != NULL) ? LWPR_RECORD_ARG_MAXW : 0), x, cutoff, NULL, NULL, NULL);
+   }
+   lwpr_predict_unrecorded(model, x, cutoff, y, conf, max_w);
+}
+
+void lwpr_predict_J(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J) {
+   if (model->rec != NULL) lwpr_record_call(model->rec, LWPR_CALL_PREDICT_J, 0, x, cutoff, NULL, NULL, NULL);
+   lwpr_predict_J_unrecorded(model, x, cutoff, y, J);
+}
 
 void lwpr_predict_JcJ(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *conf, double *Jconf) {
-   int i,j,dim;
+   if (model->rec != NULL) lwpr_record_call(model->rec, LWPR_CALL_PREDICT_JCJ, 0, x, cutoff, NULL, NULL, NULL);
+   lwpr_predict_JcJ_unrecorded(model, x, cutoff, y, J, conf, Jconf);
+}
+
+void lwpr_predict_JH(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *H) {
+   if (model->rec != NULL) lwpr_record_call(model->rec, LWPR_CALL_PREDICT_JH, 0, x, cutoff, NULL, NULL, NULL);
+   lwpr_predict_JH_unrecorded(model, x, cutoff, y, J, H);
+}
+
+void lwpr_predict_sel(const LWPR_Model *model, const double *x, double cutoff, const int *outMask, double *y, double *conf, double *max_w) {
    LWPR_ThreadData TD[NUM_THREADS];
+   void *(*predict_func)(void *);
+   int i,dim,todo;
 
-#ifdef WIN32
-   HANDLE thread[NUM_THREADS-1];
-   DWORD ID[NUM_THREADS-1];
-#else
-   pthread_t thread[NUM_THREADS-1];
-   int rc[NUM_THREADS-1];
-#endif
+   if (model->rec != NULL) {
+      lwpr_record_call(model->rec, LWPR_CALL_PREDICT_SEL, ((conf != NULL) ? LWPR_RECORD_ARG_CONF : 0)
+            | ((max_w != NULL) ? LWPR_RECORD_ARG_MAXW : 0), x, cutoff, NULL, outMask, NULL);
+   }
 
-   for (i=0;i<model->nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   predict_func = (conf==NULL) ? lwpr_aux_predict_one_T : lwpr_aux_predict_conf_one_T;
+
+   lwpr_aux_normalise_input(model, x, model->xn);
 
    for (i=0;i<NUM_THREADS;i++) {
       TD[i].model = model;
@@ -530,71 +1068,112 @@ void lwpr_predict_JcJ(const LWPR_Model *model, const double *x, double cutoff, d
    }
 
    dim = 0;
-   while (dim < model->nOut) {
-      int todo = model->nOut - dim;
-      if (todo > NUM_THREADS) todo=NUM_THREADS;
+   while ((todo = lwpr_predict_next_batch(model, outMask, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, predict_func);
 
-      for (i=0;i<todo-1;i++) {
-         TD[i].dim = dim+i;
-#ifdef WIN32
-         thread[i] = CreateThread(NULL,0, lwpr_aux_predict_one_JcJ_T ,&TD[i],0, &ID[i]);
-#else
-         rc[i] = pthread_create(&thread[i], NULL, lwpr_aux_predict_one_JcJ_T , &TD[i]);
-#endif
+      for (i=0;i<todo;i++) {
+         int d = TD[i].dim;
+         y[d] = TD[i].yn * model->norm_out[d];
+         if (conf!=NULL) conf[d] = model->norm_out[d] * TD[i].w_sec;
+         if (max_w!=NULL) max_w[d] = lwpr_aux_max_activation(model, d, TD[i].xn, TD[i].w_max,
+               0, model->sub[d].numRFS, 1, TD[i].ws->dx);
       }
+   }
+}
 
-      i = todo-1;
-      TD[i].dim = dim + i;
-      lwpr_aux_predict_one_JcJ_T(&TD[i]);
+void lwpr_predict_J_sel(const LWPR_Model *model, const double *x, double cutoff, const int *outMask, const int *inMask, double *y, double *J) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nOut = model->nOut;
+   double *Jz = (model->proj_P == NULL) ? J : model->proj_work;
+   /* With a projection, every raw column depends on all projected ones */
+   const int *inMaskZ = (model->proj_P == NULL) ? inMask : NULL;
+   LWPR_ThreadData TD[NUM_THREADS];
+   int i,j,k,dim,todo;
 
-      for (i=0;i<todo-1;i++) {
-#ifdef WIN32
-         if (thread[i]!=NULL) {
-            WaitForSingleObject(thread[i],INFINITE);
-            CloseHandle(thread[i]);
-#else
-         if (rc[i]==0) {
-            pthread_join(thread[i],NULL);
-#endif
-         } else {
-            /* Thread could not be started, do its calculations now */
-            lwpr_aux_predict_one_JcJ_T(&TD[i]);
-         }
-      }
+   if (model->rec != NULL) lwpr_record_call(model->rec, LWPR_CALL_PREDICT_J_SEL, 0, x, cutoff, NULL, outMask, inMask);
+
+   lwpr_aux_normalise_input(model, x, model->xn);
+
+   for (i=0;i<NUM_THREADS;i++) {
+      TD[i].model = model;
+      TD[i].xn = model->xn;
+      TD[i].ws = &model->ws[i];
+      TD[i].cutoff = cutoff;
+      TD[i].inMask = inMaskZ;
+   }
+
+   dim = 0;
+   while ((todo = lwpr_predict_next_batch(model, outMask, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, lwpr_aux_predict_one_Jsel_T);
 
       for (i=0;i<todo;i++) {
-         const double *dydx = TD[i].ws->sum_ydwdx_wdydx;
-         const double *dcdx = TD[i].ws->sum_ddRdxdx;
-         double no = model->norm_out[dim+i];
+         const double *dydx = TD[i].ws->sum_dwdx;
+         int d = TD[i].dim;
+         double no = model->norm_out[d];
 
-         y[dim+i] = no * TD[i].yn;
-         conf[dim+i] = no * TD[i].w_sec;
+         y[d] = no * TD[i].yn;
+         for (j=0;j<nIn;j++) {
+            if (inMaskZ == NULL || inMaskZ[j]) Jz[d+j*nOut] = dydx[j]*no/model->norm_in[j];
+         }
+      }
+   }
 
-         for (j=0;j<model->nIn;j++) {
-            double noni = no/model->norm_in[j];
-            J[dim+i+j*model->nOut]     = dydx[j]*noni;
-            Jconf[dim+i+j*model->nOut] = dcdx[j]*noni;
+   if (model->proj_P != NULL) {
+      /* Map the requested derivatives back to the raw inputs */
+      const double *P = model->proj_P;
+
+      for (j=0;j<model->nInRaw;j++) {
+         if (inMask != NULL && !inMask[j]) continue;
+         for (i=0;i<nOut;i++) {
+            double sum = 0.0;
+            if (outMask != NULL && !outMask[i]) continue;
+            for (k=0;k<nIn;k++) sum += Jz[i+k*nOut]*P[k+j*nInS];
+            J[i+j*nOut] = sum;
          }
       }
-      dim+=todo;
    }
 }
 
+void lwpr_predict_jvp(const LWPR_Model *model, const double *x, const double *v, double cutoff, double *y, double *Jv) {
+   LWPR_ThreadData TD[NUM_THREADS];
+   int i,dim,todo;
 
+   if (model->rec != NULL) lwpr_record_call(model->rec, LWPR_CALL_PREDICT_JVP, 0, x, cutoff, v, NULL, NULL);
 
-void lwpr_predict_JH(const LWPR_Model *model, const double *x, double cutoff, double *y, double *J, double *H) {
-   int i,j,dim;
+   lwpr_aux_normalise_input(model, x, model->xn);
+   /* The input transformation is linear, so directions map in the same way */
+   lwpr_aux_normalise_input(model, v, model->vn);
+
+   for (i=0;i<NUM_THREADS;i++) {
+      TD[i].model = model;
+      TD[i].xn = model->xn;
+      TD[i].vn = model->vn;
+      TD[i].ws = &model->ws[i];
+      TD[i].cutoff = cutoff;
+   }
+
+   dim = 0;
+   while ((todo = lwpr_predict_next_batch(model, NULL, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, lwpr_aux_predict_one_jvp_T);
+
+      for (i=0;i<todo;i++) {
+         int d = TD[i].dim;
+         y[d] = model->norm_out[d] * TD[i].yn;
+         Jv[d] = model->norm_out[d] * TD[i].yn_dir;
+      }
+   }
+}
+
+void lwpr_predict_vjp(const LWPR_Model *model, const double *x, const double *u, double cutoff, double *y, double *uJ) {
+   int nIn = model->nIn;
+   double *gz = (model->proj_P == NULL) ? uJ : model->proj_work;
    LWPR_ThreadData TD[NUM_THREADS];
+   int i,j,dim,todo;
 
-#ifdef WIN32
-   HANDLE thread[NUM_THREADS-1];
-   DWORD ID[NUM_THREADS-1];
-#else
-   pthread_t thread[NUM_THREADS-1];
-   int rc[NUM_THREADS-1];
-#endif
+   if (model->rec != NULL) lwpr_record_call(model->rec, LWPR_CALL_PREDICT_VJP, 0, x, cutoff, u, NULL, NULL);
 
-   for (i=0;i<model->nIn;i++) model->xn[i]=x[i]/model->norm_in[i];
+   lwpr_aux_normalise_input(model, x, model->xn);
 
    for (i=0;i<NUM_THREADS;i++) {
       TD[i].model = model;
@@ -603,58 +1182,77 @@ void lwpr_predict_JH(const LWPR_Model *model, const double *x, double cutoff, do
       TD[i].cutoff = cutoff;
    }
 
+   memset(gz, 0, nIn*sizeof(double));
    dim = 0;
-   while (dim < model->nOut) {
-      int todo = model->nOut - dim;
-      if (todo > NUM_THREADS) todo=NUM_THREADS;
+   while ((todo = lwpr_predict_next_batch(model, NULL, TD, &dim)) > 0) {
+      lwpr_predict_batch(TD, todo, lwpr_aux_predict_one_grad_T);
 
-      for (i=0;i<todo-1;i++) {
-         TD[i].dim = dim+i;
-#ifdef WIN32
-         thread[i] = CreateThread(NULL,0, lwpr_aux_predict_one_gH_T ,&TD[i],0, &ID[i]);
-#else
-         rc[i] = pthread_create(&thread[i], NULL, lwpr_aux_predict_one_gH_T , &TD[i]);
-#endif
+      /* Accumulate in order of output dimensions, independently of the number of threads */
+      for (i=0;i<todo;i++) {
+         int d = TD[i].dim;
+         y[d] = model->norm_out[d] * TD[i].yn;
+         if (u[d] != 0.0) {
+            lwpr_math_add_scalar_vector(gz, u[d]*model->norm_out[d], TD[i].ws->sum_dwdx, nIn);
+         }
       }
+   }
+   for (j=0;j<nIn;j++) gz[j]/=model->norm_in[j];
 
-      i = todo-1;
-      TD[i].dim = dim + i;
-      lwpr_aux_predict_one_gH_T(&TD[i]);
+   if (model->proj_P != NULL) {
+      /* uJ = gz' * P */
+      const double *P = model->proj_P;
+      int nInS = model->nInStore;
 
-      for (i=0;i<todo-1;i++) {
-#ifdef WIN32
-         if (thread[i]!=NULL) {
-            WaitForSingleObject(thread[i],INFINITE);
-            CloseHandle(thread[i]);
-#else
-         if (rc[i]==0) {
-            pthread_join(thread[i],NULL);
-#endif
-         } else {
-            /* Thread could not be started, do its calculations now */
-            lwpr_aux_predict_one_gH_T(&TD[i]);
-         }
+      for (j=0;j<model->nInRaw;j++) {
+         uJ[j] = lwpr_math_dot_product(gz, P + j*nInS, nIn);
       }
+   }
+}
 
-      for (i=0;i<todo;i++) {
-         const double *dydx = TD[i].ws->sum_dwdx;
-         const double *Hi = TD[i].ws->sum_ddwdxdx;
-         double no = model->norm_out[dim+i];
+int lwpr_predict_cached(const LWPR_Model *model, const double *x, double cutoff, double *y, double *err) {
+   LWPR_TaylorCache *T = model->taylor;
+   int nRaw = model->nInRaw;
+   int nOut = model->nOut;
+   int j;
 
-         y[dim+i] = no * TD[i].yn ;
-         for (j=0;j<model->nIn;j++) {
-            double fac = no/model->norm_in[j];
-            int k;
+   if (model->rec != NULL) {
+      lwpr_record_call(model->rec, LWPR_CALL_PREDICT_CACHED, (err != NULL) ? LWPR_RECORD_ARG_ERR : 0,
+            x, cutoff, NULL, NULL, NULL);
+   }
 
-            J[dim+i+j*model->nOut] = dydx[j]*fac;
-            for (k=0;k<model->nIn;k++) {
-               H[k+j*model->nIn+(dim+i)*model->nIn*model->nIn] = Hi[k+j*model->nInStore]*fac/model->norm_in[k];
-            }
+   if (T == NULL) {
+      lwpr_predict_unrecorded(model, x, cutoff, y, NULL, NULL);
+      if (err != NULL) *err = 0.0;
+      return 0;
+   }
+
+   if (T->valid && T->stamp == model->n_updates && T->cutoff == cutoff) {
+      double d2 = 0.0;
+
+      for (j=0;j<nRaw;j++) d2 += (x[j] - T->x0[j])*(x[j] - T->x0[j]);
+
+      if (d2 <= model->taylor_radius*model->taylor_radius 
+            && (model->taylor_tol <= 0.0 || 0.5*T->hnorm*d2 <= model->taylor_tol)) {
+         /* y = y0 + J0*(x-x0) */
+         memcpy(y, T->y0, nOut*sizeof(double));
+         for (j=0;j<nRaw;j++) {
+            double dxj = x[j] - T->x0[j];
+            if (dxj != 0.0) lwpr_math_add_scalar_vector(y, dxj, T->J0 + j*nOut, nOut);
          }
+         if (err != NULL) *err = (model->taylor_tol > 0.0) ? 0.5*T->hnorm*d2 : -1.0;
+         T->n_hits++;
+         return 1;
       }
-      dim+=todo;
    }
-}
-
 
-#endif
+   /* Full evaluation at x, which becomes the new expansion point */
+   T->n_misses++;
+   if (model->taylor_tol > 0.0) {
+      lwpr_predict_JH_unrecorded(model, x, cutoff, T->y0, T->J0, T->H);
+   } else {
+      lwpr_predict_J_unrecorded(model, x, cutoff, T->y0, T->J0);
+   }
+   memcpy(y, T->y0, nOut*sizeof(double));
+   if (err != NULL) *err = 0.0;
+   return 0;
+}
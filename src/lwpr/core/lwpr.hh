@@ -149,9 +149,12 @@ class LWPR_ReceptiveFieldObject {
    /** \brief Returns the distance metric of the receptive field, as a vector of vectors (nIn x nIn) */
    std::vector<doubleVec> D() const {
       std::vector<doubleVec> ds(nIn);
+      doubleVec dense(nIn*nInS);
+      const double *D = &dense[0];
+      lwpr_rf_get_D(RF, &dense[0]);
       for (int i=0;i<nIn;i++) {
          ds[i].resize(nIn);
-         memcpy(&ds[i][0], RF->D + i*nInS, sizeof(double)*nIn);    
+         memcpy(&ds[i][0], D + i*nInS, sizeof(double)*nIn);    
       }
       return ds;
    }
@@ -160,9 +163,12 @@ class LWPR_ReceptiveFieldObject {
        vector of vectors with varying length (simulating a triagonal matrix) */   
    std::vector<doubleVec> M() const {
       std::vector<doubleVec> ms(nIn);
+      doubleVec dense(nIn*nInS);
+      const double *M = &dense[0];
+      lwpr_rf_get_M(RF, &dense[0]);
       for (int i=0;i<nIn;i++) {
          ms[i].resize(i+1);
-         memcpy(&ms[i][0], RF->M + i*nInS, sizeof(double)*(i+1));    
+         memcpy(&ms[i][0], M + i*nInS, sizeof(double)*(i+1));    
       }
       return ms;
    }
@@ -345,7 +351,7 @@ class LWPR_Object {
    doubleVec update(const doubleVec& x, const doubleVec& y) {
       doubleVec yp(model.nOut);
       
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }
       
@@ -372,7 +378,7 @@ class LWPR_Object {
    doubleVec predict(const doubleVec& x, double cutoff = 0.001) {
       doubleVec yp(model.nOut);   
 
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }      
 
@@ -396,7 +402,7 @@ class LWPR_Object {
    doubleVec predict(const doubleVec& x, doubleVec& confidence, double cutoff = 0.001) {
       doubleVec yp(model.nOut);   
       
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }      
       if (confidence.size()!=(unsigned) model.nOut) confidence.resize(model.nOut);
@@ -423,7 +429,7 @@ class LWPR_Object {
    doubleVec predict(const doubleVec& x, doubleVec& confidence, doubleVec& maxW, double cutoff = 0.001) {
       doubleVec yp(model.nOut);   
       
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }      
       if (confidence.size()!=(unsigned) model.nOut) confidence.resize(model.nOut);
@@ -435,13 +441,13 @@ class LWPR_Object {
 
    /**
     * Compute the Jabobian of LWPR model at given input vector x
-    * The returned jacobian is nOut x nIn matrix in major column.
+    * The returned jacobian is nOut x nInRaw matrix in major column.
     */
    std::vector<doubleVec> predictJ(const doubleVec& x, double cutoff = 0.001) {
       doubleVec yp(model.nOut);
-      doubleVec J(model.nOut*model.nIn);
+      doubleVec J(model.nOut*model.nInRaw);
 
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }      
 
@@ -449,14 +455,119 @@ class LWPR_Object {
 
       std::vector<doubleVec> JJ(model.nOut);
       for (size_t i=0;i<(size_t)model.nOut;i++) {
-         JJ[i] = doubleVec(model.nIn);
-         for (size_t j=0;j<(size_t)model.nIn;j++) {
+         JJ[i] = doubleVec(model.nInRaw);
+         for (size_t j=0;j<(size_t)model.nInRaw;j++) {
             JJ[i][j] = J[j*model.nOut + i];
          }
       }
       return JJ;
    }
    
+   /** \brief Computes the prediction of selected output dimensions only
+      \param x       Input vector, must have nInRaw elements
+      \param outMask Output selection, must have nOut elements, dimension i is predicted if outMask[i] != 0
+      \param cutoff  A threshold parameter (default: 0.001)
+      \return        Output vector with nOut elements, unselected elements are 0
+      \exception LWPR_Exception::BAD_INPUT_DIM
+         if the dimensions of x or outMask do not match the model
+   */
+   doubleVec predictSel(const doubleVec& x, const std::vector<int>& outMask, double cutoff = 0.001) {
+      doubleVec yp(model.nOut);
+      
+      if (x.size()!=(unsigned) model.nInRaw || outMask.size()!=(unsigned) model.nOut) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }      
+
+      lwpr_predict_sel(&model, &x[0], cutoff, &outMask[0], &yp[0], NULL, NULL);
+      return yp;
+   }
+
+   /**
+    * Compute selected rows and columns of the Jacobian of the LWPR model at x.
+    * outMask (nOut elements) selects the rows, inMask (nInRaw elements) the columns,
+    * all other elements of the returned nOut x nInRaw matrix are 0.
+    */
+   std::vector<doubleVec> predictJSel(const doubleVec& x, const std::vector<int>& outMask, const std::vector<int>& inMask, double cutoff = 0.001) {
+      doubleVec yp(model.nOut);
+      doubleVec J(model.nOut*model.nInRaw);
+
+      if (x.size()!=(unsigned) model.nInRaw || outMask.size()!=(unsigned) model.nOut 
+            || inMask.size()!=(unsigned) model.nInRaw) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }      
+
+      lwpr_predict_J_sel(&model, &x[0], cutoff, &outMask[0], &inMask[0], &yp[0], &J[0]);
+
+      std::vector<doubleVec> JJ(model.nOut);
+      for (size_t i=0;i<(size_t)model.nOut;i++) {
+         JJ[i] = doubleVec(model.nInRaw);
+         for (size_t j=0;j<(size_t)model.nInRaw;j++) {
+            JJ[i][j] = J[j*model.nOut + i];
+         }
+      }
+      return JJ;
+   }
+   
+   /** \brief Computes the prediction, using the Taylor cache if possible (see lwpr_predict_cached)
+      \param x       Input vector, must have nInRaw elements
+      \param cutoff  A threshold parameter (default: 0.001)
+      \return        Output vector with nOut elements
+      \exception LWPR_Exception::BAD_INPUT_DIM
+         if the dimensionality of x does not match the model
+   */
+   doubleVec predictCached(const doubleVec& x, double cutoff = 0.001) {
+      doubleVec yp(model.nOut);
+      
+      if (x.size()!=(unsigned) model.nInRaw) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }      
+
+      lwpr_predict_cached(&model, &x[0], cutoff, &yp[0], NULL);
+      return yp;
+   }
+
+   /** \brief Computes the product of the Jacobian with a direction vector, without forming the Jacobian
+      \param x       Input vector, must have nInRaw elements
+      \param v       Direction vector, must have nInRaw elements
+      \param Jv      Output: Directional derivative J*v (nOut elements)
+      \param cutoff  A threshold parameter (default: 0.001)
+      \return        Output vector with nOut elements
+      \exception LWPR_Exception::BAD_INPUT_DIM
+         if the dimensions of x or v do not match the model
+   */
+   doubleVec predictJvp(const doubleVec& x, const doubleVec& v, doubleVec& Jv, double cutoff = 0.001) {
+      doubleVec yp(model.nOut);
+      
+      if (x.size()!=(unsigned) model.nInRaw || v.size()!=(unsigned) model.nInRaw) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }      
+      if (Jv.size()!=(unsigned) model.nOut) Jv.resize(model.nOut);
+
+      lwpr_predict_jvp(&model, &x[0], &v[0], cutoff, &yp[0], &Jv[0]);
+      return yp;
+   }
+
+   /** \brief Computes the product of a vector with the Jacobian, without forming the Jacobian
+      \param x       Input vector, must have nInRaw elements
+      \param u       Weights of the output dimensions, must have nOut elements
+      \param uJ      Output: Gradient of u'*y with respect to x (nInRaw elements)
+      \param cutoff  A threshold parameter (default: 0.001)
+      \return        Output vector with nOut elements
+      \exception LWPR_Exception::BAD_INPUT_DIM
+         if the dimensions of x or u do not match the model
+   */
+   doubleVec predictVjp(const doubleVec& x, const doubleVec& u, doubleVec& uJ, double cutoff = 0.001) {
+      doubleVec yp(model.nOut);
+      
+      if (x.size()!=(unsigned) model.nInRaw || u.size()!=(unsigned) model.nOut) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }      
+      if (uJ.size()!=(unsigned) model.nInRaw) uJ.resize(model.nInRaw);
+
+      lwpr_predict_vjp(&model, &x[0], &u[0], cutoff, &yp[0], &uJ[0]);
+      return yp;
+   }
+
    /** \brief Sets a spherical initial distance metric
       \param delta   Width parameter, distance matrix will be delta * eye(nIn)
       \exception LWPR_Exception::BAD_INIT_D
@@ -489,6 +600,83 @@ class LWPR_Object {
       }
    }
    
+   /** \brief Restricts the distance metrics to a block-diagonal structure
+      \param sizes  Sizes of groups of consecutive input dimensions, must sum up to nIn
+      \exception LWPR_Exception::BAD_INPUT_DIM
+         if the sizes do not describe a partition of the input dimensions,
+         or if the model already contains receptive fields
+   */
+   void setBlocks(const std::vector<int>& sizes) {
+      if (sizes.empty() || !lwpr_set_blocks(&model,(int) sizes.size(),&sizes[0])) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }
+   }
+
+   /** \brief Uses low-rank-plus-diagonal distance metrics D = diag(d) + L*L'
+      \param rank  Rank of L, 0 <= rank < nIn (0 = full or diagonal metrics)
+      \exception LWPR_Exception::BAD_INPUT_DIM
+         if the rank is out of range, or if the model already contains receptive fields
+   */
+   void setRank(int rank) {
+      if (!lwpr_set_rank(&model,rank)) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }
+   }
+
+   /** \brief Trains the receptive fields on a learned linear projection of the inputs
+      \param nInRaw    Dimensionality of the inputs passed to update and predict, nInRaw >= nIn
+      \param interval  Number of training samples between refinements of the projection (0 = fixed)
+      \exception LWPR_Exception::BAD_INPUT_DIM
+         if nInRaw < nIn, or if the model already contains receptive fields or a projection
+   */
+   void setProjection(int nInRaw, int interval = 1) {
+      if (interval<0 || !lwpr_set_projection(&model,nInRaw,NULL,interval)) {
+         throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      }
+   }
+
+   /** \brief Groups the receptive fields into clusters that predictions can skip as a whole
+      \param size    Maximal number of receptive fields per cluster (0 = remove all clusters)
+      \param radius  Distance within which a new receptive field joins an existing cluster
+      \exception LWPR_Exception::BAD_INPUT_DIM if size or radius are negative
+      \exception LWPR_Exception::OUT_OF_MEMORY if the clusters could not be allocated
+   */
+   void setClusters(int size, double radius = 2.0) {
+      if (size<0 || radius<0.0) throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      if (!lwpr_set_clusters(&model,size,radius)) {
+         throw LWPR_Exception(LWPR_Exception::OUT_OF_MEMORY);
+      }
+   }
+
+   /** \brief Builds an approximate random-projection index that predictions use to find candidate receptive fields
+      \param nProj   Number of random directions (0 = remove the index)
+      \param recall  Target probability that an activated receptive field is found, 0 < recall <= 1
+      \exception LWPR_Exception::BAD_INPUT_DIM if nProj is negative or recall is out of range
+      \exception LWPR_Exception::OUT_OF_MEMORY if the index could not be allocated
+   */
+   void setIndex(int nProj, double recall = 0.99) {
+      if (nProj<0 || (nProj>0 && (recall<=0.0 || recall>1.0))) throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      if (!lwpr_set_index(&model,nProj,recall)) {
+         throw LWPR_Exception(LWPR_Exception::OUT_OF_MEMORY);
+      }
+   }
+
+   /** \brief Enables a cache that answers queries close to a previous one by a first-order expansion (see lwpr_set_taylor_cache)
+      \param radius  Maximal distance of a query from the expansion point (0 = remove the cache)
+      \param tol     Maximal estimated error of a cached answer (0 = only check the radius)
+      \exception LWPR_Exception::BAD_INPUT_DIM if radius or tol are negative
+      \exception LWPR_Exception::OUT_OF_MEMORY if the cache could not be allocated
+   */
+   void setTaylorCache(double radius, double tol = 0.0) {
+      if (radius<0.0 || tol<0.0) throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
+      if (!lwpr_set_taylor_cache(&model,radius,tol)) {
+         throw LWPR_Exception(LWPR_Exception::OUT_OF_MEMORY);
+      }
+   }
+
+   /** \brief Sets whether indexed queries are checked against a full scan (see LWPR_Model.index_audit) */
+   void indexAudit(bool audit) { model.index_audit = audit ? 1 : 0; }
+
    /** \brief Sets init_alpha (learning rate for 2nd order distance metric updates) */
    void setInitAlpha(double alpha) {
       lwpr_set_init_alpha(&model,alpha);
@@ -548,6 +736,9 @@ class LWPR_Object {
    
    /** \brief Returns the input dimensionality */
    int nIn() const { return model.nIn; }
+
+   /** \brief Returns the dimensionality of the inputs before projection (equal to nIn() without projection) */
+   int nInRaw() const { return model.nInRaw; }
    
    /** \brief Returns the output dimensionality */   
    int nOut() const { return model.nOut; }
@@ -578,6 +769,15 @@ class LWPR_Object {
 
    /** \brief Returns whether distance matrices are treaded as diagonal-only */
    bool diagOnly() { return (bool) model.diag_only; }
+
+   /** \brief Returns the rank of low-rank distance metrics (0 = full or diagonal metrics) */
+   int rank() { return model.rank; }
+
+   /** \brief Returns the maximal number of receptive fields per cluster (0 = no clusters) */
+   int clusterSize() { return model.cluster_size; }
+
+   /** \brief Returns the number of random directions of the RF index (0 = no index) */
+   int indexProj() { return model.index_proj; }
    
    /** \brief Returns whether 2nd order distance matrix updates are performed */   
    bool useMeta() { return (bool) model.meta; }
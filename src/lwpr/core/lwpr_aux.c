@@ -21,6 +21,11 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <lwpr/core/lwpr_aux.h>
 #include <lwpr/core/lwpr_mem.h>
 #include <lwpr/core/lwpr_math.h>
+#include <lwpr/core/lwpr_ooc.h>
+#include <lwpr/core/lwpr_prof.h>
+#include <lwpr/core/lwpr_repl.h>
+#include <lwpr/core/lwpr_conc.h>
+#include <lwpr/core/lwpr_checkpoint.h>
 #include <math.h>
 #include <string.h>
 #include <stdlib.h>
@@ -36,8 +41,8 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 
 void lwpr_aux_dist_derivatives(int nIn,int nInS,double *dwdM, double *dJ2dM, double *ddwdMdM, double *ddJ2dMdM,
          double w, double dwdq, double ddwdqdq,
-         const double *RF_D, const double *RF_M, const double *dx,
-         int diag_only, double penalty, int meta) {
+         const double *RF_D, const double *RF_M, const int *col, const double *dx, const double *Mdx,
+         const int *block_end, int diag_only, double penalty, int meta) {
 
    int m,n;
    /* Fill elements (n,m) */
@@ -50,83 +55,83 @@ void lwpr_aux_dist_derivatives(int nIn,int nInS,double *dwdM, double *dJ2dM, dou
          /* diagonal case WITH meta learning */
          for (n=0;n<nIn;n++) {
             int n_n = n + n*nInS;
+            int p_nn = n + col[n];
             /* take the derivative of q=dx'*D*dx with respect to nn_th element of M */
 
-            double aux = 2.0 * RF_M[n_n];
+            double aux = 2.0 * RF_M[p_nn];
             double dqdM_nn = dx[n] * dx[n] * aux;
 
             dwdM[n_n] = dqdM_nn * dwdq;
             ddwdMdM[n_n] = ddwdqdq*dqdM_nn*dqdM_nn + 2*dwdq*dx[n]*dx[n];
 
-            dJ2dM[n_n] = penalty * RF_D[n_n] * aux;
-            ddJ2dMdM[n_n] = penalty*(2*RF_D[n_n] + aux*aux);
+            dJ2dM[n_n] = penalty * RF_D[p_nn] * aux;
+            ddJ2dMdM[n_n] = penalty*(2*RF_D[p_nn] + aux*aux);
          }
       } else {
          /* diagonal case WITHOUT meta learning */
          for (n=0;n<nIn;n++) {
             int n_n = n + n*nInS;
+            int p_nn = n + col[n];
             /* take the derivative of q=dx'*D*dx with respect to nn_th element of M */
 
-            double aux = 2.0 * RF_M[n_n];
+            double aux = 2.0 * RF_M[p_nn];
 
             dwdM[n_n] = dx[n] * dx[n] * aux * dwdq;
-            dJ2dM[n_n] = penalty * RF_D[n_n] * aux;
+            dJ2dM[n_n] = penalty * RF_D[p_nn] * aux;
          }
       }
       return;
    }
 
    if (meta) {
-      /* non-diagonal (= upper-triangular) case WITH meta learning*/
+      /* non-diagonal (= upper-triangular) case WITH meta learning.
+         Row n of M is zero beyond the block that contains n */
       for (n=0;n<nIn;n++) {
-         for (m=n;m<nIn;m++) {
-            double sum_aux = 0.0;
-            double sum_aux1 = 0.0;
-            double dqdM_nm = 0.0;
-            int i;
+         /* The squared norm of the n-th row of M does not depend on m */
+         double normM_n = 0.0;
+         int end = block_end[n];
+         int i;
+
+         for (i=n;i<end;i++) {
+            double M_ni = RF_M[n+col[i]];
+            normM_n += M_ni*M_ni;
+         }
 
+         for (m=n;m<end;m++) {
+            double sum_aux = 0.0;
+            double M_nm = RF_M[n+col[m]];
             /* take the derivative of q = dx'*D*dx with respect to nm_th element of M */
+            double dqdM_nm = 2.0*dx[m]*Mdx[n];
 
-            for (i=n;i<nIn;i++) {
+            for (i=n;i<end;i++) {
                /* aux corresponds to the in_th (= ni_th) element of dDdM_nm
                   this is directly processed for dwdM and dJ2dM   */
-
-               double M_ni = RF_M[n+i*nInS];
-               dqdM_nm += dx[i] * M_ni;      /* additional factor 2.0*dx[m] comes after the loop */
-               sum_aux += RF_D[i + m*nInS] * M_ni;
-
-               if (i == m) {
-                  sum_aux1 += 2.0*M_ni*M_ni;
-               } else {
-                  sum_aux1 += M_ni*M_ni;
-               }
+               sum_aux += RF_D[i+col[m]] * RF_M[n+col[i]];
             }
-            dqdM_nm *= 2.0*dx[m];
 
             dwdM[n+m*nInS] = dqdM_nm * dwdq;
             ddwdMdM[n+m*nInS] = ddwdqdq * dqdM_nm * dqdM_nm + 2*dwdq*dx[m]*dx[m];
 
             dJ2dM[n+m*nInS] = 2.0*penalty*sum_aux;
-            ddJ2dMdM[n+m*nInS] = 2.0*penalty*(RF_D[m+m*nInS] + sum_aux1);
+            ddJ2dMdM[n+m*nInS] = 2.0*penalty*(RF_D[m+col[m]] + normM_n + M_nm*M_nm);
         }
       }
    } else {
       /* non-diagonal (= upper-triangular) case WITHOUT meta learning*/
       for (n=0;n<nIn;n++) {
-         for (m=n;m<nIn;m++) {
+         int end = block_end[n];
+         int i;
+
+         for (m=n;m<end;m++) {
             double sum_aux = 0.0;
-            double dqdM_nm = 0.0;
-            int i;
 
             /* take the derivative of q = dx'*D*dx with respect to nm_th element of M */
-            for (i=n;i<nIn;i++) {
+            for (i=n;i<end;i++) {
                /* aux corresponds to the i,n_th (= n,i_th) element of dDdm_nm
                   this is directly processed for dwdM and dJ2dM   */
-               double M_ni = RF_M[n+i*nInS];
-               dqdM_nm += dx[i] * M_ni;       /* additional factor 2.0*dx[m] comes after the loop */
-               sum_aux += RF_D[i + m*nInS] * M_ni;
+               sum_aux += RF_D[i+col[m]] * RF_M[n+col[i]];
             }
-            dwdM[n+m*nInS] = 2.0 * dx[m] * dqdM_nm * dwdq;
+            dwdM[n+m*nInS] = 2.0 * dx[m] * Mdx[n] * dwdq;
             dJ2dM[n+m*nInS] = 2.0 * penalty * sum_aux;
          }
       }
@@ -240,8 +245,347 @@ void lwpr_aux_update_b_h_alpha(double *b,double *h, double *alpha,
 */
 
 
+void lwpr_aux_mask_blocks(const LWPR_Model *model, double *A) {
+   int i,j;
+   for (j=0;j<model->nIn;j++) {
+      for (i=0;i<model->block_begin[j];i++) A[i+j*model->nInStore] = 0.0;
+      for (i=model->block_end[j];i<model->nIn;i++) A[i+j*model->nInStore] = 0.0;
+   }
+}
+
+void lwpr_aux_layout_blocks(LWPR_Model *model) {
+   int nIn = model->nIn;
+   int j,k,off;
+
+   if (model->nBlocks == 1) {
+      for (j=0;j<nIn;j++) model->metric_col[j] = j*model->nInStore;
+      model->nMetric = nIn*model->nInStore;
+      return;
+   }
+   for (j=0,off=0;j<nIn;j=model->block_end[j]) {
+      int size = model->block_end[j] - j;
+      for (k=0;k<size;k++) model->metric_col[j+k] = off + k*size - j;
+      off+=size*size;
+   }
+   /* Keep the arrays behind the packed matrices aligned */
+   model->nMetric = (off&1) ? off+1 : off;
+}
+
+void lwpr_aux_pack_metric(const LWPR_Model *model, const double *A, double *X) {
+   int j;
+   for (j=0;j<model->nIn;j++) {
+      int b = model->block_begin[j];
+      memcpy(X + b + model->metric_col[j], A + b + j*model->nInStore, (model->block_end[j]-b)*sizeof(double));
+   }
+}
+
+void lwpr_aux_unpack_metric(const LWPR_Model *model, const double *X, double *A) {
+   int i,j;
+   for (j=0;j<model->nIn;j++) {
+      int b = model->block_begin[j];
+      int e = model->block_end[j];
+      double *A_j = A + j*model->nInStore;
+      for (i=0;i<b;i++) A_j[i] = 0.0;
+      memcpy(A_j + b, X + b + model->metric_col[j], (e-b)*sizeof(double));
+      for (i=e;i<model->nIn;i++) A_j[i] = 0.0;
+   }
+}
+
+double lwpr_aux_cutoff_distance(LWPR_Kernel kernel, double w_min) {
+   switch (kernel) {
+      case LWPR_GAUSSIAN_KERNEL:
+         /* w = exp(-0.5*dist) > w_min */
+         return (w_min > 0.0) ? -2.0*log(w_min) : HUGE_VAL;
+      case LWPR_BISQUARE_KERNEL:
+         /* w = (1-0.25*dist)^2 > w_min, and w = 0 for dist >= 4 */
+         return (w_min > 0.0) ? 4.0*(1.0 - sqrt(w_min)) : 4.0;
+   }
+   return HUGE_VAL;
+}
+
+void lwpr_aux_compute_bbox(LWPR_ReceptiveField *RF, double *z) {
+   int nIn = RF->model->nIn;
+   const int *col = RF->model->metric_col;
+   const double *M = RF->M;
+   int i,k,l;
+
+   if (RF->model->rank > 0) {
+      /* D >= diag(d), so 1/sqrt(d_i) bounds the extent along axis i */
+      for (i=0;i<nIn;i++) RF->box[i] = 1.0/fabs(RF->L[i]);
+   } else if (RF->model->diag_only) {
+      for (i=0;i<nIn;i++) RF->box[i] = 1.0/M[i+col[i]];
+   } else {
+      /* The extent of the ellipsoid along axis i is sqrt((D^-1)_ii) = |z|,
+      ** where z solves M'*z = e_i by forward substitution (z_k = 0 for k<i) */
+      for (i=0;i<nIn;i++) {
+         double norm2 = 0.0;
+         int end = RF->model->block_end[i];
+         for (k=i;k<end;k++) {
+            double sum = (k==i) ? 1.0 : 0.0;
+            for (l=i;l<k;l++) sum -= M[l+col[k]]*z[l];
+            z[k] = sum / M[k+col[k]];
+            norm2 += z[k]*z[k];
+         }
+         RF->box[i] = sqrt(norm2);
+      }
+   }
+   RF->boxReady = 1;
+}
+
+int lwpr_aux_rf_distance(LWPR_ReceptiveField *RF, const double *xn, double qmax,
+      double *xc, double *Mxc, double *scratch, double *dist) {
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   double q = 0.0;
+   int i,j;
+
+   if (RF->model->use_bbox && qmax < HUGE_VAL) {
+      double r = sqrt(qmax);
+
+      if (!RF->boxReady && scratch!=NULL) lwpr_aux_compute_bbox(RF, scratch);
+      if (RF->boxReady) {
+         for (i=0;i<nIn;i++) {
+            xc[i] = xn[i] - RF->c[i];
+            if (fabs(xc[i]) > r*RF->box[i]) return 0;
+         }
+      } else {
+         for (i=0;i<nIn;i++) xc[i] = xn[i] - RF->c[i];
+      }
+   } else {
+      for (i=0;i<nIn;i++) xc[i] = xn[i] - RF->c[i];
+   }
+
+   if (RF->model->rank > 0) {
+      /* Diagonal part first, then the squared elements of L'*xc */
+      const double *L = RF->L;
+      int rank = RF->model->rank;
+      for (j=0;j<nIn;j++) {
+         q += L[j]*L[j]*xc[j]*xc[j];
+         if (q > qmax) return 0;
+      }
+      for (j=1;j<=rank;j++) {
+         double Lxc_j = lwpr_math_dot_product(L + j*nInS, xc, nIn);
+         if (Mxc!=NULL) Mxc[j-1] = Lxc_j;
+         q += Lxc_j*Lxc_j;
+         if (q > qmax) return 0;
+      }
+   } else if (RF->model->diag_only) {
+      for (j=0;j<nIn;j++) {
+         q += RF->D[j+RF->model->metric_col[j]]*xc[j]*xc[j];
+         if (q > qmax) return 0;
+      }
+   } else {
+      /* Sum up the squared rows of M*xc, starting with the short ones at the bottom */
+      const int *end = RF->model->block_end;
+      const int *col = RF->model->metric_col;
+      for (j=nIn-1;j>=0;j--) {
+         double Mxc_j = 0.0;
+         for (i=j;i<end[j];i++) Mxc_j += RF->M[j+col[i]]*xc[i];
+         if (Mxc!=NULL) Mxc[j] = Mxc_j;
+         q += Mxc_j*Mxc_j;
+         if (q > qmax) return 0;
+      }
+   }
+   *dist = q;
+   return 1;
+}
+
+double lwpr_aux_max_activation(const LWPR_Model *model, int dim, const double *xn, double w_max,
+      int start, int end, int incr, double *xc) {
+   const LWPR_SubModel *sub = &model->sub[dim];
+   double qmax, dist, w;
+   int n;
+
+   if (w_max > 0.0) return w_max;
+
+   qmax = lwpr_aux_cutoff_distance(model->kernel, 0.0);
+   for (n=start;n<end;n+=incr) {
+      if (!lwpr_aux_rf_distance(sub->rf[n], xn, qmax, xc, NULL, NULL, &dist)) continue;
+
+      switch(model->kernel) {
+         case LWPR_GAUSSIAN_KERNEL:
+            w = exp(-0.5*dist);
+            break;
+         case LWPR_BISQUARE_KERNEL:
+            w = 1-0.25*dist;
+            w = (w<0) ? 0 : w*w;
+            break;
+         default:
+            w = 0.0;
+      }
+      if (w > w_max) {
+         w_max = w;
+         /* Receptive fields farther away than this one cannot raise the maximum */
+         qmax = dist;
+      }
+   }
+   return w_max;
+}
+
+void lwpr_aux_rf_Dx(const LWPR_ReceptiveField *RF, const double *xc, const double *Mxc, double *Dx) {
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   int i;
+
+   if (RF->model->rank > 0) {
+      /* Dx = diag(d)*xc + L*(L'*xc), with L'*xc passed in Mxc */
+      const double *L = RF->L;
+      for (i=0;i<nIn;i++) Dx[i] = L[i]*L[i]*xc[i];
+      for (i=1;i<=RF->model->rank;i++) {
+         lwpr_math_add_scalar_vector(Dx, Mxc[i-1], L + i*nInS, nIn);
+      }
+   } else if (RF->model->diag_only) {
+      const int *col = RF->model->metric_col;
+      for (i=0;i<nIn;i++) Dx[i] = RF->D[i+col[i]]*xc[i];
+   } else {
+      /* Dx = M'*(M*xc), column i of M holds the i-th row of M' */
+      const int *begin = RF->model->block_begin;
+      const int *col = RF->model->metric_col;
+      for (i=0;i<nIn;i++) {
+         Dx[i] = lwpr_math_dot_product(RF->M + begin[i] + col[i], Mxc + begin[i], i+1-begin[i]);
+      }
+   }
+}
+
+void lwpr_aux_add_D_column(const LWPR_ReceptiveField *RF, int i, double a, double *y) {
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   int l;
+
+   if (RF->model->rank > 0) {
+      const double *L = RF->L;
+      y[i] += a*L[i]*L[i];
+      for (l=1;l<=RF->model->rank;l++) {
+         lwpr_math_add_scalar_vector(y, a*L[i+l*nInS], L + l*nInS, nIn);
+      }
+   } else {
+      /* D(:,i) is zero outside the block that contains i */
+      int b = RF->model->block_begin[i];
+      lwpr_math_add_scalar_vector(y + b, a, RF->D + b + RF->model->metric_col[i], RF->model->block_end[i] - b);
+   }
+}
+
+void lwpr_aux_compute_D(const LWPR_ReceptiveField *RF, double *D, int dense) {
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   const int *begin = RF->model->block_begin;
+   const int *end = RF->model->block_end;
+   const int *col = RF->model->metric_col;
+   int i,j;
+
+   for (j=0;j<nIn;j++) {
+      /* Calculate in lower triangle, fill upper; D(i,j) = 0 outside the blocks */
+      int b = begin[j];
+      double *D_j = D + (dense ? j*nInS : col[j]);
+      if (dense) {
+         for (i=0;i<b;i++) D_j[i] = 0.0;
+         for (i=end[j];i<nIn;i++) D_j[i] = 0.0;
+      }
+      for (i=b;i<j;i++) {
+         D_j[i] = D[j + (dense ? i*nInS : col[i])];
+      }
+      for (i=j;i<end[j];i++) {
+         D_j[i] = lwpr_math_dot_product(RF->M + b + col[i], RF->M + b + col[j],j+1-b);
+      }
+   }
+}
+
+void lwpr_aux_rf_sync_D(LWPR_ReceptiveField *RF) {
+   if (RF->DReady) return;
+   lwpr_aux_compute_D(RF, RF->D, 0);
+   RF->DReady = 1;
+}
+
+double lwpr_aux_trace_D(const LWPR_ReceptiveField *RF) {
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   double tr = 0.0;
+   int i;
+
+   if (RF->model->rank > 0) {
+      for (i=0;i<=RF->model->rank;i++) tr += lwpr_math_norm2(RF->L + i*nInS, nIn);
+   } else if (!RF->DReady) {
+      /* D(i,i) is the squared norm of column i of M */
+      const int *begin = RF->model->block_begin;
+      const int *col = RF->model->metric_col;
+      for (i=0;i<nIn;i++) {
+         tr += lwpr_math_dot_product(RF->M + begin[i] + col[i], RF->M + begin[i] + col[i], i+1-begin[i]);
+      }
+   } else {
+      for (i=0;i<nIn;i++) tr += RF->D[i+RF->model->metric_col[i]];
+   }
+   return tr;
+}
+
+int lwpr_aux_update_lowrank_metric(LWPR_ReceptiveField *RF, double dwdq, double penalty,
+      double transMul, double wW, double dJ1dw, const double *dx, const double *Ldx, LWPR_Workspace *WS) {
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   int rank = RF->model->rank;
+   int nL = nInS*(rank+1);
+
+   double *L = RF->L;
+   double *dwdL = WS->dwdM;
+   double *dJdL = WS->dJ2dM;
+   double *G = WS->ddwdMdM;
+
+   double maxL = 0.0;
+   int reduced = 0;
+   int i,j,l;
+
+   /* penalty only occurs with a factor 2, so we take it out */
+   penalty+=penalty;
+
+   /* G = L'*L (rank x rank), needed for D*L = diag(d)*L + L*(L'*L) */
+   for (l=0;l<rank;l++) {
+      for (j=0;j<=l;j++) {
+         G[j+l*rank] = G[l+j*rank] = lwpr_math_dot_product(L + (j+1)*nInS, L + (l+1)*nInS, nIn);
+      }
+   }
+
+   for (i=0;i<nIn;i++) {
+      double d_i = L[i]*L[i];
+      double D_ii = d_i;
+      for (l=1;l<=rank;l++) D_ii += L[i+l*nInS]*L[i+l*nInS];
+
+      /* derivatives of q = dx'*D*dx and of J2 = penalty*sum(D.^2) with respect to sqrt(d_i) */
+      dwdL[i] = 2.0 * L[i] * dx[i] * dx[i] * dwdq;
+      dJdL[i] = 2.0 * L[i] * penalty * D_ii;
+
+      /* ... and with respect to L(i,l) */
+      for (l=1;l<=rank;l++) {
+         double DL_il = d_i*L[i+l*nInS];
+         for (j=1;j<=rank;j++) DL_il += L[i+j*nInS]*G[(j-1)+(l-1)*rank];
+
+         dwdL[i+l*nInS] = 2.0 * dx[i] * Ldx[l-1] * dwdq;
+         dJdL[i+l*nInS] = 2.0 * penalty * DL_il;
+      }
+   }
+
+   for (i=0;i<nL;i++) {
+      double m = fabs(L[i]);
+      if (m>maxL) maxL=m;
+   }
+
+   for (l=0;l<=rank;l++) {
+      for (i=0;i<nIn;i++) {
+         int off = i+l*nInS;
+         double delta = RF->alpha[off] * transMul * (wW * dJdL[off] + dwdL[off]*dJ1dw);
+         if (delta > 0.1*maxL) {
+            RF->alpha[off]*=0.5;
+            reduced = 1;
+         } else {
+            L[off] -= delta;
+         }
+      }
+   }
+   RF->boxReady = 0;
+   if (RF->cluster != NULL) RF->cluster->ready = 0;
+   return reduced;
+}
+
 double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
-      double w, double dwdq, double ddwdqdq, double e_cv, double e, const double *xn, LWPR_Workspace *WS) {
+      double w, double dwdq, double ddwdqdq, double e_cv, double e, const double *dx, const double *Mdx, LWPR_Workspace *WS) {
 
    double transMul;
    double penalty;
@@ -259,7 +603,6 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
    double *dJ2dM = WS->dJ2dM;
    double *ddwdMdM = WS->ddwdMdM;
    double *ddJ2dMdM = WS->ddJ2dMdM;
-   double *dx = WS->dx;
 
    double h=0.0;
    double e2;
@@ -318,15 +661,18 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
 
    wW = w/W;
 
-   for (i=0;i<nIn;i++) dx[i]=xn[i]-RF->c[i];
-
-   lwpr_aux_dist_derivatives(nIn, nInS, dwdM, dJ2dM, ddwdMdM, ddJ2dMdM, w, dwdq, ddwdqdq, RF->D, RF->M, dx, RF->model->diag_only, penalty, RF->model->meta);
+   if (RF->model->rank > 0) {
+      /* Low-rank metrics are adapted by plain gradient descent */
+      reduced = lwpr_aux_update_lowrank_metric(RF, dwdq, penalty, transMul, wW, dJ1dw, dx, Mdx, WS);
+   } else if (RF->model->diag_only) {
+      /* The workspace is dense, RF->D, M, alpha, h and b are packed (see LWPR_Model.metric_col) */
+      const int *col = RF->model->metric_col;
 
-   if (RF->model->diag_only) {
+      lwpr_aux_dist_derivatives(nIn, nInS, dwdM, dJ2dM, ddwdMdM, ddJ2dMdM, w, dwdq, ddwdqdq, RF->D, RF->M, col, dx, Mdx, RF->model->block_end, 1, penalty, RF->model->meta);
 
       maxM = 0.0;
       for (j=0;j<nIn;j++) {
-         double m = fabs(RF->M[j+j*nInS]);
+         double m = fabs(RF->M[j+col[j]]);
          if (m>maxM) maxM=m;
       }
 
@@ -351,6 +697,7 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
 
          for (j=0;j<nIn;j++) {
             int off = j + j*nInS;
+            int p = j + col[j];
             double ddJdMdM_jj = wW * ddJ2dMdM[off] + ddwdMdM[off]*dJ1dw + dwdM[off]*dwdM[off] * ddJ1dwdw;
             double aux_jj;
             double b_jj;
@@ -358,7 +705,7 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
 
             /* This implements the incremental Delta-Bar-Delta algorithm (Sutton, 1992)
                with some additional safety heuristics */
-            aux_jj = RF->model->meta_rate * transMul * dJ2dM[off] * RF->h[off];
+            aux_jj = RF->model->meta_rate * transMul * dJ2dM[off] * RF->h[p];
 
             if (aux_jj > 0.1) {
                aux_jj = 0.1;
@@ -366,51 +713,63 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
                aux_jj = -0.1;
             }
 
-            b_jj = RF->b[off] - aux_jj;
+            b_jj = RF->b[p] - aux_jj;
             if (b_jj > 10) {
                b_jj = 10;
             } else if (b_jj < -10) {
                b_jj = -10;
             }
-            RF->b[off] = b_jj;
+            RF->b[p] = b_jj;
             alpha_jj = exp(b_jj);
-            RF->alpha[off] = alpha_jj;
+            RF->alpha[p] = alpha_jj;
 
             aux_jj = 1.0 - alpha_jj*ddJdMdM_jj*transMul;
             if (aux_jj < 0) aux_jj = 0;
-            RF->h[off] = RF->h[off] * aux_jj - alpha_jj* transMul * dJ2dM[off];
+            RF->h[p] = RF->h[p] * aux_jj - alpha_jj* transMul * dJ2dM[off];
          }
       }
 
       for (j=0;j<nIn;j++) {
-         int off = j + j*nInS;
-         double delta_M_jj = RF->alpha[off] * transMul * dJ2dM[off];
+         int p = j + col[j];
+         double delta_M_jj = RF->alpha[p] * transMul * dJ2dM[j+j*nInS];
          if (delta_M_jj > 0.1*maxM) {
-            RF->alpha[off]*=0.5;
+            RF->alpha[p]*=0.5;
             reduced = 1;
          } else {
-            RF->M[off] -= delta_M_jj;
+            RF->M[p] -= delta_M_jj;
          }
       }
 
       for (j=0;j<nIn;j++) {
-         RF->D[j+j*nInS] = RF->M[j+j*nInS] * RF->M[j+j*nInS];
+         RF->D[j+col[j]] = RF->M[j+col[j]] * RF->M[j+col[j]];
       }
+      RF->boxReady = 0;
+      if (RF->cluster != NULL) RF->cluster->ready = 0;
 
    } else {
-      /* Full distance matrix (non-diagonal) case */
+      /* Full distance matrix (non-diagonal) case. Column j of M is zero above
+         the block that contains j, and those elements are skipped throughout */
+      const int *begin = RF->model->block_begin;
+      const int *col = RF->model->metric_col;
+      int changed = 0;
+
+      /* D only enters through the penalty term, so it is not formed without one */
+      if (penalty != 0.0) lwpr_aux_rf_sync_D(RF);
+      lwpr_aux_dist_derivatives(nIn, nInS, dwdM, dJ2dM, ddwdMdM, ddJ2dMdM, w, dwdq, ddwdqdq, RF->D, RF->M, col, dx, Mdx, RF->model->block_end, 0, penalty, RF->model->meta);
+
       maxM = 0.0;
       for (j=0;j<nIn;j++) {
-         for (i=0;i<=j;i++) {
-            double m = fabs(RF->M[i+j*nInS]);
+         for (i=begin[j];i<=j;i++) {
+            double m = fabs(RF->M[i+col[j]]);
             if (m>maxM) maxM=m;
          }
       }
 
       /* Reuse dJ2dM as dJdM */
       for (j=0;j<nIn;j++) {
-         /* for (i=0;i<=j;i++) dJ2dM[i+j*nInS] = wW * dJ2dM[i+j*nInS] + dwdM[i+j*nInS]*dJ1dw; */
-         lwpr_math_scale_add_scalar_vector(wW, dJ2dM + j*nInS, dJ1dw, dwdM + j*nInS, j+1);
+         /* for (i=begin[j];i<=j;i++) dJ2dM[i+j*nInS] = wW * dJ2dM[i+j*nInS] + dwdM[i+j*nInS]*dJ1dw; */
+         int off = begin[j] + j*nInS;
+         lwpr_math_scale_add_scalar_vector(wW, dJ2dM + off, dJ1dw, dwdM + off, j+1-begin[j]);
       }
 
       if (RF->model->meta) {
@@ -432,8 +791,9 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
          */
 
          for (j=0;j<nIn;j++) {
-            for (i=0;i<=j;i++) {
+            for (i=begin[j];i<=j;i++) {
                int off = i+j*nInS;
+               int p = i+col[j];
                double aux_ij;
                double b_ij;
                double alpha_ij;
@@ -443,52 +803,50 @@ double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
                /* This implements the incremental Delta-Bar-Delta algorithm (Sutton, 1992),
                   with some additional safety heuristics */
 
-               aux_ij = RF->model->meta_rate * transMul * dJ2dM[off] * RF->h[off];
+               aux_ij = RF->model->meta_rate * transMul * dJ2dM[off] * RF->h[p];
                if (aux_ij > 0.1) {
                   aux_ij = 0.1;
                } else if (aux_ij < -0.1) {
                   aux_ij = -0.1;
                }
 
-               b_ij = RF->b[off] - aux_ij;
+               b_ij = RF->b[p] - aux_ij;
                if (b_ij > 10.0) {
                   b_ij = 10.0;
                } else if (b_ij < -10.0) {
                   b_ij = -10.0;
                }
 
-               RF->b[off] = b_ij;
+               RF->b[p] = b_ij;
                alpha_ij = exp(b_ij);
-               RF->alpha[off] = alpha_ij;
+               RF->alpha[p] = alpha_ij;
 
                aux_ij = 1.0 - alpha_ij*ddJdMdM_ij*transMul;
                if (aux_ij < 0) aux_ij = 0;
-               RF->h[off] = RF->h[off] * aux_ij - alpha_ij* transMul * dJ2dM[off];
+               RF->h[p] = RF->h[p] * aux_ij - alpha_ij* transMul * dJ2dM[off];
             }
          }
       }
 
 
       for (j=0;j<nIn;j++) {
-         for (i=0;i<=j;i++) {
-            double delta_M_ij = RF->alpha[i+j*nInS] * transMul * dJ2dM[i+j*nInS];
+         for (i=begin[j];i<=j;i++) {
+            double delta_M_ij = RF->alpha[i+col[j]] * transMul * dJ2dM[i+j*nInS];
             if (delta_M_ij > 0.1*maxM) {
                reduced = 1;
-               RF->alpha[i+j*nInS]*=0.5;
+               RF->alpha[i+col[j]]*=0.5;
             } else {
-               RF->M[i+j*nInS] -= delta_M_ij;
+               RF->M[i+col[j]] -= delta_M_ij;
+               changed = 1;
             }
          }
       }
 
-      for (j=0;j<nIn;j++) {
-         /* Calculate in lower triangle, fill upper */
-         for (i=0;i<j;i++) {
-            RF->D[i+j*nInS] = RF->D[j+i*nInS];
-         }
-         for (i=j;i<nIn;i++) {
-            RF->D[i+j*nInS] = lwpr_math_dot_product(RF->M + i*nInS, RF->M + j*nInS,j+1);
-         }
+      /* D = M'*M is formed again when it is needed (see lwpr_aux_rf_sync_D) */
+      if (changed) {
+         RF->DReady = 0;
+         RF->boxReady = 0;
+         if (RF->cluster != NULL) RF->cluster->ready = 0;
       }
    }
 
@@ -508,8 +866,18 @@ LWPR_ReceptiveField *lwpr_aux_add_rf(LWPR_SubModel *sub, int nReg) {
    LWPR_ReceptiveField *RF;
 
    if (sub->numRFS == sub->numPointers) {
-      LWPR_ReceptiveField **newStore = (LWPR_ReceptiveField **) LWPR_REALLOC(sub->rf, (sub->numPointers+16)*sizeof(LWPR_ReceptiveField *));
-      if (newStore == NULL) return NULL;
+      LWPR_ReceptiveField **newStore;
+
+      if (sub->model->conc != NULL) {
+         /* Concurrent readers may still scan the old array */
+         newStore = (LWPR_ReceptiveField **) LWPR_MALLOC((sub->numPointers+16)*sizeof(LWPR_ReceptiveField *));
+         if (newStore == NULL) return NULL;
+         memcpy(newStore, sub->rf, sub->numRFS*sizeof(LWPR_ReceptiveField *));
+         lwpr_conc_retire(sub->model->conc, sub->rf, lwpr_conc_release_mem);
+      } else {
+         newStore = (LWPR_ReceptiveField **) LWPR_REALLOC(sub->rf, (sub->numPointers+16)*sizeof(LWPR_ReceptiveField *));
+         if (newStore == NULL) return NULL;
+      }
 
       sub->rf = newStore;
       sub->numPointers+=16;
@@ -531,109 +899,747 @@ LWPR_ReceptiveField *lwpr_aux_add_rf(LWPR_SubModel *sub, int nReg) {
    } else {
       memset(RF, 0, sizeof(LWPR_ReceptiveField));
    }
+   /* Concurrent readers skip the RF until lwpr_conc_write_end is called on it */
+   RF->seq = (sub->model->conc != NULL) ? 1 : 0;
+   RF->ckpt = 0;
 
    sub->rf[sub->numRFS++]=RF;
+   lwpr_aux_index_note(sub, sub->numRFS-1);
 
    return RF;
 }
 
+void lwpr_aux_copy_rf(LWPR_ReceptiveField *RFd, const LWPR_ReceptiveField *RFs) {
+   const LWPR_Model *model = RFs->model;
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nReg = RFs->nReg;
+
+   RFd->trustworthy = RFs->trustworthy;
+   RFd->w           = (RFs->w_stamp == RFd->model->n_updates) ? RFs->w : 0.0;
+   RFd->w_stamp     = RFd->model->n_updates;
+   RFd->sum_e2      = RFs->sum_e2;
+   RFd->mon_sum_e2  = RFs->mon_sum_e2;
+   RFd->mon_sum_w   = RFs->mon_sum_w;
+   RFd->beta0       = RFs->beta0;
+   RFd->SSp         = RFs->SSp;
+
+   if (RFs->L != NULL) {
+      memcpy(RFd->L,      RFs->L,      nInS * (model->rank+1) * sizeof(double));
+      memcpy(RFd->alpha,  RFs->alpha,  nInS * (model->rank+1) * sizeof(double));
+   } else {
+      int nM = model->nMetric;
+      memcpy(RFd->D,      RFs->D,      nM * sizeof(double));
+      RFd->DReady = RFs->DReady;
+      memcpy(RFd->M,      RFs->M,      nM * sizeof(double));
+      memcpy(RFd->alpha,  RFs->alpha,  nM * sizeof(double));
+      memcpy(RFd->h,      RFs->h,      nM * sizeof(double));
+      memcpy(RFd->b,      RFs->b,      nM * sizeof(double));
+   }
+   memcpy(RFd->beta,   RFs->beta,   nReg * sizeof(double));
+   memcpy(RFd->c,      RFs->c,      nIn * sizeof(double));
+   memcpy(RFd->SXresYres, RFs->SXresYres, nInS * nReg * sizeof(double));
+   memcpy(RFd->SSs2,   RFs->SSs2,   nReg * sizeof(double));
+   memcpy(RFd->SSYres, RFs->SSYres, nReg * sizeof(double));
+   memcpy(RFd->SSXres, RFs->SSXres, nInS * nReg * sizeof(double));
+   memcpy(RFd->U,      RFs->U,      nInS * nReg * sizeof(double));
+   memcpy(RFd->P,      RFs->P,      nInS * nReg * sizeof(double));
+   memcpy(RFd->H,      RFs->H,      nReg * sizeof(double));
+   memcpy(RFd->r,      RFs->r,      nReg * sizeof(double));
+   memcpy(RFd->sum_w,  RFs->sum_w,  nReg * sizeof(double));
+   memcpy(RFd->sum_e_cv2, RFs->sum_e_cv2, nReg * sizeof(double));
+   memcpy(RFd->n_data, RFs->n_data, nReg * sizeof(double));
+   memcpy(RFd->lambda, RFs->lambda, nReg * sizeof(double));
+   memcpy(RFd->s,      RFs->s,      nReg * sizeof(double));
+   memcpy(RFd->mean_x, RFs->mean_x, nIn * sizeof(double));
+   memcpy(RFd->var_x,  RFs->var_x,  nIn * sizeof(double));
+}
+
+int lwpr_aux_copy_settings(LWPR_Model *dest, const LWPR_Model *src) {
+   int nIn = src->nIn;
+   int nInS = src->nInStore;
+
+   if (!lwpr_init_model(dest, nIn, src->nOut, src->name)) return 0;
+
+   dest->diag_only     = src->diag_only;
+   dest->nBlocks       = src->nBlocks;
+   dest->rank          = src->rank;
+   memcpy(dest->block_begin, src->block_begin, nIn * sizeof(int));
+   memcpy(dest->block_end,   src->block_end,   nIn * sizeof(int));
+   lwpr_aux_layout_blocks(dest);
+   dest->meta          = src->meta;
+   dest->meta_rate     = src->meta_rate;
+   dest->penalty       = src->penalty;
+   dest->w_gen         = src->w_gen;
+   dest->w_prune       = src->w_prune;
+   dest->init_lambda   = src->init_lambda;
+   dest->final_lambda  = src->final_lambda;
+   dest->tau_lambda    = src->tau_lambda;
+   dest->init_S2       = src->init_S2;
+   dest->add_threshold = src->add_threshold;
+   dest->kernel        = src->kernel;
+   dest->update_D      = src->update_D;
+   dest->gate_factor   = src->gate_factor;
+   dest->gate_keep     = src->gate_keep;
+   dest->use_bbox      = src->use_bbox;
+   dest->n_data        = src->n_data;
+   dest->n_updates     = src->n_updates;
+
+   memcpy(dest->mean_x,     src->mean_x,     nIn * sizeof(double));
+   memcpy(dest->var_x,      src->var_x,      nIn * sizeof(double));
+   memcpy(dest->norm_in,    src->norm_in,    nIn * sizeof(double));
+   memcpy(dest->norm_out,   src->norm_out,   src->nOut * sizeof(double));
+   memcpy(dest->init_D,     src->init_D,     nIn * nInS * sizeof(double));
+   memcpy(dest->init_M,     src->init_M,     nIn * nInS * sizeof(double));
+   memcpy(dest->init_alpha, src->init_alpha, nIn * nInS * sizeof(double));
+
+   if (src->proj_P != NULL) {
+      int nInRaw = src->nInRaw;
+
+      if (!lwpr_mem_alloc_projection(dest, nInRaw)) {
+         lwpr_free_model(dest);
+         return 0;
+      }
+      dest->proj_interval = src->proj_interval;
+      memcpy(dest->proj_P,    src->proj_P,    nInS * nInRaw * sizeof(double));
+      memcpy(dest->proj_mean, src->proj_mean, nInRaw * sizeof(double));
+      memcpy(dest->proj_cov,  src->proj_cov,  nInRaw * nInRaw * sizeof(double));
+   }
+   return 1;
+}
 
-/* returns ymz. xmz is also output value */
-double lwpr_aux_update_means(LWPR_ReceptiveField *RF, const double *x, double y, double w, double *xmz) {
-   int i;
-   int nIn = RF->model->nIn;
-   double swl = RF->sum_w[0] * RF->lambda[0];
-   double invFac = 1.0/(swl + w);
+void lwpr_aux_free_clusters(LWPR_SubModel *sub) {
+   int k,n;
 
-   for (i=0;i<nIn;i++) {
-      double mx = RF->mean_x[i];
-      mx = RF->mean_x[i] = (swl * mx + w*x[i])*invFac;
-      mx = xmz[i] = x[i] - mx;
-      RF->var_x[i] = (swl * RF->var_x[i] + w*mx*mx)*invFac;
+   for (k=0;k<sub->numClusters;k++) {
+      LWPR_Cluster *C = sub->clusters[k];
+      for (n=0;n<C->numRFS;n++) C->rf[n]->cluster = NULL;
+      LWPR_FREE(C->rf);
+      LWPR_FREE(C->storage);
+      LWPR_FREE(C);
    }
-   RF->beta0 = (swl * RF->beta0 + w*y)*invFac;
-   return (y-RF->beta0);
+   if (sub->clusters != NULL) LWPR_FREE(sub->clusters);
+   sub->clusters = NULL;
+   sub->numClusters = sub->numClusterPointers = 0;
 }
 
+static LWPR_Cluster *lwpr_aux_add_cluster(LWPR_SubModel *sub) {
+   const LWPR_Model *model = sub->model;
+   int nInS = model->nInStore;
+   LWPR_Cluster *C;
 
-void lwpr_aux_compute_projection_r(int nIn, int nInS, int nReg,
-      double *s, double *xres, const double *x, const double *U, const double *P) {
+   if (sub->numClusters == sub->numClusterPointers) {
+      LWPR_Cluster **newStore = (LWPR_Cluster **) LWPR_REALLOC(sub->clusters, (sub->numClusterPointers+16)*sizeof(LWPR_Cluster *));
+      if (newStore == NULL) return NULL;
 
-   int i,j;
-   double sj;
+      sub->clusters = newStore;
+      sub->numClusterPointers+=16;
 
-   for (i=0;i<nIn;i++) xres[i] = x[i];
-   for (j=0;j<nReg-1;j++) {
-      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xres + j*nInS, nIn);
-      for (i=0;i<nIn;i++) {
-         xres[i + (j+1)*nInS] = xres[i + j*nInS] - P[i+j*nInS]*sj;
-      }
+      #ifdef MATLAB
+         if (model->isPersistent) mexMakeMemoryPersistent(sub->clusters);
+      #endif
    }
-   s[nReg-1] = lwpr_math_dot_product(U+(nReg-1)*nInS, xres + (nReg-1)*nInS, nIn);
-}
 
+   C = (LWPR_Cluster *) LWPR_MALLOC(sizeof(LWPR_Cluster));
+   if (C == NULL) return NULL;
 
-void lwpr_aux_compute_projection(int nIn, int nInS, int nReg,
-      double *s, const double *x, const double *U, const double *P, LWPR_Workspace *WS) {
+   C->rf = (LWPR_ReceptiveField **) LWPR_MALLOC(model->cluster_size * sizeof(LWPR_ReceptiveField *));
+   C->storage = (double *) LWPR_MALLOC(4*nInS*sizeof(double));
+   if (C->rf == NULL || C->storage == NULL) {
+      if (C->rf != NULL) LWPR_FREE(C->rf);
+      if (C->storage != NULL) LWPR_FREE(C->storage);
+      LWPR_FREE(C);
+      return NULL;
+   }
+   #ifdef MATLAB
+      if (model->isPersistent) {
+         mexMakeMemoryPersistent(C);
+         mexMakeMemoryPersistent(C->rf);
+         mexMakeMemoryPersistent(C->storage);
+      }
+   #endif
 
-   int i,j;
-   double sj;
-   double *xu = WS->xu;
+   C->anchor = C->storage;
+   C->cmin   = C->anchor + nInS;
+   C->cmax   = C->cmin + nInS;
+   C->bmax   = C->cmax + nInS;
+   C->numRFS = 0;
+   C->ready  = 0;
 
-   for (i=0;i<nIn;i++) xu[i] = x[i];
+   sub->clusters[sub->numClusters++] = C;
+   return C;
+}
 
-   for (j=0;j<nReg-1;j++) {
-      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xu, nIn);
-      /* for (i=0;i<nIn;i++) xu[i] -= P[i+j*nInS]*sj; */
-      lwpr_math_add_scalar_vector(xu,-sj,P+j*nInS, nIn);
+int lwpr_aux_cluster_insert(LWPR_SubModel *sub, LWPR_ReceptiveField *RF, double *xc) {
+   const LWPR_Model *model = sub->model;
+   double qmax = model->cluster_radius * model->cluster_radius;
+   LWPR_Cluster *C = NULL;
+   int k;
+
+   /* Nearest founder in the metric of the new RF; qmax shrinks as we go */
+   for (k=0;k<sub->numClusters;k++) {
+      LWPR_Cluster *Ck = sub->clusters[k];
+      double dist;
+
+      if (Ck->numRFS >= model->cluster_size) continue;
+      if (!lwpr_aux_rf_distance(RF, Ck->anchor, qmax, xc, NULL, NULL, &dist)) continue;
+      C = Ck;
+      qmax = dist;
    }
-   s[nReg-1]=lwpr_math_dot_product(U+(nReg-1)*nInS, xu, nIn);
+
+   if (C == NULL) {
+      C = lwpr_aux_add_cluster(sub);
+      if (C == NULL) {
+         lwpr_aux_free_clusters(sub);
+         return 0;
+      }
+      memcpy(C->anchor, RF->c, model->nIn*sizeof(double));
+   }
+   C->rf[C->numRFS++] = RF;
+   C->ready = 0;
+   RF->cluster = C;
+   return 1;
 }
 
-void lwpr_aux_compute_projection_d(int nIn, int nInS, int nReg,
-      double *s, double *dsdx, const double *x, const double *U, const double *P, LWPR_Workspace *WS) {
+void lwpr_aux_cluster_remove(LWPR_SubModel *sub, LWPR_ReceptiveField *RF) {
+   LWPR_Cluster *C = RF->cluster;
+   int n,k;
 
-   int i,j;
-   double sj;
-   double *xu = WS->xu;
-   double *dxdx = WS->dwdM;  /* it's also an nIns x nIn matrix */
+   RF->cluster = NULL;
+   for (n=0;n<C->numRFS;n++) {
+      if (C->rf[n] == RF) {
+         C->rf[n] = C->rf[--C->numRFS];
+         break;
+      }
+   }
+   C->ready = 0;
+   if (C->numRFS > 0) return;
 
-   memset(dxdx,0,nInS*nIn*sizeof(double));
-   for (i=0;i<nIn;i++) xu[i] = x[i];
-   for (i=0;i<nIn;i++) dxdx[i+i*nInS] = 1.0;
+   for (k=0;k<sub->numClusters;k++) {
+      if (sub->clusters[k] == C) {
+         sub->clusters[k] = sub->clusters[--sub->numClusters];
+         break;
+      }
+   }
+   LWPR_FREE(C->rf);
+   LWPR_FREE(C->storage);
+   LWPR_FREE(C);
+}
 
-   for (j=0;j<nReg-1;j++) {
-      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xu, nIn);
+static void lwpr_aux_refresh_cluster(LWPR_Cluster *C, int nIn, double *scratch) {
+   int i,n;
 
-      /* dsdx(:,j) = dxdx * U(:,j); */
-      lwpr_math_scalar_vector(dsdx + j*nInS, U[j*nInS], dxdx, nIn);
-      for (i=1;i<nIn;i++) {
-         lwpr_math_add_scalar_vector(dsdx + j*nInS, U[i+j*nInS], dxdx + i*nInS, nIn);
-      }
-      /* for (i=0;i<nIn;i++) xu[i] -= P[i+j*nInS]*sj; */
-      lwpr_math_add_scalar_vector(xu,-sj,P+j*nInS,nIn);
+   for (n=0;n<C->numRFS;n++) {
+      LWPR_ReceptiveField *RF = C->rf[n];
 
-      /* dxdx = dxdx - dsdx(:,j) * P(:,j)'; */
+      if (!RF->boxReady) lwpr_aux_compute_bbox(RF, scratch);
+      if (n==0) {
+         memcpy(C->cmin, RF->c,   nIn*sizeof(double));
+         memcpy(C->cmax, RF->c,   nIn*sizeof(double));
+         memcpy(C->bmax, RF->box, nIn*sizeof(double));
+         continue;
+      }
       for (i=0;i<nIn;i++) {
-         lwpr_math_add_scalar_vector(dxdx + i*nInS, -P[i+j*nInS], dsdx + j*nInS, nIn);
+         if (RF->c[i] < C->cmin[i]) C->cmin[i] = RF->c[i];
+         if (RF->c[i] > C->cmax[i]) C->cmax[i] = RF->c[i];
+         if (RF->box[i] > C->bmax[i]) C->bmax[i] = RF->box[i];
       }
    }
-   j=nReg-1;
-   s[j]=lwpr_math_dot_product(U+j*nInS, xu, nIn);
-   lwpr_math_scalar_vector(dsdx + j*nInS, U[j*nInS], dxdx, nIn);
-   for (i=1;i<nIn;i++) {
-      lwpr_math_add_scalar_vector(dsdx + j*nInS, U[i+j*nInS], dxdx + i*nInS, nIn);
-   }
+   C->ready = 1;
 }
 
-void lwpr_aux_update_regression(LWPR_ReceptiveField *RF, double *yp, double *e_cv_R, double *e,
-   const double *x, double y, double w, LWPR_Workspace *WS) {
+void lwpr_aux_free_index(LWPR_SubModel *sub) {
+   LWPR_RFIndex *idx = sub->index;
 
-   int nIn = RF->model->nIn;
-   int nInS = RF->model->nInStore;
-   int nReg = RF->nReg;
+   if (idx == NULL) return;
+   if (idx->entry != NULL) LWPR_FREE(idx->entry);
+   if (idx->proj != NULL) LWPR_FREE(idx->proj);
+   if (idx->seen != NULL) LWPR_FREE(idx->seen);
+   LWPR_FREE(idx);
+   sub->index = NULL;
+}
 
-   double *yres = WS->yres;
+void lwpr_aux_taylor_store(const LWPR_Model *model, const double *x, double cutoff,
+      const double *y, const double *J, const double *H) {
+   LWPR_TaylorCache *T = model->taylor;
+   int nRaw = model->nInRaw;
+   int nOut = model->nOut;
+   int i;
+
+   if (T == NULL) return;
+   if (H == NULL && model->taylor_tol > 0.0) {
+      /* No error estimate available for this point */
+      T->valid = 0;
+      return;
+   }
+   if (x != T->x0) memcpy(T->x0, x, nRaw*sizeof(double));
+   if (y != T->y0) memcpy(T->y0, y, nOut*sizeof(double));
+   if (J != T->J0) memcpy(T->J0, J, nOut*nRaw*sizeof(double));
+   T->hnorm = 0.0;
+   if (H != NULL) {
+      for (i=0;i<nOut;i++) {
+         double h = sqrt(lwpr_math_dot_product(H + i*nRaw*nRaw, H + i*nRaw*nRaw, nRaw*nRaw));
+         if (h > T->hnorm) T->hnorm = h;
+      }
+   }
+   T->cutoff = cutoff;
+   T->stamp = model->n_updates;
+   T->valid = 1;
+}
+
+void lwpr_aux_free_taylor(LWPR_Model *model) {
+   if (model->taylor == NULL) return;
+   LWPR_FREE(model->taylor->storage);
+   LWPR_FREE(model->taylor);
+   model->taylor = NULL;
+}
+
+double lwpr_aux_index_kappa(int nIn, int nProj, double recall) {
+   double p, lo = 0.0, hi = 40.0;
+   int k;
+
+   if (recall >= 1.0) return 1.0;
+   /* Each direction must be passed with probability p = erf(kappa/sqrt(2)) */
+   p = pow(recall, 1.0/nProj);
+   for (k=0;k<100;k++) {
+      double mid = 0.5*(lo+hi);
+      if (erf(mid*0.70710678118654752440) < p) lo = mid; else hi = mid;
+   }
+   hi/=sqrt((double) nIn);
+   return (hi < 1.0) ? hi : 1.0;
+}
+
+/* Extent sqrt(g'*inv(D)*g) of the unit ellipsoid of a RF along direction g */
+static double lwpr_aux_rf_width(const LWPR_ReceptiveField *RF, const double *g, double *z) {
+   const LWPR_Model *model = RF->model;
+   int nIn = model->nIn;
+   double w2 = 0.0;
+   int k,l;
+
+   if (model->rank > 0) {
+      /* D >= diag(d), so this is an upper bound */
+      for (k=0;k<nIn;k++) w2 += g[k]*g[k]/(RF->L[k]*RF->L[k]);
+   } else if (model->diag_only) {
+      for (k=0;k<nIn;k++) w2 += g[k]*g[k]/RF->D[k+model->metric_col[k]];
+   } else {
+      /* |z|^2 where M'*z = g, by forward substitution */
+      const double *M = RF->M;
+      for (k=0;k<nIn;k++) {
+         const double *M_k = M + model->metric_col[k];
+         double sum = g[k];
+         for (l=model->block_begin[k];l<k;l++) sum -= M_k[l]*z[l];
+         z[k] = sum / M_k[k];
+         w2 += z[k]*z[k];
+      }
+   }
+   return sqrt(w2);
+}
+
+static int lwpr_aux_compare_index_entries(const void *a, const void *b) {
+   double ka = ((const LWPR_RFIndexEntry *) a)->key;
+   double kb = ((const LWPR_RFIndexEntry *) b)->key;
+   return (ka < kb) ? -1 : ((ka > kb) ? 1 : 0);
+}
+
+int lwpr_aux_build_index(LWPR_SubModel *sub, double *scratch) {
+   const LWPR_Model *model = sub->model;
+   LWPR_RFIndex *idx = sub->index;
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nProj = model->index_proj;
+   int numRFS = sub->numRFS;
+   int n,t;
+
+   idx->ready = 0;
+   if (numRFS > idx->numPointers) {
+      int numPointers = numRFS + 16;
+
+      if (idx->entry != NULL) LWPR_FREE(idx->entry);
+      if (idx->proj != NULL) LWPR_FREE(idx->proj);
+      if (idx->seen != NULL) LWPR_FREE(idx->seen);
+      idx->numPointers = 0;
+      /* The second half of entry takes the new entries of a refresh */
+      idx->entry = (LWPR_RFIndexEntry *) LWPR_MALLOC(2*numPointers*sizeof(LWPR_RFIndexEntry));
+      /* proj, width and xproj share one block, and so do seen and dirty */
+      idx->proj = (double *) LWPR_MALLOC((2*nProj*numPointers + nProj)*sizeof(double));
+      idx->seen = (char *) LWPR_MALLOC(2*numPointers);
+      if (idx->entry == NULL || idx->proj == NULL || idx->seen == NULL) return 0;
+      #ifdef MATLAB
+         if (model->isPersistent) {
+            mexMakeMemoryPersistent(idx->entry);
+            mexMakeMemoryPersistent(idx->proj);
+            mexMakeMemoryPersistent(idx->seen);
+         }
+      #endif
+      idx->numPointers = numPointers;
+   }
+   idx->width = idx->proj + nProj*idx->numPointers;
+   idx->xproj = idx->width + nProj*idx->numPointers;
+   idx->dirty = idx->seen + idx->numPointers;
+   memset(idx->dirty, 0, (size_t) idx->numPointers);
+   idx->changed = 0;
+
+   idx->maxWidth = 0.0;
+   for (n=0;n<numRFS;n++) {
+      const LWPR_ReceptiveField *RF = sub->rf[n];
+
+      for (t=0;t<nProj;t++) {
+         const double *g = model->index_dirs + t*nInS;
+         idx->proj[t+n*nProj] = lwpr_math_dot_product(g, RF->c, nIn);
+         idx->width[t+n*nProj] = lwpr_aux_rf_width(RF, g, scratch);
+      }
+      if (idx->width[n*nProj] > idx->maxWidth) idx->maxWidth = idx->width[n*nProj];
+      idx->entry[n].key = idx->proj[n*nProj];
+      idx->entry[n].n = n;
+   }
+   qsort(idx->entry, (size_t) numRFS, sizeof(LWPR_RFIndexEntry), lwpr_aux_compare_index_entries);
+
+   idx->numRFS = numRFS;
+   idx->stamp = model->n_updates;
+   idx->ready = 1;
+   return 1;
+}
+
+int lwpr_aux_refresh_index(LWPR_SubModel *sub, double *scratch) {
+   const LWPR_Model *model = sub->model;
+   LWPR_RFIndex *idx = sub->index;
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nProj = model->index_proj;
+   int numRFS = sub->numRFS;
+   int numOld = idx->numRFS;
+   LWPR_RFIndexEntry *fresh;
+   int i,j,k,m,n,t;
+
+   if (!idx->ready || numRFS > idx->numPointers) return lwpr_aux_build_index(sub, scratch);
+   if (!idx->changed && numRFS == numOld && idx->stamp == model->n_updates) return 1;
+
+   /* Keep the entries of the RFs that are still at their positions */
+   for (i=0,k=0;i<numOld;i++) {
+      n = idx->entry[i].n;
+      if (n < numRFS && !idx->dirty[n]) idx->entry[k++] = idx->entry[i];
+   }
+
+   /* Centres never move, so the RFs kept in place only need new extents if their metric was
+   ** updated. New or moved RFs are projected afresh. */
+   fresh = idx->entry + idx->numPointers;
+   for (n=0,m=0;n<numRFS;n++) {
+      const LWPR_ReceptiveField *RF = sub->rf[n];
+
+      if (n >= numOld || idx->dirty[n]) {
+         for (t=0;t<nProj;t++) {
+            const double *g = model->index_dirs + t*nInS;
+            idx->proj[t+n*nProj] = lwpr_math_dot_product(g, RF->c, nIn);
+            idx->width[t+n*nProj] = lwpr_aux_rf_width(RF, g, scratch);
+         }
+         fresh[m].key = idx->proj[n*nProj];
+         fresh[m++].n = n;
+      } else if (RF->w_stamp > idx->stamp) {
+         for (t=0;t<nProj;t++) {
+            idx->width[t+n*nProj] = lwpr_aux_rf_width(RF, model->index_dirs + t*nInS, scratch);
+         }
+      }
+   }
+   qsort(fresh, (size_t) m, sizeof(LWPR_RFIndexEntry), lwpr_aux_compare_index_entries);
+
+   /* Merge the new entries in from the back, k + m = numRFS */
+   for (i=k-1,j=m-1;j>=0;) {
+      if (i>=0 && idx->entry[i].key > fresh[j].key) {
+         idx->entry[i+j+1] = idx->entry[i];
+         i--;
+      } else {
+         idx->entry[i+j+1] = fresh[j];
+         j--;
+      }
+   }
+
+   idx->maxWidth = 0.0;
+   for (n=0;n<numRFS;n++) {
+      if (idx->width[n*nProj] > idx->maxWidth) idx->maxWidth = idx->width[n*nProj];
+   }
+   memset(idx->dirty, 0, (size_t) ((numOld > numRFS) ? numOld : numRFS));
+   idx->changed = 0;
+   idx->numRFS = numRFS;
+   idx->stamp = model->n_updates;
+   return 1;
+}
+
+void lwpr_aux_index_note(LWPR_SubModel *sub, int n) {
+   LWPR_RFIndex *idx = sub->index;
+
+   if (idx == NULL || !idx->ready) return;
+   if (n < idx->numPointers) {
+      idx->dirty[n] = 1;
+      idx->changed = 1;
+   } else {
+      idx->ready = 0;
+   }
+}
+
+void lwpr_aux_invalidate_index(LWPR_SubModel *sub) {
+   if (sub->index != NULL) sub->index->ready = 0;
+}
+
+static void lwpr_aux_index_scan_init(LWPR_RFScan *scan) {
+   LWPR_SubModel *sub = scan->sub;
+   const LWPR_Model *model = sub->model;
+   LWPR_RFIndex *idx = sub->index;
+   int nProj = model->index_proj;
+   int lo,hi,t;
+   double h;
+
+   for (t=0;t<nProj;t++) {
+      idx->xproj[t] = lwpr_math_dot_product(model->index_dirs + t*model->nInStore, scan->xn, model->nIn);
+   }
+   idx->n_queries++;
+   if (model->index_audit) memset(idx->seen, 0, (size_t) idx->numRFS);
+
+   scan->n = 0;
+   scan->end = idx->numRFS;
+   if (scan->r == HUGE_VAL) return;
+
+   /* Binary search for the range of first projections that may pass */
+   h = model->index_kappa * scan->r * idx->maxWidth;
+   lo = 0; hi = idx->numRFS;
+   while (lo<hi) {
+      int mid = (lo+hi)/2;
+      if (idx->entry[mid].key < idx->xproj[0] - h) lo = mid+1; else hi = mid;
+   }
+   scan->n = lo;
+   hi = idx->numRFS;
+   while (lo<hi) {
+      int mid = (lo+hi)/2;
+      if (idx->entry[mid].key <= idx->xproj[0] + h) lo = mid+1; else hi = mid;
+   }
+   scan->end = lo;
+}
+
+static void lwpr_aux_index_audit(LWPR_RFScan *scan) {
+   LWPR_SubModel *sub = scan->sub;
+   const LWPR_Model *model = sub->model;
+   LWPR_RFIndex *idx = sub->index;
+   int dim = (int) (sub - model->sub);
+   int n;
+
+   idx->n_audited++;
+   for (n=0;n<idx->numRFS;n++) {
+      double dist, w;
+
+      if (idx->seen[n]) continue;
+      if (!lwpr_aux_rf_distance(sub->rf[n], scan->xn, scan->qmax, scan->scratch, NULL, NULL, &dist)) continue;
+      if (dist >= scan->qmax) continue;
+
+      switch(model->kernel) {
+         case LWPR_GAUSSIAN_KERNEL:
+            w = exp(-0.5*dist);
+            break;
+         case LWPR_BISQUARE_KERNEL:
+            w = 1-0.25*dist;
+            w = (w<0) ? 0 : w*w;
+            break;
+         default:
+            w = 0.0;
+      }
+      idx->n_missed++;
+      if (model->index_miss != NULL) model->index_miss(dim, n, w, model->index_miss_data);
+   }
+}
+
+void lwpr_aux_rf_scan_init(LWPR_RFScan *scan, LWPR_SubModel *sub, const double *xn, double qmax, double *scratch) {
+   scan->sub = sub;
+   scan->xn = xn;
+   scan->qmax = qmax;
+   scan->r = sqrt(qmax);
+   scan->scratch = scratch;
+   scan->cl = -1;
+   scan->n = 0;
+   scan->end = 0;
+   scan->mode = (sub->clusters != NULL) ? 1 : 0;
+
+   if (sub->index != NULL && scratch != NULL) {
+      LWPR_RFIndex *idx = sub->index;
+
+      lwpr_aux_refresh_index(sub, scratch);
+      if (idx->ready) {
+         scan->mode = 2;
+         lwpr_aux_index_scan_init(scan);
+      }
+   }
+}
+
+LWPR_ReceptiveField *lwpr_aux_rf_scan_next(LWPR_RFScan *scan) {
+   LWPR_SubModel *sub = scan->sub;
+   int nIn = sub->model->nIn;
+
+   if (scan->mode == 0) {
+      return (scan->n < sub->numRFS) ? sub->rf[scan->n++] : NULL;
+   }
+
+   if (scan->mode == 2) {
+      const LWPR_Model *model = sub->model;
+      LWPR_RFIndex *idx = sub->index;
+      int nProj = model->index_proj;
+      double h = model->index_kappa * scan->r;
+
+      while (scan->n < scan->end) {
+         int n = idx->entry[scan->n++].n;
+         const double *proj = idx->proj + n*nProj;
+         const double *width = idx->width + n*nProj;
+         int t;
+
+         if (h < HUGE_VAL) {
+            for (t=0;t<nProj;t++) {
+               if (fabs(idx->xproj[t] - proj[t]) > h*width[t]) break;
+            }
+            if (t<nProj) continue;
+         }
+         idx->n_candidates++;
+         if (model->index_audit) idx->seen[n] = 1;
+         return sub->rf[n];
+      }
+      if (model->index_audit && scan->end >= 0) {
+         lwpr_aux_index_audit(scan);
+         scan->end = -1;
+      }
+      return NULL;
+   }
+
+   while (scan->cl < 0 || scan->n >= sub->clusters[scan->cl]->numRFS) {
+      LWPR_Cluster *C;
+      int i;
+
+      if (++scan->cl >= sub->numClusters) return NULL;
+      scan->n = 0;
+      C = sub->clusters[scan->cl];
+
+      if (scan->r == HUGE_VAL) break;
+      if (!C->ready && scan->scratch!=NULL) lwpr_aux_refresh_cluster(C, nIn, scan->scratch);
+      if (!C->ready) break;
+
+      /* Every member satisfies |xn_i - c_i| <= r*box_i if it is activated above the cutoff */
+      for (i=0;i<nIn;i++) {
+         double xi = scan->xn[i];
+         double rb = scan->r * C->bmax[i];
+         if (xi < C->cmin[i] - rb || xi > C->cmax[i] + rb) {
+            scan->n = C->numRFS;
+            break;
+         }
+      }
+   }
+   return sub->clusters[scan->cl]->rf[scan->n++];
+}
+
+
+/* returns ymz. xmz is also output value */
+double lwpr_aux_update_means(LWPR_ReceptiveField *RF, const double *x, double y, double w, double *xmz) {
+   int i;
+   int nIn = RF->model->nIn;
+   double swl = RF->sum_w[0] * RF->lambda[0];
+   double invFac = 1.0/(swl + w);
+
+   for (i=0;i<nIn;i++) {
+      double mx = RF->mean_x[i];
+      mx = RF->mean_x[i] = (swl * mx + w*x[i])*invFac;
+      mx = xmz[i] = x[i] - mx;
+      RF->var_x[i] = (swl * RF->var_x[i] + w*mx*mx)*invFac;
+   }
+   RF->beta0 = (swl * RF->beta0 + w*y)*invFac;
+   return (y-RF->beta0);
+}
+
+
+void lwpr_aux_compute_projection_r(int nIn, int nInS, int nReg,
+      double *s, double *xres, const double *x, const double *U, const double *P) {
+
+   int i,j;
+   double sj;
+
+   for (i=0;i<nIn;i++) xres[i] = x[i];
+   for (j=0;j<nReg-1;j++) {
+      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xres + j*nInS, nIn);
+      for (i=0;i<nIn;i++) {
+         xres[i + (j+1)*nInS] = xres[i + j*nInS] - P[i+j*nInS]*sj;
+      }
+   }
+   s[nReg-1] = lwpr_math_dot_product(U+(nReg-1)*nInS, xres + (nReg-1)*nInS, nIn);
+}
+
+
+void lwpr_aux_compute_projection(int nIn, int nInS, int nReg,
+      double *s, const double *x, const double *U, const double *P, LWPR_Workspace *WS) {
+
+   int i,j;
+   double sj;
+   double *xu = WS->xu;
+
+   for (i=0;i<nIn;i++) xu[i] = x[i];
+
+   for (j=0;j<nReg-1;j++) {
+      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xu, nIn);
+      /* for (i=0;i<nIn;i++) xu[i] -= P[i+j*nInS]*sj; */
+      lwpr_math_add_scalar_vector(xu,-sj,P+j*nInS, nIn);
+   }
+   s[nReg-1]=lwpr_math_dot_product(U+(nReg-1)*nInS, xu, nIn);
+}
+
+void lwpr_aux_compute_projection_d(int nIn, int nInS, int nReg,
+      double *s, double *dsdx, const double *x, const double *U, const double *P, LWPR_Workspace *WS) {
+
+   int i,j;
+   double sj;
+   double *xu = WS->xu;
+   double *dxdx = WS->dwdM;  /* it's also an nIns x nIn matrix */
+
+   memset(dxdx,0,nInS*nIn*sizeof(double));
+   for (i=0;i<nIn;i++) xu[i] = x[i];
+   for (i=0;i<nIn;i++) dxdx[i+i*nInS] = 1.0;
+
+   for (j=0;j<nReg-1;j++) {
+      s[j] = sj = lwpr_math_dot_product(U+j*nInS, xu, nIn);
+
+      /* dsdx(:,j) = dxdx * U(:,j); */
+      lwpr_math_scalar_vector(dsdx + j*nInS, U[j*nInS], dxdx, nIn);
+      for (i=1;i<nIn;i++) {
+         lwpr_math_add_scalar_vector(dsdx + j*nInS, U[i+j*nInS], dxdx + i*nInS, nIn);
+      }
+      /* for (i=0;i<nIn;i++) xu[i] -= P[i+j*nInS]*sj; */
+      lwpr_math_add_scalar_vector(xu,-sj,P+j*nInS,nIn);
+
+      /* dxdx = dxdx - dsdx(:,j) * P(:,j)'; */
+      for (i=0;i<nIn;i++) {
+         lwpr_math_add_scalar_vector(dxdx + i*nInS, -P[i+j*nInS], dsdx + j*nInS, nIn);
+      }
+   }
+   j=nReg-1;
+   s[j]=lwpr_math_dot_product(U+j*nInS, xu, nIn);
+   lwpr_math_scalar_vector(dsdx + j*nInS, U[j*nInS], dxdx, nIn);
+   for (i=1;i<nIn;i++) {
+      lwpr_math_add_scalar_vector(dsdx + j*nInS, U[i+j*nInS], dxdx + i*nInS, nIn);
+   }
+}
+
+void lwpr_aux_compute_projection_adjoint(int nIn, int nInS, int nReg,
+      double *g, const double *beta, const double *U, const double *P) {
+   int j;
+
+   /* s[j] = U(:,j)'*xu_j with xu_{j+1} = xu_j - s[j]*P(:,j), so going backwards
+   ** g_j = g_{j+1} + (beta[j] - P(:,j)'*g_{j+1}) * U(:,j)
+   */
+   lwpr_math_scalar_vector(g, beta[nReg-1], U+(nReg-1)*nInS, nIn);
+   for (j=nReg-2;j>=0;j--) {
+      double a = beta[j] - lwpr_math_dot_product(P+j*nInS, g, nIn);
+      lwpr_math_add_scalar_vector(g, a, U+j*nInS, nIn);
+   }
+}
+
+void lwpr_aux_update_regression(LWPR_ReceptiveField *RF, double *yp, double *e_cv_R, double *e,
+   const double *x, double y, double w, LWPR_Workspace *WS) {
+
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   int nReg = RF->nReg;
+
+   double *yres = WS->yres;
    double *ytarget = WS->ytarget;
    double *e_cv = WS->e_cv;
    double *xres = WS->xres;
@@ -763,6 +1769,58 @@ int lwpr_aux_check_add_projection(LWPR_ReceptiveField *RF) {
    }
 }
 
+int lwpr_aux_prune_projections(LWPR_ReceptiveField *RF, double threshold, double *flops_predict, double *flops_update) {
+   int nIn = RF->model->nIn;
+   int nReg = RF->nReg;
+   int nInS = RF->model->nInStore;
+   int nRegMin = (nIn>1) ? 2:1;
+   int nRegStore;
+   double total = 0.0;
+   int i,j;
+
+   for (i=0;i<nReg;i++) {
+      total += RF->beta[i]*RF->beta[i]*RF->SSs2[i]/RF->sum_w[i];
+   }
+
+   while (nReg > nRegMin) {
+      double contrib = RF->beta[nReg-1]*RF->beta[nReg-1]*RF->SSs2[nReg-1]/RF->sum_w[nReg-1];
+      double mse_n_reg = RF->sum_e_cv2[nReg-1] / RF->sum_w[nReg-1] + 1e-10;
+      double mse_n_reg_1 = RF->sum_e_cv2[nReg-2] / RF->sum_w[nReg-2] + 1e-10;
+
+      if (contrib >= threshold*total || mse_n_reg_1 > (1.0+threshold)*mse_n_reg) break;
+      nReg--;
+   }
+
+   /* Per axis: compute_projection costs ~4N, plus 2 for the regression, during prediction.
+   ** lwpr_aux_update_regression visits each axis with ~18N + 21 operations */
+   if (flops_predict!=NULL) *flops_predict = (double) (RF->nReg - nReg) * (4.0*nIn + 2.0);
+   if (flops_update!=NULL) *flops_update = (double) (RF->nReg - nReg) * (18.0*nIn + 21.0);
+
+   if (nReg == RF->nReg) return 0;
+
+   /* lwpr_aux_check_add_projection re-grows into the unused slots and expects them to be
+   ** zero, as after lwpr_mem_alloc_rf. The storage below is not always reallocated. */
+   for (j=nReg;j<RF->nRegStore;j++) {
+      memset(RF->SXresYres + j*nInS, 0, nInS*sizeof(double));
+      memset(RF->SSXres + j*nInS, 0, nInS*sizeof(double));
+      memset(RF->U + j*nInS, 0, nInS*sizeof(double));
+      memset(RF->P + j*nInS, 0, nInS*sizeof(double));
+      RF->beta[j] = RF->SSs2[j] = RF->SSYres[j] = RF->H[j] = RF->r[j] = 0.0;
+      RF->sum_w[j] = RF->sum_e_cv2[j] = RF->n_data[j] = RF->lambda[j] = RF->s[j] = 0.0;
+   }
+
+   i = RF->nReg - nReg;
+   RF->nReg = nReg;
+   RF->slopeReady = 0;
+
+   /* Keep nRegStore even for alignment reasons; if shrinking fails, the RF is still valid */
+   nRegStore = (nReg&1) ? nReg+1 : nReg;
+   if (nRegStore < LWPR_REGSTORE) nRegStore = LWPR_REGSTORE;
+   if (nRegStore < RF->nRegStore) (void) lwpr_mem_realloc_rf(RF, nRegStore);
+
+   return i;
+}
+
 int lwpr_aux_init_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, const LWPR_ReceptiveField *RFT, const double *xc, double y) {
    int i,j,nReg, nRegStore;
    int nIn = model->nIn;
@@ -773,9 +1831,21 @@ int lwpr_aux_init_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, const LWP
       nRegStore = (nReg > LWPR_REGSTORE) ? nReg : LWPR_REGSTORE;
       if (!lwpr_mem_alloc_rf(RF, model, nReg, nRegStore)) return 0;
 
-      memcpy(RF->D, model->init_D, nInS*nIn*sizeof(double));
-      memcpy(RF->M, model->init_M, nInS*nIn*sizeof(double));
-      memcpy(RF->alpha, model->init_alpha, nInS*nIn*sizeof(double));
+      if (model->rank > 0) {
+         /* Start from the diagonal of init_D, 1% of which is put into L(i,i%rank) so
+            that the gradient with respect to L does not vanish */
+         for (i=0;i<nIn;i++) {
+            double D_ii = model->init_D[i+i*nInS];
+            RF->L[i] = sqrt(0.99*D_ii);
+            RF->L[i+(1+i%model->rank)*nInS] = sqrt(0.01*D_ii);
+            for (j=0;j<=model->rank;j++) RF->alpha[i+j*nInS] = model->init_alpha[i+i*nInS];
+         }
+      } else {
+         lwpr_aux_pack_metric(model, model->init_D, RF->D);
+         lwpr_aux_pack_metric(model, model->init_M, RF->M);
+         lwpr_aux_pack_metric(model, model->init_alpha, RF->alpha);
+         RF->DReady = 1;
+      }
       RF->beta0 = y;
    } else {
       nReg = RFT->nReg;
@@ -783,9 +1853,15 @@ int lwpr_aux_init_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, const LWP
 
       if (!lwpr_mem_alloc_rf(RF, model, nReg, nRegStore)) return 0;
 
-      memcpy(RF->D, RFT->D, nInS*nIn*sizeof(double));
-      memcpy(RF->M, RFT->M, nInS*nIn*sizeof(double));
-      memcpy(RF->alpha, RFT->alpha, nInS*nIn*sizeof(double));
+      if (model->rank > 0) {
+         memcpy(RF->L, RFT->L, nInS*(model->rank+1)*sizeof(double));
+         memcpy(RF->alpha, RFT->alpha, nInS*(model->rank+1)*sizeof(double));
+      } else {
+         memcpy(RF->D, RFT->D, model->nMetric*sizeof(double));
+         memcpy(RF->M, RFT->M, model->nMetric*sizeof(double));
+         memcpy(RF->alpha, RFT->alpha, model->nMetric*sizeof(double));
+         RF->DReady = RFT->DReady;
+      }
       RF->beta0 = RFT->beta0;
    }
    /* lwpr_mem_alloc_rf has initialised all elements to zero */
@@ -805,9 +1881,11 @@ int lwpr_aux_init_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, const LWP
       RF->n_data[i] = 1e-10;
       RF->lambda[i] = model->init_lambda;
    }
-   for (j=0;j<nIn;j++) {
-      for (i=0;i<=j;i++) {
-         RF->b[i+j*nInS] = log(RF->alpha[i+j*nInS] + 1e-10);
+   if (RF->b != NULL) {
+      for (j=0;j<nIn;j++) {
+         for (i=model->block_begin[j];i<=j;i++) {
+            RF->b[i+model->metric_col[j]] = log(RF->alpha[i+model->metric_col[j]] + 1e-10);
+         }
       }
    }
    return 1;
@@ -829,46 +1907,211 @@ void lwpr_aux_update_model_stats(LWPR_Model *model, const double *x) {
    }
 }
 
+void lwpr_aux_project_input(const LWPR_Model *model, const double *x, double *z) {
+   const double *P = model->proj_P;
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int j;
 
+   for (j=0;j<nIn;j++) z[j] = 0.0;
+   for (j=0;j<model->nInRaw;j++) {
+      if (x[j] != 0.0) lwpr_math_add_scalar_vector(z, x[j], P + j*nInS, nIn);
+   }
+}
 
-void *lwpr_aux_update_one_T(void *ptr) {
-   LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
-   LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
-   LWPR_Workspace *WS = TD->ws;
-   const LWPR_Model *model = TD->model;
+void lwpr_aux_normalise_input(const LWPR_Model *model, const double *x, double *xn) {
+   int i;
 
-   int i,j,n,nIn,nInS;
-   double *xc;
-   double e,e_cv;
+   if (model->proj_P != NULL) {
+      lwpr_aux_project_input(model, x, xn);
+      for (i=0;i<model->nIn;i++) xn[i]/=model->norm_in[i];
+   } else {
+      for (i=0;i<model->nIn;i++) xn[i]=x[i]/model->norm_in[i];
+   }
+}
 
-   double ymz;
+void lwpr_aux_update_projection(LWPR_Model *model, const double *x) {
+   int nRaw = model->nInRaw;
+   double *mx = model->proj_mean;
+   double *C = model->proj_cov;
+   double *d = lwpr_aux_projection_temp(model);
+   double n = (double) model->n_data;
+   double invN1 = 1.0/(n + 1.0);
+   int i,j;
 
-   double w, w_sec = 0.0, w_max = 0.0;
-   int ind = -1, ind_sec = -1, ind_max = -1;
-   double yp = 0.0, yp_n;
+   for (i=0;i<nRaw;i++) {
+      d[i] = x[i] - mx[i];
+      mx[i] += d[i]*invN1;
+   }
+   /* C <- (n*C + n/(n+1)*d*d') / (n+1), where d is taken w.r.t. the old mean */
+   for (j=0;j<nRaw;j++) {
+      lwpr_math_scale_add_scalar_vector(n*invN1, C + j*nRaw, n*invN1*invN1*d[j], d, nRaw);
+   }
 
-   double sum_w = 0.0;
+   if (model->proj_interval > 0 && (model->n_data + 1) % model->proj_interval == 0) {
+      (void) lwpr_aux_refine_projection(model);
+   }
+}
 
-   double dwdq,ddwdqdq;
-
-   nIn = TD->model->nIn;
-   nInS = TD->model->nInStore;
+int lwpr_aux_refine_projection(LWPR_Model *model) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nRaw = model->nInRaw;
+   double *P = model->proj_P;
+   const double *C = model->proj_cov;
+   double *W = lwpr_aux_projection_temp(model);
+   int i,j,r;
+
+   /* W = C*P', i.e. column r of W is C times row r of P */
+   for (r=0;r<nIn;r++) {
+      double *w = W + r*nRaw;
+      for (i=0;i<nRaw;i++) w[i] = 0.0;
+      for (j=0;j<nRaw;j++) {
+         if (P[r+j*nInS] != 0.0) lwpr_math_add_scalar_vector(w, P[r+j*nInS], C + j*nRaw, nRaw);
+      }
+   }
 
-   xc = WS->xc;
+   /* Modified Gram-Schmidt on the columns of W. Directions the covariance
+   ** does not (yet) support fall back to the current rows of P */
+   for (r=0;r<nIn;r++) {
+      double *w = W + r*nRaw;
+      double norm0 = lwpr_math_norm2(w, nRaw);
+      double norm = 0.0;
+      int attempt;
+
+      for (attempt=0;attempt<2;attempt++) {
+         for (i=0;i<r;i++) {
+            double dp = lwpr_math_dot_product(w, W + i*nRaw, nRaw);
+            lwpr_math_add_scalar_vector(w, -dp, W + i*nRaw, nRaw);
+         }
+         norm = lwpr_math_norm2(w, nRaw);
+         if (norm0 > 0.0 && norm > 1e-20*norm0) break;
 
-   for (n=TD->start;n<TD->end;n+=TD->incr) {
+         for (j=0;j<nRaw;j++) w[j] = P[r+j*nInS];
+         norm0 = 1.0;
+      }
+      if (attempt == 2) return 0;
+      lwpr_math_scalar_vector(w, 1.0/sqrt(norm), w, nRaw);
+   }
 
-      double dist = 0.0;
-      LWPR_ReceptiveField *RF = sub->rf[n];
+   for (j=0;j<nRaw;j++) {
+      for (r=0;r<nIn;r++) P[r+j*nInS] = W[j + r*nRaw];
+   }
+   return 1;
+}
 
+void lwpr_aux_unproject_J(const LWPR_Model *model, const double *Jz, double *J) {
+   const double *P = model->proj_P;
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nOut = model->nOut;
+   int i,j,k;
+
+   for (j=0;j<model->nInRaw;j++) {
+      for (i=0;i<nOut;i++) {
+         double sum = 0.0;
+         for (k=0;k<nIn;k++) sum += Jz[i+k*nOut]*P[k+j*nInS];
+         J[i+j*nOut] = sum;
+      }
+   }
+}
 
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
+void lwpr_aux_unproject_H(const LWPR_Model *model, const double *Hz, double *H) {
+   const double *P = model->proj_P;
+   double *T = lwpr_aux_projection_temp(model);
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nRaw = model->nInRaw;
+   int i,j,k;
+
+   for (i=0;i<model->nOut;i++) {
+      const double *Hzi = Hz + i*nIn*nIn;
+      double *Hi = H + i*nRaw*nRaw;
+
+      /* T = Hz_i * P, then H_i = P' * T */
+      for (j=0;j<nRaw;j++) {
+         double *t = T + j*nIn;
+         for (k=0;k<nIn;k++) t[k] = 0.0;
+         for (k=0;k<nIn;k++) lwpr_math_add_scalar_vector(t, P[k+j*nInS], Hzi + k*nIn, nIn);
       }
+      for (j=0;j<nRaw;j++) {
+         for (k=0;k<nRaw;k++) {
+            Hi[k+j*nRaw] = lwpr_math_dot_product(P + k*nInS, T + j*nIn, nIn);
+         }
+      }
+   }
+}
 
-      for (j=0;j<nIn;j++) {
-         dist += xc[j] * lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
+double *lwpr_aux_projection_temp(const LWPR_Model *model) {
+   /* Behind the reduced Jacobians (2 x nOut x nIn) and Hessians (nOut x nIn x nIn) */
+   return model->proj_work + model->nIn*model->nOut*(model->nIn + 2);
+}
+
+int lwpr_aux_gate_sample(const LWPR_Model *model, const double *xn, const double *yn, double *yp, double *max_w) {
+   LWPR_ThreadData TD;
+   int i, novel = 0;
+
+   TD.model = model;
+   TD.xn = xn;
+   TD.ws = &model->ws[0];
+   TD.cutoff = 0.0;
+
+   for (i=0;i<model->nOut;i++) {
+      TD.dim = i;
+      (void) lwpr_aux_predict_conf_one_T(&TD);
+      if (max_w!=NULL) max_w[i]=TD.w_max;
+      if (yp!=NULL) yp[i]=TD.yn * model->norm_out[i];
+
+      /* No trustworthy RF yet, or an RF would have to be added */
+      if (TD.w_max <= model->w_gen || TD.w_sec >= 1e20) {
+         novel = 1;
+      } else if (fabs(yn[i] - TD.yn) >= model->gate_factor * TD.w_sec) {
+         novel = 1;
       }
+   }
+   return novel;
+}
+
+
+void *lwpr_aux_update_one_T(void *ptr) {
+   LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
+   LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
+   LWPR_Workspace *WS = TD->ws;
+   const LWPR_Model *model = TD->model;
+
+   int i,n;
+   double *xc;
+   double qmax, w_min;
+   double e,e_cv;
+
+   double ymz;
+
+   double w, w_sec = 0.0, w_max = 0.0;
+   int ind = -1, ind_sec = -1, ind_max = -1;
+   double yp = 0.0, yp_n;
+
+   double sum_w = 0.0;
+
+   double dwdq,ddwdqdq;
+
+   /* xc is kept intact until the distance metric update */
+   xc = WS->dx;
+
+   /* Activations below all of the thresholds for updating, for adding RFs
+   ** (w_max, and w_max used as a template) and for pruning (w_sec) can be skipped */
+   w_min = 0.001;
+   if (0.1*model->w_gen < w_min) w_min = 0.1*model->w_gen;
+   if (model->w_prune < w_min) w_min = model->w_prune;
+   qmax = lwpr_aux_cutoff_distance(model->kernel, w_min);
+
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   for (n=TD->start;n<TD->end;n+=TD->incr) {
+
+      double dist;
+      LWPR_ReceptiveField *RF = sub->rf[n];
+
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, WS->Mx, NULL, &dist)) continue;
+
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
             w = exp(-0.5*dist);
@@ -907,11 +2150,26 @@ void *lwpr_aux_update_one_T(void *ptr) {
 
       if (w>0.001) {
          double transmul;
+         /* Activation weighted with the importance of the sample, for the local statistics */
+         double wi = w*TD->weight;
+
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_REGRESSION);
+         if (RF->ckpt) lwpr_checkpoint_preserve(model, RF);
+         if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
+         if (model->conc != NULL) lwpr_conc_write_begin(&RF->seq);
 
          RF->w = w;
+         RF->w_stamp = TD->stamp;
+         RF->dirty |= LWPR_DELTA_STATS;
 
-         ymz = lwpr_aux_update_means(RF,TD->xn,TD->yn,w,WS->xmz);
-         lwpr_aux_update_regression(RF, &yp_n, &e_cv, &e, WS->xmz, ymz,w, WS);
+         ymz = lwpr_aux_update_means(RF,TD->xn,TD->yn,wi,WS->xmz);
+         lwpr_aux_update_regression(RF, &yp_n, &e_cv, &e, WS->xmz, ymz,wi, WS);
+
+         /* e_cv stems from the regression before this update */
+         if (model->mon_decay > 0.0) {
+            RF->mon_sum_e2 = model->mon_decay*RF->mon_sum_e2 + wi*e_cv*e_cv;
+            RF->mon_sum_w = model->mon_decay*RF->mon_sum_w + wi;
+         }
 
          if (RF->trustworthy) {
             yp += w*yp_n;
@@ -919,19 +2177,24 @@ void *lwpr_aux_update_one_T(void *ptr) {
          }
 
          if (model->update_D) {
-            transmul = lwpr_aux_update_distance_metric(RF, w, dwdq, ddwdqdq, e_cv, e, TD->xn, WS);
+            LWPR_PROF_PHASE(TD, LWPR_PHASE_METRIC);
+            RF->dirty |= LWPR_DELTA_METRIC;
+            transmul = lwpr_aux_update_distance_metric(RF, wi, dwdq*TD->weight, ddwdqdq*TD->weight,
+                  e_cv, e, xc, WS->Mx, WS);
+            LWPR_PROF_PHASE(TD, LWPR_PHASE_REGRESSION);
          }
 
          lwpr_aux_check_add_projection(RF);
 
          for (i=0;i<RF->nReg;i++) {
-            RF->n_data[i] = RF->n_data[i] * RF->lambda[i] + 1;
+            RF->n_data[i] = RF->n_data[i] * RF->lambda[i] + TD->weight;
             RF->lambda[i] = model->tau_lambda * RF->lambda[i] + model->final_lambda*(1.0-model->tau_lambda);
          }
-      } else {
-         RF->w = 0.0;
+         if (model->conc != NULL) lwpr_conc_write_end(&RF->seq);
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
       }
    }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
 
    TD->w_max = w_max;
    TD->ind_max = ind_max;
@@ -944,56 +2207,121 @@ void *lwpr_aux_update_one_T(void *ptr) {
 
 int lwpr_aux_update_one_add_prune(LWPR_Model *model, LWPR_ThreadData *TD, int dim, const double *xn, double yn) {
    LWPR_SubModel *sub = &model->sub[dim];
+   int ok;
 
-   if (TD->w_max <= model->w_gen) {
-      LWPR_ReceptiveField *RF = lwpr_aux_add_rf(sub,0);
+   if (model->conc == NULL) return lwpr_aux_add_prune(model, TD, dim, xn, yn);
 
-      /* Receptive field could not be allocated. The LWPR model is still
-         valid, but return "0" to indicate this */
-      if (RF == NULL) return 0;
+   /* Concurrent readers repeat a pass over the RFs that overlaps this */
+   lwpr_conc_write_begin(&sub->seq);
+   ok = lwpr_aux_add_prune(model, TD, dim, xn, yn);
+   lwpr_conc_write_end(&sub->seq);
+   return ok;
+}
 
-      if ((TD->w_max > 0.1*model->w_gen) && (sub->rf[TD->ind_max]->trustworthy)) {
-         return lwpr_aux_init_rf(RF,model,sub->rf[TD->ind_max], xn, yn);
-      }
-      return lwpr_aux_init_rf(RF,model,NULL, xn, yn);
-   }
+int lwpr_aux_new_rf(LWPR_Model *model, int dim, const LWPR_ReceptiveField *RFT, const double *xn, double yn, double *scratch) {
+   LWPR_SubModel *sub = &model->sub[dim];
+   LWPR_ReceptiveField *RF = lwpr_aux_add_rf(sub,0);
 
-   /* Prune ReceptiveFields */
-   if (TD->w_sec > model->w_prune) {
-      double tr_max = 0.0, tr_sec = 0.0;
-      int i,prune;
-      for (i=0;i<model->nIn;i++) {
-         /*
-         tr_max += lwpr_math_norm2(sub->rf[TD->ind_max]->M + i*model->nInStore, model->nIn);
-         tr_sec += lwpr_math_norm2(sub->rf[TD->ind_sec]->M + i*model->nInStore, model->nIn);
-         */
-         /* code for just comparing the traces of D */
-         tr_max += sub->rf[TD->ind_max]->D[i+i*model->nInStore];
-         tr_sec += sub->rf[TD->ind_sec]->D[i+i*model->nInStore];
-      }
-      /* TODO: ORIGINAL LOGIC WAS REVERSED -- CHECK */
-      prune = (tr_max < tr_sec) ? TD->ind_max : TD->ind_sec;
+   /* Receptive field could not be allocated. The LWPR model is still
+      valid, but return "0" to indicate this */
+   if (RF == NULL) return 0;
+
+   if (!lwpr_aux_init_rf(RF,model,RFT, xn, yn)) return 0;
+   if (model->conc != NULL) lwpr_conc_write_end(&RF->seq);
+   if (model->repl != NULL) lwpr_repl_note_add(model->repl, dim);
+   /* If no memory is left for clusters, the SubModel falls back to scanning all RFs */
+   if (sub->clusters != NULL) return lwpr_aux_cluster_insert(sub, RF, scratch);
+   return 1;
+}
+
+int lwpr_aux_prune_choice(const LWPR_SubModel *sub, int ind_max, int ind_sec) {
+   double tr_max, tr_sec;
+   /* code for just comparing the traces of D */
+   tr_max = lwpr_aux_trace_D(sub->rf[ind_max]);
+   tr_sec = lwpr_aux_trace_D(sub->rf[ind_sec]);
+   /* TODO: ORIGINAL LOGIC WAS REVERSED -- CHECK */
+   return (tr_max < tr_sec) ? ind_max : ind_sec;
+}
 
+void lwpr_aux_remove_rf(LWPR_Model *model, int dim, int prune) {
+   LWPR_SubModel *sub = &model->sub[dim];
+
+   if (sub->rf[prune]->ckpt) lwpr_checkpoint_preserve(model, sub->rf[prune]);
+   if (model->repl != NULL) lwpr_repl_note_prune(model->repl, dim, prune);
+   if (sub->rf[prune]->cluster != NULL) lwpr_aux_cluster_remove(sub, sub->rf[prune]);
+   if (model->conc != NULL) {
+      lwpr_conc_retire(model->conc, sub->rf[prune], lwpr_conc_release_rf);
+   } else {
       lwpr_mem_free_rf(sub->rf[prune]);
       LWPR_FREE(sub->rf[prune]);
+   }
 
-      if (prune < sub->numRFS-1) {
-         /* Fill the gap with last RF (we just move around the pointer) */
-         sub->rf[prune] = sub->rf[sub->numRFS-1];
-      }
-      sub->numRFS--;
-      sub->n_pruned++;
+   if (prune < sub->numRFS-1) {
+      /* Fill the gap with last RF (we just move around the pointer) */
+      sub->rf[prune] = sub->rf[sub->numRFS-1];
+      lwpr_aux_index_note(sub, prune);
+   }
+   sub->numRFS--;
+   sub->n_pruned++;
+
+   /* printf("Output %d, pruned RF %d\n",dim+1,prune+1); */
+}
+
+int lwpr_aux_add_prune(LWPR_Model *model, LWPR_ThreadData *TD, int dim, const double *xn, double yn) {
+   LWPR_SubModel *sub = &model->sub[dim];
+
+   if (TD->w_max <= model->w_gen) {
+      const LWPR_ReceptiveField *RFT = NULL;
 
-      /* printf("Output %d, pruned RF %d\n",dim+1,prune+1); */
+      if ((TD->w_max > 0.1*model->w_gen) && (sub->rf[TD->ind_max]->trustworthy)) RFT = sub->rf[TD->ind_max];
+      return lwpr_aux_new_rf(model, dim, RFT, xn, yn, TD->ws->xc);
+   }
+
+   /* Prune ReceptiveFields */
+   if (TD->w_sec > model->w_prune) {
+      lwpr_aux_remove_rf(model, dim, lwpr_aux_prune_choice(sub, TD->ind_max, TD->ind_sec));
    }
 
    return 1;
 }
 
-int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn, double yn, double *y_pred, double *max_w) {
-   LWPR_ThreadData TD[NUM_THREADS];
+void lwpr_aux_combine_threads(LWPR_ThreadData *TD, int num) {
    int i;
 
+   for (i=1;i<num;i++) {
+      TD[0].sum_w += TD[i].sum_w;
+      TD[0].yp += TD[i].yp;
+      if (TD[i].w_max > TD[0].w_max) {
+         if (TD[i].w_sec > TD[0].w_max) {
+            /* if TD[i].w_sec > "old" w_max, then we have
+               TD[i].w_max and TD[i].w_sec as new largest two values */
+            TD[0].w_max = TD[i].w_max;
+            TD[0].ind_max = TD[i].ind_max;
+            TD[0].w_sec = TD[i].w_sec;
+            TD[0].ind_sec = TD[i].ind_sec;
+         } else {
+            /* TD[i].w_max > "old" w_max, but TD[i].w_sec is not, that is,
+               TD[i].w_max and "old" w_max are now the largest two */
+            TD[0].w_sec = TD[0].w_max;
+            TD[0].ind_sec = TD[0].ind_max;
+            TD[0].w_max = TD[i].w_max;
+            TD[0].ind_max = TD[i].ind_max;
+         }
+      } else {
+         /* "old" w_sec < TD[i].w_max < "old" w_max, that is,
+             TD[i].w_max gets "new" w_sec */
+         if (TD[i].w_max > TD[0].w_sec) {
+            TD[0].w_sec = TD[i].w_max;
+            TD[0].ind_sec = TD[i].ind_max;
+         }
+      }
+   }
+}
+
+int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn, double yn, double *y_pred, double *max_w, LWPR_Workspace *ws) {
+   LWPR_ThreadData TD[NUM_THREADS];
+   int i,ok;
+
 #if NUM_THREADS > 1
    #ifdef WIN32
       HANDLE thread[NUM_THREADS-1];
@@ -1012,10 +2340,14 @@ int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn, double yn,
       TD[i].incr = NUM_THREADS;
       TD[i].start = i;
       TD[i].end = model->sub[dim].numRFS;
-      TD[i].ws = &model->ws[i];
+      TD[i].ws = (ws != NULL) ? ws : &model->ws[i];
+      TD[i].stamp = model->n_updates;
+      TD[i].weight = model->gate_weight;
    }
 
 #if NUM_THREADS > 1
+   /* With a given workspace, the slices run one after another in this thread */
+   if (ws == NULL) {
    #ifdef WIN32
       for (i=0;i<NUM_THREADS-1;i++) {
          thread[i] = CreateThread(NULL,0,lwpr_aux_update_one_T,&TD[i],0, &ID[i]);
@@ -1025,6 +2357,7 @@ int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn, double yn,
          rc[i] = pthread_create(&thread[i], NULL, lwpr_aux_update_one_T, &TD[i]);
       }
    #endif
+   }
 #endif
 
    (void) lwpr_aux_update_one_T(&TD[NUM_THREADS-1]);
@@ -1034,7 +2367,7 @@ int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn, double yn,
    ** couldn't be spawned in the first place */
    #ifdef WIN32
       for (i=0;i<NUM_THREADS-1;i++) {
-         if (thread[i]!=NULL) {
+         if (ws == NULL && thread[i]!=NULL) {
             WaitForSingleObject(thread[i],INFINITE);
             CloseHandle(thread[i]);
          } else {
@@ -1043,7 +2376,7 @@ int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn, double yn,
       }
    #else
       for (i=0;i<NUM_THREADS-1;i++) {
-         if (rc[i]==0) {
+         if (ws == NULL && rc[i]==0) {
             pthread_join(thread[i],NULL);
          } else {
             (void) lwpr_aux_update_one_T(&TD[i]);
@@ -1051,260 +2384,591 @@ int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn, double yn,
       }
    #endif
 
-   /* Accumulate statistics in TD[0] */
+   lwpr_aux_combine_threads(TD, NUM_THREADS);
+#endif
 
-   for (i=1;i<NUM_THREADS;i++) {
-      TD[0].sum_w += TD[i].sum_w;
-      TD[0].yp += TD[i].yp;
-      if (TD[i].w_max > TD[0].w_max) {
-         if (TD[i].w_sec > TD[0].w_max) {
-            /* if TD[i].w_sec > "old" w_max, then we have
-               TD[i].w_max and TD[i].w_sec as new largest two values */
-            TD[0].w_max = TD[i].w_max;
-            TD[0].ind_max = TD[i].ind_max;
-            TD[0].w_sec = TD[i].w_sec;
-            TD[0].ind_sec = TD[i].ind_sec;
+   if (TD[0].sum_w > 0.0) {
+      *y_pred = TD[0].yp/TD[0].sum_w;
+   } else {
+      *y_pred = 0.0;
+   }
+
+   /* No receptive field was updated if none was above the threshold, so their
+   ** activations are still the ones the sample saw */
+   if (max_w != NULL) *max_w = lwpr_aux_max_activation(model, dim, xn, TD[0].w_max,
+         0, model->sub[dim].numRFS, 1, TD[0].ws->dx);
+
+   LWPR_PROF_PHASE(&TD[0], LWPR_PHASE_ADD_PRUNE);
+   ok = lwpr_aux_update_one_add_prune(model, &TD[0], dim, xn, yn);
+   LWPR_PROF_PHASE(&TD[0], LWPR_PHASE_NONE);
+   return ok;
+}
+
+
+
+/* A note to developers:  lwpr_aux_predict_one_T and lwpr_aux_predict_conf_one_T
+** are very similar, and one might wonder why we need two functions.
+** This is done for efficieny. Without confidence bounds, we also might
+** be able to use readily calculated slopes instead of doing PLS.
+**
+** Also, please note the difference between threaded updates and predictions:
+** The threaded predict-functions are designed to operate on whole submodels,
+** whereas the updates break up submodels into multiple threads. Therefore,
+** univariate LWPR models (single SubModel) cannot be predicted faster when
+** using threads, but the updates might get faster.
+** The design rationale was that predictions are fast, and therefore the
+** overhead of creating multiple threads per submodel is significant.
+** On the other hand, updates are rather slow, and we wish to speed up
+** also models with univariate outputs.
+*/
+void *lwpr_aux_predict_one_T(void *ptr) {
+   LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
+   LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
+   LWPR_Workspace *WS = TD->ws;
+   int i;
+   int nIn=TD->model->nIn;
+   int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
+
+   double *xc = WS->xc;
+   double *s = WS->s;
+
+   double w;
+
+   double yp = 0.0;
+
+   double sum_w = 0.0;
+
+   TD->w_max = 0.0;
+
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
+
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, NULL, WS->xu, &dist)) continue;
+
+      switch(TD->model->kernel) {
+         case LWPR_GAUSSIAN_KERNEL:
+            w = exp(-0.5*dist);
+            break;
+         case LWPR_BISQUARE_KERNEL:
+            w = 1-0.25*dist;
+            w = (w<0) ? 0 : w*w;
+            break;
+         default:
+            w = 0.0;
+      }
+
+      if (w > TD->w_max) {
+         TD->w_max = w;
+      }
+
+      if (w > TD->cutoff && RF->trustworthy) {
+         double yp_n = RF->beta0;
+
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
+         for (i=0;i<nIn;i++) {
+            xc[i] = TD->xn[i] - RF->mean_x[i];
+         }
+
+         if (RF->slopeReady) {
+            yp_n += lwpr_math_dot_product(xc, RF->slope, nIn);
          } else {
-            /* TD[i].w_max > "old" w_max, but TD[i].w_sec is not, that is,
-               TD[i].w_max and "old" w_max are now the largest two */
-            TD[0].w_sec = TD[0].w_max;
-            TD[0].ind_sec = TD[0].ind_max;
-            TD[0].w_max = TD[i].w_max;
-            TD[0].ind_max = TD[i].ind_max;
+            int nR = RF->nReg;
+
+            if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
+            if (RF->n_data[nR-1] <= 2*nIn) nR--;
+
+            lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
+
+            for (i=0;i<nR;i++) {
+               yp_n+=s[i]*RF->beta[i];
+            }
          }
-      } else {
-         /* "old" w_sec < TD[i].w_max < "old" w_max, that is,
-             TD[i].w_max gets "new" w_sec */
-         if (TD[i].w_max > TD[0].w_sec) {
-            TD[0].w_sec = TD[i].w_max;
-            TD[0].ind_sec = TD[i].ind_max;
+
+         yp += w*yp_n;
+         sum_w += w;
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+      }
+   }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
+   if (sum_w > 0.0) yp/=sum_w;
+   TD->yn = yp;
+
+   return NULL;
+}
+
+
+void *lwpr_aux_predict_conf_one_T(void *ptr) {
+   LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
+   LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
+   LWPR_Workspace *WS = TD->ws;
+   int i;
+   int nIn=TD->model->nIn;
+   int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
+
+   double *xc = WS->xc;
+   double *s = WS->s;
+
+   double w;
+
+
+   double sum_w = 0.0;
+   double sum_wyy = 0.0;
+   double sum_conf = 0.0;
+
+   TD->w_max = 0.0;
+   TD->yn = 0.0;
+
+   /* Prediction and confidence bounds in one go */
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
+
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, NULL, WS->xu, &dist)) continue;
+
+      switch(TD->model->kernel) {
+         case LWPR_GAUSSIAN_KERNEL:
+            w = exp(-0.5*dist);
+            break;
+         case LWPR_BISQUARE_KERNEL:
+            w = 1-0.25*dist;
+            w = (w<0) ? 0 : w*w;
+            break;
+         default:
+            w = 0.0;
+      }
+
+      if (w > TD->w_max) {
+         TD->w_max = w;
+      }
+
+      if (w > TD->cutoff && RF->trustworthy) {
+         double yp_n = RF->beta0;
+         double sigma2 = 0.0;
+         int nR = RF->nReg;
+
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
+         if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
+         if (RF->n_data[nR-1] <= 2*nIn) nR--;
+
+         for (i=0;i<nIn;i++) {
+            xc[i] = TD->xn[i] - RF->mean_x[i];
+         }
+         lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
+         for (i=0;i<nR;i++) {
+            yp_n+=s[i]*RF->beta[i];
+            sigma2 +=s[i]*s[i] / RF->SSs2[i];
+         }
+         sigma2 = RF->sum_e_cv2[nR-1]/(RF->sum_w[nR-1] - RF->SSp)*(1+w*sigma2);
+
+         sum_wyy += w*yp_n*yp_n;
+         sum_conf += w*sigma2;
+
+         TD->yn += w*yp_n;
+         sum_w += w;
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+      }
+   }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
+   if (sum_w > 0.0) {
+      double sum_wy = TD->yn;
+      TD->yn /= sum_w;
+      TD->w_sec = sqrt(fabs(sum_conf + sum_wyy - sum_wy*TD->yn))/sum_w; /* This serves as confidence bound */
+   } else {
+      TD->w_sec = 1e20; /* DBL_INFTY; */
+   }
+   return NULL;
+}
+
+double lwpr_aux_predict_one(const LWPR_Model *model, int dim,
+      const double *xn, double cutoff, double *conf, double *max_w) {
+
+   LWPR_ThreadData TD;
+   TD.model = model;
+   TD.xn = xn;
+   TD.ws = &model->ws[0];
+   TD.cutoff = cutoff;
+   TD.dim = dim;
+
+   if (conf == NULL) {
+      (void) lwpr_aux_predict_one_T(&TD);
+   } else {
+      (void) lwpr_aux_predict_conf_one_T(&TD);
+      *conf = TD.w_sec;
+   }
+   if (max_w!=NULL) *max_w = lwpr_aux_max_activation(model, dim, xn, TD.w_max,
+         0, model->sub[dim].numRFS, 1, TD.ws->dx);
+   return TD.yn;
+}
+
+
+
+
+void *lwpr_aux_predict_one_J_T(void *ptr) {
+   LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
+   LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
+   LWPR_Workspace *WS = TD->ws;
+
+   int i;
+   int nIn=TD->model->nIn;
+   int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
+
+   double *xc = WS->xc;
+   double *s = WS->s;
+   double *dsdx = WS->dsdx;
+   double *Dx = WS->Dx;
+   double *sum_dwdx = WS->sum_dwdx;
+   double *sum_ydwdx_wdydx = WS->sum_ydwdx_wdydx;
+
+   double w, dwdq;
+   double yp = 0.0;
+
+   double sum_w = 0.0;
+
+   memset(sum_dwdx,0,nIn*sizeof(double));
+   memset(sum_ydwdx_wdydx,0,nIn*sizeof(double));
+
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
+
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, WS->Mx, WS->xu, &dist)) continue;
+      lwpr_aux_rf_Dx(RF, xc, WS->Mx, Dx);
+      switch(TD->model->kernel) {
+         case LWPR_GAUSSIAN_KERNEL:
+            w = exp(-0.5*dist);
+            dwdq = -0.5 * w;
+            break;
+         case LWPR_BISQUARE_KERNEL:
+            dwdq = 1-0.25*dist;
+            if (dwdq<0) {
+               w = dwdq = 0.0;
+            } else {
+               w = dwdq*dwdq;
+               dwdq = -0.5*dwdq;
+            }
+            break;
+         default:
+            w = dwdq = 0;
+      }
+
+      if (w>TD->cutoff && RF->trustworthy) {
+         double yp_n = RF->beta0;
+
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
+         for (i=0;i<nIn;i++) {
+            xc[i] = TD->xn[i] - RF->mean_x[i];
+         }
+
+         sum_w += w;
+
+         if (RF->slopeReady) {
+            yp_n += lwpr_math_dot_product(xc, RF->slope, nIn);
+            yp += w*yp_n;
+         } else {
+            int nR = RF->nReg;
+
+            if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
+            if (RF->n_data[nR-1] <= 2*nIn) nR--;
+
+
+            lwpr_aux_compute_projection_d(nIn, nInS, nR, s, dsdx, xc, RF->U, RF->P,WS);
+            for (i=0;i<nR;i++) {
+               yp_n+=s[i]*RF->beta[i];
+            }
+            yp += w*yp_n;
+            lwpr_math_scalar_vector(RF->slope, RF->beta[0], dsdx, nIn);
+            for (i=1;i<nR;i++) {
+               lwpr_math_add_scalar_vector(RF->slope, RF->beta[i], dsdx + i*nInS, nIn);
+            }
+            /*  part of original code without cached slopes:
+            for (i=0;i<RF->nReg;i++) {
+               lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, w * RF->beta[i], dsdx + i*nInS, nIn);
+            }
+            */
+            RF->slopeReady=1;
          }
+
+         lwpr_math_add_scalar_vector(sum_dwdx, 2.0*dwdq, Dx, nIn);
+         lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, yp_n*2.0*dwdq, Dx, nIn);
+         lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, w, RF->slope, nIn);
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
       }
    }
-#endif
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
 
-   if (TD[0].sum_w > 0.0) {
-      *y_pred = TD[0].yp/TD[0].sum_w;
+   if (sum_w > 0.0) {
+      yp/=sum_w;
+
+      /* Put gradient into sum_dwdx */
+      /* dydx = -(yp/sum_w) * dw/dx  + (1/sum_w)*sum_ydwdx_wdydx) */
+      lwpr_math_scale_add_scalar_vector(-yp/sum_w, sum_dwdx, 1.0/sum_w, sum_ydwdx_wdydx, nIn);
+      TD->yn = yp;
    } else {
-      *y_pred = 0.0;
+      /* sum_dwdx = 0 */
+      /* memset(sum_dwdx,0,nIn*sizeof(double)); */
+      TD->yn = 0.0;
    }
-
-   if (max_w != NULL) *max_w = TD[0].w_max;
-
-   return lwpr_aux_update_one_add_prune(model, &TD[0], dim, xn, yn);
+   return NULL;
 }
 
+/* Dx(j) = (D*(xn - RF->c))_j, from the results of lwpr_aux_rf_distance */
+static double lwpr_aux_rf_Dx_at(const LWPR_ReceptiveField *RF, const double *xc, const double *Mxc, int j) {
+   int nInS = RF->model->nInStore;
+   int l;
+
+   if (RF->model->rank > 0) {
+      const double *L = RF->L;
+      double Dx = L[j]*L[j]*xc[j];
+      for (l=1;l<=RF->model->rank;l++) Dx += L[j+l*nInS]*Mxc[l-1];
+      return Dx;
+   } else if (RF->model->diag_only) {
+      return RF->D[j+RF->model->metric_col[j]]*xc[j];
+   } else {
+      int b = RF->model->block_begin[j];
+      return lwpr_math_dot_product(RF->M + b + RF->model->metric_col[j], Mxc + b, j+1-b);
+   }
+}
 
-
-/* A note to developers:  lwpr_aux_predict_one_T and lwpr_aux_predict_conf_one_T
-** are very similar, and one might wonder why we need two functions.
-** This is done for efficieny. Without confidence bounds, we also might
-** be able to use readily calculated slopes instead of doing PLS.
-**
-** Also, please note the difference between threaded updates and predictions:
-** The threaded predict-functions are designed to operate on whole submodels,
-** whereas the updates break up submodels into multiple threads. Therefore,
-** univariate LWPR models (single SubModel) cannot be predicted faster when
-** using threads, but the updates might get faster.
-** The design rationale was that predictions are fast, and therefore the
-** overhead of creating multiple threads per submodel is significant.
-** On the other hand, updates are rather slow, and we wish to speed up
-** also models with univariate outputs.
-*/
-void *lwpr_aux_predict_one_T(void *ptr) {
+void *lwpr_aux_predict_one_Jsel_T(void *ptr) {
    LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
    LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
    LWPR_Workspace *WS = TD->ws;
-   int i,j,n;
+   const int *inMask = TD->inMask;
+
+   int i;
    int nIn=TD->model->nIn;
    int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
 
    double *xc = WS->xc;
    double *s = WS->s;
+   double *dsdx = WS->dsdx;
+   double *sum_dwdx = WS->sum_dwdx;
+   double *sum_ydwdx_wdydx = WS->sum_ydwdx_wdydx;
 
-   double w;
-
+   double w, dwdq;
    double yp = 0.0;
 
    double sum_w = 0.0;
 
-   TD->w_max = 0.0;
-
-   for (n=0;n<sub->numRFS;n++) {
-      double dist = 0.0;
-      LWPR_ReceptiveField *RF = sub->rf[n];
+   if (inMask == NULL) return lwpr_aux_predict_one_J_T(ptr);
 
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
-      }
+   memset(sum_dwdx,0,nIn*sizeof(double));
+   memset(sum_ydwdx_wdydx,0,nIn*sizeof(double));
 
-      for (j=0;j<nIn;j++) {
-         dist += xc[j] * lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-      }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
 
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, WS->Mx, WS->xu, &dist)) continue;
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
             w = exp(-0.5*dist);
+            dwdq = -0.5 * w;
             break;
          case LWPR_BISQUARE_KERNEL:
-            w = 1-0.25*dist;
-            w = (w<0) ? 0 : w*w;
+            dwdq = 1-0.25*dist;
+            if (dwdq<0) {
+               w = dwdq = 0.0;
+            } else {
+               w = dwdq*dwdq;
+               dwdq = -0.5*dwdq;
+            }
             break;
+         default:
+            w = dwdq = 0;
       }
 
-      if (w > TD->w_max) {
-         TD->w_max = w;
-      }
-
-      if (w > TD->cutoff && RF->trustworthy) {
+      if (w>TD->cutoff && RF->trustworthy) {
          double yp_n = RF->beta0;
 
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
+         /* Only the requested elements of D*(x-c) are needed, and xc is overwritten below */
+         for (i=0;i<nIn;i++) {
+            if (inMask[i]) WS->Dx[i] = lwpr_aux_rf_Dx_at(RF, xc, WS->Mx, i);
+         }
          for (i=0;i<nIn;i++) {
             xc[i] = TD->xn[i] - RF->mean_x[i];
          }
 
+         sum_w += w;
+
          if (RF->slopeReady) {
             yp_n += lwpr_math_dot_product(xc, RF->slope, nIn);
+            yp += w*yp_n;
          } else {
             int nR = RF->nReg;
 
+            if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
             if (RF->n_data[nR-1] <= 2*nIn) nR--;
 
-            lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
-
+            lwpr_aux_compute_projection_d(nIn, nInS, nR, s, dsdx, xc, RF->U, RF->P,WS);
             for (i=0;i<nR;i++) {
                yp_n+=s[i]*RF->beta[i];
             }
+            yp += w*yp_n;
+            lwpr_math_scalar_vector(RF->slope, RF->beta[0], dsdx, nIn);
+            for (i=1;i<nR;i++) {
+               lwpr_math_add_scalar_vector(RF->slope, RF->beta[i], dsdx + i*nInS, nIn);
+            }
+            RF->slopeReady=1;
          }
 
-         yp += w*yp_n;
-         sum_w += w;
+         /* Same operations as lwpr_aux_predict_one_J_T, restricted to the requested elements */
+         for (i=0;i<nIn;i++) {
+            if (!inMask[i]) continue;
+            sum_dwdx[i] += (2.0*dwdq)*WS->Dx[i];
+            sum_ydwdx_wdydx[i] += (yp_n*2.0*dwdq)*WS->Dx[i];
+            sum_ydwdx_wdydx[i] += w*RF->slope[i];
+         }
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
       }
    }
-   if (sum_w > 0.0) yp/=sum_w;
-   TD->yn = yp;
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
 
+   if (sum_w > 0.0) {
+      yp/=sum_w;
+      for (i=0;i<nIn;i++) {
+         if (inMask[i]) sum_dwdx[i] = (-yp/sum_w)*sum_dwdx[i] + (1.0/sum_w)*sum_ydwdx_wdydx[i];
+      }
+      TD->yn = yp;
+   } else {
+      TD->yn = 0.0;
+   }
    return NULL;
 }
 
-
-void *lwpr_aux_predict_conf_one_T(void *ptr) {
+void *lwpr_aux_predict_one_jvp_T(void *ptr) {
    LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
    LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
    LWPR_Workspace *WS = TD->ws;
-   int i,j,n;
+   const double *vn = TD->vn;
+
+   int i;
    int nIn=TD->model->nIn;
    int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
 
    double *xc = WS->xc;
    double *s = WS->s;
+   double *sv = WS->e_cv;
+   double *Dx = WS->Dx;
 
-   double w;
-
-
+   double w, dwdq;
+   double yp = 0.0;
    double sum_w = 0.0;
-   double sum_wyy = 0.0;
-   double sum_conf = 0.0;
-
-   TD->w_max = 0.0;
-   TD->yn = 0.0;
-
-   /* Prediction and confidence bounds in one go */
-   for (n=0;n<sub->numRFS;n++) {
-      double dist = 0.0;
-      LWPR_ReceptiveField *RF = sub->rf[n];
+   double sum_dwdv = 0.0;
+   double sum_ydwdv_wdydv = 0.0;
 
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
-      }
-
-      for (j=0;j<nIn;j++) {
-         dist += xc[j] * lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-      }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
 
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, WS->Mx, WS->xu, &dist)) continue;
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
             w = exp(-0.5*dist);
+            dwdq = -0.5 * w;
             break;
          case LWPR_BISQUARE_KERNEL:
-            w = 1-0.25*dist;
-            w = (w<0) ? 0 : w*w;
+            dwdq = 1-0.25*dist;
+            if (dwdq<0) {
+               w = dwdq = 0.0;
+            } else {
+               w = dwdq*dwdq;
+               dwdq = -0.5*dwdq;
+            }
             break;
+         default:
+            w = dwdq = 0;
       }
 
-      if (w > TD->w_max) {
-         TD->w_max = w;
-      }
-
-      if (w > TD->cutoff && RF->trustworthy) {
+      if (w>TD->cutoff && RF->trustworthy) {
          double yp_n = RF->beta0;
-         double sigma2 = 0.0;
-         int nR = RF->nReg;
+         double dydv = 0.0;
+         double Dxv;
 
-         if (RF->n_data[nR-1] <= 2*nIn) nR--;
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
+         lwpr_aux_rf_Dx(RF, xc, WS->Mx, Dx);
+         Dxv = lwpr_math_dot_product(Dx, vn, nIn);
 
          for (i=0;i<nIn;i++) {
             xc[i] = TD->xn[i] - RF->mean_x[i];
          }
-         lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
-         for (i=0;i<nR;i++) {
-            yp_n+=s[i]*RF->beta[i];
-            sigma2 +=s[i]*s[i] / RF->SSs2[i];
-         }
-         sigma2 = RF->sum_e_cv2[nR-1]/(RF->sum_w[nR-1] - RF->SSp)*(1+w*sigma2);
 
-         sum_wyy += w*yp_n*yp_n;
-         sum_conf += w*sigma2;
-
-         TD->yn += w*yp_n;
          sum_w += w;
+
+         if (RF->slopeReady) {
+            yp_n += lwpr_math_dot_product(xc, RF->slope, nIn);
+            dydv = lwpr_math_dot_product(vn, RF->slope, nIn);
+         } else {
+            int nR = RF->nReg;
+
+            if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
+            if (RF->n_data[nR-1] <= 2*nIn) nR--;
+
+            /* The projections are linear, so slope'*vn = beta'*s(vn) */
+            lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
+            lwpr_aux_compute_projection(nIn, nInS, nR, sv, vn, RF->U, RF->P, WS);
+            for (i=0;i<nR;i++) {
+               yp_n += s[i]*RF->beta[i];
+               dydv += sv[i]*RF->beta[i];
+            }
+         }
+         yp += w*yp_n;
+
+         sum_dwdv += 2.0*dwdq*Dxv;
+         sum_ydwdv_wdydv += yp_n*2.0*dwdq*Dxv + w*dydv;
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
       }
    }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
+
    if (sum_w > 0.0) {
-      double sum_wy = TD->yn;
-      TD->yn /= sum_w;
-      TD->w_sec = sqrt(fabs(sum_conf + sum_wyy - sum_wy*TD->yn))/sum_w; /* This serves as confidence bound */
+      yp/=sum_w;
+      TD->yn_dir = (-yp/sum_w)*sum_dwdv + (1.0/sum_w)*sum_ydwdv_wdydv;
+      TD->yn = yp;
    } else {
-      TD->w_sec = 1e20; /* DBL_INFTY; */
+      TD->yn_dir = 0.0;
+      TD->yn = 0.0;
    }
    return NULL;
 }
 
-double lwpr_aux_predict_one(const LWPR_Model *model, int dim,
-      const double *xn, double cutoff, double *conf, double *max_w) {
-
-   LWPR_ThreadData TD;
-   TD.model = model;
-   TD.xn = xn;
-   TD.ws = &model->ws[0];
-   TD.cutoff = cutoff;
-   TD.dim = dim;
-
-   if (conf == NULL) {
-      (void) lwpr_aux_predict_one_T(&TD);
-   } else {
-      (void) lwpr_aux_predict_conf_one_T(&TD);
-      *conf = TD.w_sec;
-   }
-   if (max_w!=NULL) *max_w = TD.w_max;
-   return TD.yn;
-}
-
-
-
-
-void *lwpr_aux_predict_one_J_T(void *ptr) {
+void *lwpr_aux_predict_one_grad_T(void *ptr) {
    LWPR_ThreadData *TD = (LWPR_ThreadData *) ptr;
    LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
    LWPR_Workspace *WS = TD->ws;
 
-   int i,j,n;
+   int i;
    int nIn=TD->model->nIn;
    int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
 
    double *xc = WS->xc;
    double *s = WS->s;
-   double *dsdx = WS->dsdx;
+   double *g = WS->xmz;
    double *Dx = WS->Dx;
    double *sum_dwdx = WS->sum_dwdx;
    double *sum_ydwdx_wdydx = WS->sum_ydwdx_wdydx;
@@ -1317,18 +2981,12 @@ void *lwpr_aux_predict_one_J_T(void *ptr) {
    memset(sum_dwdx,0,nIn*sizeof(double));
    memset(sum_ydwdx_wdydx,0,nIn*sizeof(double));
 
-   for (n=0;n<sub->numRFS;n++) {
-      double dist = 0.0;
-      LWPR_ReceptiveField *RF = sub->rf[n];
-
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
-      }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
 
-      for (j=0;j<nIn;j++) {
-         Dx[j] = lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-         dist += xc[j] * Dx[j];
-      }
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, WS->Mx, WS->xu, &dist)) continue;
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
             w = exp(-0.5*dist);
@@ -1349,7 +3007,10 @@ void *lwpr_aux_predict_one_J_T(void *ptr) {
 
       if (w>TD->cutoff && RF->trustworthy) {
          double yp_n = RF->beta0;
+         const double *slope;
 
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
+         lwpr_aux_rf_Dx(RF, xc, WS->Mx, Dx);
          for (i=0;i<nIn;i++) {
             xc[i] = TD->xn[i] - RF->mean_x[i];
          }
@@ -1357,47 +3018,37 @@ void *lwpr_aux_predict_one_J_T(void *ptr) {
          sum_w += w;
 
          if (RF->slopeReady) {
-            yp_n += lwpr_math_dot_product(xc, RF->slope, nIn);
-            yp += w*yp_n;
+            slope = RF->slope;
+            yp_n += lwpr_math_dot_product(xc, slope, nIn);
          } else {
             int nR = RF->nReg;
 
+            if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
             if (RF->n_data[nR-1] <= 2*nIn) nR--;
 
-
-            lwpr_aux_compute_projection_d(nIn, nInS, nR, s, dsdx, xc, RF->U, RF->P,WS);
+            lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, RF->U, RF->P, WS);
             for (i=0;i<nR;i++) {
                yp_n+=s[i]*RF->beta[i];
             }
-            yp += w*yp_n;
-            lwpr_math_scalar_vector(RF->slope, RF->beta[0], dsdx, nIn);
-            for (i=1;i<nR;i++) {
-               lwpr_math_add_scalar_vector(RF->slope, RF->beta[i], dsdx + i*nInS, nIn);
-            }
-            /*  part of original code without cached slopes:
-            for (i=0;i<RF->nReg;i++) {
-               lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, w * RF->beta[i], dsdx + i*nInS, nIn);
-            }
-            */
-            RF->slopeReady=1;
+            lwpr_aux_compute_projection_adjoint(nIn, nInS, nR, g, RF->beta, RF->U, RF->P);
+            slope = g;
          }
+         yp += w*yp_n;
 
          lwpr_math_add_scalar_vector(sum_dwdx, 2.0*dwdq, Dx, nIn);
          lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, yp_n*2.0*dwdq, Dx, nIn);
-         lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, w, RF->slope, nIn);
+         lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, w, slope, nIn);
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
       }
    }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
 
    if (sum_w > 0.0) {
       yp/=sum_w;
-
-      /* Put gradient into sum_dwdx */
       /* dydx = -(yp/sum_w) * dw/dx  + (1/sum_w)*sum_ydwdx_wdydx) */
       lwpr_math_scale_add_scalar_vector(-yp/sum_w, sum_dwdx, 1.0/sum_w, sum_ydwdx_wdydx, nIn);
       TD->yn = yp;
    } else {
-      /* sum_dwdx = 0 */
-      /* memset(sum_dwdx,0,nIn*sizeof(double)); */
       TD->yn = 0.0;
    }
    return NULL;
@@ -1428,9 +3079,12 @@ void *lwpr_aux_predict_one_JcJ_T(void *ptr) {
    LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
    LWPR_Workspace *WS = TD->ws;
 
-   int i,j,n;
+   int i;
    int nIn=TD->model->nIn;
    int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
 
    double *xc = WS->xc;
    double *s = WS->s;
@@ -1452,18 +3106,13 @@ void *lwpr_aux_predict_one_JcJ_T(void *ptr) {
 
    memset(sum_dRdx,0,nIn*sizeof(double));
 
-   for (n=0;n<sub->numRFS;n++) {
-      double dist = 0.0;
-      LWPR_ReceptiveField *RF = sub->rf[n];
-
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
-      }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
 
-      for (j=0;j<nIn;j++) {
-         Dx[j] = lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-         dist += xc[j] * Dx[j];
-      }
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, WS->Mx, WS->xu, &dist)) continue;
+      lwpr_aux_rf_Dx(RF, xc, WS->Mx, Dx);
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
             w = exp(-0.5*dist);
@@ -1488,6 +3137,8 @@ void *lwpr_aux_predict_one_JcJ_T(void *ptr) {
          double Gamma,sigma2;
          double sum_sS2 = 0.0;
 
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
+         if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
          for (i=0;i<nIn;i++) {
             xc[i] = TD->xn[i] - RF->mean_x[i];
          }
@@ -1536,8 +3187,10 @@ void *lwpr_aux_predict_one_JcJ_T(void *ptr) {
 
          /* This part is for w*d(yp_n*yp_n)/dx */
          lwpr_math_add_scalar_vector(sum_dRdx, 2.0*w*yp_n, RF->slope, nIn);
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
       }
    }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
 
    if (sum_w > 0.0) {
       yp/=sum_w;
@@ -1603,9 +3256,12 @@ void *lwpr_aux_predict_one_gH_T(void *ptr) {
    LWPR_SubModel *sub = &(TD->model->sub[TD->dim]);
    LWPR_Workspace *WS = TD->ws;
 
-   int i,j,n;
+   int i;
    int nIn=TD->model->nIn;
    int nInS=TD->model->nInStore;
+   double qmax = lwpr_aux_cutoff_distance(TD->model->kernel, TD->cutoff);
+   LWPR_RFScan scan;
+   LWPR_ReceptiveField *RF;
 
    double *xc = WS->xc;
    double *s = WS->s;
@@ -1627,18 +3283,13 @@ void *lwpr_aux_predict_one_gH_T(void *ptr) {
    memset(sum_ddRdxdx,0,nInS*nIn*sizeof(double));
    memset(sum_ddwdxdx,0,nInS*nIn*sizeof(double));
 
-   for (n=0;n<sub->numRFS;n++) {
-      double dist = 0.0;
-      LWPR_ReceptiveField *RF = sub->rf[n];
-
-      for (i=0;i<nIn;i++) {
-         xc[i] = TD->xn[i] - RF->c[i];
-      }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
+   lwpr_aux_rf_scan_init(&scan, sub, TD->xn, qmax, WS->xu);
+   while ((RF = lwpr_aux_rf_scan_next(&scan)) != NULL) {
+      double dist;
 
-      for (j=0;j<nIn;j++) {
-         Dx[j] = lwpr_math_dot_product(RF->D + j*nInS, xc, nIn);
-         dist += xc[j] * Dx[j];
-      }
+      if (!lwpr_aux_rf_distance(RF, TD->xn, qmax, xc, WS->Mx, WS->xu, &dist)) continue;
+      lwpr_aux_rf_Dx(RF, xc, WS->Mx, Dx);
       switch(TD->model->kernel) {
          case LWPR_GAUSSIAN_KERNEL:
             w = exp(-0.5*dist);
@@ -1662,6 +3313,7 @@ void *lwpr_aux_predict_one_gH_T(void *ptr) {
       if (w>TD->cutoff && RF->trustworthy) {
          double yp_n = RF->beta0;
 
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_PROJECTION);
          for (i=0;i<nIn;i++) {
             xc[i] = TD->xn[i] - RF->mean_x[i];
          }
@@ -1674,6 +3326,7 @@ void *lwpr_aux_predict_one_gH_T(void *ptr) {
          } else {
             int nR = RF->nReg;
 
+            if (RF->oocBlock != NULL) lwpr_ooc_touch(RF->oocBlock);
             if (RF->n_data[nR-1] <= 2*nIn) nR--;
 
 
@@ -1698,22 +3351,25 @@ void *lwpr_aux_predict_one_gH_T(void *ptr) {
          lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, yp_n*2.0*dwdq, Dx, nIn);
          lwpr_math_add_scalar_vector(sum_ydwdx_wdydx, w, RF->slope, nIn);
 
+         lwpr_aux_rf_sync_D(RF);
          for (i=0;i<nIn;i++) {
             /* sum up ddwdxdx */
             lwpr_math_add_scalar_vector(sum_ddwdxdx + i*nInS, 4.0*ddwdqdq*Dx[i], Dx, nIn);
-            lwpr_math_add_scalar_vector(sum_ddwdxdx + i*nInS, 2.0*dwdq, RF->D + i*nInS, nIn);
+            lwpr_aux_add_D_column(RF, i, 2.0*dwdq, sum_ddwdxdx + i*nInS);
 
             /* sum up ddRdxdx */
             /* ... the yp_n * ddwdxdx part */
             lwpr_math_add_scalar_vector(sum_ddRdxdx + i*nInS, yp_n*4.0*ddwdqdq*Dx[i], Dx, nIn);
-            lwpr_math_add_scalar_vector(sum_ddRdxdx + i*nInS, yp_n*2.0*dwdq, RF->D + i*nInS, nIn);
+            lwpr_aux_add_D_column(RF, i, yp_n*2.0*dwdq, sum_ddRdxdx + i*nInS);
             /* += dwdx*dydx'  ,that is, 2*dwdq*Dx * RF->slope' */
             lwpr_math_add_scalar_vector(sum_ddRdxdx + i*nInS, 2.0*dwdq*RF->slope[i], Dx, nIn);
             /* += dydx*dwdx'  ,that is, 2*dwdq*Dx' * RF->slope */
             lwpr_math_add_scalar_vector(sum_ddRdxdx + i*nInS, 2.0*dwdq*Dx[i], RF->slope, nIn);
          }
+         LWPR_PROF_PHASE(TD, LWPR_PHASE_SCAN);
       }
    }
+   LWPR_PROF_PHASE(TD, LWPR_PHASE_NONE);
 
    if (sum_w > 0.0) {
       yp/=sum_w;
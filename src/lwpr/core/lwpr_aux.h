@@ -40,7 +40,7 @@ extern "C" {
 typedef struct LWPR_Workspace {
    int *derivOk;           /**< \brief Used within lwpr_aux_update_distance_metric for storing which PLS directions can be trusted */
    double *storage;        /**< \brief Pointer to the allocated memory */
-   double *dx;             /**< \brief Used to hold the difference between a normalised input vector and a RF's centre */
+   double *dx;             /**< \brief Used to hold the difference between a normalised input vector and a RF's centre during updates */
    double *dwdM;           /**< \brief Derivatives of the weight w with respect to LWPR_ReceptiveField.M */
    double *dJ2dM;          /**< \brief Derivatives of the cost J2 with respect to M */
    double *ddwdMdM;        /**< \brief 2nd derivatives of w wrt. M */
@@ -57,6 +57,7 @@ typedef struct LWPR_Workspace {
    double *s;              /**< \brief Intermediate results used within lwpr_aux_update_regression */
    double *dsdx;           /**< \brief Intermediate results used within lwpr_aux_predict_one_J */
    double *Dx;             /**< \brief Used to store RF.D * (x-RF.c) */
+   double *Mx;             /**< \brief Used to store RF.M * (x-RF.c), as computed by lwpr_aux_rf_distance */
    double *sum_dwdx;       /**< \brief Intermediate results used within lwpr_aux_predict_one_J */
    double *sum_ydwdx_wdydx;/**< \brief Intermediate results used within lwpr_aux_predict_one_J */
    double *sum_ddwdxdx;    /**< \brief Intermediate results used within lwpr_aux_predict_one_gH */
@@ -81,8 +82,27 @@ typedef struct {
    int end;                /**< \brief Upper bound for RF index this thread should handle */
    int ind_max;            /**< \brief Index of RF with largest activation */
    int ind_sec;            /**< \brief Index of RF with second largest activation */
+   int stamp;              /**< \brief Value of LWPR_Model.n_updates for the sample, written to LWPR_ReceptiveField.w_stamp by updates */
+   double weight;          /**< \brief Importance weight of the sample in updates (LWPR_Model.gate_weight), multiplies the activations in the local statistics */
+   const int *inMask;      /**< \brief Input dimensions for which derivatives are requested (Nx1), used by lwpr_aux_predict_one_Jsel_T */
+   const double *vn;       /**< \brief Normalised direction (Nx1), used by lwpr_aux_predict_one_jvp_T */
+   double yn_dir;          /**< \brief Derivative of yn along vn, computed by lwpr_aux_predict_one_jvp_T */
 } LWPR_ThreadData;
 
+/** \brief State of a scan over the receptive fields of a LWPR_SubModel that may
+      contribute to a prediction, see lwpr_aux_rf_scan_next. */
+typedef struct {
+   LWPR_SubModel *sub;     /**< \brief The LWPR_SubModel that is scanned */
+   const double *xn;       /**< \brief Normalised input vector (Nx1) */
+   double r;               /**< \brief Square root of the maximal squared distance of interest */
+   double *scratch;        /**< \brief Working memory (Nx1) for refreshing cluster summaries, or NULL */
+   int mode;               /**< \brief 0: all RFs, 1: clusters, 2: random-projection index */
+   int cl;                 /**< \brief Index of the current cluster */
+   int n;                  /**< \brief Index of the next RF within the current cluster (or the SubModel, or the index) */
+   int end;                /**< \brief End of the candidate range of the index */
+   double qmax;            /**< \brief Maximal squared distance of interest */
+} LWPR_RFScan;
+
 /** \brief Computes the derivates of the activation w and a penalty term with
             respect to M, Cholesky factors of the distance metric
    \param[in] nIn       Number of input dimensions
@@ -94,9 +114,12 @@ typedef struct {
    \param[in] w         Activation of receptive field
    \param[in] dwdq      Derivative of w with respect to squared distance (~ outer derivate of the kernel)
    \param[in] ddwdqdq   2nd derivative of w with respect to squared distance
-   \param[in] RF_D      The receptive field's distance metric (nIn x nIn)
-   \param[in] RF_M      The Cholesky factorisation of RF_M (nIn x nIn)
+   \param[in] RF_D      The receptive field's distance metric (nIn x nIn, packed)
+   \param[in] RF_M      The Cholesky factorisation of RF_M (nIn x nIn, packed)
+   \param[in] col       Column offsets of the packed matrices RF_D and RF_M (nIn x 1, see LWPR_Model.metric_col)
    \param[in] dx        The difference between the normalised input x and the receptive fields centre c (nIn x 1)
+   \param[in] Mdx       RF_M * dx as computed by lwpr_aux_rf_distance (nIn x 1, not used for diagonal metrics)
+   \param[in] block_end One past the last dimension of the metric block containing dimension i (nIn x 1, see LWPR_Model.block_end)
    \param[in] diag_only Flag that determines whether the distance metric is to be treated as diagonal
    \param[in] penalty   Pre-factor involved in computation of J2
    \param[in] meta      Flag that determines whether 2nd derivatives should be computed
@@ -104,8 +127,143 @@ typedef struct {
 void lwpr_aux_dist_derivatives(int nIn,int nInS,
          double *dwdM, double *dJ2dM, double *ddwdMdM, double *ddJ2dMdM,
          double w, double dwdq, double ddwdqdq,
-         const double *RF_D, const double *RF_M, const double *dx,
-         int diag_only, double penalty, int meta);
+         const double *RF_D, const double *RF_M, const int *col, const double *dx, const double *Mdx,
+         const int *block_end, int diag_only, double penalty, int meta);
+
+/** \brief Sets all elements of a symmetric (nIn x nIn) matrix to zero that couple
+      two different blocks of input dimensions (see lwpr_set_blocks)
+   \param[in] model    The LWPR model that defines the blocks
+   \param[in,out] A    The matrix, stored with column stride LWPR_Model.nInStore
+*/
+void lwpr_aux_mask_blocks(const LWPR_Model *model, double *A);
+
+/** \brief Sets LWPR_Model.metric_col and LWPR_Model.nMetric from the blocks of the model.
+      A single block keeps the dense layout with column stride LWPR_Model.nInStore,
+      otherwise the blocks are stored one after the other, each one densely.
+   \param[in,out] model  The LWPR model that defines the blocks
+*/
+void lwpr_aux_layout_blocks(LWPR_Model *model);
+
+/** \brief Copies the blocks of a dense (nIn x nIn) matrix into the packed layout of
+      the distance matrices of the receptive fields (see LWPR_Model.metric_col)
+   \param[in] model    The LWPR model that defines the blocks
+   \param[in] A        The dense matrix, stored with column stride LWPR_Model.nInStore
+   \param[out] X       The packed matrix (LWPR_Model.nMetric)
+*/
+void lwpr_aux_pack_metric(const LWPR_Model *model, const double *A, double *X);
+
+/** \brief Expands a packed distance matrix of a receptive field into a dense matrix,
+      with zeros outside the blocks (inverse of lwpr_aux_pack_metric)
+   \param[in] model    The LWPR model that defines the blocks
+   \param[in] X        The packed matrix (LWPR_Model.nMetric)
+   \param[out] A       The dense matrix, stored with column stride LWPR_Model.nInStore
+*/
+void lwpr_aux_unpack_metric(const LWPR_Model *model, const double *X, double *A);
+
+/** \brief Translates a minimal activation into the corresponding squared distance
+   \param[in] kernel    The kernel function (Gaussian or BiSquare)
+   \param[in] w_min     Minimal activation of interest
+   \return The squared distance beyond which activations are at most w_min (HUGE_VAL if there is no such distance)
+*/
+double lwpr_aux_cutoff_distance(LWPR_Kernel kernel, double w_min);
+
+/** \brief Computes the squared distance (x-c)'D(x-c) of an input vector to a receptive field,
+      and gives up as soon as it is clear that the distance exceeds qmax.
+
+   For diagonal distance metrics, the terms D_jj*(x_j-c_j)^2 are summed up, otherwise the squared
+   elements of M*(x-c). All of these are non-negative, so the partial sums provide lower bounds.
+   If LWPR_Model.use_bbox is set and qmax is finite, the receptive field is first tested against
+   the bounding box of its support, which costs only nIn comparisons.
+   \param[in,out] RF    Pointer to the receptive field (the box is updated if scratch is not NULL)
+   \param[in] xn        Normalised input vector (nIn)
+   \param[in] qmax      Squared distance beyond which the receptive field is of no interest (see lwpr_aux_cutoff_distance)
+   \param[out] xc       The difference xn - RF->c (nIn)
+   \param[out] Mxc      M*(xn - RF->c) (nIn, only for non-diagonal metrics), or L'*(xn - RF->c) (rank) for
+                        low-rank metrics, may be NULL
+   \param[in] scratch   Working memory (nIn) for computing a missing bounding box, or NULL if
+                        outdated boxes should just not be used
+   \param[out] dist     Squared distance (only if the receptive field was not rejected)
+   \return
+      - 1 if the distance is at most qmax
+      - 0 if the receptive field has been rejected
+*/
+int lwpr_aux_rf_distance(LWPR_ReceptiveField *RF, const double *xn, double qmax,
+      double *xc, double *Mxc, double *scratch, double *dist);
+
+/** \brief Completes the maximum activation of a scan that skipped the receptive fields below
+      its cutoff, and therefore found 0 if none of them were above it.
+
+   The receptive fields start, start+incr, ... below end are scanned with the squared distance
+   that corresponds to the running maximum as qmax, so only the ones that raise the maximum
+   are computed completely.
+   \param[in] model     Pointer to the LWPR_Model
+   \param[in] dim       Output dimension
+   \param[in] xn        Normalised input vector (nIn)
+   \param[in] w_max     Maximum found by the scan, returned unchanged unless it is 0
+   \param[in] start     Index of the first receptive field
+   \param[in] end       Upper bound for the index of the receptive fields
+   \param[in] incr      Increment for the index of the receptive fields
+   \param[out] xc       Working memory (nIn)
+   \return The largest activation of these receptive fields at xn
+*/
+double lwpr_aux_max_activation(const LWPR_Model *model, int dim, const double *xn, double w_max,
+      int start, int end, int incr, double *xc);
+
+/** \brief Computes D*(x-c) from the results of lwpr_aux_rf_distance
+   \param[in] RF        Pointer to the receptive field
+   \param[in] xc        The difference xn - RF->c (nIn)
+   \param[in] Mxc       M*(xn - RF->c) or L'*(xn - RF->c) as computed by lwpr_aux_rf_distance
+   \param[out] Dx       D*(xn - RF->c) (nIn)
+*/
+void lwpr_aux_rf_Dx(const LWPR_ReceptiveField *RF, const double *xc, const double *Mxc, double *Dx);
+
+/** \brief Computes the bounding box of the support of a receptive field, that is,
+      the half-widths sqrt((D^-1)_ii) of the ellipsoid (x-c)'D(x-c) <= 1, and stores it in RF->box.
+   \param[in,out] RF    Pointer to the receptive field
+   \param[in] z         Working memory (nIn)
+*/
+void lwpr_aux_compute_bbox(LWPR_ReceptiveField *RF, double *z);
+
+/** \brief Adds a multiple of the i-th column of a receptive field's distance metric to a vector,
+      for any parameterisation of the metric
+   \param[in] RF        Pointer to the receptive field
+   \param[in] i         Column index
+   \param[in] a         Scalar factor
+   \param[in,out] y     Vector (nIn), y += a*D(:,i)
+*/
+void lwpr_aux_add_D_column(const LWPR_ReceptiveField *RF, int i, double a, double *y);
+
+/** \brief Computes D = M'*M of a receptive field with a full (block-diagonal) metric
+   \param[in] RF        Pointer to the receptive field
+   \param[out] D       Distance metric (nIn x nIn), packed like RF->M, or stored densely
+                        with stride nInStore and zeros outside the blocks if <em>dense</em> is set
+   \param[in] dense     Selects the layout of D
+*/
+void lwpr_aux_compute_D(const LWPR_ReceptiveField *RF, double *D, int dense);
+
+/** \brief Re-computes RF->D from RF->M if it is out of date (see LWPR_ReceptiveField.DReady).
+   Updates of full metrics only mark D as out of date, so this must be called before RF->D is read.
+*/
+void lwpr_aux_rf_sync_D(LWPR_ReceptiveField *RF);
+
+/** \brief Returns the trace of a receptive field's distance metric */
+double lwpr_aux_trace_D(const LWPR_ReceptiveField *RF);
+
+/** \brief Gradient step on a low-rank-plus-diagonal distance metric, called from
+      lwpr_aux_update_distance_metric if LWPR_Model.rank > 0. Costs O(nIn*rank^2).
+   \param[in,out] RF    Pointer to the receptive field
+   \param[in] dwdq      Derivative of w with respect to squared distance
+   \param[in] penalty   Pre-factor involved in computation of J2
+   \param[in] transMul  Transient multiplier
+   \param[in] wW        Activation divided by the accumulated activation
+   \param[in] dJ1dw     Derivative of the CV cost with respect to w
+   \param[in] dx        The difference between the normalised input x and the receptive fields centre c (nIn x 1)
+   \param[in] Ldx       L' * dx as computed by lwpr_aux_rf_distance (rank x 1)
+   \param[in] ws        Pointer to working memory that may be used
+   \return 1 if any learning rate had to be reduced, 0 otherwise
+*/
+int lwpr_aux_update_lowrank_metric(LWPR_ReceptiveField *RF, double dwdq, double penalty,
+      double transMul, double wW, double dJ1dw, const double *dx, const double *Ldx, LWPR_Workspace *ws);
 
 /** \brief Performs an update of a receptive field's distance metric.
    \param[in,out] RF    Pointer to the receptive field
@@ -114,13 +272,15 @@ void lwpr_aux_dist_derivatives(int nIn,int nInS,
    \param[in] ddwdqdq   2nd derivative of w with respect to squared distance
    \param[in] e_cv      Current cross-validation error of the RF
    \param[in] e         Current (non-CV) error
-   \param[in] xn        Normalised input vector (nIn x 1)
+   \param[in] dx        The difference between the normalised input x and the receptive fields centre c (nIn x 1),
+                        as computed for the activation w
+   \param[in] Mdx       M * dx (or L' * dx) as computed by lwpr_aux_rf_distance (nIn x 1, not used for diagonal metrics)
    \param[in] ws        Pointer to working memory that may be used
    \return              The "transient multiplier" used to dampen the distance metric updates
 */
 double lwpr_aux_update_distance_metric(LWPR_ReceptiveField *RF,
       double w, double dwdq, double ddwdqdq,
-      double e_cv, double e, const double *xn, LWPR_Workspace *ws);
+      double e_cv, double e, const double *dx, const double *Mdx, LWPR_Workspace *ws);
 
 /** \brief Performs an update of the receptive field's statistics (weighted mean input and output)
    \param[in,out] RF    Pointer to the receptive field
@@ -177,6 +337,21 @@ void lwpr_aux_compute_projection_d(int nIn, int nInS, int nReg,
       double *s, double *dsdx, const double *x,
       const double *U, const double *P, LWPR_Workspace *ws);
 
+/** \brief Computes the gradient of sum_i beta_i*s_i with respect to x, where s are the
+   PLS projections of x as computed by lwpr_aux_compute_projection. Since the projections
+   are linear in x, this is the slope of the receptive field's local model. The gradient is
+   accumulated backwards through the PLS directions in O(nIn*nReg), without forming dsdx.
+   \param[in] nIn    Number of input dimensions
+   \param[in] nInS   Storage length (stride) of matrices U and P
+   \param[in] nReg   Number of PLS regression directions
+   \param[out] g     Gradient (nIn)
+   \param[in] beta   PLS regression coefficients (nReg)
+   \param[in] U      PLS regression axes (nIn x nReg)
+   \param[in] P      PLS projection axes (nIn x nReg)
+*/
+void lwpr_aux_compute_projection_adjoint(int nIn, int nInS, int nReg,
+      double *g, const double *beta, const double *U, const double *P);
+
 /** \brief Performs an update on the regression parameters of one receptive field
    \param[in,out] RF    Pointer to the receptive field
    \param[out] yp       Predicted output of the receptive field AFTER the update
@@ -198,6 +373,108 @@ void lwpr_aux_update_regression(LWPR_ReceptiveField *RF, double *yp,
 */
 LWPR_ReceptiveField *lwpr_aux_add_rf(LWPR_SubModel *sub, int nReg);
 
+/** \brief Copies the parameters and statistics of a receptive field, as stored in model files,
+   into another receptive field of the same dimensions. The activation is carried over if it
+   belongs to the current update of the destination's model (see lwpr_rf_activation).
+   \param[in,out] RFd  Receptive field allocated with RFs->nReg regression directions
+   \param[in] RFs      Receptive field to copy from
+*/
+void lwpr_aux_copy_rf(LWPR_ReceptiveField *RFd, const LWPR_ReceptiveField *RFs);
+
+/** \brief Initialises a model with the settings, input/output statistics and input projection of
+   another model, but without any receptive fields (see lwpr_duplicate_model)
+   \param[out] dest    Pointer to an (uninitialised) LWPR_Model
+   \param[in] src      Model to copy from
+   \return
+      - 0 if the necessary memory could not be allocated
+      - 1 in case of success
+*/
+int lwpr_aux_copy_settings(LWPR_Model *dest, const LWPR_Model *src);
+
+/** \brief Starts a scan over the receptive fields that may be activated by an input
+   \param[out] scan     Scan state
+   \param[in] sub       LWPR_SubModel specific to one output dimension
+   \param[in] xn        Normalised input vector (nIn x 1)
+   \param[in] qmax      Maximal squared distance of interest, as returned by lwpr_aux_cutoff_distance
+   \param[in] scratch   Working memory (nIn) for refreshing cluster summaries, or NULL
+*/
+void lwpr_aux_rf_scan_init(LWPR_RFScan *scan, LWPR_SubModel *sub, const double *xn, double qmax, double *scratch);
+
+/** \brief Returns the next receptive field of a scan, or NULL at the end of it.
+   Without clusters, all receptive fields are returned in the order of sub->rf. Otherwise,
+   the members of clusters whose summary rules out squared distances below qmax are skipped.
+*/
+LWPR_ReceptiveField *lwpr_aux_rf_scan_next(LWPR_RFScan *scan);
+
+/** \brief Adds a receptive field to the nearest cluster that is within LWPR_Model.cluster_radius
+      and not full yet, or founds a new cluster. The centre and distance metric of the RF must be set.
+   \param[in,out] sub   LWPR_SubModel specific to one output dimension, with sub->clusters != NULL
+   \param[in,out] RF    Pointer to the receptive field (must be part of sub->rf)
+   \param[in] xc        Working memory (nIn)
+   \return
+      - 0 if memory could not be allocated, in which case all clusters of sub are removed
+      - 1 in case of success
+*/
+int lwpr_aux_cluster_insert(LWPR_SubModel *sub, LWPR_ReceptiveField *RF, double *xc);
+
+/** \brief Removes a receptive field from its cluster, and the cluster if it becomes empty */
+void lwpr_aux_cluster_remove(LWPR_SubModel *sub, LWPR_ReceptiveField *RF);
+
+/** \brief Removes all clusters of a LWPR_SubModel, which is then scanned one RF by one */
+void lwpr_aux_free_clusters(LWPR_SubModel *sub);
+
+/** \brief (Re-)builds the random-projection index of a LWPR_SubModel (see lwpr_set_index)
+   \param[in,out] sub   LWPR_SubModel specific to one output dimension, with sub->index != NULL
+   \param[in] scratch   Working memory (nIn) for computing bounding boxes
+   \return
+      - 0 if memory could not be allocated, in which case the index is marked as not ready
+      - 1 in case of success
+*/
+int lwpr_aux_build_index(LWPR_SubModel *sub, double *scratch);
+
+/** \brief Brings the random-projection index of a LWPR_SubModel up to date. Only the extents of
+      the RFs updated since the last refresh are recomputed, and only new or moved RFs are
+      projected and merged into the sorted table. The index is built anew if it is not ready,
+      e.g. because its tables are too small for the RFs.
+   \param[in,out] sub   LWPR_SubModel specific to one output dimension, with sub->index != NULL
+   \param[in] scratch   Working memory (nIn)
+   \return
+      - 0 if memory could not be allocated, in which case the index is marked as not ready
+      - 1 in case of success
+*/
+int lwpr_aux_refresh_index(LWPR_SubModel *sub, double *scratch);
+
+/** \brief Notes that position n of LWPR_SubModel.rf received a new or moved RF, so that
+      lwpr_aux_refresh_index indexes it again. Does nothing if the SubModel has no index.
+*/
+void lwpr_aux_index_note(LWPR_SubModel *sub, int n);
+
+/** \brief Marks the random-projection index of a LWPR_SubModel (if any) as not ready, after
+      the RFs have been rearranged, so that it is built anew before it is used again */
+void lwpr_aux_invalidate_index(LWPR_SubModel *sub);
+
+/** \brief Removes the random-projection index of a LWPR_SubModel */
+void lwpr_aux_free_index(LWPR_SubModel *sub);
+
+/** \brief Stores an expansion point in the Taylor cache of a model, if it has one
+   (see lwpr_set_taylor_cache). The arguments may point into the cache itself.
+   \param[in] model   Pointer to an LWPR_Model
+   \param[in] x       Input vector (nInRaw)
+   \param[in] cutoff  Cutoff parameter used for computing y and J
+   \param[in] y       Prediction at x (nOut)
+   \param[in] J       Jacobian at x (nOut x nInRaw)
+   \param[in] H       Hessians at x (nInRaw x nInRaw x nOut), or NULL
+*/
+void lwpr_aux_taylor_store(const LWPR_Model *model, const double *x, double cutoff,
+      const double *y, const double *J, const double *H);
+
+/** \brief Removes the Taylor cache of a model */
+void lwpr_aux_free_taylor(LWPR_Model *model);
+
+/** \brief Computes the factor by which the random-projection index scales the extents of
+      the receptive fields, min(1, kappa/sqrt(nIn)), where erf(kappa/sqrt(2))^nProj = recall */
+double lwpr_aux_index_kappa(int nIn, int nProj, double recall);
+
 /** \brief Check if a receptive field needs another PLS regression axis,
    and modify the relevant variables.
    \param[in,out] RF    Pointer to the receptive field
@@ -208,6 +485,24 @@ LWPR_ReceptiveField *lwpr_aux_add_rf(LWPR_SubModel *sub, int nReg);
 */
 int lwpr_aux_check_add_projection(LWPR_ReceptiveField *RF);
 
+/** \brief Removes trailing PLS regression axes of a receptive field that contribute
+   negligibly to its predictions, and shrinks the RF's storage accordingly.
+
+   The contribution of axis r is measured as beta[r]^2 * SSs2[r] / sum_w[r], that is,
+   the explained variance, relative to the sum over all axes. A trailing axis is
+   removed if its relative contribution is below <em>threshold</em>, and if the
+   cross-validation error without it (sum_e_cv2/sum_w of the previous axis) is at
+   most (1+threshold) times the error with it. At least as many axes as a new
+   RF starts with are always kept.
+
+   \param[in,out] RF           Pointer to the receptive field
+   \param[in] threshold        Relative contribution threshold, e.g. 0.01
+   \param[out] flops_predict   Approximate number of floating point operations saved per prediction (may be NULL)
+   \param[out] flops_update    Approximate number of floating point operations saved per update (may be NULL)
+   \return Number of removed PLS axes
+*/
+int lwpr_aux_prune_projections(LWPR_ReceptiveField *RF, double threshold, double *flops_predict, double *flops_update);
+
 /** \brief Allocates and initialises the variables of a receptive field.
    \param[in,out] RF Pointer to the receptive field to be initialised
    \param[in] model  Pointer to the LWPR model the RF belongs to
@@ -229,12 +524,15 @@ int lwpr_aux_init_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model,
    \param[in]  yn       Normalised input sample (specific to output dimension "dim")
    \param[out] y_pred   Prediction for yn after update
    \param[out] max_w    Maximum activation over all receptive fields
+   \param[in]  ws       Workspace for running all receptive fields in the calling thread, or NULL
+                        for spreading them over NUM_THREADS threads (using LWPR_Model.ws).
+                        Both give the same results.
    \return
       - 1 in case of success
       - 0 if a receptive field would have to be added, but memory allocation failed
 */
 int lwpr_aux_update_one(LWPR_Model *model, int dim, const double *xn,
-      double yn, double *y_pred, double *max_w);
+      double yn, double *y_pred, double *max_w, LWPR_Workspace *ws);
 
 /** \brief Thread function for updating a subset of receptive fields
    \param[in] ptr    Pointer to an LWPR_ThreadData structure
@@ -256,6 +554,39 @@ void *lwpr_aux_update_one_T(void *ptr);
 int lwpr_aux_update_one_add_prune(LWPR_Model *model, LWPR_ThreadData *TD,
       int dim, const double *xn, double yn);
 
+/** \brief Adds or prunes receptive fields like lwpr_aux_update_one_add_prune, without
+   announcing the change to concurrent readers (see lwpr_set_concurrent)
+*/
+int lwpr_aux_add_prune(LWPR_Model *model, LWPR_ThreadData *TD,
+      int dim, const double *xn, double yn);
+
+/** \brief Adds a receptive field centred at xn to one output dimension of the LWPR model
+   \param[in,out] model Pointer to the LWPR model
+   \param[in]  dim      Output dimension
+   \param[in]  RFT      Receptive field whose distance metric and PLS directions are used as a
+                        template, or NULL to start from the initial distance metric
+   \param[in]  xn       Normalised input vector (centre of the new RF)
+   \param[in]  yn       Normalised output sample (specific to output dimension "dim")
+   \param[in]  scratch  Working memory (nIn) for inserting the new RF into a cluster
+   \return
+      - 1 in case of success
+      - 0 if memory allocation failed
+*/
+int lwpr_aux_new_rf(LWPR_Model *model, int dim, const LWPR_ReceptiveField *RFT,
+      const double *xn, double yn, double *scratch);
+
+/** \brief Chooses which of two overlapping receptive fields (indices into LWPR_SubModel.rf) is pruned */
+int lwpr_aux_prune_choice(const LWPR_SubModel *sub, int ind_max, int ind_sec);
+
+/** \brief Removes the receptive field at index <em>prune</em> from one output dimension of the
+   LWPR model, filling the gap with the last receptive field
+*/
+void lwpr_aux_remove_rf(LWPR_Model *model, int dim, int prune);
+
+/** \brief Accumulates sums and the two largest activations of the threads TD[1..num-1] in TD[0]
+*/
+void lwpr_aux_combine_threads(LWPR_ThreadData *TD, int num);
+
 /** \brief Computes the prediction of an LWPR model for a specific output dimension.
       Can also return confidence bounds and the maximal activation of all receptive fields.
    \param[in] model  Must point to a valid LWPR_Model structure
@@ -380,6 +711,31 @@ double lwpr_aux_predict_one_gH(const LWPR_Model *model, int dim,
 */
 void *lwpr_aux_predict_one_J_T(void *ptr);
 
+/** \brief Like lwpr_aux_predict_one_J_T, but computes only the derivatives with respect
+      to the input dimensions selected by \e inMask (in the LWPR_ThreadData structure).
+
+   If \e inMask is NULL, this is equivalent to lwpr_aux_predict_one_J_T. Otherwise, only
+   the elements of \e sum_dwdx with inMask[i] != 0 are written, and D*(x-c) is only
+   evaluated at those elements for each activated receptive field.
+*/
+void *lwpr_aux_predict_one_Jsel_T(void *ptr);
+
+/** \brief Computes the prediction and its derivative along the direction \e vn
+      (in the LWPR_ThreadData structure) for one output dimension.
+
+   The slopes of receptive fields whose cached slope is not available are applied to
+   \e vn by projecting it onto the PLS directions, so no derivatives of the projections
+   are formed and the cache is left as it is. The results are stored in \e yn and \e yn_dir.
+*/
+void *lwpr_aux_predict_one_jvp_T(void *ptr);
+
+/** \brief Computes the prediction and its gradient for one output dimension, like
+      lwpr_aux_predict_one_J_T, but obtains slopes that are not cached yet by
+      lwpr_aux_compute_projection_adjoint, without filling the cache.
+      The gradient is stored in \e sum_dwdx of the thread's LWPR_Workspace.
+*/
+void *lwpr_aux_predict_one_grad_T(void *ptr);
+
 
 /** \brief Thread function for predicting output and gradient for one SubModel
    \param[in,out] ptr    Pointer to an LWPR_ThreadData structure
@@ -426,6 +782,76 @@ void *lwpr_aux_predict_one_gH_T(void *ptr);
 */
 void lwpr_aux_update_model_stats(LWPR_Model *model, const double *x);
 
+/** \brief Projects a raw input vector onto the input space of the receptive fields
+   \param[in] model  Pointer to an LWPR model structure with an input projection
+   \param[in] x      Raw input vector (nInRaw)
+   \param[out] z     Projected input vector z = P*x (nIn, not normalised)
+*/
+void lwpr_aux_project_input(const LWPR_Model *model, const double *x, double *z);
+
+/** \brief Maps a raw input vector to the normalised input of the receptive fields,
+      projecting it first if the model uses an input projection
+   \param[in] model  Pointer to an LWPR model structure
+   \param[in] x      Raw input vector (nInRaw)
+   \param[out] xn    Normalised (and projected) input vector (nIn)
+*/
+void lwpr_aux_normalise_input(const LWPR_Model *model, const double *x, double *xn);
+
+/** \brief Updates the mean and covariance of the raw inputs, and refines the
+      input projection every LWPR_Model.proj_interval samples.
+   \param[in,out] model Pointer to an LWPR model structure with an input projection
+   \param[in]  x        Raw input vector x (nInRaw)
+
+   Must be called before lwpr_aux_update_model_stats, since it uses LWPR_Model.n_data
+   as the number of previously seen samples.
+*/
+void lwpr_aux_update_projection(LWPR_Model *model, const double *x);
+
+/** \brief Performs one step of orthogonal iteration of the input projection
+      towards the leading principal directions of the raw input covariance
+   \param[in,out] model Pointer to an LWPR model structure with an input projection
+   \return
+      - 1 if the projection was refined
+      - 0 if the projection was left unchanged (degenerate covariance)
+*/
+int lwpr_aux_refine_projection(LWPR_Model *model);
+
+/** \brief Maps Jacobians w.r.t. the projected inputs back to the raw inputs, J = Jz*P
+   \param[in] model  Pointer to an LWPR model structure with an input projection
+   \param[in] Jz     Jacobians w.r.t. projected inputs (nOut x nIn)
+   \param[out] J     Jacobians w.r.t. raw inputs (nOut x nInRaw)
+*/
+void lwpr_aux_unproject_J(const LWPR_Model *model, const double *Jz, double *J);
+
+/** \brief Maps Hessians w.r.t. the projected inputs back to the raw inputs, H = P'*Hz*P
+   \param[in] model  Pointer to an LWPR model structure with an input projection
+   \param[in] Hz     Hessians w.r.t. projected inputs (nIn x nIn x nOut)
+   \param[out] H     Hessians w.r.t. raw inputs (nInRaw x nInRaw x nOut)
+*/
+void lwpr_aux_unproject_H(const LWPR_Model *model, const double *Hz, double *H);
+
+/** \brief Returns the temporary nIn x nInRaw matrix within LWPR_Model.proj_work
+   \param[in] model  Pointer to an LWPR model structure with an input projection
+
+   The workspace starts with the reduced Jacobians (nOut x nIn), the reduced Jacobians
+   of the confidence bounds (nOut x nIn) and the reduced Hessians (nIn x nIn x nOut).
+*/
+double *lwpr_aux_projection_temp(const LWPR_Model *model);
+
+/** \brief Decides whether a training sample passes the throttling gate, that is,
+      whether its prediction error exceeds LWPR_Model.gate_factor times the confidence bound
+      in at least one output dimension.
+   \param[in] model   Pointer to an LWPR model structure
+   \param[in] xn      Normalised input vector (nIn)
+   \param[in] yn      Normalised output vector (nOut)
+   \param[out] yp     Current prediction (not normalised), must be NULL or point to nOut doubles
+   \param[out] max_w  Maximal activation per output dimension, must be NULL or point to nOut doubles
+   \return
+      - 1 if the sample should be used for training
+      - 0 if the sample carries no new information
+*/
+int lwpr_aux_gate_sample(const LWPR_Model *model, const double *xn, const double *yn, double *yp, double *max_w);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,267 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_repl.h>
+#include <lwpr/core/lwpr_conc.h>
+#include <lwpr/core/lwpr_batch.h>
+#include <math.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if NUM_THREADS > 1
+   #ifdef WIN32
+      #include <windows.h>
+   #else
+      #include <pthread.h>
+   #endif
+#endif
+
+/* Work of one thread in the regression phase: entries thread, thread+NUM_THREADS, ...
+** of TD (all samples of all output dimensions, in order) */
+typedef struct {
+   LWPR_ThreadData *TD;
+   int num;
+   int thread;
+   int max_w;
+} LWPR_BatchSlice;
+
+static void *lwpr_batch_slice_T(void *ptr) {
+   LWPR_BatchSlice *S = (LWPR_BatchSlice *) ptr;
+   int k;
+
+   for (k=0;k<S->num;k++) {
+      LWPR_ThreadData *T = &S->TD[k*NUM_THREADS + S->thread];
+
+      (void) lwpr_aux_update_one_T(T);
+      /* The RFs of this slice are only changed by this thread, so they are still
+      ** the ones the sample saw. Such a maximum stays below all thresholds. */
+      if (S->max_w) T->w_max = lwpr_aux_max_activation(T->model, T->dim, T->xn, T->w_max, T->start, T->end, T->incr, T->ws->dx);
+   }
+   return NULL;
+}
+
+/* Runs the slices of all threads, each in its own thread if possible */
+static void lwpr_batch_regression(LWPR_ThreadData *TD, int num, int max_w) {
+   LWPR_BatchSlice S[NUM_THREADS];
+   int i;
+
+#if NUM_THREADS > 1
+   #ifdef WIN32
+      HANDLE thread[NUM_THREADS-1];
+      DWORD ID[NUM_THREADS-1];
+   #else
+      pthread_t thread[NUM_THREADS-1];
+      int rc[NUM_THREADS-1];
+   #endif
+#endif
+
+   for (i=0;i<NUM_THREADS;i++) {
+      S[i].TD = TD;
+      S[i].num = num;
+      S[i].thread = i;
+      S[i].max_w = max_w;
+   }
+
+#if NUM_THREADS > 1
+   for (i=0;i<NUM_THREADS-1;i++) {
+   #ifdef WIN32
+      thread[i] = CreateThread(NULL,0, lwpr_batch_slice_T ,&S[i],0, &ID[i]);
+   #else
+      rc[i] = pthread_create(&thread[i], NULL, lwpr_batch_slice_T, &S[i]);
+   #endif
+   }
+#endif
+
+   (void) lwpr_batch_slice_T(&S[NUM_THREADS-1]);
+
+#if NUM_THREADS > 1
+   /* Wait for other threads to finish, or do their calculations if they
+   ** couldn't be spawned in the first place */
+   for (i=0;i<NUM_THREADS-1;i++) {
+   #ifdef WIN32
+      if (thread[i]!=NULL) {
+         WaitForSingleObject(thread[i],INFINITE);
+         CloseHandle(thread[i]);
+   #else
+      if (rc[i]==0) {
+         pthread_join(thread[i],NULL);
+   #endif
+      } else {
+         (void) lwpr_batch_slice_T(&S[i]);
+      }
+   }
+#endif
+}
+
+/* Activation of a receptive field at xn, or 0 if xn is farther away than qmax */
+static double lwpr_batch_activation(const LWPR_Model *model, LWPR_ReceptiveField *RF,
+      const double *xn, double qmax, LWPR_Workspace *ws) {
+   double dist, w;
+
+   if (!lwpr_aux_rf_distance(RF, xn, qmax, ws->dx, ws->Mx, NULL, &dist)) return 0.0;
+
+   switch(model->kernel) {
+      case LWPR_GAUSSIAN_KERNEL:
+         return exp(-0.5*dist);
+      case LWPR_BISQUARE_KERNEL:
+         w = 1-0.25*dist;
+         return (w<0) ? 0.0 : w*w;
+   }
+   return 0.0;
+}
+
+/* Resolves the add and prune proposals of the N samples of output dimension dim (TD[k*NUM_THREADS]
+** holds the combined results of sample k) and applies them. dead holds space for the RFs of dim. */
+static int lwpr_batch_structure(LWPR_Model *model, int dim, const LWPR_ThreadData *TD, int N, int *dead) {
+   LWPR_SubModel *sub = &model->sub[dim];
+   LWPR_Workspace *ws = &model->ws[0];
+   int numOld = sub->numRFS;
+   double qmax = lwpr_aux_cutoff_distance(model->kernel, model->w_gen);
+   int k,n,ok = 1;
+
+   if (model->conc != NULL) lwpr_conc_write_begin(&sub->seq);
+
+   for (n=0;n<numOld;n++) dead[n] = 0;
+
+   for (k=0;k<N;k++) {
+      const LWPR_ThreadData *T = &TD[k*NUM_THREADS];
+
+      if (T->w_max <= model->w_gen) {
+         const LWPR_ReceptiveField *RFT = NULL;
+
+         /* Already covered by an RF added for an earlier sample? */
+         for (n=numOld;n<sub->numRFS;n++) {
+            if (lwpr_batch_activation(model, sub->rf[n], T->xn, qmax, ws) > model->w_gen) break;
+         }
+         if (n<sub->numRFS) continue;
+
+         if ((T->w_max > 0.1*model->w_gen) && !dead[T->ind_max] && (sub->rf[T->ind_max]->trustworthy)) {
+            RFT = sub->rf[T->ind_max];
+         }
+         if (!lwpr_aux_new_rf(model, dim, RFT, T->xn, T->yn, ws->xc)) ok = 0;
+      } else if (T->w_sec > model->w_prune) {
+         if (dead[T->ind_max] || dead[T->ind_sec]) continue;
+         dead[lwpr_aux_prune_choice(sub, T->ind_max, T->ind_sec)] = 1;
+      }
+   }
+
+   /* From the back, so that the RF moved into a gap is never one that is still to be removed */
+   for (n=numOld-1;n>=0;n--) {
+      if (dead[n]) lwpr_aux_remove_rf(model, dim, n);
+   }
+
+   if (model->conc != NULL) lwpr_conc_write_end(&sub->seq);
+   return ok;
+}
+
+/* Trains the samples one after another */
+static int lwpr_batch_serial(LWPR_Model *model, int N, const double *X, const double *Y, double *Yp, double *max_w) {
+   int k, ok = 1;
+
+   for (k=0;k<N;k++) {
+      ok &= lwpr_update(model, X + k*model->nInRaw, Y + k*model->nOut,
+            (Yp != NULL) ? Yp + k*model->nOut : NULL, (max_w != NULL) ? max_w + k*model->nOut : NULL);
+   }
+   return ok;
+}
+
+int lwpr_update_batch(LWPR_Model *model, int N, const double *X, const double *Y, double *Yp, double *max_w) {
+   int nIn = model->nIn;
+   int nOut = model->nOut;
+   LWPR_ThreadData *TD;
+   double *xn, *yn;
+   int *dead;
+   int i,k,dim,maxRF = 1,ok = 1;
+
+   if (N <= 0) return 1;
+   if (model->lazy != NULL && !lwpr_finish_loading(model)) return 0;
+
+   if (model->gate_factor > 0.0 || model->proj_P != NULL || model->rec != NULL) {
+      return lwpr_batch_serial(model, N, X, Y, Yp, max_w);
+   }
+
+   for (dim=0;dim<nOut;dim++) {
+      if (model->sub[dim].numRFS > maxRF) maxRF = model->sub[dim].numRFS;
+   }
+
+   TD = (LWPR_ThreadData *) LWPR_MALLOC(sizeof(LWPR_ThreadData)*N*nOut*NUM_THREADS);
+   xn = (double *) LWPR_MALLOC(sizeof(double)*N*(nIn + nOut));
+   dead = (int *) LWPR_MALLOC(sizeof(int)*maxRF);
+   if (TD == NULL || xn == NULL || dead == NULL) {
+      if (TD != NULL) LWPR_FREE(TD);
+      if (xn != NULL) LWPR_FREE(xn);
+      if (dead != NULL) LWPR_FREE(dead);
+      return lwpr_batch_serial(model, N, X, Y, Yp, max_w);
+   }
+   yn = xn + N*nIn;
+
+   for (k=0;k<N;k++) {
+      const double *x = X + k*nIn;
+      const double *y = Y + k*nOut;
+
+      lwpr_aux_update_model_stats(model,x);
+      for (i=0;i<nIn;i++) xn[k*nIn + i]=x[i]/model->norm_in[i];
+      for (i=0;i<nOut;i++) yn[k*nOut + i]=y[i]/model->norm_out[i];
+   }
+
+   for (dim=0;dim<nOut;dim++) {
+      for (k=0;k<N;k++) {
+         LWPR_ThreadData *T = &TD[(dim*N + k)*NUM_THREADS];
+
+         for (i=0;i<NUM_THREADS;i++) {
+            T[i].model = model;
+            T[i].dim = dim;
+            T[i].xn = xn + k*nIn;
+            T[i].yn = yn[k*nOut + dim];
+            T[i].incr = NUM_THREADS;
+            T[i].start = i;
+            T[i].end = model->sub[dim].numRFS;
+            T[i].ws = &model->ws[i];
+            T[i].stamp = model->n_updates + k + 1;
+            T[i].weight = 1.0;
+         }
+      }
+   }
+
+   lwpr_batch_regression(TD, N*nOut, max_w != NULL);
+   model->n_updates += N;
+
+   for (dim=0;dim<nOut;dim++) {
+      for (k=0;k<N;k++) {
+         LWPR_ThreadData *T = &TD[(dim*N + k)*NUM_THREADS];
+
+         lwpr_aux_combine_threads(T, NUM_THREADS);
+         if (max_w!=NULL) max_w[k*nOut + dim] = T->w_max;
+         if (Yp!=NULL) Yp[k*nOut + dim] = ((T->sum_w > 0.0) ? T->yp/T->sum_w : 0.0) * model->norm_out[dim];
+      }
+      ok &= lwpr_batch_structure(model, dim, TD + dim*N*NUM_THREADS, N, dead);
+   }
+
+   LWPR_FREE(dead);
+   LWPR_FREE(xn);
+   LWPR_FREE(TD);
+
+   if (model->repl != NULL) lwpr_repl_tick(model->repl);
+   if (model->conc != NULL) lwpr_conc_collect(model->conc);
+   return ok;
+}
@@ -0,0 +1,100 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_batch.h
+   \brief Prototypes for updating an LWPR model with a batch of samples
+
+   lwpr_update adds and prunes receptive fields right after each sample, based on the two
+   largest activations over all receptive fields of an output dimension. Threads that share
+   the receptive fields therefore have to be joined after every sample. lwpr_update_batch
+   separates the two phases:
+   - In the regression phase, each of the NUM_THREADS threads updates its slice of the receptive
+     fields of every output dimension with all samples of the batch, in order. Each receptive
+     field sees the same samples in the same order as with lwpr_update, and the threads are
+     started only once per batch. Per sample and output dimension, the thread results are
+     combined in the same order as in lwpr_update, and give <em>yp</em>, <em>max_w</em>, and
+     a proposal to add a receptive field (largest activation below LWPR_Model.w_gen) or to
+     prune one of the two most active ones (second largest activation above LWPR_Model.w_prune).
+   - In the structural phase, the proposals of each output dimension are resolved in the order
+     of the samples, and applied in one pass:
+     - A proposal to add a receptive field is dropped if a receptive field added for an earlier
+       sample of the batch is activated by more than LWPR_Model.w_gen at its input (two new
+       receptive fields would cover the same point).
+     - A proposal to prune is dropped if either receptive field is already pruned for an
+       earlier sample (the overlap is resolved already). Otherwise the one chosen as in
+       lwpr_update is marked.
+     - A marked receptive field is not used as the template of a new one.
+     - Marked receptive fields are removed after all additions, from the highest index to the
+       lowest, so the indices of the proposals stay valid throughout.
+
+   The decisions only depend on the samples and the model, not on the number of threads or
+   their timing. If no receptive fields are added or pruned, the model is the same as after
+   calling lwpr_update for each sample. Otherwise, the batch differs from lwpr_update in that
+   a new receptive field is not trained with the rest of the batch, and a pruned receptive
+   field is still trained until the end of it. Small batches stay close to lwpr_update.
+
+   Samples are passed through lwpr_update one by one (with the same result as a batch of size
+   one) if the model uses the throttling gate (lwpr_set_gate), learns its input projection
+   (lwpr_set_projection), or its calls are recorded (lwpr_record_start), or if the working
+   memory of the batch cannot be allocated. A batch counts as one update for the
+   interval of the replication (lwpr_repl_start).
+
+   \code
+   double X[64*nInRaw], Y[64*nOut], Yp[64*nOut];
+   ... fill X, Y with 64 samples ...
+   lwpr_update_batch(&model, 64, X, Y, Yp, NULL);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_BATCH_H
+#define __LWPR_BATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct LWPR_Model;
+
+/** \brief Updates an LWPR model with a batch of input/output pairs, see lwpr_batch.h
+
+   \param[in,out] model  Must point to a valid LWPR_Model structure
+   \param[in] N          Number of samples
+   \param[in] X          Input vectors, one after another (<em>nInRaw x N</em>)
+   \param[in] Y          Output vectors, one after another (<em>nOut x N</em>)
+   \param[out] Yp        Predictions given each input vector, made while the receptive fields are
+                         updated as in lwpr_update. Must be NULL or point to <em>nOut x N</em> doubles
+   \param[out] max_w     Maximum activation per sample and output dimension. Must be NULL or point to
+                         <em>nOut x N</em> doubles
+   \return
+      - 1 if the update was succesful
+      - 0 if a receptive field would have to be added, but the necessary memory could not be allocated,
+        or if the training statistics of a model read by lwpr_read_binary_lazy could not be loaded.
+   \ingroup LWPR_C
+*/
+int lwpr_update_batch(struct LWPR_Model *model, int N, const double *X, const double *Y,
+      double *Yp, double *max_w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
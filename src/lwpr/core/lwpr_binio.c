@@ -25,8 +25,37 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <string.h>
 #include <stdlib.h>
 
-
-#define LWPR_BINIO_VERSION    -1
+#ifdef WIN32
+   #include <windows.h>
+#elif NUM_THREADS > 1
+   #include <pthread.h>
+#endif
+
+
+#define LWPR_BINIO_VERSION    -4
+/* Files of version -1 do not contain the block structure of the distance metrics,
+** files of version -2 do not contain the rank of low-rank metrics,
+** files of version -3 do not contain the input projection */
+#define LWPR_BINIO_VERSION_NOBLOCKS  -1
+#define LWPR_BINIO_VERSION_NORANK    -2
+#define LWPR_BINIO_VERSION_NOPROJ    -3
+
+/* State of a model whose training statistics are still to be read, see lwpr_read_binary_lazy */
+struct LWPR_LazyLoad {
+   FILE *fp;                     /* The model file, kept open until the second phase is done */
+   LWPR_ReceptiveField **rf;     /* The receptive fields in the order of the file */
+   long *offset;                 /* File offsets of the fields of rf[i] (just after nReg) */
+   int numRF;                    /* Number of entries in rf and offset */
+   int numPointers;              /* Number of entries that can be stored before a re-allocation is necessary */
+   volatile int cancel;          /* Tells the background thread to stop */
+   int state;                    /* 0 = second phase pending, 1 = running in the background, 2 = done */
+   int ok;                       /* Result of the second phase */
+#ifdef WIN32
+   HANDLE thread;
+#elif NUM_THREADS > 1
+   pthread_t thread;
+#endif
+};
 
 
 int lwpr_io_write_matrix(FILE *fp,int M, int Ms, int N, const double *data) {
@@ -71,6 +100,21 @@ int lwpr_io_read_int(FILE *fp, int *data) {
    return (int) fread(data, sizeof(int), 1, fp);
 }
 
+/* Writes a packed distance matrix of a RF (D, M, alpha, h, b) as a dense nIn x nIn matrix,
+** with zeros outside the blocks (see LWPR_Model.metric_col) */
+static int lwpr_io_write_metric(FILE *fp, const LWPR_Model *model, const double *data) {
+   int i,j,ok = 1;
+
+   for (j=0;j<model->nIn;j++) {
+      int b = model->block_begin[j];
+      int e = model->block_end[j];
+      for (i=0;i<b;i++) ok &= lwpr_io_write_scalar(fp,0.0);
+      ok &= lwpr_io_write_vector(fp,e-b,data + b + model->metric_col[j]);
+      for (i=e;i<model->nIn;i++) ok &= lwpr_io_write_scalar(fp,0.0);
+   }
+   return ok;
+}
+
 int lwpr_io_write_rf(FILE *fp, const LWPR_ReceptiveField *RF) {
    int ok;
    int nIn = RF->model->nIn;
@@ -79,9 +123,14 @@ int lwpr_io_write_rf(FILE *fp, const LWPR_ReceptiveField *RF) {
 
    ok = (fwrite("[RF]", 1, 4, fp)==4) ? 1:0;
    ok &= lwpr_io_write_int(fp, nReg);
-   ok &= lwpr_io_write_matrix(fp,nIn,nInS,nIn,RF->D);
-   ok &= lwpr_io_write_matrix(fp,nIn,nInS,nIn,RF->M);
-   ok &= lwpr_io_write_matrix(fp,nIn,nInS,nIn,RF->alpha);
+   if (RF->L != NULL) {
+      ok &= lwpr_io_write_matrix(fp,nIn,nInS,RF->model->rank+1,RF->L);
+      ok &= lwpr_io_write_matrix(fp,nIn,nInS,RF->model->rank+1,RF->alpha);
+   } else {
+      ok &= lwpr_io_write_metric(fp,RF->model,RF->D);
+      ok &= lwpr_io_write_metric(fp,RF->model,RF->M);
+      ok &= lwpr_io_write_metric(fp,RF->model,RF->alpha);
+   }
    ok &= lwpr_io_write_scalar(fp,RF->beta0);
    ok &= lwpr_io_write_vector(fp,nReg,RF->beta);
    ok &= lwpr_io_write_vector(fp,nIn,RF->c);
@@ -93,8 +142,10 @@ int lwpr_io_write_rf(FILE *fp, const LWPR_ReceptiveField *RF) {
    ok &= lwpr_io_write_matrix(fp,nIn,nInS,nReg,RF->P);
    ok &= lwpr_io_write_vector(fp,nReg,RF->H);
    ok &= lwpr_io_write_vector(fp,nReg,RF->r);
-   ok &= lwpr_io_write_matrix(fp,nIn,nInS,nIn,RF->h);
-   ok &= lwpr_io_write_matrix(fp,nIn,nInS,nIn,RF->b);
+   if (RF->L == NULL) {
+      ok &= lwpr_io_write_metric(fp,RF->model,RF->h);
+      ok &= lwpr_io_write_metric(fp,RF->model,RF->b);
+   }
    ok &= lwpr_io_write_vector(fp,nReg,RF->sum_w);
    ok &= lwpr_io_write_vector(fp,nReg,RF->sum_e_cv2);
    ok &= lwpr_io_write_scalar(fp,RF->sum_e2);
@@ -104,16 +155,101 @@ int lwpr_io_write_rf(FILE *fp, const LWPR_ReceptiveField *RF) {
    ok &= lwpr_io_write_vector(fp,nReg,RF->lambda);
    ok &= lwpr_io_write_vector(fp,nIn,RF->mean_x);
    ok &= lwpr_io_write_vector(fp,nIn,RF->var_x);
-   ok &= lwpr_io_write_scalar(fp,RF->w);
+   ok &= lwpr_io_write_scalar(fp,lwpr_rf_activation(RF));
    ok &= lwpr_io_write_vector(fp,nReg,RF->s);
    return ok;
 }
 
-int lwpr_io_read_rf(FILE *fp, LWPR_SubModel *sub) {
+/* Reads a matrix if <em>want</em> is set, and skips it otherwise */
+static int lwpr_io_get_matrix(FILE *fp, int want, int M, int Ms, int N, double *data) {
+   if (want) return lwpr_io_read_matrix(fp, M, Ms, N, data);
+   return (fseek(fp, (long) (sizeof(double)*M*N), SEEK_CUR) == 0) ? 1:0;
+}
+
+static int lwpr_io_get_vector(FILE *fp, int want, int N, double *data) {
+   if (want) return lwpr_io_read_vector(fp, N, data);
+   return (fseek(fp, (long) (sizeof(double)*N), SEEK_CUR) == 0) ? 1:0;
+}
+
+static int lwpr_io_get_scalar(FILE *fp, int want, double *data) {
+   if (want) return lwpr_io_read_scalar(fp, data);
+   return (fseek(fp, (long) sizeof(double), SEEK_CUR) == 0) ? 1:0;
+}
+
+static int lwpr_io_get_int(FILE *fp, int want, int *data) {
+   if (want) return lwpr_io_read_int(fp, data);
+   return (fseek(fp, (long) sizeof(int), SEEK_CUR) == 0) ? 1:0;
+}
+
+/* Reads the blocks of a dense distance matrix into the packed layout if <em>want</em> is set,
+** and skips the matrix otherwise (inverse of lwpr_io_write_metric). The zeros outside the
+** blocks are read, not skipped, since the stream may be a pipe (see lwpr_replica_apply) */
+static int lwpr_io_get_metric(FILE *fp, int want, const LWPR_Model *model, double *data) {
+   int i,j,ok = 1;
+   double zero;
+
+   if (!want) return lwpr_io_get_matrix(fp, 0, model->nIn, model->nIn, model->nIn, data);
+   for (j=0;j<model->nIn;j++) {
+      int b = model->block_begin[j];
+      int e = model->block_end[j];
+      for (i=0;i<b;i++) ok &= lwpr_io_read_scalar(fp,&zero);
+      ok &= lwpr_io_read_vector(fp,e-b,data + b + model->metric_col[j]);
+      for (i=e;i<model->nIn;i++) ok &= lwpr_io_read_scalar(fp,&zero);
+   }
+   return ok;
+}
+
+int lwpr_io_read_rf_fields(FILE *fp, LWPR_ReceptiveField *RF, int phases) {
+   int ok = 1;
+   int nIn = RF->model->nIn;
+   int nInS = RF->model->nInStore;
+   int nReg = RF->nReg;
+   int P = phases & LWPR_LOAD_PREDICT;
+   int T = phases & LWPR_LOAD_TRAIN;
+
+   if (RF->L != NULL) {
+      ok &= lwpr_io_get_matrix(fp,P,nIn,nInS,RF->model->rank+1,RF->L);
+      ok &= lwpr_io_get_matrix(fp,T,nIn,nInS,RF->model->rank+1,RF->alpha);
+   } else {
+      ok &= lwpr_io_get_metric(fp,P,RF->model,RF->D);
+      ok &= lwpr_io_get_metric(fp,P,RF->model,RF->M);
+      ok &= lwpr_io_get_metric(fp,T,RF->model,RF->alpha);
+   }
+   ok &= lwpr_io_get_scalar(fp,P,&RF->beta0);
+   ok &= lwpr_io_get_vector(fp,P,nReg,RF->beta);
+   ok &= lwpr_io_get_vector(fp,P,nIn,RF->c);
+   ok &= lwpr_io_get_matrix(fp,T,nIn,nInS,nReg,RF->SXresYres);
+   ok &= lwpr_io_get_vector(fp,P,nReg,RF->SSs2);
+   ok &= lwpr_io_get_vector(fp,T,nReg,RF->SSYres);
+   ok &= lwpr_io_get_matrix(fp,T,nIn,nInS,nReg,RF->SSXres);
+   ok &= lwpr_io_get_matrix(fp,P,nIn,nInS,nReg,RF->U);
+   ok &= lwpr_io_get_matrix(fp,P,nIn,nInS,nReg,RF->P);
+   ok &= lwpr_io_get_vector(fp,T,nReg,RF->H);
+   ok &= lwpr_io_get_vector(fp,T,nReg,RF->r);
+   if (RF->L == NULL) {
+      ok &= lwpr_io_get_metric(fp,T,RF->model,RF->h);
+      ok &= lwpr_io_get_metric(fp,T,RF->model,RF->b);
+   }
+   ok &= lwpr_io_get_vector(fp,P,nReg,RF->sum_w);
+   ok &= lwpr_io_get_vector(fp,P,nReg,RF->sum_e_cv2);
+   ok &= lwpr_io_get_scalar(fp,T,&RF->sum_e2);
+   ok &= lwpr_io_get_scalar(fp,P,&RF->SSp);
+   ok &= lwpr_io_get_vector(fp,P,nReg,RF->n_data);
+   ok &= lwpr_io_get_int(fp,P,&RF->trustworthy);
+   ok &= lwpr_io_get_vector(fp,T,nReg,RF->lambda);
+   ok &= lwpr_io_get_vector(fp,P,nIn,RF->mean_x);
+   ok &= lwpr_io_get_vector(fp,T,nIn,RF->var_x);
+   ok &= lwpr_io_get_scalar(fp,T,&RF->w);
+   ok &= lwpr_io_get_vector(fp,T,nReg,RF->s);
+   return ok;
+}
+
+/* Reads the header of an RF record and adds the receptive field to the submodel. If lazy is not NULL,
+   only the fields needed for predictions are read, and the position of the record is noted. */
+static int lwpr_io_read_rf_lazy(FILE *fp, LWPR_SubModel *sub, struct LWPR_LazyLoad *lazy) {
    char str[5];
    int ok;
    int nIn = sub->model->nIn;
-   int nInS = sub->model->nInStore;
    int nReg;
    LWPR_ReceptiveField *RF;
 
@@ -128,34 +264,30 @@ int lwpr_io_read_rf(FILE *fp, LWPR_SubModel *sub) {
    RF = lwpr_aux_add_rf(sub,nReg);
    if (RF==NULL) return 0;
 
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nIn,RF->D);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nIn,RF->M);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nIn,RF->alpha);
-   ok &= lwpr_io_read_scalar(fp,&RF->beta0);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->beta);
-   ok &= lwpr_io_read_vector(fp,nIn,RF->c);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nReg,RF->SXresYres);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->SSs2);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->SSYres);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nReg,RF->SSXres);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nReg,RF->U);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nReg,RF->P);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->H);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->r);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nIn,RF->h);
-   ok &= lwpr_io_read_matrix(fp,nIn,nInS,nIn,RF->b);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->sum_w);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->sum_e_cv2);
-   ok &= lwpr_io_read_scalar(fp,&RF->sum_e2);
-   ok &= lwpr_io_read_scalar(fp,&RF->SSp);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->n_data);
-   ok &= lwpr_io_read_int(fp,&RF->trustworthy);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->lambda);
-   ok &= lwpr_io_read_vector(fp,nIn,RF->mean_x);
-   ok &= lwpr_io_read_vector(fp,nIn,RF->var_x);
-   ok &= lwpr_io_read_scalar(fp,&RF->w);
-   ok &= lwpr_io_read_vector(fp,nReg,RF->s);
-   return ok;
+   if (lazy == NULL) return lwpr_io_read_rf_fields(fp, RF, LWPR_LOAD_ALL);
+
+   if (lazy->numRF == lazy->numPointers) {
+      int num = lazy->numPointers + 64;
+      LWPR_ReceptiveField **rf = (LWPR_ReceptiveField **) LWPR_REALLOC(lazy->rf, num*sizeof(LWPR_ReceptiveField *));
+      long *offset;
+
+      if (rf == NULL) return 0;
+      lazy->rf = rf;
+      offset = (long *) LWPR_REALLOC(lazy->offset, num*sizeof(long));
+      if (offset == NULL) return 0;
+      lazy->offset = offset;
+      lazy->numPointers = num;
+   }
+   lazy->rf[lazy->numRF] = RF;
+   lazy->offset[lazy->numRF] = ftell(fp);
+   if (lazy->offset[lazy->numRF] < 0) return 0;
+   lazy->numRF++;
+
+   return lwpr_io_read_rf_fields(fp, RF, LWPR_LOAD_PREDICT);
+}
+
+int lwpr_io_read_rf(FILE *fp, LWPR_SubModel *sub) {
+   return lwpr_io_read_rf_lazy(fp, sub, NULL);
 }
 
 int lwpr_write_binary_fp(const LWPR_Model *model, FILE *fp) {
@@ -166,6 +298,9 @@ int lwpr_write_binary_fp(const LWPR_Model *model, FILE *fp) {
    int i,dim;
    int version = LWPR_BINIO_VERSION;
 
+   /* Loading the training statistics completes the model without changing its predictions */
+   if (model->lazy != NULL && !lwpr_finish_loading((LWPR_Model *) model)) return 0;
+
    ok = (int) fwrite("LWPR", sizeof(char), 4, fp);
    if (ok!=4) return 0;
 
@@ -185,6 +320,22 @@ int lwpr_write_binary_fp(const LWPR_Model *model, FILE *fp) {
    ok &= lwpr_io_write_vector(fp, nIn, model->mean_x);
    ok &= lwpr_io_write_vector(fp, nIn, model->var_x);
    ok &= lwpr_io_write_int(fp, model->diag_only);
+   ok &= lwpr_io_write_int(fp, model->nBlocks);
+   for (i=0;i<nIn;i=model->block_end[i]) {
+      ok &= lwpr_io_write_int(fp, model->block_end[i] - i);
+   }
+   ok &= lwpr_io_write_int(fp, model->rank);
+   if (model->proj_P != NULL) {
+      int nInRaw = model->nInRaw;
+
+      ok &= lwpr_io_write_int(fp, nInRaw);
+      ok &= lwpr_io_write_int(fp, model->proj_interval);
+      ok &= lwpr_io_write_matrix(fp, nIn, nInS, nInRaw, model->proj_P);
+      ok &= lwpr_io_write_vector(fp, nInRaw, model->proj_mean);
+      ok &= lwpr_io_write_matrix(fp, nInRaw, nInRaw, nInRaw, model->proj_cov);
+   } else {
+      ok &= lwpr_io_write_int(fp, 0);
+   }
    ok &= lwpr_io_write_int(fp, model->update_D);
    ok &= lwpr_io_write_int(fp, model->meta);
    ok &= lwpr_io_write_scalar(fp, model->meta_rate);
@@ -210,6 +361,7 @@ int lwpr_write_binary_fp(const LWPR_Model *model, FILE *fp) {
       ok &= lwpr_io_write_int(fp, sub->numRFS);
       ok &= lwpr_io_write_int(fp, sub->n_pruned);
       for (i=0;i<sub->numRFS;i++) {
+         lwpr_aux_rf_sync_D(sub->rf[i]);
          ok &= lwpr_io_write_rf(fp, sub->rf[i]);
       }
    }
@@ -217,7 +369,9 @@ int lwpr_write_binary_fp(const LWPR_Model *model, FILE *fp) {
    return ok;
 }
 
-int lwpr_read_binary_fp(LWPR_Model *model, FILE *fp) {
+/* Reads a model from a binary file, see lwpr_read_binary_fp. If lazy is not NULL, the training
+   statistics of the receptive fields are skipped (see lwpr_io_read_rf_lazy). */
+static int lwpr_io_read_model(LWPR_Model *model, FILE *fp, struct LWPR_LazyLoad *lazy) {
    char str[5];
    int ok;
    int nIn,nInS,nOut;
@@ -232,7 +386,8 @@ int lwpr_read_binary_fp(LWPR_Model *model, FILE *fp) {
 
    if (!lwpr_io_read_int(fp, &version)) return 0;
 
-   if (version!=LWPR_BINIO_VERSION) {
+   if (version!=LWPR_BINIO_VERSION && version!=LWPR_BINIO_VERSION_NOPROJ
+         && version!=LWPR_BINIO_VERSION_NORANK && version!=LWPR_BINIO_VERSION_NOBLOCKS) {
       fprintf(stderr,"Sorry, version of binary LWPR file does not match this implementation.\n");
       return 0;
    }
@@ -260,6 +415,41 @@ int lwpr_read_binary_fp(LWPR_Model *model, FILE *fp) {
    ok &= lwpr_io_read_vector(fp, nIn, model->mean_x);
    ok &= lwpr_io_read_vector(fp, nIn, model->var_x);
    ok &= lwpr_io_read_int(fp, &model->diag_only);
+   if (version!=LWPR_BINIO_VERSION_NOBLOCKS) {
+      int nBlocks, *sizes;
+
+      ok &= lwpr_io_read_int(fp, &nBlocks);
+      if (!ok || nBlocks<1 || nBlocks>nIn) {
+         lwpr_free_model(model);
+         return 0;
+      }
+      sizes = (int *) LWPR_MALLOC(nBlocks*sizeof(int));
+      if (sizes == NULL) {
+         lwpr_free_model(model);
+         return 0;
+      }
+      for (i=0;i<nBlocks;i++) ok &= lwpr_io_read_int(fp, &sizes[i]);
+      if (ok && nBlocks>1) ok = lwpr_set_blocks(model, nBlocks, sizes);
+      LWPR_FREE(sizes);
+   }
+   if (version==LWPR_BINIO_VERSION || version==LWPR_BINIO_VERSION_NOPROJ) {
+      ok &= lwpr_io_read_int(fp, &i);
+      if (ok) ok = lwpr_set_rank(model, i);
+   }
+   if (version==LWPR_BINIO_VERSION) {
+      int nInRaw = 0;
+
+      ok &= lwpr_io_read_int(fp, &nInRaw);
+      if (ok && nInRaw>0) {
+         ok &= lwpr_io_read_int(fp, &i);
+         if (ok) ok = lwpr_set_projection(model, nInRaw, NULL, i);
+         if (ok) {
+            ok &= lwpr_io_read_matrix(fp, nIn, nInS, nInRaw, model->proj_P);
+            ok &= lwpr_io_read_vector(fp, nInRaw, model->proj_mean);
+            ok &= lwpr_io_read_matrix(fp, nInRaw, nInRaw, nInRaw, model->proj_cov);
+         }
+      }
+   }
    ok &= lwpr_io_read_int(fp, &model->update_D);
    ok &= lwpr_io_read_int(fp, &model->meta);
    ok &= lwpr_io_read_scalar(fp, &model->meta_rate);
@@ -291,8 +481,8 @@ int lwpr_read_binary_fp(LWPR_Model *model, FILE *fp) {
       ok &= (i==dim);
       ok &= lwpr_io_read_int(fp, &numRFS);
       ok &= lwpr_io_read_int(fp, &sub->n_pruned);
-      for (i=0;i<numRFS;i++) {
-         ok &= lwpr_io_read_rf(fp, sub);
+      for (i=0;i<numRFS && ok;i++) {
+         ok &= lwpr_io_read_rf_lazy(fp, sub, lazy);
       }
       ok &= (numRFS == sub->numRFS);
    }
@@ -307,6 +497,106 @@ int lwpr_read_binary_fp(LWPR_Model *model, FILE *fp) {
 }
 
 
+int lwpr_read_binary_fp(LWPR_Model *model, FILE *fp) {
+   return lwpr_io_read_model(model, fp, NULL);
+}
+
+/* Second phase of lwpr_read_binary_lazy: reads the training statistics of all receptive fields */
+static void *lwpr_io_lazy_T(void *ptr) {
+   struct LWPR_LazyLoad *lazy = (struct LWPR_LazyLoad *) ptr;
+   int i, ok = 1;
+
+   for (i=0;i<lazy->numRF && ok && !lazy->cancel;i++) {
+      ok = (fseek(lazy->fp, lazy->offset[i], SEEK_SET) == 0) ? 1:0;
+      if (ok) ok = lwpr_io_read_rf_fields(lazy->fp, lazy->rf[i], LWPR_LOAD_TRAIN);
+   }
+   lazy->ok = ok && !lazy->cancel;
+   return NULL;
+}
+
+#if defined(WIN32) && NUM_THREADS > 1
+static DWORD WINAPI lwpr_io_lazy_T_win32(LPVOID ptr) {
+   (void) lwpr_io_lazy_T(ptr);
+   return 0;
+}
+#endif
+
+static void lwpr_io_lazy_free(struct LWPR_LazyLoad *lazy) {
+   fclose(lazy->fp);
+   if (lazy->rf != NULL) LWPR_FREE(lazy->rf);
+   if (lazy->offset != NULL) LWPR_FREE(lazy->offset);
+   LWPR_FREE(lazy);
+}
+
+int lwpr_read_binary_lazy(LWPR_Model *model, const char *filename, int background) {
+   struct LWPR_LazyLoad *lazy;
+
+   lazy = (struct LWPR_LazyLoad *) LWPR_CALLOC(1, sizeof(struct LWPR_LazyLoad));
+   if (lazy == NULL) return 0;
+   lazy->fp = fopen(filename, "rb");
+   if (lazy->fp == NULL) {
+      LWPR_FREE(lazy);
+      return 0;
+   }
+   if (!lwpr_io_read_model(model, lazy->fp, lazy)) {
+      lwpr_io_lazy_free(lazy);
+      return 0;
+   }
+   model->lazy = lazy;
+
+#if NUM_THREADS > 1
+   if (background) {
+#ifdef WIN32
+      lazy->thread = CreateThread(NULL, 0, lwpr_io_lazy_T_win32, lazy, 0, NULL);
+      if (lazy->thread != NULL) lazy->state = 1;
+#else
+      if (pthread_create(&lazy->thread, NULL, lwpr_io_lazy_T, lazy) == 0) lazy->state = 1;
+#endif
+   }
+#endif
+   /* Without a background thread, the second phase runs in lwpr_finish_loading */
+   return 1;
+}
+
+/* Waits for the background thread of a lazily loaded model, if it is running */
+static void lwpr_io_lazy_join(struct LWPR_LazyLoad *lazy) {
+   if (lazy->state != 1) return;
+#ifdef WIN32
+   WaitForSingleObject(lazy->thread, INFINITE);
+   CloseHandle(lazy->thread);
+#elif NUM_THREADS > 1
+   pthread_join(lazy->thread, NULL);
+#endif
+   lazy->state = 2;
+}
+
+int lwpr_finish_loading(LWPR_Model *model) {
+   struct LWPR_LazyLoad *lazy = model->lazy;
+
+   if (lazy == NULL) return 1;
+   if (lazy->state == 0) {
+      (void) lwpr_io_lazy_T(lazy);
+      lazy->state = 2;
+   }
+   lwpr_io_lazy_join(lazy);
+   /* If the second phase failed, the state is kept, and the model can only be used for predictions */
+   if (!lazy->ok) return 0;
+
+   lwpr_io_lazy_free(lazy);
+   model->lazy = NULL;
+   return 1;
+}
+
+void lwpr_io_lazy_abort(LWPR_Model *model) {
+   struct LWPR_LazyLoad *lazy = model->lazy;
+
+   if (lazy == NULL) return;
+   lazy->cancel = 1;
+   lwpr_io_lazy_join(lazy);
+   lwpr_io_lazy_free(lazy);
+   model->lazy = NULL;
+}
+
 int lwpr_write_binary(const LWPR_Model *model, const char *filename) {
    int ok;
    FILE *fp;
@@ -0,0 +1,316 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_checkpoint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+   #include <windows.h>
+   #include <io.h>
+#else
+   #include <unistd.h>
+   #if NUM_THREADS > 1
+      #include <pthread.h>
+      #include <sched.h>
+   #endif
+#endif
+
+/* Atomic operations on the state of the slots, as in lwpr_conc.c. YIELD gives up the
+** processor while another thread finishes copying a receptive field. */
+#ifdef WIN32
+   #define LWPR_CKPT_CAS(p,o,n)   (InterlockedCompareExchange((volatile LONG *) (p), (LONG) (n), (LONG) (o)) == (LONG) (o))
+   #define LWPR_CKPT_LOAD(p)      (*(p))
+   #define LWPR_CKPT_STORE(p,v)   (*(p) = (v))
+   #define LWPR_CKPT_YIELD()      SwitchToThread()
+#else
+   #define LWPR_CKPT_CAS(p,o,n)   __sync_bool_compare_and_swap((p), (o), (n))
+   #define LWPR_CKPT_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+   #define LWPR_CKPT_STORE(p,v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+   #if NUM_THREADS > 1
+      #define LWPR_CKPT_YIELD()   sched_yield()
+   #else
+      #define LWPR_CKPT_YIELD()
+   #endif
+#endif
+
+/* States of a slot: the receptive field still needs a copy, is being copied, or has been copied */
+#define LWPR_CKPT_PENDING   0
+#define LWPR_CKPT_COPYING   1
+#define LWPR_CKPT_COPIED    2
+
+struct LWPR_CheckpointThread {
+#ifdef WIN32
+   HANDLE thread;
+#elif NUM_THREADS > 1
+   pthread_t thread;
+#else
+   int dummy;
+#endif
+};
+
+static int lwpr_checkpoint_write(LWPR_Checkpoint *cp, const LWPR_Model *model) {
+   int ok;
+   FILE *fp;
+   size_t len = strlen(cp->filename);
+   char *tmpname = (char *) LWPR_MALLOC(len + 5);
+
+   if (tmpname == NULL) return 0;
+   strcpy(tmpname, cp->filename);
+   strcpy(tmpname + len, ".tmp");
+
+   fp = fopen(tmpname, "wb");
+   if (fp == NULL) {
+      LWPR_FREE(tmpname);
+      return 0;
+   }
+   ok = lwpr_write_binary_fp(model, fp);
+   if (fflush(fp) != 0) ok = 0;
+   if (ok && (cp->flags & LWPR_CHECKPOINT_FSYNC)) {
+#ifdef WIN32
+      if (_commit(_fileno(fp)) != 0) ok = 0;
+#else
+      if (fsync(fileno(fp)) != 0) ok = 0;
+#endif
+   }
+   if (fclose(fp) != 0) ok = 0;
+
+   if (ok) {
+#ifdef WIN32
+      ok = MoveFileExA(tmpname, cp->filename, MOVEFILE_REPLACE_EXISTING) ? 1 : 0;
+#else
+      ok = (rename(tmpname, cp->filename) == 0) ? 1 : 0;
+#endif
+   }
+   if (!ok) remove(tmpname);
+   LWPR_FREE(tmpname);
+   return ok;
+}
+
+/* Copies the receptive field of slot k into the snapshot, unless this has happened already.
+** If another thread is copying it right now, waits until that copy is complete. */
+static void lwpr_checkpoint_copy(LWPR_Checkpoint *cp, int k) {
+   const LWPR_ReceptiveField *RFs = cp->orig[k];
+   LWPR_ReceptiveField *RFd;
+   int ready;
+
+   if (LWPR_CKPT_LOAD(&cp->state[k]) == LWPR_CKPT_COPIED) return;
+   if (!LWPR_CKPT_CAS(&cp->state[k], LWPR_CKPT_PENDING, LWPR_CKPT_COPYING)) {
+      while (LWPR_CKPT_LOAD(&cp->state[k]) != LWPR_CKPT_COPIED) LWPR_CKPT_YIELD();
+      return;
+   }
+
+   RFd = (LWPR_ReceptiveField *) LWPR_MALLOC(sizeof(LWPR_ReceptiveField));
+   if (RFd != NULL) {
+      int nRegStore = (RFs->nReg > LWPR_REGSTORE) ? RFs->nReg : LWPR_REGSTORE;
+
+      memset(RFd, 0, sizeof(LWPR_ReceptiveField));
+      if (lwpr_mem_alloc_rf(RFd, &cp->snapshot, RFs->nReg, nRegStore)) {
+         /* A prediction may fill in D while it is copied: only trust D if it was ready before */
+         ready = LWPR_CKPT_LOAD(&RFs->DReady);
+         lwpr_aux_copy_rf(RFd, RFs);
+         if (!ready) RFd->DReady = 0;
+      } else {
+         LWPR_FREE(RFd);
+         RFd = NULL;
+      }
+   }
+   cp->copy[k] = RFd;
+   LWPR_CKPT_STORE(&cp->state[k], LWPR_CKPT_COPIED);
+}
+
+void lwpr_checkpoint_preserve(const LWPR_Model *model, LWPR_ReceptiveField *RF) {
+   if (model->checkpoint != NULL) lwpr_checkpoint_copy(model->checkpoint, RF->ckpt - 1);
+   RF->ckpt = 0;
+}
+
+#if NUM_THREADS > 1
+/* Copies the receptive fields that training has not copied yet, and hands all copies
+** over to the snapshot. Returns 0 if any copy could not be allocated. */
+static int lwpr_checkpoint_collect(LWPR_Checkpoint *cp) {
+   int dim, n, k, ok = 1;
+
+   for (k=0;k<cp->numSlots;k++) lwpr_checkpoint_copy(cp, k);
+
+   k = 0;
+   for (dim=0;dim<cp->snapshot.nOut;dim++) {
+      LWPR_SubModel *sub = &cp->snapshot.sub[dim];
+
+      for (n=0;n<sub->numPointers;n++,k++) {
+         if (cp->copy[k] == NULL) {
+            ok = 0;
+         } else {
+            sub->rf[sub->numRFS++] = cp->copy[k];
+         }
+      }
+   }
+   return ok;
+}
+
+#endif
+
+/* Releases the slots, and detaches the checkpoint from the model */
+static void lwpr_checkpoint_free_slots(LWPR_Checkpoint *cp) {
+   if (cp->model == NULL) return;
+   cp->model->checkpoint = NULL;
+   cp->model = NULL;
+   if (cp->orig != NULL) LWPR_FREE(cp->orig);
+   if (cp->copy != NULL) LWPR_FREE(cp->copy);
+   if (cp->state != NULL) LWPR_FREE((void *) cp->state);
+   cp->orig = cp->copy = NULL;
+   cp->state = NULL;
+}
+
+#if NUM_THREADS > 1
+/* Starts the snapshot: the settings and statistics of the model are copied right away, its
+** receptive fields are copied on the first change (lwpr_checkpoint_preserve) or by the thread.
+** Out-of-core models, and models with another lazy checkpoint pending, are copied completely. */
+static int lwpr_checkpoint_snapshot(LWPR_Checkpoint *cp, LWPR_Model *model) {
+   int dim, n, k = 0;
+
+   if (model->lazy != NULL && !lwpr_finish_loading(model)) return 0;
+   if (model->ooc != NULL || model->checkpoint != NULL) return lwpr_duplicate_model(&cp->snapshot, model);
+   if (!lwpr_aux_copy_settings(&cp->snapshot, model)) return 0;
+
+   cp->numSlots = 0;
+   for (dim=0;dim<model->nOut;dim++) cp->numSlots += model->sub[dim].numRFS;
+
+   cp->orig = (LWPR_ReceptiveField **) LWPR_MALLOC((cp->numSlots + 1)*sizeof(LWPR_ReceptiveField *));
+   cp->copy = (LWPR_ReceptiveField **) LWPR_MALLOC((cp->numSlots + 1)*sizeof(LWPR_ReceptiveField *));
+   cp->state = (volatile int *) LWPR_CALLOC((size_t) (cp->numSlots + 1), sizeof(int));
+   cp->model = model;
+   if (cp->orig == NULL || cp->copy == NULL || cp->state == NULL) {
+      lwpr_checkpoint_free_slots(cp);
+      lwpr_free_model(&cp->snapshot);
+      return 0;
+   }
+
+   for (dim=0;dim<model->nOut;dim++) {
+      LWPR_SubModel *sub = &cp->snapshot.sub[dim];
+      int numRFS = model->sub[dim].numRFS;
+
+      sub->n_pruned = model->sub[dim].n_pruned;
+      if (numRFS == 0) continue;
+      sub->rf = (LWPR_ReceptiveField **) LWPR_MALLOC(numRFS*sizeof(LWPR_ReceptiveField *));
+      if (sub->rf == NULL) {
+         lwpr_checkpoint_free_slots(cp);
+         lwpr_free_model(&cp->snapshot);
+         return 0;
+      }
+      sub->numPointers = numRFS;
+   }
+
+   for (dim=0;dim<model->nOut;dim++) {
+      for (n=0;n<model->sub[dim].numRFS;n++) {
+         LWPR_ReceptiveField *RF = model->sub[dim].rf[n];
+
+         cp->orig[k] = RF;
+         cp->copy[k] = NULL;
+         RF->ckpt = ++k;
+      }
+   }
+   model->checkpoint = cp;
+   return 1;
+}
+
+static void *lwpr_checkpoint_T(void *ptr) {
+   LWPR_Checkpoint *cp = (LWPR_Checkpoint *) ptr;
+
+   cp->ok = (cp->model == NULL || lwpr_checkpoint_collect(cp)) ? lwpr_checkpoint_write(cp, &cp->snapshot) : 0;
+   /* Release the snapshot as early as possible */
+   lwpr_free_model(&cp->snapshot);
+   if (cp->callback != NULL) cp->callback(cp->filename, cp->ok, cp->userData);
+   return NULL;
+}
+
+#ifdef WIN32
+static DWORD WINAPI lwpr_checkpoint_T_win32(LPVOID ptr) {
+   (void) lwpr_checkpoint_T(ptr);
+   return 0;
+}
+#endif
+#endif
+
+int lwpr_checkpoint_start(LWPR_Checkpoint *cp, LWPR_Model *model, const char *filename,
+      int flags, LWPR_CheckpointCallback callback, void *userData) {
+
+   cp->filename = (char *) LWPR_MALLOC(strlen(filename)+1);
+   if (cp->filename == NULL) return 0;
+   strcpy(cp->filename, filename);
+
+   cp->flags = flags;
+   cp->callback = callback;
+   cp->userData = userData;
+   cp->ok = 0;
+   cp->thread = NULL;
+   cp->model = NULL;
+   cp->numSlots = 0;
+   cp->orig = cp->copy = NULL;
+   cp->state = NULL;
+
+#if NUM_THREADS > 1
+   cp->thread = (struct LWPR_CheckpointThread *) LWPR_MALLOC(sizeof(struct LWPR_CheckpointThread));
+   if (cp->thread != NULL) {
+      if (lwpr_checkpoint_snapshot(cp, model)) {
+#ifdef WIN32
+         cp->thread->thread = CreateThread(NULL, 0, lwpr_checkpoint_T_win32, cp, 0, NULL);
+         if (cp->thread->thread != NULL) return 1;
+#else
+         if (pthread_create(&cp->thread->thread, NULL, lwpr_checkpoint_T, cp) == 0) return 1;
+#endif
+         lwpr_checkpoint_free_slots(cp);
+         lwpr_free_model(&cp->snapshot);
+      }
+      LWPR_FREE(cp->thread);
+      cp->thread = NULL;
+   }
+#endif
+
+   /* No background thread available: only block the caller if this was asked for */
+   if (!(flags & LWPR_CHECKPOINT_SYNC)) {
+      LWPR_FREE(cp->filename);
+      cp->filename = NULL;
+      return 0;
+   }
+   cp->ok = lwpr_checkpoint_write(cp, model);
+   if (cp->callback != NULL) cp->callback(cp->filename, cp->ok, cp->userData);
+   return 1;
+}
+
+int lwpr_checkpoint_wait(LWPR_Checkpoint *cp) {
+   if (cp->thread != NULL) {
+#ifdef WIN32
+      WaitForSingleObject(cp->thread->thread, INFINITE);
+      CloseHandle(cp->thread->thread);
+#elif NUM_THREADS > 1
+      pthread_join(cp->thread->thread, NULL);
+#endif
+      LWPR_FREE(cp->thread);
+      cp->thread = NULL;
+   }
+   lwpr_checkpoint_free_slots(cp);
+   LWPR_FREE(cp->filename);
+   cp->filename = NULL;
+   return cp->ok;
+}
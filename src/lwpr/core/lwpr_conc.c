@@ -0,0 +1,378 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_math.h>
+#include <lwpr/core/lwpr_conc.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifdef WIN32
+   #include <windows.h>
+#endif
+
+/* Atomic operations. LOAD has acquire and STORE has release semantics, which
+** volatile accesses already provide with Microsoft's compilers. FENCE is a full barrier. */
+#ifdef WIN32
+   #define LWPR_CONC_CAS(p,o,n)   (InterlockedCompareExchange((volatile LONG *) (p), (LONG) (n), (LONG) (o)) == (LONG) (o))
+   #define LWPR_CONC_LOAD(p)      (*(p))
+   #define LWPR_CONC_STORE(p,v)   (*(p) = (v))
+   #define LWPR_CONC_FENCE()      MemoryBarrier()
+#else
+   #define LWPR_CONC_CAS(p,o,n)   __sync_bool_compare_and_swap((p), (o), (n))
+   #define LWPR_CONC_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+   #define LWPR_CONC_STORE(p,v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+   #define LWPR_CONC_FENCE()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+/* Contribution of one receptive field to a prediction */
+typedef struct {
+   double w;            /* Activation */
+   int used;            /* Flag that determines whether the RF contributes (w > cutoff, trustworthy) */
+   double yp;           /* Prediction of the RF */
+   double sigma2;       /* Variance of the prediction (only with confidence bounds) */
+} LWPR_ConcPart;
+
+void lwpr_conc_write_begin(volatile int *seq) {
+   LWPR_CONC_STORE(seq, *seq + 1);
+   LWPR_CONC_FENCE();
+}
+
+void lwpr_conc_write_end(volatile int *seq) {
+   LWPR_CONC_FENCE();
+   LWPR_CONC_STORE(seq, *seq + 1);
+}
+
+void lwpr_conc_release_rf(void *RF) {
+   lwpr_mem_free_rf((LWPR_ReceptiveField *) RF);
+   LWPR_FREE(RF);
+}
+
+void lwpr_conc_release_mem(void *ptr) {
+   LWPR_FREE(ptr);
+}
+
+/* Smallest epoch a reader is predicting in, or the current epoch if there is none */
+static unsigned long lwpr_conc_min_epoch(const LWPR_Concurrent *C) {
+   unsigned long min = LWPR_CONC_LOAD(&C->epoch);
+   int i;
+
+   for (i=0;i<LWPR_CONC_READERS;i++) {
+      unsigned long e = LWPR_CONC_LOAD(&C->active[i]);
+      if (e != 0 && e < min) min = e;
+   }
+   return min;
+}
+
+void lwpr_conc_retire(LWPR_Concurrent *C, void *ptr, void (*release)(void *)) {
+   while (!LWPR_CONC_CAS(&C->lock, 0, 1)) ;
+
+   if (C->numRetired == C->numRetiredPointers) {
+      LWPR_Retired *newStore = (LWPR_Retired *) LWPR_REALLOC(C->retired, (C->numRetiredPointers+64)*sizeof(LWPR_Retired));
+
+      if (newStore == NULL) {
+         /* No memory to defer the release: start a new epoch, and wait until
+         ** all readers have left the current one */
+         unsigned long epoch = LWPR_CONC_LOAD(&C->epoch);
+
+         LWPR_CONC_STORE(&C->epoch, epoch + 1);
+         LWPR_CONC_FENCE();
+         while (lwpr_conc_min_epoch(C) <= epoch) ;
+         release(ptr);
+         C->n_retired++;
+         C->n_released++;
+         LWPR_CONC_STORE(&C->lock, 0);
+         return;
+      }
+      C->retired = newStore;
+      C->numRetiredPointers+=64;
+   }
+   C->retired[C->numRetired].ptr = ptr;
+   C->retired[C->numRetired].release = release;
+   C->retired[C->numRetired].epoch = LWPR_CONC_LOAD(&C->epoch);
+   C->numRetired++;
+   C->n_retired++;
+
+   LWPR_CONC_STORE(&C->lock, 0);
+}
+
+void lwpr_conc_collect(LWPR_Concurrent *C) {
+   unsigned long min;
+   int i,j;
+
+   if (C->numRetired == 0) return;
+
+   /* Readers that start from now on cannot reach anything retired so far */
+   LWPR_CONC_FENCE();
+   LWPR_CONC_STORE(&C->epoch, C->epoch + 1);
+   LWPR_CONC_FENCE();
+   min = lwpr_conc_min_epoch(C);
+
+   for (i=j=0;i<C->numRetired;i++) {
+      if (C->retired[i].epoch < min) {
+         C->retired[i].release(C->retired[i].ptr);
+         C->n_released++;
+      } else {
+         C->retired[j++] = C->retired[i];
+      }
+   }
+   C->numRetired = j;
+}
+
+void lwpr_conc_free(LWPR_Concurrent *C) {
+   int i;
+
+   for (i=0;i<C->numRetired;i++) C->retired[i].release(C->retired[i].ptr);
+   if (C->retired != NULL) LWPR_FREE(C->retired);
+   LWPR_FREE(C);
+}
+
+int lwpr_set_concurrent(LWPR_Model *model, int enable) {
+   LWPR_Concurrent *C = model->conc;
+   int i,j;
+
+   if (!enable) {
+      if (C == NULL) return 1;
+      for (i=0;i<LWPR_CONC_READERS;i++) {
+         if (C->used[i]) return 0;
+      }
+      lwpr_conc_free(C);
+      model->conc = NULL;
+      return 1;
+   }
+   if (C != NULL) return 1;
+   if (model->proj_P != NULL && model->proj_interval > 0) return 0;
+   /* Touching out-of-core blocks changes their LRU list, which readers cannot do without a lock */
+   if (model->ooc != NULL) return 0;
+
+   C = (LWPR_Concurrent *) LWPR_CALLOC(1, sizeof(LWPR_Concurrent));
+   if (C == NULL) return 0;
+   C->epoch = 1;
+
+   for (i=0;i<model->nOut;i++) {
+      model->sub[i].seq = 0;
+      for (j=0;j<model->sub[i].numRFS;j++) model->sub[i].rf[j]->seq = 0;
+   }
+   model->conc = C;
+   return 1;
+}
+
+int lwpr_reader_init(LWPR_Reader *R, const LWPR_Model *model) {
+   LWPR_Concurrent *C = model->conc;
+   int i;
+
+   if (C == NULL) return 0;
+
+   memset(R, 0, sizeof(LWPR_Reader));
+   R->model = model;
+   R->xn = (double *) LWPR_MALLOC(model->nInStore * sizeof(double));
+   R->ws = (LWPR_Workspace *) LWPR_MALLOC(sizeof(LWPR_Workspace));
+   if (R->xn == NULL || R->ws == NULL || !lwpr_mem_alloc_ws(R->ws, model->nIn)) {
+      if (R->ws != NULL) LWPR_FREE(R->ws);
+      if (R->xn != NULL) LWPR_FREE(R->xn);
+      return 0;
+   }
+
+   for (i=0;i<LWPR_CONC_READERS;i++) {
+      if (LWPR_CONC_CAS(&C->used[i], 0, 1)) {
+         R->slot = i;
+         return 1;
+      }
+   }
+   lwpr_mem_free_ws(R->ws);
+   LWPR_FREE(R->ws);
+   LWPR_FREE(R->xn);
+   return 0;
+}
+
+void lwpr_reader_close(LWPR_Reader *R) {
+   lwpr_mem_free_ws(R->ws);
+   LWPR_FREE(R->ws);
+   LWPR_FREE(R->xn);
+   LWPR_CONC_STORE(&R->model->conc->used[R->slot], 0);
+}
+
+/* Computes the contribution of one receptive field from a consistent state, in the same way as
+** lwpr_aux_predict_one_T (conf == 0) or lwpr_aux_predict_conf_one_T (conf != 0).
+** Returns 0 if the RF changed LWPR_CONC_RETRIES times while it was read. */
+static int lwpr_conc_read_rf(LWPR_Reader *R, LWPR_ReceptiveField *RF, double qmax, double cutoff,
+      int conf, LWPR_ConcPart *part) {
+   const LWPR_Model *model = R->model;
+   LWPR_Workspace *WS = R->ws;
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   double *xc = WS->xc;
+   double *s = WS->s;
+   int tries,i;
+
+   for (tries=0;tries<=LWPR_CONC_RETRIES;tries++) {
+      const double *U, *P, *beta, *SSs2, *sum_e_cv2, *sum_w, *n_data;
+      double dist;
+      int nR, seq;
+
+      if (tries > 0) R->n_retries++;
+
+      seq = LWPR_CONC_LOAD(&RF->seq);
+      if (seq & 1) continue;
+
+      /* First check that nReg and the pointers fit together. The arrays they point
+      ** to stay valid until this prediction ends, even if the RF grows meanwhile */
+      nR = RF->nReg;
+      U = RF->U; P = RF->P; beta = RF->beta; SSs2 = RF->SSs2;
+      sum_e_cv2 = RF->sum_e_cv2; sum_w = RF->sum_w; n_data = RF->n_data;
+      LWPR_CONC_FENCE();
+      if (RF->seq != seq) continue;
+
+      part->used = 0;
+      part->w = 0.0;
+      if (lwpr_aux_rf_distance(RF, R->xn, qmax, xc, NULL, NULL, &dist)) {
+         switch(model->kernel) {
+            case LWPR_GAUSSIAN_KERNEL:
+               part->w = exp(-0.5*dist);
+               break;
+            case LWPR_BISQUARE_KERNEL:
+               part->w = 1-0.25*dist;
+               part->w = (part->w<0) ? 0 : part->w*part->w;
+               break;
+            default:
+               part->w = 0.0;
+         }
+
+         if (part->w > cutoff && RF->trustworthy) {
+            part->used = 1;
+            part->yp = RF->beta0;
+
+            for (i=0;i<nIn;i++) {
+               xc[i] = R->xn[i] - RF->mean_x[i];
+            }
+
+            if (!conf && RF->slopeReady) {
+               part->yp += lwpr_math_dot_product(xc, RF->slope, nIn);
+            } else {
+               double sigma2 = 0.0;
+
+               if (n_data[nR-1] <= 2*nIn) nR--;
+
+               lwpr_aux_compute_projection(nIn, nInS, nR, s, xc, U, P, WS);
+               for (i=0;i<nR;i++) {
+                  part->yp += s[i]*beta[i];
+                  if (conf) sigma2 += s[i]*s[i] / SSs2[i];
+               }
+               if (conf) part->sigma2 = sum_e_cv2[nR-1]/(sum_w[nR-1] - RF->SSp)*(1+part->w*sigma2);
+            }
+         }
+      }
+      LWPR_CONC_FENCE();
+      if (RF->seq == seq) return 1;
+   }
+   R->n_skipped++;
+   return 0;
+}
+
+/* Prediction of one output dimension, see lwpr_aux_predict_one_T and lwpr_aux_predict_conf_one_T */
+static double lwpr_conc_predict_one(LWPR_Reader *R, int dim, double cutoff, double *conf, double *max_w) {
+   const LWPR_Model *model = R->model;
+   const LWPR_SubModel *sub = &model->sub[dim];
+   double qmax = lwpr_aux_cutoff_distance(model->kernel, cutoff);
+   double yp, sum_w, sum_wyy, sum_conf, w_max;
+
+   for (;;) {
+      LWPR_ReceptiveField **rf;
+      int n, numRFS, seq;
+
+      seq = LWPR_CONC_LOAD(&sub->seq);
+      /* Receptive fields are just being added or pruned */
+      if (seq & 1) continue;
+
+      rf = sub->rf;
+      numRFS = sub->numRFS;
+      LWPR_CONC_FENCE();
+      if (sub->seq != seq) continue;
+
+      yp = sum_w = sum_wyy = sum_conf = w_max = 0.0;
+      for (n=0;n<numRFS;n++) {
+         LWPR_ConcPart part;
+
+         if (!lwpr_conc_read_rf(R, rf[n], qmax, cutoff, conf != NULL, &part)) continue;
+
+         if (part.w > w_max) w_max = part.w;
+         if (part.used) {
+            if (conf != NULL) {
+               sum_wyy += part.w*part.yp*part.yp;
+               sum_conf += part.w*part.sigma2;
+            }
+            yp += part.w*part.yp;
+            sum_w += part.w;
+         }
+      }
+      /* Nothing above the cutoff: complete the maximum with a scan that only computes
+      ** the activations which raise it (and no predictions, with an infinite cutoff) */
+      if (max_w != NULL && w_max == 0.0) {
+         for (n=0;n<numRFS;n++) {
+            LWPR_ConcPart part;
+
+            if (!lwpr_conc_read_rf(R, rf[n], lwpr_aux_cutoff_distance(model->kernel, w_max), HUGE_VAL, 0, &part)) continue;
+            if (part.w > w_max) w_max = part.w;
+         }
+      }
+      LWPR_CONC_FENCE();
+      if (sub->seq == seq) break;
+      R->n_rescans++;
+   }
+
+   if (max_w != NULL) *max_w = w_max;
+   if (conf != NULL) {
+      if (sum_w > 0.0) {
+         double sum_wy = yp;
+         yp /= sum_w;
+         *conf = sqrt(fabs(sum_conf + sum_wyy - sum_wy*yp))/sum_w;
+      } else {
+         *conf = 1e20;
+      }
+   } else {
+      if (sum_w > 0.0) yp/=sum_w;
+   }
+   return yp;
+}
+
+void lwpr_reader_predict(LWPR_Reader *R, const double *x, double cutoff, double *y, double *conf, double *max_w) {
+   const LWPR_Model *model = R->model;
+   LWPR_Concurrent *C = model->conc;
+   int dim;
+
+   lwpr_aux_normalise_input(model, x, R->xn);
+
+   /* Announce the epoch before touching any receptive field */
+   LWPR_CONC_STORE(&C->active[R->slot], LWPR_CONC_LOAD(&C->epoch));
+   LWPR_CONC_FENCE();
+
+   for (dim=0;dim<model->nOut;dim++) {
+      double no = model->norm_out[dim];
+
+      y[dim] = no * lwpr_conc_predict_one(R, dim, cutoff, (conf != NULL) ? &conf[dim] : NULL,
+            (max_w != NULL) ? &max_w[dim] : NULL);
+      if (conf != NULL) conf[dim] *= no;
+   }
+
+   LWPR_CONC_STORE(&C->active[R->slot], 0);
+   R->n_predictions++;
+}
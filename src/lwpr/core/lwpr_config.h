@@ -63,6 +63,10 @@
    */
 #undef LT_OBJDIR
 
+/* Define to 1 to compile in profiling of update and prediction phases
+   (hardware performance counters on Linux) */
+#undef LWPR_PROFILE
+
 /* Number of threads to use */
 #undef NUM_THREADS
 
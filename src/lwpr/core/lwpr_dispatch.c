@@ -0,0 +1,286 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_dispatch.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <time.h>
+   #if NUM_THREADS > 1
+      #include <pthread.h>
+   #endif
+#endif
+
+/* Number of samples per output dimension for timing updates and predictions */
+#define LWPR_DISPATCH_SAMPLES    16
+/* Number of times the threads are started for timing them */
+#define LWPR_DISPATCH_REPEAT     8
+/* Weight 1/LWPR_DISPATCH_SMOOTH of a new time in the moving averages */
+#define LWPR_DISPATCH_SMOOTH     16.0
+
+static const char *lwpr_dispatch_names[LWPR_NUM_DISPATCH] = {
+   "serial", "outputs", "rfs"
+};
+
+const char *lwpr_dispatch_name(int mode) {
+   if (mode < 0 || mode >= LWPR_NUM_DISPATCH) return "none";
+   return lwpr_dispatch_names[mode];
+}
+
+double lwpr_dispatch_clock(void) {
+#ifdef WIN32
+   LARGE_INTEGER f, c;
+   QueryPerformanceFrequency(&f);
+   QueryPerformanceCounter(&c);
+   return (double) c.QuadPart / (double) f.QuadPart;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+#endif
+}
+
+int lwpr_dispatch_stats(const LWPR_Model *model, LWPR_Dispatch *stats) {
+   if (model->dispatch != NULL) {
+      *stats = *model->dispatch;
+      return 1;
+   }
+   memset(stats, 0, sizeof(LWPR_Dispatch));
+   stats->last_update = (NUM_THREADS > 1) ? LWPR_DISPATCH_RFS : LWPR_DISPATCH_SERIAL;
+   stats->last_predict = (NUM_THREADS > 1) ? LWPR_DISPATCH_OUTPUTS : LWPR_DISPATCH_SERIAL;
+   return 0;
+}
+
+void lwpr_fixed_dispatch(LWPR_Model *model) {
+   if (model->dispatch != NULL) LWPR_FREE(model->dispatch);
+   model->dispatch = NULL;
+}
+
+int lwpr_dispatch_update(const LWPR_Model *model) {
+   LWPR_Dispatch *D = model->dispatch;
+   int mode = LWPR_DISPATCH_SERIAL;
+
+#if NUM_THREADS > 1
+   if (D->update_probe < LWPR_DISPATCH_PROBE) {
+      double load[NUM_THREADS];
+      double serial, best, cost, maxLoad = 0.0;
+      int dim, t, numRF = 0;
+
+      for (t=0;t<NUM_THREADS;t++) load[t] = 0.0;
+      for (dim=0;dim<model->nOut;dim++) {
+         numRF += model->sub[dim].numRFS;
+         load[dim % NUM_THREADS] += model->sub[dim].numRFS;
+      }
+      best = serial = D->update_rf * numRF;
+
+      if (model->nOut > 1) {
+         /* Output dimension dim is updated by thread dim % NUM_THREADS */
+         int threads = (model->nOut < NUM_THREADS) ? model->nOut : NUM_THREADS;
+
+         for (t=0;t<threads;t++) if (load[t] > maxLoad) maxLoad = load[t];
+         cost = D->spawn * (threads-1) / (NUM_THREADS-1) + D->update_rf * maxLoad;
+         if (cost < best) {
+            best = cost;
+            mode = LWPR_DISPATCH_OUTPUTS;
+         }
+      }
+      /* Every output dimension starts its own threads */
+      cost = model->nOut * D->spawn + serial / NUM_THREADS;
+      if (cost < best) mode = LWPR_DISPATCH_RFS;
+   }
+#endif
+
+   if (mode == LWPR_DISPATCH_SERIAL) D->update_probe = 0; else D->update_probe++;
+   D->last_update = mode;
+   D->n_update[mode] += 1.0;
+   return mode;
+}
+
+int lwpr_dispatch_predict(const LWPR_Model *model, int numRF, int maxRF, int todo) {
+   LWPR_Dispatch *D = model->dispatch;
+   int mode = LWPR_DISPATCH_SERIAL;
+
+#if NUM_THREADS > 1
+   if (todo > 1 && D->predict_probe < LWPR_DISPATCH_PROBE) {
+      double cost = D->spawn * (todo-1) / (NUM_THREADS-1) + D->predict_rf * maxRF;
+
+      if (cost < D->predict_rf * numRF) mode = LWPR_DISPATCH_OUTPUTS;
+   }
+#endif
+
+   if (mode == LWPR_DISPATCH_SERIAL) D->predict_probe = 0; else D->predict_probe++;
+   D->last_predict = mode;
+   D->n_predict[mode] += 1.0;
+   return mode;
+}
+
+/* Moving average of the time per receptive field, started from the first measurement */
+static void lwpr_dispatch_average(double *avg, int numRF, double time) {
+   if (numRF <= 0) return;
+   if (*avg > 0.0) {
+      *avg += (time / numRF - *avg) / LWPR_DISPATCH_SMOOTH;
+   } else {
+      *avg = time / numRF;
+   }
+}
+
+void lwpr_dispatch_time_update(const LWPR_Model *model, int numRF, double time) {
+   lwpr_dispatch_average(&model->dispatch->update_rf, numRF, time);
+}
+
+void lwpr_dispatch_time_predict(const LWPR_Model *model, int numRF, double time) {
+   lwpr_dispatch_average(&model->dispatch->predict_rf, numRF, time);
+}
+
+#if NUM_THREADS > 1
+
+static void *lwpr_dispatch_idle_T(void *ptr) {
+   return ptr;
+}
+
+/* Average time for starting and joining NUM_THREADS-1 threads that do nothing */
+static double lwpr_dispatch_time_spawn(void) {
+   double t0, total = 0.0;
+   int i,r;
+#ifdef WIN32
+   HANDLE thread[NUM_THREADS-1];
+   DWORD ID[NUM_THREADS-1];
+#else
+   pthread_t thread[NUM_THREADS-1];
+   int rc[NUM_THREADS-1];
+#endif
+
+   for (r=0;r<LWPR_DISPATCH_REPEAT;r++) {
+      t0 = lwpr_dispatch_clock();
+      for (i=0;i<NUM_THREADS-1;i++) {
+#ifdef WIN32
+         thread[i] = CreateThread(NULL,0, lwpr_dispatch_idle_T ,NULL,0, &ID[i]);
+#else
+         rc[i] = pthread_create(&thread[i], NULL, lwpr_dispatch_idle_T, NULL);
+#endif
+      }
+      for (i=0;i<NUM_THREADS-1;i++) {
+#ifdef WIN32
+         if (thread[i]!=NULL) {
+            WaitForSingleObject(thread[i],INFINITE);
+            CloseHandle(thread[i]);
+         }
+#else
+         if (rc[i]==0) pthread_join(thread[i],NULL);
+#endif
+      }
+      total += lwpr_dispatch_clock() - t0;
+   }
+   return total / LWPR_DISPATCH_REPEAT;
+}
+
+/* Times serial updates of a copy of the model, with inputs at the centres of its RFs.
+** Returns the time per receptive field (0 if there are none), or -1 if the copy failed. */
+static double lwpr_dispatch_time_updates(const LWPR_Model *model) {
+   LWPR_Model tmp;
+   double time = 0.0, numRF = 0.0;
+   int dim,k;
+
+   if (!lwpr_duplicate_model(&tmp, model)) return -1.0;
+
+   for (dim=0;dim<tmp.nOut;dim++) {
+      for (k=0;k<LWPR_DISPATCH_SAMPLES && tmp.sub[dim].numRFS > 0;k++) {
+         const LWPR_ReceptiveField *RF = tmp.sub[dim].rf[(k * tmp.sub[dim].numRFS) / LWPR_DISPATCH_SAMPLES];
+         double yp, t0;
+
+         memcpy(tmp.xn, RF->c, tmp.nIn * sizeof(double));
+         numRF += tmp.sub[dim].numRFS;
+         tmp.n_updates++;
+
+         t0 = lwpr_dispatch_clock();
+         (void) lwpr_aux_update_one(&tmp, dim, tmp.xn, RF->beta0, &yp, NULL, &tmp.ws[0]);
+         time += lwpr_dispatch_clock() - t0;
+      }
+   }
+   lwpr_free_model(&tmp);
+   return (numRF > 0.0) ? time / numRF : 0.0;
+}
+
+/* Times serial predictions of the model, with inputs at the centres of its RFs.
+** Returns the time per receptive field (0 if there are none). */
+static double lwpr_dispatch_time_predictions(LWPR_Model *model) {
+   LWPR_ThreadData TD;
+   double time = 0.0, numRF = 0.0;
+   int dim,k;
+
+   TD.model = model;
+   TD.xn = model->xn;
+   TD.ws = &model->ws[0];
+   TD.cutoff = 0.001;
+
+   for (dim=0;dim<model->nOut;dim++) {
+      const LWPR_SubModel *sub = &model->sub[dim];
+
+      TD.dim = dim;
+      for (k=0;k<LWPR_DISPATCH_SAMPLES && sub->numRFS > 0;k++) {
+         double t0;
+
+         memcpy(model->xn, sub->rf[(k * sub->numRFS) / LWPR_DISPATCH_SAMPLES]->c, model->nIn * sizeof(double));
+         numRF += sub->numRFS;
+
+         t0 = lwpr_dispatch_clock();
+         (void) lwpr_aux_predict_one_T(&TD);
+         time += lwpr_dispatch_clock() - t0;
+      }
+   }
+   return (numRF > 0.0) ? time / numRF : 0.0;
+}
+
+#endif
+
+int lwpr_calibrate_dispatch(LWPR_Model *model) {
+#if NUM_THREADS == 1
+   return 0;
+#else
+   LWPR_Dispatch *D;
+   double update_rf;
+
+   if (model->lazy != NULL && !lwpr_finish_loading(model)) return 0;
+
+   /* Time the model without the overhead of choosing */
+   lwpr_fixed_dispatch(model);
+
+   update_rf = lwpr_dispatch_time_updates(model);
+   if (update_rf < 0.0) return 0;
+
+   D = (LWPR_Dispatch *) LWPR_CALLOC(1, sizeof(LWPR_Dispatch));
+   if (D == NULL) return 0;
+
+   D->spawn = lwpr_dispatch_time_spawn();
+   D->update_rf = update_rf;
+   D->predict_rf = lwpr_dispatch_time_predictions(model);
+   D->last_update = LWPR_DISPATCH_RFS;
+   D->last_predict = LWPR_DISPATCH_OUTPUTS;
+
+   model->dispatch = D;
+   return 1;
+#endif
+}
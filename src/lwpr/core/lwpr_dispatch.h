@@ -0,0 +1,153 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_dispatch.h
+   \brief Prototypes for choosing between serial and multi-threaded updates and predictions
+      at runtime
+
+   If the library is compiled with NUM_THREADS > 1, lwpr_update splits the receptive fields of
+   each output dimension into NUM_THREADS slices that are updated by freshly started threads,
+   and the predictions start one thread per output dimension. For submodels with few receptive
+   fields, starting and joining the threads takes longer than the work they share.
+
+   lwpr_calibrate_dispatch measures both on the host: the time for starting and joining
+   NUM_THREADS-1 threads, and the time per receptive field of a serial update and prediction
+   of the model at hand. Afterwards, each update and prediction estimates the cost of the
+   possible modes from the current number of receptive fields, and picks the cheapest one:
+   - LWPR_DISPATCH_SERIAL: everything runs in the calling thread,
+   - LWPR_DISPATCH_OUTPUTS: the output dimensions are spread over the threads,
+   - LWPR_DISPATCH_RFS: the receptive fields of each output dimension are spread over the
+     threads (updates only).
+
+   The times per receptive field are kept up to date with a moving average over the serial
+   calls, and every LWPR_DISPATCH_PROBE-th call runs serially for that purpose, so the
+   estimates follow the model while its receptive fields gain projections. The results of
+   updates and predictions do not depend on the mode: a serial update processes the same slices
+   of receptive fields, and combines their sums in the same order, as the threads would.
+
+   Predictions have no RF-parallel mode, because each output dimension is predicted from the
+   few receptive fields that the activation scan (or the clusters and the index, see
+   lwpr_set_clusters) finds, and merging the sums of several threads would change the rounding.
+
+   The calibration is not stored in model files, since it only holds for the host it was
+   measured on. lwpr_duplicate_model copies it, but not the counters. lwpr_predict must not be
+   called from several threads at the same time, since it uses the working memory of the model
+   (see lwpr_conc.h). Threads that predict while the model is trained or used elsewhere should
+   use an LWPR_Reader (lwpr_reader_predict), which does not touch the dispatch statistics.
+
+   \code
+   lwpr_calibrate_dispatch(&model);
+   ... lwpr_update / lwpr_predict ...
+   lwpr_dispatch_stats(&model, &stats);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_DISPATCH_H
+#define __LWPR_DISPATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Dispatch mode: the update or prediction runs in the calling thread */
+#define LWPR_DISPATCH_SERIAL     0
+/** \brief Dispatch mode: each thread handles whole output dimensions */
+#define LWPR_DISPATCH_OUTPUTS    1
+/** \brief Dispatch mode: each thread handles a slice of the receptive fields of every output dimension */
+#define LWPR_DISPATCH_RFS        2
+/** \brief Number of dispatch modes */
+#define LWPR_NUM_DISPATCH        3
+
+/** \brief Number of calls after which a call runs serially to refresh the time per receptive field */
+#define LWPR_DISPATCH_PROBE      1024
+
+/** \brief Calibration and statistics of choosing the dispatch mode at runtime, see lwpr_calibrate_dispatch
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Dispatch {
+   double spawn;           /**< \brief Time for starting and joining NUM_THREADS-1 threads (seconds) */
+   double update_rf;       /**< \brief Time per receptive field of a serial update of one output dimension (seconds) */
+   double predict_rf;      /**< \brief Time per receptive field of a serial prediction of one output dimension (seconds) */
+   int last_update;        /**< \brief Mode of the last update (LWPR_DISPATCH_SERIAL, ...) */
+   int last_predict;       /**< \brief Mode of the last prediction (of the last group of NUM_THREADS output dimensions) */
+   int update_probe;       /**< \brief Number of updates since the last serial one */
+   int predict_probe;      /**< \brief Number of predictions since the last serial one */
+   double n_update[LWPR_NUM_DISPATCH];    /**< \brief Number of updates per mode */
+   double n_predict[LWPR_NUM_DISPATCH];   /**< \brief Number of predictions (groups of up to NUM_THREADS output dimensions) per mode */
+} LWPR_Dispatch;
+
+struct LWPR_Model;
+
+/** \brief Measures the cost of starting threads and of the receptive fields of a model, and lets
+      updates and predictions of the model choose their dispatch mode from then on
+   \param[in,out] model  Pointer to a valid LWPR model. Its updates are timed on a copy
+                         (see lwpr_duplicate_model), so the model itself is not changed.
+   \return
+      - 1 in case of success. Calling it again repeats the measurements.
+      - 0 if the library is compiled with NUM_THREADS = 1, or memory could not be allocated
+   \ingroup LWPR_C
+*/
+int lwpr_calibrate_dispatch(struct LWPR_Model *model);
+
+/** \brief Returns a model to the dispatch modes fixed at compile time (RF-parallel updates,
+      output-parallel predictions), and discards its calibration
+   \ingroup LWPR_C
+*/
+void lwpr_fixed_dispatch(struct LWPR_Model *model);
+
+/** \brief Reads the calibration and the modes chosen so far
+   \param[in] model   Pointer to a valid LWPR model
+   \param[out] stats  Calibration and counters. For models that were not calibrated, all values
+                      are zero, and the modes are those fixed at compile time.
+   \return
+      - 1 if the model chooses its dispatch mode at runtime
+      - 0 otherwise
+   \ingroup LWPR_C
+*/
+int lwpr_dispatch_stats(const struct LWPR_Model *model, LWPR_Dispatch *stats);
+
+/** \brief Returns a printable name of a dispatch mode ("serial", "outputs", "rfs") */
+const char *lwpr_dispatch_name(int mode);
+
+/** \brief Called by lwpr_update to choose the mode of an update of all output dimensions.
+      Only used if LWPR_Model.dispatch is set. */
+int lwpr_dispatch_update(const struct LWPR_Model *model);
+
+/** \brief Called by the predictions to choose the mode for a group of <em>todo</em> output
+      dimensions with <em>numRF</em> receptive fields in total and at most <em>maxRF</em> in one
+      of them. Only used if LWPR_Model.dispatch is set. */
+int lwpr_dispatch_predict(const struct LWPR_Model *model, int numRF, int maxRF, int todo);
+
+/** \brief Called after a serial update of <em>numRF</em> receptive fields that took <em>time</em> seconds */
+void lwpr_dispatch_time_update(const struct LWPR_Model *model, int numRF, double time);
+
+/** \brief Called after a serial prediction from <em>numRF</em> receptive fields that took <em>time</em> seconds */
+void lwpr_dispatch_time_predict(const struct LWPR_Model *model, int numRF, double time);
+
+/** \brief Returns the time of a monotonic clock in seconds */
+double lwpr_dispatch_clock(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
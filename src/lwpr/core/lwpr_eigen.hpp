@@ -145,7 +145,12 @@ class LWPR_ReceptiveFieldObject {
    /** \brief Returns the distance metric of the receptive field, as a vector of vectors (nIn x nIn) */
    Eigen::MatrixXd D() const {
       Eigen::MatrixXd ds(nIn, nIn);
-      memcpy(ds.data(), RF->D, sizeof(double)*(nIn*nIn));
+      std::vector<double> dense(nIn*nInS);
+      const double *D = &dense[0];
+      lwpr_rf_get_D(RF, &dense[0]);
+      for (int i=0;i<nIn;i++) {
+         memcpy(ds.data() + i*nIn, D + i*nInS, sizeof(double)*nIn);
+      }
       return ds;
    }
 
@@ -154,8 +159,11 @@ class LWPR_ReceptiveFieldObject {
    Eigen::MatrixXd M() const {
       Eigen::MatrixXd ms(nIn, nIn);
       ms.setZero();
+      std::vector<double> dense(nIn*nInS);
+      const double *M = &dense[0];
+      lwpr_rf_get_M(RF, &dense[0]);
       for (int i=0;i<nIn;i++) {
-         memcpy(ms.data() + i*nInS, RF->M + i*nInS, sizeof(double)*(i+1));
+         memcpy(ms.data() + i*nIn, M + i*nInS, sizeof(double)*(i+1));
       }
       return ms;
    }
@@ -359,7 +367,7 @@ class LWPR_Object {
    Eigen::VectorXd update(const Eigen::VectorXd& x, const Eigen::VectorXd& y) {
        Eigen::VectorXd yp(model.nOut);
 
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }
 
@@ -391,7 +399,7 @@ class LWPR_Object {
    Eigen::VectorXd predict(const Eigen::VectorXd& x, double cutoff = 0.001) {
        Eigen::VectorXd yp(model.nOut);
 
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }
 
@@ -415,7 +423,7 @@ class LWPR_Object {
    Eigen::VectorXd predict(const Eigen::VectorXd& x, Eigen::VectorXd& confidence, double cutoff = 0.001) {
        Eigen::VectorXd yp(model.nOut);
 
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }
       if (confidence.size()!=(unsigned) model.nOut) confidence.resize(model.nOut);
@@ -442,7 +450,7 @@ class LWPR_Object {
    Eigen::VectorXd predict(const Eigen::VectorXd& x, Eigen::VectorXd& confidence, Eigen::VectorXd& maxW, double cutoff = 0.001) {
        Eigen::VectorXd yp(model.nOut);
 
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }
       if (confidence.size()!=(unsigned) model.nOut) confidence.resize(model.nOut);
@@ -454,13 +462,13 @@ class LWPR_Object {
 
    /**
     * Compute the Jabobian of LWPR model at given input vector x
-    * The returned jacobian is nOut x nIn matrix in major column.
+    * The returned jacobian is nOut x nInRaw matrix in major column.
     */
    Eigen::MatrixXd predictJ(const Eigen::VectorXd& x, double cutoff = 0.001) {
       Eigen::VectorXd yp(model.nOut);
-      Eigen::MatrixXd J(model.nOut, model.nIn);
+      Eigen::MatrixXd J(model.nOut, model.nInRaw);
 
-      if (x.size()!=(unsigned) model.nIn) {
+      if (x.size()!=(unsigned) model.nInRaw) {
          throw LWPR_Exception(LWPR_Exception::BAD_INPUT_DIM);
       }
 
@@ -560,6 +568,9 @@ class LWPR_Object {
    /** \brief Returns the input dimensionality */
    int nIn() const { return model.nIn; }
 
+   /** \brief Returns the dimensionality of the inputs before projection (equal to nIn() without projection) */
+   int nInRaw() const { return model.nInRaw; }
+
    /** \brief Returns the output dimensionality */
    int nOut() const { return model.nOut; }
 
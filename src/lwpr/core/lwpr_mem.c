@@ -20,14 +20,18 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <lwpr/core/lwpr.h>
 #include <lwpr/core/lwpr_aux.h>
 #include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_ooc.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_conc.h>
 #include <string.h>
 #include <stdlib.h>
 typedef long int                intptr_t;
 
 int lwpr_mem_alloc_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, int nReg, int nRegStore) {
-   double *storage;
-   int nIn = model->nIn;
+   double *storage, *cold;
    int nInS = model->nInStore;
+   int nM = model->nMetric;
+   int nFix, nCold, nVar;
 
    if (nRegStore < nReg) nRegStore = nReg;
 
@@ -37,24 +41,68 @@ int lwpr_mem_alloc_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, int nReg
    RF->model = model;
 
    /* First allocate stuff independent of nReg:
-   **    D,M,alpha,h,b are nIn x nIn
+   **    D,M,alpha,h,b are nIn x nIn, or only their blocks (nMetric, see lwpr_set_blocks)
    **    mean_x, var_x are nIn x 1
    **           slope  is  nIn x 1
-   **      ==>  nIn * (5*nIn + 4)
+   **             box  is  nIn x 1
+   **      ==>  5*nMetric + 5*nIn
+   ** Low-rank metrics replace D,M,h,b by L, and alpha is nIn x (rank+1)
+   **      ==>  nIn * (2*rank + 7)
+   ** alpha, h and b are only needed for updates of activated RFs. Out-of-core
+   ** models (see lwpr_set_out_of_core) keep them in the arena block, in front
+   ** of the variables that depend on nReg.
    */
+   if (model->rank > 0) {
+      nFix = nInS*(model->rank + 1) + 5*nInS;
+      nCold = nInS*(model->rank + 1);
+   } else {
+      nFix = 2*nM + 5*nInS;
+      nCold = 3*nM;
+   }
+   nVar = nRegStore*(4*nInS + 10);
 
-   storage = RF->fixStorage = (double *) LWPR_CALLOC((size_t) (1 + nInS*(5*nIn + 4)), sizeof(double));
-   if (storage==NULL) return 0;
+   if (model->ooc != NULL) {
+      storage = RF->fixStorage = (double *) LWPR_CALLOC((size_t) (1 + nFix), sizeof(double));
+      if (storage==NULL) return 0;
+
+      RF->oocBlock = lwpr_ooc_alloc_block(model->ooc, RF, (size_t) (nCold + nVar));
+      if (RF->oocBlock==NULL) {
+         LWPR_FREE(RF->fixStorage);
+         RF->fixStorage=NULL;
+         return 0;
+      }
+      /* Blocks are page-aligned */
+      cold = RF->varStorage = lwpr_ooc_block_data(RF->oocBlock);
+   } else {
+      storage = RF->fixStorage = (double *) LWPR_CALLOC((size_t) (1 + nFix + nCold), sizeof(double));
+      if (storage==NULL) return 0;
+      RF->oocBlock = NULL;
+      cold = NULL;
+   }
 
    if (((intptr_t)((void *) storage)) & 8) storage++;
-   RF->alpha  = storage; storage+=nInS*nIn;
-   RF->D      = storage; storage+=nInS*nIn;
-   RF->M      = storage; storage+=nInS*nIn;
-   RF->h      = storage; storage+=nInS*nIn;
-   RF->b      = storage; storage+=nInS*nIn;
+
+   if (model->rank > 0) {
+      RF->L      = storage; storage+=nCold;
+      RF->D = RF->M = RF->h = RF->b = NULL;
+   } else {
+      RF->D      = storage; storage+=nM;
+      RF->M      = storage; storage+=nM;
+      RF->L      = NULL;
+   }
+   if (cold == NULL) {
+      cold = storage; storage+=nCold;
+   }
+   RF->alpha = cold;
+   if (model->rank == 0) {
+      RF->h = cold + nM;
+      RF->b = cold + 2*nM;
+   }
+   RF->DReady = 1;
    RF->c      = storage; storage+=nInS;
    RF->mean_x = storage; storage+=nInS;
    RF->slope  = storage; storage+=nInS;
+   RF->box    = storage; storage+=nInS;
    RF->var_x  = storage;
 
    /* Now, allocate stuff dependent of nReg (nRegStore):
@@ -62,23 +110,27 @@ int lwpr_mem_alloc_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, int nReg
    ** Alignment of the rest can be assured if nRegStore is always chosen even (2,4,...)
    */
 
-   storage = RF->varStorage = (double *) LWPR_CALLOC((size_t) (1 + nRegStore*(4*nInS + 10)), sizeof(double));
-
-   if (storage==NULL) {
-      /* free already alloced storage */
-      LWPR_FREE(RF->fixStorage);
-      RF->fixStorage=NULL;
-      return 0;
-   }
+   if (RF->oocBlock != NULL) {
+      storage = RF->varStorage + nCold;
+   } else {
+      storage = RF->varStorage = (double *) LWPR_CALLOC((size_t) (1 + nVar), sizeof(double));
 
-   #ifdef MATLAB
-      if (model->isPersistent) {
-         mexMakeMemoryPersistent(RF->varStorage);
-         mexMakeMemoryPersistent(RF->fixStorage);
+      if (storage==NULL) {
+         /* free already alloced storage */
+         LWPR_FREE(RF->fixStorage);
+         RF->fixStorage=NULL;
+         return 0;
       }
-   #endif
 
-   if (((intptr_t)((void *) storage)) & 8) storage++;
+      #ifdef MATLAB
+         if (model->isPersistent) {
+            mexMakeMemoryPersistent(RF->varStorage);
+            mexMakeMemoryPersistent(RF->fixStorage);
+         }
+      #endif
+
+      if (((intptr_t)((void *) storage)) & 8) storage++;
+   }
 
    RF->SXresYres = storage; storage+=nInS*nRegStore;
    RF->SSXres    = storage; storage+=nInS*nRegStore;
@@ -97,8 +149,13 @@ int lwpr_mem_alloc_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, int nReg
    RF->s         = storage;
 
    RF->w = RF->beta0 = RF->sum_e2 = 0.0;
+   RF->mon_sum_e2 = RF->mon_sum_w = 0.0;
+   RF->w_stamp = 0;
+   RF->dirty = 0;
    RF->trustworthy = 0;
    RF->slopeReady = 0;
+   RF->boxReady = 0;
+   RF->cluster = NULL;
 
 
    return 1;
@@ -106,15 +163,35 @@ int lwpr_mem_alloc_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, int nReg
 
 int lwpr_mem_realloc_rf(LWPR_ReceptiveField *RF, int nRegStore) {
    double *newStorage, *storage;
+   struct LWPR_OutOfCoreBlock *newBlock = NULL;
    int nInS,nReg;
 
    nInS = RF->model->nInStore;
    nReg = RF->nReg;
 
-   storage = newStorage = (double *) LWPR_CALLOC((size_t)(1 + nRegStore*(4*nInS + 11)), sizeof(double));
-   if (newStorage==NULL) return 0;
+   if (RF->oocBlock != NULL) {
+      /* alpha, h and b move along with the PLS variables */
+      int nM = RF->model->nMetric;
+      int rank = RF->model->rank;
+      int nCold = (rank > 0) ? nInS*(rank + 1) : 3*nM;
+
+      newBlock = lwpr_ooc_alloc_block(RF->model->ooc, RF, (size_t)(nCold + nRegStore*(4*nInS + 10)));
+      if (newBlock==NULL) return 0;
+      storage = newStorage = lwpr_ooc_block_data(newBlock);
+
+      memcpy(storage, RF->alpha, nCold*sizeof(double));
+      RF->alpha = storage;
+      if (rank == 0) {
+         RF->h = storage + nM;
+         RF->b = storage + 2*nM;
+      }
+      storage+=nCold;
+   } else {
+      storage = newStorage = (double *) LWPR_CALLOC((size_t)(1 + nRegStore*(4*nInS + 11)), sizeof(double));
+      if (newStorage==NULL) return 0;
 
-   if (((intptr_t)((void *) storage)) & 8) storage++;
+      if (((intptr_t)((void *) storage)) & 8) storage++;
+   }
 
    memcpy(storage, RF->SXresYres, nInS*nReg*sizeof(double)); RF->SXresYres = storage; storage+=nInS*nRegStore;
    memcpy(storage, RF->SSXres,    nInS*nReg*sizeof(double)); RF->SSXres    = storage; storage+=nInS*nRegStore;
@@ -132,7 +209,15 @@ int lwpr_mem_realloc_rf(LWPR_ReceptiveField *RF, int nRegStore) {
    memcpy(storage, RF->lambda,    nReg*sizeof(double)); RF->lambda    = storage; storage+=nRegStore;
    memcpy(storage, RF->s,         nReg*sizeof(double)); RF->s         = storage;
 
-   LWPR_FREE(RF->varStorage);
+   if (newBlock != NULL) {
+      lwpr_ooc_free_block(RF->oocBlock);
+      RF->oocBlock = newBlock;
+   } else if (RF->model->conc != NULL) {
+      /* Concurrent readers may still use the old storage */
+      lwpr_conc_retire(RF->model->conc, RF->varStorage, lwpr_conc_release_mem);
+   } else {
+      LWPR_FREE(RF->varStorage);
+   }
    RF->varStorage = newStorage;
    RF->nRegStore = nRegStore;
 #ifdef MATLAB
@@ -141,11 +226,75 @@ int lwpr_mem_realloc_rf(LWPR_ReceptiveField *RF, int nRegStore) {
    return 1;
 }
 
+int lwpr_mem_move_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model) {
+   LWPR_ReceptiveField old = *RF;
+   int nInS = model->nInStore;
+   int nReg = RF->nReg;
+   int nM = (model->rank > 0) ? nInS*(model->rank + 1) : model->nMetric;
+
+   if (!lwpr_mem_alloc_rf(RF, model, nReg, old.nRegStore)) {
+      *RF = old;
+      return 0;
+   }
+
+   if (old.L != NULL) {
+      memcpy(RF->L,   old.L,   nM*sizeof(double));
+   } else {
+      memcpy(RF->D,   old.D,   nM*sizeof(double));
+      memcpy(RF->M,   old.M,   nM*sizeof(double));
+      memcpy(RF->h,   old.h,   nM*sizeof(double));
+      memcpy(RF->b,   old.b,   nM*sizeof(double));
+   }
+   memcpy(RF->alpha,  old.alpha,  nM*sizeof(double));
+   memcpy(RF->c,      old.c,      nInS*sizeof(double));
+   memcpy(RF->mean_x, old.mean_x, nInS*sizeof(double));
+   memcpy(RF->slope,  old.slope,  nInS*sizeof(double));
+   memcpy(RF->box,    old.box,    nInS*sizeof(double));
+   memcpy(RF->var_x,  old.var_x,  nInS*sizeof(double));
+
+   memcpy(RF->SXresYres, old.SXresYres, nInS*nReg*sizeof(double));
+   memcpy(RF->SSXres,    old.SSXres,    nInS*nReg*sizeof(double));
+   memcpy(RF->U,         old.U,         nInS*nReg*sizeof(double));
+   memcpy(RF->P,         old.P,         nInS*nReg*sizeof(double));
+   memcpy(RF->beta,      old.beta,      nReg*sizeof(double));
+   memcpy(RF->SSs2,      old.SSs2,      nReg*sizeof(double));
+   memcpy(RF->SSYres,    old.SSYres,    nReg*sizeof(double));
+   memcpy(RF->H,         old.H,         nReg*sizeof(double));
+   memcpy(RF->r,         old.r,         nReg*sizeof(double));
+   memcpy(RF->sum_w,     old.sum_w,     nReg*sizeof(double));
+   memcpy(RF->sum_e_cv2, old.sum_e_cv2, nReg*sizeof(double));
+   memcpy(RF->n_data,    old.n_data,    nReg*sizeof(double));
+   memcpy(RF->lambda,    old.lambda,    nReg*sizeof(double));
+   memcpy(RF->s,         old.s,         nReg*sizeof(double));
+
+   RF->trustworthy = old.trustworthy;
+   RF->slopeReady  = old.slopeReady;
+   RF->boxReady    = old.boxReady;
+   RF->DReady      = old.DReady;
+   RF->w           = old.w;
+   RF->w_stamp     = old.w_stamp;
+   RF->dirty       = old.dirty;
+   RF->sum_e2      = old.sum_e2;
+   RF->mon_sum_e2  = old.mon_sum_e2;
+   RF->mon_sum_w   = old.mon_sum_w;
+   RF->beta0       = old.beta0;
+   RF->SSp         = old.SSp;
+   RF->cluster     = old.cluster;
+
+   lwpr_mem_free_rf(&old);
+   return 1;
+}
+
 void lwpr_mem_free_rf(LWPR_ReceptiveField *RF) {
    RF->nRegStore = 0;
 
    LWPR_FREE(RF->fixStorage);
-   LWPR_FREE(RF->varStorage);
+   if (RF->oocBlock != NULL) {
+      lwpr_ooc_free_block(RF->oocBlock);
+      RF->oocBlock = NULL;
+   } else {
+      LWPR_FREE(RF->varStorage);
+   }
 }
 
 int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int nOut, int storeRFS) {
@@ -174,7 +323,7 @@ int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int nOut, int storeRFS) {
    }
 
 
-   storage = (double *) LWPR_CALLOC((size_t)(1 + 2*nOut + nInS*(3*nIn + 4)), sizeof(double));
+   storage = (double *) LWPR_CALLOC((size_t)(1 + 2*nOut + nInS*(3*nIn + 7)), sizeof(double));
    if (storage==NULL) {
       LWPR_FREE(model->sub);
       for (i=0;i<NUM_THREADS;i++) lwpr_mem_free_ws(&model->ws[i]);
@@ -191,16 +340,38 @@ int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int nOut, int storeRFS) {
    model->init_alpha = storage; storage+=nInS*nIn;
    model->norm_in = storage;    storage+=nInS;
    model->xn = storage;         storage+=nInS;
+   model->vn = storage;         storage+=nInS;
+   /* nInS doubles hold at least 2*nIn ints */
+   model->block_begin = (int *) storage; storage+=nInS;
+   model->block_end = model->block_begin + nIn;
+   model->metric_col = (int *) storage; storage+=nInS;
    model->norm_out = storage;   storage+=nOut;
    model->yn = storage;
 
    model->name = NULL;
+   model->nInRaw = nIn;
+   model->proj_P = model->proj_mean = model->proj_cov = NULL;
+   model->proj_work = model->proj_storage = NULL;
+   model->proj_interval = 0;
+   model->index_dirs = NULL;
+   model->taylor = NULL;
+   model->ooc = NULL;
+   model->rec = NULL;
+   model->repl = NULL;
+   model->lazy = NULL;
+   model->dispatch = NULL;
+   model->conc = NULL;
+   model->checkpoint = NULL;
 
    model->nOut = nOut;
    for (i=0;i<nOut;i++) {
       model->sub[i].n_pruned = 0;
       model->sub[i].numRFS = 0;
+      model->sub[i].seq = 0;
       model->sub[i].numPointers = storeRFS;
+      model->sub[i].numClusters = model->sub[i].numClusterPointers = 0;
+      model->sub[i].clusters = NULL;
+      model->sub[i].index = NULL;
       model->sub[i].model = model;
       if (storeRFS>0) {
          model->sub[i].rf = (LWPR_ReceptiveField **) LWPR_CALLOC((size_t)storeRFS, sizeof(LWPR_ReceptiveField *));
@@ -229,6 +400,9 @@ int lwpr_mem_alloc_sub(LWPR_SubModel *sub, int storeRFS) {
    sub->n_pruned = 0;
    sub->numRFS = 0;
    sub->numPointers = storeRFS;
+   sub->numClusters = sub->numClusterPointers = 0;
+   sub->clusters = NULL;
+   sub->index = NULL;
    sub->rf = (LWPR_ReceptiveField **) LWPR_CALLOC((size_t)storeRFS, sizeof(LWPR_ReceptiveField *));
 
    if (sub->rf == NULL) {
@@ -242,8 +416,11 @@ int lwpr_mem_alloc_sub(LWPR_SubModel *sub, int storeRFS) {
 void lwpr_free_model(LWPR_Model *model) {
    int i;
    if (model->nOut * model->nIn == 0) return;
+   lwpr_io_lazy_abort(model);
    for (i=0;i<model->nOut;i++) {
       int j;
+      lwpr_aux_free_clusters(&model->sub[i]);
+      lwpr_aux_free_index(&model->sub[i]);
       for (j=0; j < model->sub[i].numRFS; j++) {
          lwpr_mem_free_rf(model->sub[i].rf[j]);
          LWPR_FREE(model->sub[i].rf[j]);
@@ -257,9 +434,43 @@ void lwpr_free_model(LWPR_Model *model) {
    }
    LWPR_FREE(model->ws);
    LWPR_FREE(model->storage);
+   if (model->proj_storage != NULL) LWPR_FREE(model->proj_storage);
+   if (model->index_dirs != NULL) LWPR_FREE(model->index_dirs);
+   lwpr_aux_free_taylor(model);
+   if (model->ooc != NULL) lwpr_ooc_close(model->ooc);
+   if (model->dispatch != NULL) LWPR_FREE(model->dispatch);
+   if (model->conc != NULL) lwpr_conc_free(model->conc);
    if (model->name != NULL) LWPR_FREE(model->name);
 }
 
+int lwpr_mem_alloc_projection(LWPR_Model *model, int nInRaw) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nOut = model->nOut;
+   double *storage;
+
+   /* P is nIn x nInRaw, mean is nInRaw x 1, cov is nInRaw x nInRaw
+   ** The workspace holds two nOut x nIn Jacobians, nOut Hessians (nIn x nIn),
+   ** and an nIn x nInRaw (or nInRaw x nIn) temporary matrix
+   */
+   storage = (double *) LWPR_CALLOC((size_t)(1 + nInS*nInRaw + nInRaw*(nInRaw + 1)
+         + nIn*(2*nOut + nIn*nOut + nInRaw)), sizeof(double));
+   if (storage == NULL) return 0;
+
+   model->proj_storage = storage;
+#ifdef MATLAB
+   if (model->isPersistent) mexMakeMemoryPersistent(storage);
+#endif
+   if (((intptr_t)((void *) storage)) & 8) storage++;
+
+   model->proj_P = storage;     storage+=nInS*nInRaw;
+   model->proj_mean = storage;  storage+=nInRaw;
+   model->proj_cov = storage;   storage+=nInRaw*nInRaw;
+   model->proj_work = storage;
+   model->nInRaw = nInRaw;
+   return 1;
+}
+
 
 int lwpr_mem_alloc_ws(LWPR_Workspace *ws, int nIn) {
    int nInS;
@@ -271,7 +482,7 @@ int lwpr_mem_alloc_ws(LWPR_Workspace *ws, int nIn) {
 
    if (ws->derivOk == NULL) return 0;
 
-   ws->storage = storage = (double *) LWPR_CALLOC((size_t)(1 + 8*nInS*nIn + 7*nInS + 6*nIn), sizeof(double));
+   ws->storage = storage = (double *) LWPR_CALLOC((size_t)(1 + 8*nInS*nIn + 8*nInS + 6*nIn), sizeof(double));
 
    if (storage == NULL) {
       LWPR_FREE(ws->derivOk);
@@ -291,6 +502,7 @@ int lwpr_mem_alloc_ws(LWPR_Workspace *ws, int nIn) {
 
    ws->dsdx     = storage; storage+=nInS*nIn;
    ws->Dx       = storage; storage+=nInS;
+   ws->Mx       = storage; storage+=nInS;
    /* The following variables are needed for calculating
    ** gradients and Hessians of the predictions.
    ** In theory they could use the same space as, say, dwdM etc.
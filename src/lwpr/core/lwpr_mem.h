@@ -75,6 +75,21 @@ int lwpr_mem_alloc_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model, int nReg
 */         
 int lwpr_mem_realloc_rf(LWPR_ReceptiveField *RF, int nRegStore);
 
+/** \brief Re-allocates all memory of a receptive field according to the storage mode of its model.
+
+   \param[in,out] RF     Pointer to a valid receptive field structure.
+   \param[in] model      Pointer to the LWPR model the receptive field belongs to.
+   \return
+      - 1 in case of succes
+      - 0 in case of failure, the receptive field is left unchanged.
+
+   Depending on LWPR_Model.ooc, the new memory is either allocated in RAM or partly
+   within the memory-mapped file of the model. The address of the LWPR_ReceptiveField
+   structure itself does not change.
+   \sa lwpr_set_out_of_core
+*/
+int lwpr_mem_move_rf(LWPR_ReceptiveField *RF, const LWPR_Model *model);
+
 /** \brief Disposes the memory for the internal variables of a receptive field.
 
    \param[in,out] RF     Pointer to a receptive field structure.
@@ -121,6 +136,19 @@ void lwpr_mem_free_ws(LWPR_Workspace *ws);
 */             
 int lwpr_mem_alloc_model(LWPR_Model *model, int nIn, int nOut, int storeRFS);
 
+/** \brief Allocates memory for the input projection of an LWPR model
+
+   \param[in,out] model  Pointer to an LWPR_Model structure without a projection
+   \param[in] nInRaw     Dimensionality of the raw inputs
+   \return
+      - 1 in case of succes
+      - 0 in case of failure 
+
+   The memory is zeroed and disposed by lwpr_free_model().
+   \sa lwpr_set_projection
+*/
+int lwpr_mem_alloc_projection(LWPR_Model *model, int nInRaw);
+
 /** \brief Allocates memory for internal variables of a LWPR submodel structure.
 
    \param[in,out] sub  Pointer to an existing LWPR_SubModel structure
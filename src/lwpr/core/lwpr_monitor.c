@@ -0,0 +1,384 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#if !defined(WIN32) && !defined(_GNU_SOURCE)
+   #define _GNU_SOURCE     /* for SCHED_IDLE */
+#endif
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_conc.h>
+#include <lwpr/core/lwpr_monitor.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Atomic operations on the indices of the queue and the sequence numbers of the statistics.
+** LOAD has acquire and STORE has release semantics. FENCE is a full barrier. */
+#ifdef WIN32
+   #include <windows.h>
+   #define LWPR_MON_LOAD(p)      (*(p))
+   #define LWPR_MON_STORE(p,v)   (*(p) = (v))
+   #define LWPR_MON_FENCE()      MemoryBarrier()
+#else
+   #define LWPR_MON_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+   #define LWPR_MON_STORE(p,v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+   #define LWPR_MON_FENCE()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+#if NUM_THREADS > 1
+   #ifndef WIN32
+      #include <pthread.h>
+      #include <sched.h>
+      #include <time.h>
+   #endif
+
+/* Milliseconds after which an idle background thread looks at the queue again, in case
+** lwpr_monitor_validate could not wake it up without waiting for the lock */
+#define LWPR_MON_POLL   10
+
+struct LWPR_MonitorThread {
+   volatile int quit;
+   int conc;            /* 1 if the monitor switched on concurrent predictions of the model */
+   LWPR_Reader reader;  /* Predicts the validation samples while the model is trained */
+#ifdef WIN32
+   HANDLE thread;
+   CRITICAL_SECTION lock;
+   CONDITION_VARIABLE cond;
+#else
+   pthread_t thread;
+   pthread_mutex_t lock;
+   pthread_cond_t cond;
+#endif
+};
+
+#ifdef WIN32
+   #define LWPR_MON_LOCK(T)     EnterCriticalSection(&(T)->lock)
+   #define LWPR_MON_TRYLOCK(T)  TryEnterCriticalSection(&(T)->lock)
+   #define LWPR_MON_UNLOCK(T)   LeaveCriticalSection(&(T)->lock)
+   #define LWPR_MON_SIGNAL(T)   WakeConditionVariable(&(T)->cond)
+#else
+   #define LWPR_MON_LOCK(T)     pthread_mutex_lock(&(T)->lock)
+   #define LWPR_MON_TRYLOCK(T)  (pthread_mutex_trylock(&(T)->lock) == 0)
+   #define LWPR_MON_UNLOCK(T)   pthread_mutex_unlock(&(T)->lock)
+   #define LWPR_MON_SIGNAL(T)   pthread_cond_signal(&(T)->cond)
+#endif
+#endif
+
+static void lwpr_monitor_record(LWPR_MonitorStats *S, int nOut, double decay, const double *y, const double *yp) {
+   int i;
+   double a;
+
+   /* Plain averages until the effective window of the exponential weighting is reached */
+   a = 1.0/(double) (++S->n_data);
+   if (a < 1.0 - decay) a = 1.0 - decay;
+
+   for (i=0;i<nOut;i++) {
+      double e = y[i] - yp[i];
+      double d = y[i] - S->mean_y[i];
+      S->mse[i] += a*(e*e - S->mse[i]);
+      S->mean_y[i] += a*d;
+      S->var_y[i] = (1.0 - a)*(S->var_y[i] + a*d*d);
+   }
+}
+
+/* Copies the validation statistics into the entry of shown[] that is not the most recent one.
+** lwpr_monitor_get reads the other entry meanwhile, and never waits for this function. */
+static void lwpr_monitor_publish(LWPR_Monitor *mon) {
+   int nOut = mon->model->nOut;
+   int b = 1 - mon->shown_last;
+   LWPR_MonitorStats *S = &mon->shown[b];
+
+   lwpr_conc_write_begin(&mon->shown_seq[b]);
+   S->n_data = mon->valid.n_data;
+   memcpy(S->mse, mon->valid.mse, nOut*sizeof(double));
+   memcpy(S->mean_y, mon->valid.mean_y, nOut*sizeof(double));
+   memcpy(S->var_y, mon->valid.var_y, nOut*sizeof(double));
+   lwpr_conc_write_end(&mon->shown_seq[b]);
+   LWPR_MON_STORE(&mon->shown_last, b);
+}
+
+/* Evaluates the oldest queued validation sample, through R if it is not NULL */
+static void lwpr_monitor_eval_one(LWPR_Monitor *mon, LWPR_Reader *R) {
+   int nIn = mon->model->nInRaw;
+   int nOut = mon->model->nOut;
+   const double *sample = mon->queue + mon->head*(nIn + nOut);
+
+   if (R != NULL) {
+      lwpr_reader_predict(R, sample, 0.0, mon->yv, NULL, NULL);
+   } else {
+      lwpr_predict(mon->model, sample, 0.0, mon->yv, NULL, NULL);
+   }
+   lwpr_monitor_record(&mon->valid, nOut, mon->decay, sample + nIn, mon->yv);
+   lwpr_monitor_publish(mon);
+
+   /* Hands the slot back to lwpr_monitor_validate */
+   LWPR_MON_STORE(&mon->head, (mon->head + 1) % (mon->capacity + 1));
+}
+
+#if NUM_THREADS > 1
+#ifndef WIN32
+static void lwpr_monitor_wait(struct LWPR_MonitorThread *T) {
+   struct timespec until;
+
+   clock_gettime(CLOCK_REALTIME, &until);
+   until.tv_nsec += LWPR_MON_POLL * 1000000L;
+   if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+   }
+   (void) pthread_cond_timedwait(&T->cond, &T->lock, &until);
+}
+#endif
+
+static void *lwpr_monitor_T(void *ptr) {
+   LWPR_Monitor *mon = (LWPR_Monitor *) ptr;
+   struct LWPR_MonitorThread *T = mon->thread;
+
+   /* The thread never holds anything that training waits for, so it can run at the
+   ** lowest priority without slowing down lwpr_monitor_update */
+#if defined(WIN32)
+   SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_LOWEST);
+#elif defined(SCHED_IDLE)
+   {
+      struct sched_param param;
+      param.sched_priority = 0;
+      (void) pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+   }
+#endif
+
+   LWPR_MON_LOCK(T);
+   while (!LWPR_MON_LOAD(&T->quit)) {
+      if (mon->head == LWPR_MON_LOAD(&mon->tail)) {
+#ifdef WIN32
+         SleepConditionVariableCS(&T->cond, &T->lock, LWPR_MON_POLL);
+#else
+         lwpr_monitor_wait(T);
+#endif
+         continue;
+      }
+      LWPR_MON_UNLOCK(T);
+      lwpr_monitor_eval_one(mon, &T->reader);
+      LWPR_MON_LOCK(T);
+   }
+   LWPR_MON_UNLOCK(T);
+   return NULL;
+}
+
+#ifdef WIN32
+static DWORD WINAPI lwpr_monitor_T_win32(LPVOID ptr) {
+   (void) lwpr_monitor_T(ptr);
+   return 0;
+}
+#endif
+
+/* Starts the background thread, or returns 0 if the model cannot be read while it is
+** trained (see lwpr_set_concurrent) or the thread cannot be started */
+static int lwpr_monitor_start_thread(LWPR_Monitor *mon) {
+   struct LWPR_MonitorThread *T;
+
+   T = (struct LWPR_MonitorThread *) LWPR_MALLOC(sizeof(struct LWPR_MonitorThread));
+   if (T == NULL) return 0;
+   T->quit = 0;
+   T->conc = (mon->model->conc == NULL);
+
+   if (!lwpr_set_concurrent(mon->model, 1)) {
+      LWPR_FREE(T);
+      return 0;
+   }
+   if (lwpr_reader_init(&T->reader, mon->model)) {
+      mon->thread = T;
+#ifdef WIN32
+      InitializeCriticalSection(&T->lock);
+      InitializeConditionVariable(&T->cond);
+      T->thread = CreateThread(NULL, 0, lwpr_monitor_T_win32, mon, 0, NULL);
+      if (T->thread != NULL) return 1;
+      DeleteCriticalSection(&T->lock);
+#else
+      if (pthread_mutex_init(&T->lock, NULL) == 0) {
+         if (pthread_cond_init(&T->cond, NULL) == 0) {
+            if (pthread_create(&T->thread, NULL, lwpr_monitor_T, mon) == 0) return 1;
+            pthread_cond_destroy(&T->cond);
+         }
+         pthread_mutex_destroy(&T->lock);
+      }
+#endif
+      mon->thread = NULL;
+      lwpr_reader_close(&T->reader);
+   }
+   if (T->conc) (void) lwpr_set_concurrent(mon->model, 0);
+   LWPR_FREE(T);
+   return 0;
+}
+
+static void lwpr_monitor_stop_thread(LWPR_Monitor *mon) {
+   struct LWPR_MonitorThread *T = mon->thread;
+
+   LWPR_MON_STORE(&T->quit, 1);
+   LWPR_MON_LOCK(T);
+   LWPR_MON_SIGNAL(T);
+   LWPR_MON_UNLOCK(T);
+
+#ifdef WIN32
+   WaitForSingleObject(T->thread, INFINITE);
+   CloseHandle(T->thread);
+   DeleteCriticalSection(&T->lock);
+#else
+   pthread_join(T->thread, NULL);
+   pthread_cond_destroy(&T->cond);
+   pthread_mutex_destroy(&T->lock);
+#endif
+   lwpr_reader_close(&T->reader);
+   if (T->conc) (void) lwpr_set_concurrent(mon->model, 0);
+   mon->thread = NULL;
+   LWPR_FREE(T);
+}
+#endif
+
+static void lwpr_monitor_init_stats(LWPR_MonitorStats *S, double *storage, int nOut) {
+   S->n_data = 0;
+   S->mse    = storage;
+   S->mean_y = storage + nOut;
+   S->var_y  = storage + 2*nOut;
+}
+
+int lwpr_monitor_init(LWPR_Monitor *mon, LWPR_Model *model, double decay, int capacity) {
+   int nIn = model->nInRaw;
+   int nOut = model->nOut;
+   double *storage;
+   int i,n;
+
+   if (decay <= 0.0 || decay >= 1.0 || capacity < 0) return 0;
+
+   /* 3*nOut for each of the four LWPR_MonitorStats, nOut for yp and yv, and the queue,
+   ** which has one slot more than it can hold to tell a full queue from an empty one */
+   storage = mon->storage = (double *) LWPR_CALLOC((size_t) (14*nOut + (capacity+1)*(nIn + nOut)), sizeof(double));
+   if (storage == NULL) return 0;
+
+   mon->model = model;
+   mon->decay = decay;
+   mon->capacity = capacity;
+   mon->head = mon->tail = mon->n_dropped = 0;
+   mon->shown_seq[0] = mon->shown_seq[1] = mon->shown_last = 0;
+
+   lwpr_monitor_init_stats(&mon->fit, storage, nOut);        storage+=3*nOut;
+   lwpr_monitor_init_stats(&mon->valid, storage, nOut);      storage+=3*nOut;
+   lwpr_monitor_init_stats(&mon->shown[0], storage, nOut);   storage+=3*nOut;
+   lwpr_monitor_init_stats(&mon->shown[1], storage, nOut);   storage+=3*nOut;
+   mon->yp           = storage; storage+=nOut;
+   mon->yv           = storage; storage+=nOut;
+   mon->queue        = storage;
+
+   /* Per-RF statistics start afresh with this monitor */
+   for (i=0;i<nOut;i++) {
+      for (n=0;n<model->sub[i].numRFS;n++) {
+         model->sub[i].rf[n]->mon_sum_e2 = model->sub[i].rf[n]->mon_sum_w = 0.0;
+      }
+   }
+   model->mon_decay = decay;
+
+   mon->thread = NULL;
+#if NUM_THREADS > 1
+   /* Without the thread, lwpr_monitor_validate evaluates the samples itself */
+   if (capacity > 0) (void) lwpr_monitor_start_thread(mon);
+#endif
+   return 1;
+}
+
+void lwpr_monitor_free(LWPR_Monitor *mon) {
+#if NUM_THREADS > 1
+   if (mon->thread != NULL) lwpr_monitor_stop_thread(mon);
+#endif
+   mon->model->mon_decay = 0.0;
+   LWPR_FREE(mon->storage);
+   mon->storage = NULL;
+}
+
+int lwpr_monitor_update(LWPR_Monitor *mon, const double *x, const double *y, double *yp, double *max_w) {
+   int code;
+
+   if (yp == NULL) yp = mon->yp;
+   code = lwpr_update(mon->model, x, y, yp, max_w);
+   lwpr_monitor_record(&mon->fit, mon->model->nOut, mon->decay, y, yp);
+   return code;
+}
+
+int lwpr_monitor_validate(LWPR_Monitor *mon, const double *x, const double *y) {
+   int nIn = mon->model->nInRaw;
+   int nOut = mon->model->nOut;
+   int next = (mon->tail + 1) % (mon->capacity + 1);
+   double *sample;
+
+   if (next == LWPR_MON_LOAD(&mon->head)) {
+      mon->n_dropped++;
+      return 0;
+   }
+   sample = mon->queue + mon->tail*(nIn + nOut);
+   memcpy(sample, x, nIn*sizeof(double));
+   memcpy(sample + nIn, y, nOut*sizeof(double));
+   LWPR_MON_STORE(&mon->tail, next);
+
+#if NUM_THREADS > 1
+   if (mon->thread != NULL) {
+      /* If the thread holds the lock, it is about to look at the queue or to wait
+      ** for at most LWPR_MON_POLL milliseconds */
+      if (LWPR_MON_TRYLOCK(mon->thread)) {
+         LWPR_MON_SIGNAL(mon->thread);
+         LWPR_MON_UNLOCK(mon->thread);
+      }
+      return 1;
+   }
+#endif
+   lwpr_monitor_eval_one(mon, NULL);
+   return 1;
+}
+
+void lwpr_monitor_get(LWPR_Monitor *mon, double *fit_mse, double *fit_nmse, double *val_mse, double *val_nmse) {
+   int nOut = mon->model->nOut;
+   int i,b,seq;
+
+   for (i=0;i<nOut;i++) {
+      if (fit_mse!=NULL) fit_mse[i] = mon->fit.mse[i];
+      if (fit_nmse!=NULL) fit_nmse[i] = (mon->fit.var_y[i] > 0.0) ? mon->fit.mse[i]/mon->fit.var_y[i] : 0.0;
+   }
+   if (val_mse == NULL && val_nmse == NULL) return;
+
+   /* The most recent copy of the validation statistics is only written again after the
+   ** other one was completed. A retry therefore means that the evaluation made progress. */
+   do {
+      const LWPR_MonitorStats *S;
+
+      b = LWPR_MON_LOAD(&mon->shown_last);
+      seq = LWPR_MON_LOAD(&mon->shown_seq[b]);
+      if (seq & 1) {
+         b = 1 - b;
+         seq = LWPR_MON_LOAD(&mon->shown_seq[b]);
+      }
+      S = &mon->shown[b];
+      for (i=0;i<nOut;i++) {
+         if (val_mse!=NULL) val_mse[i] = S->mse[i];
+         if (val_nmse!=NULL) val_nmse[i] = (S->var_y[i] > 0.0) ? S->mse[i]/S->var_y[i] : 0.0;
+      }
+      LWPR_MON_FENCE();
+   } while ((seq & 1) || LWPR_MON_LOAD(&mon->shown_seq[b]) != seq);
+}
+
+double lwpr_monitor_rf_mse(const LWPR_ReceptiveField *RF) {
+   if (RF->mon_sum_w <= 0.0) return 0.0;
+   return RF->mon_sum_e2 / RF->mon_sum_w;
+}
@@ -0,0 +1,168 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_monitor.h
+   \brief Prototypes for monitoring the accuracy of an LWPR model during training
+
+   An LWPR_Monitor keeps exponentially weighted statistics of the prediction error
+   of a model. The fit error is obtained for free from the predictions that
+   lwpr_update computes anyway. These are formed while the receptive fields are
+   adjusted to the new sample, so the fit error is optimistic. Per region, each
+   receptive field accumulates the cross-validation errors of its updates, which
+   stem from its regression before the update (see lwpr_monitor_rf_mse). For an
+   estimate of the generalisation error of the whole model,
+   held-out validation samples can be queued with lwpr_monitor_validate. If the
+   library is compiled with NUM_THREADS > 1, they are evaluated by a low-priority
+   background thread that predicts through an LWPR_Reader (see lwpr_conc.h) while
+   the model is trained. Training never waits for that thread, and the thread never
+   waits for training. lwpr_monitor_get only reads the statistics of the samples
+   evaluated so far. Without multi-threading, or if the model cannot be read while
+   it is trained (lwpr_set_concurrent fails, e.g. for a learned input projection or
+   an out-of-core model), each sample is evaluated within lwpr_monitor_validate.
+
+   \code
+   LWPR_Monitor mon;
+   lwpr_monitor_init(&mon, &model, 0.999, 1000);
+   while (...) {
+      lwpr_monitor_update(&mon, x, y, yp, NULL);
+      if (...) lwpr_monitor_validate(&mon, x_val, y_val);
+   }
+   lwpr_monitor_get(&mon, fit_mse, fit_nmse, val_mse, val_nmse);
+   lwpr_monitor_free(&mon);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_MONITOR_H
+#define __LWPR_MONITOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Exponentially weighted error statistics of one stream of samples */
+typedef struct {
+   int n_data;             /**< \brief Number of samples that entered the statistics */
+   double *mse;            /**< \brief Exponentially weighted mean squared error (nOut) */
+   double *mean_y;         /**< \brief Exponentially weighted mean of the targets (nOut) */
+   double *var_y;          /**< \brief Exponentially weighted variance of the targets (nOut) */
+} LWPR_MonitorStats;
+
+/** \brief Accuracy monitor attached to an LWPR_Model.
+
+    Always initialise with lwpr_monitor_init and destroy with lwpr_monitor_free.
+    lwpr_monitor_update, lwpr_monitor_validate and lwpr_monitor_get must be called
+    from the same thread. While the background thread runs, concurrent predictions
+    of the model are switched on (lwpr_set_concurrent), and the model must only be
+    changed through lwpr_monitor_update. Only one monitor can be attached to a model.
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Monitor {
+   LWPR_Model *model;      /**< \brief The monitored model */
+   double decay;           /**< \brief Decay factor of the exponentially weighted statistics (0 < decay < 1) */
+   LWPR_MonitorStats fit;  /**< \brief Statistics of the predictions returned by lwpr_update */
+   LWPR_MonitorStats valid;/**< \brief Statistics of the validation samples, written where they are evaluated */
+   LWPR_MonitorStats shown[2];/**< \brief Copies of valid that lwpr_monitor_get reads from */
+   volatile int shown_seq[2];/**< \brief Sequence numbers of the copies in shown (odd while a copy is written) */
+   volatile int shown_last;/**< \brief Index of the most recent copy in shown */
+   int capacity;           /**< \brief Maximal number of queued validation samples */
+   volatile int head;      /**< \brief Slot of the oldest queued validation sample (advanced after its evaluation) */
+   volatile int tail;      /**< \brief Slot of the next validation sample to be queued */
+   int n_dropped;          /**< \brief Number of validation samples rejected because the queue was full */
+   double *queue;          /**< \brief Ring buffer of validation samples, capacity+1 slots of (nInRaw+nOut) doubles */
+   double *yp;             /**< \brief Holds a prediction of the monitored model (nOut) */
+   double *yv;             /**< \brief Holds the prediction of a validation sample (nOut) */
+   double *storage;        /**< \brief Pointer to allocated memory. Do not touch. */
+   struct LWPR_MonitorThread *thread; /**< \brief Background thread state (NULL if lwpr_monitor_validate evaluates the samples) */
+} LWPR_Monitor;
+
+/** \brief Initialises an accuracy monitor for a given LWPR model.
+   \param[out] mon       Pointer to an (uninitialised) LWPR_Monitor
+   \param[in] model      The model to monitor, must stay valid until lwpr_monitor_free is called
+   \param[in] decay      Decay factor of the statistics, e.g. 0.999 for an effective window of 1000 samples.
+                         The per-RF statistics decay by this factor per update of the RF (LWPR_Model.mon_decay).
+   \param[in] capacity   Maximal number of validation samples that may wait for evaluation
+   \return
+      - 1 in case of success
+      - 0 in case of failure (invalid parameters, memory could not be allocated). If the
+        background thread cannot be started, validation samples are evaluated within
+        lwpr_monitor_validate instead.
+   \ingroup LWPR_C
+*/
+int lwpr_monitor_init(LWPR_Monitor *mon, LWPR_Model *model, double decay, int capacity);
+
+/** \brief Stops the background thread (if any) and disposes the monitor's memory.
+      The monitored model itself is left untouched, apart from switching concurrent predictions
+      off again if the monitor switched them on, and no longer collecting per-RF statistics.
+   \param[in,out] mon    Pointer to a valid LWPR_Monitor
+   \ingroup LWPR_C
+*/
+void lwpr_monitor_free(LWPR_Monitor *mon);
+
+/** \brief Updates the monitored model with (x,y) as in lwpr_update, and records the error
+      of the prediction that lwpr_update returns (the fit error).
+   \param[in,out] mon    Pointer to a valid LWPR_Monitor
+   \param[in] x          Input vector (nInRaw)
+   \param[in] y          Output vector (nOut)
+   \param[out] yp        Prediction given x, must be NULL or point to nOut doubles
+   \param[out] max_w     Maximum activation per output dimension, must be NULL or point to nOut doubles
+   \return The return value of lwpr_update
+   \ingroup LWPR_C
+*/
+int lwpr_monitor_update(LWPR_Monitor *mon, const double *x, const double *y, double *yp, double *max_w);
+
+/** \brief Queues a held-out validation sample (x,y) for evaluation. The sample is copied.
+      Without the background thread, the sample is evaluated right away.
+   \param[in,out] mon    Pointer to a valid LWPR_Monitor
+   \param[in] x          Input vector (nInRaw)
+   \param[in] y          Output vector (nOut)
+   \return
+      - 1 if the sample was queued
+      - 0 if the queue was full and the sample was dropped
+   \ingroup LWPR_C
+*/
+int lwpr_monitor_validate(LWPR_Monitor *mon, const double *x, const double *y);
+
+/** \brief Retrieves the current error statistics per output dimension. Validation samples
+      still in the queue are not waited for, they enter the statistics once evaluated. Each argument must be NULL or point to an array of nOut doubles. The normalised errors are
+      the mean squared errors divided by the variance of the targets.
+   \param[in,out] mon    Pointer to a valid LWPR_Monitor
+   \param[out] fit_mse   Mean squared error of the predictions returned by lwpr_update
+   \param[out] fit_nmse  Normalised mean squared error of the predictions returned by lwpr_update
+   \param[out] val_mse   Mean squared error on the validation samples
+   \param[out] val_nmse  Normalised mean squared error on the validation samples
+   \ingroup LWPR_C
+*/
+void lwpr_monitor_get(LWPR_Monitor *mon, double *fit_mse, double *fit_nmse, double *val_mse, double *val_nmse);
+
+/** \brief Returns the exponentially weighted (leave-one-out cross validation) mean squared error
+      of a receptive field, accumulated by its updates since the monitor was attached. The error
+      refers to normalised outputs, and is 0 while the RF has not been updated yet.
+   \param[in] RF         Pointer to a valid receptive field
+   \ingroup LWPR_C
+*/
+double lwpr_monitor_rf_mse(const LWPR_ReceptiveField *RF);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,421 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_ooc.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if !defined(WIN32) && !defined(MATLAB)
+   #define LWPR_OOC_SUPPORTED
+   #include <unistd.h>
+   #include <fcntl.h>
+   #include <sys/types.h>
+   #include <sys/mman.h>
+   #include <sys/time.h>
+   #include <sys/resource.h>
+   #if NUM_THREADS > 1
+      #include <pthread.h>
+   #endif
+   /* Advice for evicted blocks: reclaim the pages if the kernel supports it,
+   ** otherwise only drop them from our page tables */
+   #ifdef MADV_PAGEOUT
+      #define LWPR_OOC_EVICT MADV_PAGEOUT
+   #else
+      #define LWPR_OOC_EVICT MADV_DONTNEED
+   #endif
+#endif
+
+/** \brief A page-aligned piece of the memory-mapped file, owned by a receptive field or free */
+typedef struct LWPR_OutOfCoreBlock {
+   double *data;                       /**< \brief Start of the block */
+   size_t bytes;                       /**< \brief Size of the block, a multiple of the page size */
+   LWPR_ReceptiveField *RF;            /**< \brief Owner of the block, NULL if it is free */
+   struct LWPR_OutOfCore *ooc;         /**< \brief Arena the block belongs to */
+   struct LWPR_OutOfCoreBlock *prev;   /**< \brief More recently activated block */
+   struct LWPR_OutOfCoreBlock *next;   /**< \brief Less recently activated block, or next free block */
+   int resident;                       /**< \brief Flag that determines whether the block is in the LRU list */
+} LWPR_OutOfCoreBlock;
+
+/** \brief Memory-mapped file and residency manager of an out-of-core model */
+typedef struct LWPR_OutOfCore {
+   int fd;                    /**< \brief File descriptor of the (already removed) file */
+   size_t pageSize;           /**< \brief Page size of the system */
+   int numSegments;           /**< \brief Number of mapped pieces of the file */
+   int numSegPointers;        /**< \brief Number of pieces that can be stored before a re-allocation is necessary */
+   char **segBase;            /**< \brief Start addresses of the pieces */
+   size_t *segSize;           /**< \brief Sizes of the pieces */
+   size_t segUsed;            /**< \brief Number of bytes handed out from the last piece */
+   size_t fileBytes;          /**< \brief Size of the file */
+   size_t budget;             /**< \brief RAM budget for the blocks */
+   size_t residentBytes;      /**< \brief Size of the blocks in the LRU list */
+   size_t blockBytes;         /**< \brief Size of the blocks that are owned by receptive fields */
+   long numBlocks;            /**< \brief Number of blocks that are owned by receptive fields */
+   long numResident;          /**< \brief Number of blocks in the LRU list */
+   long n_touches;            /**< \brief Number of calls to lwpr_ooc_touch */
+   long n_pageins;            /**< \brief Number of touched blocks that had been evicted */
+   long n_evictions;          /**< \brief Number of evicted blocks */
+   long minflt0;              /**< \brief Minor page faults of the process when the arena was created */
+   long majflt0;              /**< \brief Major page faults of the process when the arena was created */
+   LWPR_OutOfCoreBlock *head; /**< \brief Most recently activated block */
+   LWPR_OutOfCoreBlock *tail; /**< \brief Least recently activated block */
+   LWPR_OutOfCoreBlock *freeList; /**< \brief Blocks that can be re-used */
+#if defined(LWPR_OOC_SUPPORTED) && NUM_THREADS > 1
+   pthread_mutex_t lock;      /**< \brief Protects all of the above (updates run on several threads per SubModel) */
+#endif
+} LWPR_OutOfCore;
+
+#if defined(LWPR_OOC_SUPPORTED) && NUM_THREADS > 1
+   #define LWPR_OOC_LOCK(ooc)    pthread_mutex_lock(&(ooc)->lock)
+   #define LWPR_OOC_UNLOCK(ooc)  pthread_mutex_unlock(&(ooc)->lock)
+#else
+   #define LWPR_OOC_LOCK(ooc)
+   #define LWPR_OOC_UNLOCK(ooc)
+#endif
+
+double *lwpr_ooc_block_data(const LWPR_OutOfCoreBlock *B) {
+   return B->data;
+}
+
+#ifdef LWPR_OOC_SUPPORTED
+
+static void lwpr_ooc_unlink(LWPR_OutOfCore *ooc, LWPR_OutOfCoreBlock *B) {
+   if (B->prev != NULL) B->prev->next = B->next; else ooc->head = B->next;
+   if (B->next != NULL) B->next->prev = B->prev; else ooc->tail = B->prev;
+   B->prev = B->next = NULL;
+}
+
+static void lwpr_ooc_push(LWPR_OutOfCore *ooc, LWPR_OutOfCoreBlock *B) {
+   B->prev = NULL;
+   B->next = ooc->head;
+   if (ooc->head != NULL) ooc->head->prev = B; else ooc->tail = B;
+   ooc->head = B;
+}
+
+/* Evicts least recently activated blocks until the budget is met, but never "keep" */
+static void lwpr_ooc_enforce(LWPR_OutOfCore *ooc, const LWPR_OutOfCoreBlock *keep) {
+   while (ooc->residentBytes > ooc->budget && ooc->tail != NULL && ooc->tail != keep) {
+      LWPR_OutOfCoreBlock *B = ooc->tail;
+
+      lwpr_ooc_unlink(ooc, B);
+      B->resident = 0;
+      ooc->residentBytes -= B->bytes;
+      ooc->numResident--;
+      ooc->n_evictions++;
+      (void) madvise((void *) B->data, B->bytes, LWPR_OOC_EVICT);
+   }
+}
+
+/* Maps another piece of the file that can hold at least "bytes" */
+static int lwpr_ooc_grow(LWPR_OutOfCore *ooc, size_t bytes) {
+   size_t size = LWPR_OOC_SEGMENT;
+   void *base;
+
+   if (size < bytes) size = bytes;
+
+   if (ooc->numSegments == ooc->numSegPointers) {
+      char **newBase;
+      size_t *newSize;
+
+      newBase = (char **) LWPR_REALLOC(ooc->segBase, (ooc->numSegPointers+8)*sizeof(char *));
+      if (newBase == NULL) return 0;
+      ooc->segBase = newBase;
+      newSize = (size_t *) LWPR_REALLOC(ooc->segSize, (ooc->numSegPointers+8)*sizeof(size_t));
+      if (newSize == NULL) return 0;
+      ooc->segSize = newSize;
+      ooc->numSegPointers += 8;
+   }
+
+   if (ftruncate(ooc->fd, (off_t) (ooc->fileBytes + size)) != 0) return 0;
+#ifdef __linux__
+   /* Reserve the disk space now, such that a full disk is reported here and not by SIGBUS */
+   if (posix_fallocate(ooc->fd, (off_t) ooc->fileBytes, (off_t) size) != 0) {
+      (void) ftruncate(ooc->fd, (off_t) ooc->fileBytes);
+      return 0;
+   }
+#endif
+   base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ooc->fd, (off_t) ooc->fileBytes);
+   if (base == MAP_FAILED) {
+      (void) ftruncate(ooc->fd, (off_t) ooc->fileBytes);
+      return 0;
+   }
+   ooc->segBase[ooc->numSegments] = (char *) base;
+   ooc->segSize[ooc->numSegments] = size;
+   ooc->numSegments++;
+   ooc->fileBytes += size;
+   ooc->segUsed = 0;
+   return 1;
+}
+
+LWPR_OutOfCoreBlock *lwpr_ooc_alloc_block(LWPR_OutOfCore *ooc, LWPR_ReceptiveField *RF, size_t n) {
+   LWPR_OutOfCoreBlock *B, *prev = NULL;
+   size_t bytes = n*sizeof(double);
+
+   bytes = ((bytes + ooc->pageSize - 1) / ooc->pageSize) * ooc->pageSize;
+
+   LWPR_OOC_LOCK(ooc);
+
+   for (B = ooc->freeList; B != NULL; prev = B, B = B->next) {
+      if (B->bytes == bytes) break;
+   }
+   if (B != NULL) {
+      if (prev != NULL) prev->next = B->next; else ooc->freeList = B->next;
+      memset(B->data, 0, bytes);
+   } else {
+      B = (LWPR_OutOfCoreBlock *) LWPR_MALLOC(sizeof(LWPR_OutOfCoreBlock));
+      if (B == NULL) {
+         LWPR_OOC_UNLOCK(ooc);
+         return NULL;
+      }
+      /* Fresh parts of the file read as zero */
+      if (ooc->numSegments == 0 || ooc->segUsed + bytes > ooc->segSize[ooc->numSegments-1]) {
+         if (!lwpr_ooc_grow(ooc, bytes)) {
+            LWPR_FREE(B);
+            LWPR_OOC_UNLOCK(ooc);
+            return NULL;
+         }
+      }
+      B->data = (double *) (ooc->segBase[ooc->numSegments-1] + ooc->segUsed);
+      B->bytes = bytes;
+      ooc->segUsed += bytes;
+   }
+   B->RF = RF;
+   B->ooc = ooc;
+   B->resident = 1;
+   lwpr_ooc_push(ooc, B);
+   ooc->residentBytes += bytes;
+   ooc->numResident++;
+   ooc->blockBytes += bytes;
+   ooc->numBlocks++;
+   lwpr_ooc_enforce(ooc, B);
+
+   LWPR_OOC_UNLOCK(ooc);
+   return B;
+}
+
+void lwpr_ooc_free_block(LWPR_OutOfCoreBlock *B) {
+   LWPR_OutOfCore *ooc = B->ooc;
+
+   LWPR_OOC_LOCK(ooc);
+   if (B->resident) {
+      lwpr_ooc_unlink(ooc, B);
+      ooc->residentBytes -= B->bytes;
+      ooc->numResident--;
+   }
+   /* The contents are of no interest anymore */
+   (void) madvise((void *) B->data, B->bytes, MADV_DONTNEED);
+   ooc->blockBytes -= B->bytes;
+   ooc->numBlocks--;
+   B->RF = NULL;
+   B->resident = 0;
+   B->prev = NULL;
+   B->next = ooc->freeList;
+   ooc->freeList = B;
+   LWPR_OOC_UNLOCK(ooc);
+}
+
+void lwpr_ooc_touch(LWPR_OutOfCoreBlock *B) {
+   LWPR_OutOfCore *ooc = B->ooc;
+
+   LWPR_OOC_LOCK(ooc);
+   ooc->n_touches++;
+   if (B->resident) {
+      if (ooc->head != B) {
+         lwpr_ooc_unlink(ooc, B);
+         lwpr_ooc_push(ooc, B);
+      }
+   } else {
+      ooc->n_pageins++;
+      (void) madvise((void *) B->data, B->bytes, MADV_WILLNEED);
+      B->resident = 1;
+      lwpr_ooc_push(ooc, B);
+      ooc->residentBytes += B->bytes;
+      ooc->numResident++;
+      lwpr_ooc_enforce(ooc, B);
+   }
+   LWPR_OOC_UNLOCK(ooc);
+}
+
+void lwpr_ooc_close(LWPR_OutOfCore *ooc) {
+   int i;
+
+   while (ooc->freeList != NULL) {
+      LWPR_OutOfCoreBlock *B = ooc->freeList;
+      ooc->freeList = B->next;
+      LWPR_FREE(B);
+   }
+   for (i=0;i<ooc->numSegments;i++) munmap((void *) ooc->segBase[i], ooc->segSize[i]);
+   if (ooc->segBase != NULL) LWPR_FREE(ooc->segBase);
+   if (ooc->segSize != NULL) LWPR_FREE(ooc->segSize);
+   close(ooc->fd);
+#if NUM_THREADS > 1
+   pthread_mutex_destroy(&ooc->lock);
+#endif
+   LWPR_FREE(ooc);
+}
+
+/* Moves every RF whose storage does not match the model's mode (resident or out-of-core) */
+static int lwpr_ooc_move_all(LWPR_Model *model) {
+   int dim, n;
+   int want = (model->ooc != NULL);
+
+   for (dim=0;dim<model->nOut;dim++) {
+      LWPR_SubModel *sub = &model->sub[dim];
+      for (n=0;n<sub->numRFS;n++) {
+         LWPR_ReceptiveField *RF = sub->rf[n];
+         if ((RF->oocBlock != NULL) == want) continue;
+         if (!lwpr_mem_move_rf(RF, model)) return 0;
+      }
+   }
+   return 1;
+}
+
+int lwpr_set_out_of_core(LWPR_Model *model, const char *filename, size_t budget) {
+   LWPR_OutOfCore *ooc = model->ooc;
+   struct rusage ru;
+
+   /* RFs are moved into the arena, which the background thread of lwpr_read_binary_lazy must not write to */
+   if (model->lazy != NULL && !lwpr_finish_loading(model)) return 0;
+
+   if (filename == NULL) {
+      if (ooc == NULL) return 1;
+      model->ooc = NULL;
+      if (!lwpr_ooc_move_all(model)) {
+         model->ooc = ooc;
+         return 0;
+      }
+      lwpr_ooc_close(ooc);
+      return 1;
+   }
+
+   /* Concurrent readers (see lwpr_set_concurrent) cannot touch blocks without a lock */
+   if (model->conc != NULL) return 0;
+
+   if (ooc != NULL) {
+      LWPR_OOC_LOCK(ooc);
+      ooc->budget = budget;
+      lwpr_ooc_enforce(ooc, NULL);
+      LWPR_OOC_UNLOCK(ooc);
+      return 1;
+   }
+
+   ooc = (LWPR_OutOfCore *) LWPR_CALLOC(1, sizeof(LWPR_OutOfCore));
+   if (ooc == NULL) return 0;
+
+   ooc->fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+   if (ooc->fd < 0) {
+      LWPR_FREE(ooc);
+      return 0;
+   }
+   (void) unlink(filename);
+#if NUM_THREADS > 1
+   if (pthread_mutex_init(&ooc->lock, NULL) != 0) {
+      close(ooc->fd);
+      LWPR_FREE(ooc);
+      return 0;
+   }
+#endif
+   ooc->pageSize = (size_t) sysconf(_SC_PAGESIZE);
+   ooc->budget = budget;
+   if (getrusage(RUSAGE_SELF, &ru) == 0) {
+      ooc->minflt0 = ru.ru_minflt;
+      ooc->majflt0 = ru.ru_majflt;
+   }
+
+   model->ooc = ooc;
+   if (!lwpr_ooc_move_all(model)) {
+      /* Try to bring everything back, otherwise keep the arena for the RFs within it */
+      model->ooc = NULL;
+      if (lwpr_ooc_move_all(model)) lwpr_ooc_close(ooc); else model->ooc = ooc;
+      return 0;
+   }
+   return 1;
+}
+
+int lwpr_out_of_core_stats(const LWPR_Model *model, LWPR_OutOfCoreStats *stats) {
+   LWPR_OutOfCore *ooc = model->ooc;
+   struct rusage ru;
+   int i;
+
+   memset(stats, 0, sizeof(LWPR_OutOfCoreStats));
+   if (ooc == NULL) return 0;
+
+   LWPR_OOC_LOCK(ooc);
+   stats->budget = ooc->budget;
+   stats->arenaBytes = ooc->fileBytes;
+   stats->blockBytes = ooc->blockBytes;
+   stats->residentBytes = ooc->residentBytes;
+   stats->numBlocks = ooc->numBlocks;
+   stats->numResident = ooc->numResident;
+   stats->n_touches = ooc->n_touches;
+   stats->n_pageins = ooc->n_pageins;
+   stats->n_evictions = ooc->n_evictions;
+
+   for (i=0;i<ooc->numSegments;i++) {
+      size_t p, numPages = ooc->segSize[i] / ooc->pageSize;
+#ifdef __APPLE__
+      char *vec = (char *) LWPR_MALLOC(numPages);
+#else
+      unsigned char *vec = (unsigned char *) LWPR_MALLOC(numPages);
+#endif
+      if (vec == NULL) continue;
+      if (mincore((void *) ooc->segBase[i], ooc->segSize[i], vec) == 0) {
+         for (p=0;p<numPages;p++) if (vec[p] & 1) stats->mappedBytes += ooc->pageSize;
+      }
+      LWPR_FREE(vec);
+   }
+   LWPR_OOC_UNLOCK(ooc);
+
+   if (getrusage(RUSAGE_SELF, &ru) == 0) {
+      stats->n_minflt = ru.ru_minflt - ooc->minflt0;
+      stats->n_majflt = ru.ru_majflt - ooc->majflt0;
+   }
+   return 1;
+}
+
+#else
+
+/* Out-of-core models are not supported on this platform: lwpr_set_out_of_core always fails,
+** such that the remaining functions are never called with a valid block or arena */
+
+LWPR_OutOfCoreBlock *lwpr_ooc_alloc_block(LWPR_OutOfCore *ooc, LWPR_ReceptiveField *RF, size_t n) {
+   return NULL;
+}
+
+void lwpr_ooc_free_block(LWPR_OutOfCoreBlock *B) {}
+
+void lwpr_ooc_touch(LWPR_OutOfCoreBlock *B) {}
+
+void lwpr_ooc_close(LWPR_OutOfCore *ooc) {
+   LWPR_FREE(ooc);
+}
+
+int lwpr_set_out_of_core(LWPR_Model *model, const char *filename, size_t budget) {
+   return (filename == NULL) ? 1 : 0;
+}
+
+int lwpr_out_of_core_stats(const LWPR_Model *model, LWPR_OutOfCoreStats *stats) {
+   memset(stats, 0, sizeof(LWPR_OutOfCoreStats));
+   return 0;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_ooc.h
+   \brief Prototypes for keeping the bulk of the receptive fields of an LWPR model
+      in a memory-mapped file ("out-of-core" models)
+
+   After lwpr_set_out_of_core, each receptive field is split into two parts:
+   - The distance metric (D and M, or L), the centre, mean_x, var_x, slope and the
+     bounding box stay in ordinary memory. These are needed to compute activations,
+     and for predictions from cached slopes.
+   - The metric learning rates and statistics (alpha, h, b) and all PLS variables
+     and statistics are placed in a page-aligned block of a memory-mapped file.
+     These are only read once a receptive field is activated.
+
+   A residency manager keeps the blocks in least-recently-activated order. Whenever the
+   blocks that were activated lately exceed the RAM budget, the oldest ones are handed back
+   to the operating system with madvise (MADV_PAGEOUT if available, MADV_DONTNEED otherwise),
+   and a block that is activated again is announced with MADV_WILLNEED. The blocks remain
+   accessible at any time, so updates and predictions work unchanged even if the model
+   is larger than physical memory. Note that modified pages are only reclaimed after the
+   kernel has written them back to the file.
+
+   Out-of-core models are not supported on Windows and within MEX-files.
+
+   \code
+   lwpr_set_out_of_core(&model, "/var/tmp/model.arena", 256<<20);
+   ... train and predict as usual ...
+   lwpr_out_of_core_stats(&model, &stats);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_OOC_H
+#define __LWPR_OOC_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Size of the pieces (in bytes) in which the memory-mapped file grows */
+#define LWPR_OOC_SEGMENT   (64<<20)
+
+/** \brief Residency and page-fault counters of an out-of-core model, see lwpr_out_of_core_stats
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_OutOfCoreStats {
+   size_t budget;          /**< \brief RAM budget for the blocks of the receptive fields (bytes) */
+   size_t arenaBytes;      /**< \brief Size of the memory-mapped file (bytes) */
+   size_t blockBytes;      /**< \brief Size of the blocks held by receptive fields (bytes) */
+   size_t residentBytes;   /**< \brief Size of the blocks the residency manager keeps resident (bytes) */
+   size_t mappedBytes;     /**< \brief Part of the memory-mapped file that is in physical memory, as reported by mincore (bytes) */
+   long numBlocks;         /**< \brief Number of blocks held by receptive fields */
+   long numResident;       /**< \brief Number of blocks the residency manager keeps resident */
+   long n_touches;         /**< \brief Number of activations of receptive fields with a block */
+   long n_pageins;         /**< \brief Number of activations that had to page in an evicted block */
+   long n_evictions;       /**< \brief Number of blocks that were handed back to the operating system */
+   long n_minflt;          /**< \brief Minor page faults of the process since lwpr_set_out_of_core */
+   long n_majflt;          /**< \brief Major page faults (with disk I/O) of the process since lwpr_set_out_of_core */
+} LWPR_OutOfCoreStats;
+
+/** \brief Moves the receptive fields of an LWPR model into a memory-mapped file, or back into RAM
+   \param[in,out] model  Pointer to a valid LWPR model
+   \param[in] filename   Name of the file that backs the receptive fields. It is created (or
+                         truncated) and immediately removed again, such that its space is released
+                         when the model is freed. NULL moves all receptive fields back into RAM.
+   \param[in] budget     Number of bytes of the file that may stay resident. If the model already
+                         is out-of-core, only the budget is changed.
+   \return
+      - 1 in case of success
+      - 0 if the file could not be created or mapped, or memory could not be allocated.
+        The model stays valid, but some of its receptive fields may still live in the file.
+        Also 0 if concurrent predictions are switched on (see lwpr_set_concurrent).
+        On platforms without support for out-of-core models, 0 unless filename is NULL.
+
+   Receptive fields that are created later are allocated within the file, too.
+   Copies made by lwpr_duplicate_model and models read from files keep all receptive
+   fields in RAM.
+   \ingroup LWPR_C
+*/
+int lwpr_set_out_of_core(LWPR_Model *model, const char *filename, size_t budget);
+
+/** \brief Retrieves the residency and page-fault counters of an out-of-core model
+   \param[in] model    Pointer to a valid LWPR model
+   \param[out] stats   Counters, set to zero if the model is not out-of-core
+   \return
+      - 1 if the model is out-of-core
+      - 0 otherwise
+   \ingroup LWPR_C
+*/
+int lwpr_out_of_core_stats(const LWPR_Model *model, LWPR_OutOfCoreStats *stats);
+
+/** \brief Allocates a zeroed, page-aligned block within the memory-mapped file of a model
+   \param[in] ooc   Arena of the model (LWPR_Model.ooc)
+   \param[in] RF    Receptive field that will own the block
+   \param[in] n     Number of doubles
+   \return Pointer to the block (see lwpr_ooc_block_data), or NULL in case of failure.
+
+   The new block is considered resident, and may cause others to be evicted.
+   Used internally by lwpr_mem_alloc_rf and lwpr_mem_realloc_rf.
+*/
+struct LWPR_OutOfCoreBlock *lwpr_ooc_alloc_block(struct LWPR_OutOfCore *ooc, LWPR_ReceptiveField *RF, size_t n);
+
+/** \brief Returns the memory of a block to its arena for re-use
+   \param[in] B   Block that was allocated by lwpr_ooc_alloc_block
+*/
+void lwpr_ooc_free_block(struct LWPR_OutOfCoreBlock *B);
+
+/** \brief Tells the residency manager that a block is about to be read or written
+   \param[in] B   Block that was allocated by lwpr_ooc_alloc_block
+
+   Called by the update and prediction routines for every activated receptive field
+   whose LWPR_ReceptiveField.oocBlock is not NULL.
+*/
+void lwpr_ooc_touch(struct LWPR_OutOfCoreBlock *B);
+
+/** \brief Returns a pointer to the memory of a block */
+double *lwpr_ooc_block_data(const struct LWPR_OutOfCoreBlock *B);
+
+/** \brief Unmaps and closes the memory-mapped file of a model.
+   \param[in] ooc   Arena that no longer holds any blocks. Called from lwpr_free_model.
+*/
+void lwpr_ooc_close(struct LWPR_OutOfCore *ooc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
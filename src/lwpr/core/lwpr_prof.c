@@ -0,0 +1,278 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_prof.h>
+#include <string.h>
+#include <stdlib.h>
+
+static const char *lwpr_prof_names[LWPR_NUM_PHASES] = {
+   "scan", "regression", "metric", "add/prune", "projection"
+};
+
+const char *lwpr_profile_phase_name(int phase) {
+   if (phase < 0 || phase >= LWPR_NUM_PHASES) return "none";
+   return lwpr_prof_names[phase];
+}
+
+#if LWPR_PROFILE
+
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <time.h>
+   #include <unistd.h>
+   #ifdef __linux__
+      #define LWPR_PROF_PERF
+      #include <pthread.h>
+      #include <sys/syscall.h>
+      #include <linux/perf_event.h>
+   #endif
+#endif
+
+#ifdef _MSC_VER
+   #define LWPR_PROF_TLS __declspec(thread)
+#else
+   #define LWPR_PROF_TLS __thread
+#endif
+
+#define LWPR_PROF_EVENTS   4
+
+/* Phase state of one OS thread */
+typedef struct {
+   int opened;                      /* Flag that determines whether opening the counters was tried */
+   int fd[LWPR_PROF_EVENTS];        /* Counter group, fd[0] is the leader (-1 if not available) */
+   int gen;                         /* Value of lwpr_prof_gen when phase was set */
+   int phase;                       /* Current phase */
+   int slot;                        /* Workspace index the current phase is accounted to */
+   double t0;                       /* Time when the current phase was entered */
+   double v0[LWPR_PROF_EVENTS];     /* Counter values when the current phase was entered */
+} LWPR_ProfThread;
+
+static LWPR_ProfileCounters lwpr_prof_table[LWPR_NUM_PHASES][NUM_THREADS];
+static volatile int lwpr_prof_enabled = 0;
+static volatile int lwpr_prof_gen = 0;
+static LWPR_PROF_TLS LWPR_ProfThread lwpr_prof_thread;
+
+#ifdef LWPR_PROF_PERF
+static pthread_once_t lwpr_prof_once = PTHREAD_ONCE_INIT;
+static pthread_key_t lwpr_prof_key;
+
+/* Closes the counters when a (worker) thread exits */
+static void lwpr_prof_close(void *ptr) {
+   LWPR_ProfThread *T = (LWPR_ProfThread *) ptr;
+   int i;
+
+   for (i=LWPR_PROF_EVENTS-1;i>=0;i--) {
+      if (T->fd[i] >= 0) close(T->fd[i]);
+      T->fd[i] = -1;
+   }
+}
+
+static void lwpr_prof_make_key(void) {
+   (void) pthread_key_create(&lwpr_prof_key, lwpr_prof_close);
+}
+#endif
+
+static void lwpr_prof_open(LWPR_ProfThread *T) {
+   int i;
+
+   T->opened = 1;
+   for (i=0;i<LWPR_PROF_EVENTS;i++) T->fd[i] = -1;
+#ifdef LWPR_PROF_PERF
+   {
+      static const int config[LWPR_PROF_EVENTS] = {
+         PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+         PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+      };
+      struct perf_event_attr attr;
+
+      for (i=0;i<LWPR_PROF_EVENTS;i++) {
+         memset(&attr, 0, sizeof(attr));
+         attr.size = sizeof(attr);
+         attr.type = PERF_TYPE_HARDWARE;
+         attr.config = config[i];
+         attr.read_format = PERF_FORMAT_GROUP;
+         attr.exclude_kernel = 1;
+         attr.exclude_hv = 1;
+         T->fd[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, (i==0) ? -1 : T->fd[0], 0);
+         if (T->fd[i] < 0) {
+            lwpr_prof_close(T);
+            return;
+         }
+      }
+      (void) pthread_once(&lwpr_prof_once, lwpr_prof_make_key);
+      (void) pthread_setspecific(lwpr_prof_key, T);
+   }
+#endif
+}
+
+static double lwpr_prof_clock(void) {
+#ifdef WIN32
+   LARGE_INTEGER f, c;
+   QueryPerformanceFrequency(&f);
+   QueryPerformanceCounter(&c);
+   return (double) c.QuadPart / (double) f.QuadPart;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+#endif
+}
+
+static void lwpr_prof_read(const LWPR_ProfThread *T, double *t, double *v) {
+   int i;
+
+   *t = lwpr_prof_clock();
+   for (i=0;i<LWPR_PROF_EVENTS;i++) v[i] = T->v0[i];
+#ifdef LWPR_PROF_PERF
+   if (T->fd[0] >= 0) {
+      /* PERF_FORMAT_GROUP: number of events, followed by their values */
+      __u64 buf[1 + LWPR_PROF_EVENTS];
+
+      if (read(T->fd[0], buf, sizeof(buf)) == (ssize_t) sizeof(buf)) {
+         for (i=0;i<LWPR_PROF_EVENTS;i++) v[i] = (double) buf[1+i];
+      }
+   }
+#endif
+}
+
+void lwpr_profile_phase(int thread, int phase) {
+   LWPR_ProfThread *T = &lwpr_prof_thread;
+   double t, v[LWPR_PROF_EVENTS];
+   int current;
+
+   if (!lwpr_prof_enabled) return;
+
+   current = (T->gen == lwpr_prof_gen) ? T->phase : LWPR_PHASE_NONE;
+   if (current == phase && (phase == LWPR_PHASE_NONE || T->slot == thread)) return;
+
+   if (!T->opened) lwpr_prof_open(T);
+   lwpr_prof_read(T, &t, v);
+
+   if (current != LWPR_PHASE_NONE) {
+      LWPR_ProfileCounters *C = &lwpr_prof_table[current][T->slot];
+
+      C->time += t - T->t0;
+      C->cycles += v[0] - T->v0[0];
+      C->instructions += v[1] - T->v0[1];
+      C->llc_misses += v[2] - T->v0[2];
+      C->branch_misses += v[3] - T->v0[3];
+   }
+   if (phase != LWPR_PHASE_NONE) lwpr_prof_table[phase][thread].calls += 1.0;
+
+   T->gen = lwpr_prof_gen;
+   T->phase = phase;
+   T->slot = thread;
+   T->t0 = t;
+   memcpy(T->v0, v, sizeof(v));
+}
+
+int lwpr_profile_start(void) {
+   LWPR_ProfThread *T = &lwpr_prof_thread;
+
+   lwpr_prof_enabled = 0;
+   memset(lwpr_prof_table, 0, sizeof(lwpr_prof_table));
+   lwpr_prof_gen++;
+   if (!T->opened) lwpr_prof_open(T);
+   lwpr_prof_enabled = 1;
+
+   return LWPR_PROFILE_TIME | ((T->fd[0] >= 0) ? LWPR_PROFILE_COUNTERS : 0);
+}
+
+void lwpr_profile_stop(void) {
+   lwpr_prof_enabled = 0;
+   lwpr_prof_gen++;
+}
+
+int lwpr_profile_get(int phase, int thread, LWPR_ProfileCounters *C) {
+   int i;
+
+   if (phase < 0 || phase >= LWPR_NUM_PHASES || thread >= NUM_THREADS) return 0;
+
+   if (thread >= 0) {
+      *C = lwpr_prof_table[phase][thread];
+      return 1;
+   }
+   memset(C, 0, sizeof(LWPR_ProfileCounters));
+   for (i=0;i<NUM_THREADS;i++) {
+      const LWPR_ProfileCounters *T = &lwpr_prof_table[phase][i];
+
+      C->calls += T->calls;
+      C->time += T->time;
+      C->cycles += T->cycles;
+      C->instructions += T->instructions;
+      C->llc_misses += T->llc_misses;
+      C->branch_misses += T->branch_misses;
+   }
+   return 1;
+}
+
+static void lwpr_prof_print(FILE *fp, int phase, int thread) {
+   LWPR_ProfileCounters C;
+   char name[16];
+
+   lwpr_profile_get(phase, thread, &C);
+   if (thread < 0) strcpy(name, "all"); else sprintf(name, "%d", thread);
+
+   fprintf(fp, "%-11s %6s %11.0f %10.3f %12.0f %12.0f %5.2f %10.0f %10.0f\n",
+         lwpr_profile_phase_name(phase), name, C.calls, 1000.0*C.time, C.cycles, C.instructions,
+         (C.cycles > 0.0) ? C.instructions / C.cycles : 0.0, C.llc_misses, C.branch_misses);
+}
+
+void lwpr_profile_report(FILE *fp) {
+   int p;
+
+   fprintf(fp, "%-11s %6s %11s %10s %12s %12s %5s %10s %10s\n",
+         "phase", "thread", "calls", "time[ms]", "cycles", "instructions", "IPC", "LLC-miss", "br-miss");
+   for (p=0;p<LWPR_NUM_PHASES;p++) {
+      lwpr_prof_print(fp, p, -1);
+#if NUM_THREADS > 1
+      {
+         int t;
+         for (t=0;t<NUM_THREADS;t++) {
+            if (lwpr_prof_table[p][t].calls > 0.0) lwpr_prof_print(fp, p, t);
+         }
+      }
+#endif
+   }
+}
+
+#else
+
+/* Profiling is not compiled in */
+
+int lwpr_profile_start(void) {
+   return 0;
+}
+
+void lwpr_profile_stop(void) {}
+
+int lwpr_profile_get(int phase, int thread, LWPR_ProfileCounters *C) {
+   memset(C, 0, sizeof(LWPR_ProfileCounters));
+   return 0;
+}
+
+void lwpr_profile_report(FILE *fp) {
+   fprintf(fp, "LWPR profiling is not available (compile with LWPR_PROFILE set to 1)\n");
+}
+
+void lwpr_profile_phase(int thread, int phase) {}
+
+#endif
@@ -0,0 +1,651 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_record.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifdef WIN32
+   #include <windows.h>
+#else
+   #include <time.h>
+   #if NUM_THREADS > 1
+      #include <pthread.h>
+   #endif
+#endif
+
+#define LWPR_RECORD_VERSION   1
+
+/* Number of doubles an LWPR_RecordHeader takes up within a slot */
+#define LWPR_REC_HDR   ((int) ((sizeof(LWPR_RecordHeader) + sizeof(double) - 1) / sizeof(double)))
+
+/* Atomic operations. LOAD has acquire and STORE has release semantics, which
+** volatile accesses already provide with Microsoft's compilers */
+#ifdef WIN32
+   #define LWPR_REC_CAS(p,o,n)   (InterlockedCompareExchange((volatile LONG *) (p), (LONG) (n), (LONG) (o)) == (LONG) (o))
+   #define LWPR_REC_INC(p)       ((unsigned long) InterlockedIncrement((volatile LONG *) (p)) - 1)
+   #define LWPR_REC_LOAD(p)      (*(p))
+   #define LWPR_REC_STORE(p,v)   (*(p) = (v))
+#else
+   #define LWPR_REC_CAS(p,o,n)   __sync_bool_compare_and_swap((p), (o), (n))
+   #define LWPR_REC_INC(p)       __sync_fetch_and_add((p), 1)
+   #define LWPR_REC_LOAD(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+   #define LWPR_REC_STORE(p,v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
+
+#if NUM_THREADS > 1
+struct LWPR_RecorderThread {
+   volatile int quit;
+#ifdef WIN32
+   HANDLE thread;
+#else
+   pthread_t thread;
+#endif
+};
+#endif
+
+static double lwpr_record_clock(void) {
+#ifdef WIN32
+   LARGE_INTEGER f, c;
+   QueryPerformanceFrequency(&f);
+   QueryPerformanceCounter(&c);
+   return (double) c.QuadPart / (double) f.QuadPart;
+#else
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (double) ts.tv_sec + 1e-9 * (double) ts.tv_nsec;
+#endif
+}
+
+static void lwpr_record_sleep(double t) {
+#ifdef WIN32
+   Sleep((DWORD) (1000.0*t));
+#else
+   struct timespec ts;
+   ts.tv_sec = (time_t) t;
+   ts.tv_nsec = (long) (1e9*(t - (double) ts.tv_sec));
+   nanosleep(&ts, NULL);
+#endif
+}
+
+/* Number of doubles following the header of a record, or -1 for an invalid type */
+static int lwpr_record_length(int type, int args, int nIn, int nOut) {
+   int n = nIn;
+
+   switch (type) {
+      case LWPR_CALL_UPDATE:
+      case LWPR_CALL_PREDICT_VJP:
+         n += nOut;
+         break;
+      case LWPR_CALL_PREDICT_JVP:
+         n += nIn;
+         break;
+      case LWPR_CALL_PREDICT_SEL:
+      case LWPR_CALL_PREDICT_J_SEL:
+         if (args & LWPR_RECORD_ARG_OUTMASK) n += nOut;
+         if (args & LWPR_RECORD_ARG_INMASK) n += nIn;
+         break;
+      default:
+         if (type < LWPR_CALL_UPDATE || type >= LWPR_NUM_CALLS) return -1;
+   }
+   return n;
+}
+
+/* The ring buffer is a bounded multi-producer/multi-consumer queue: slotSeq[i] equals the
+** position that may fill slot i next, and position+1 once that slot holds a complete record */
+static double *lwpr_record_push_begin(LWPR_Recorder *rec, unsigned long *pos) {
+   unsigned long mask = (unsigned long) rec->capacity - 1;
+   unsigned long p = LWPR_REC_LOAD(&rec->head);
+
+   for (;;) {
+      unsigned long seq = LWPR_REC_LOAD(&rec->slotSeq[p & mask]);
+      long dif;
+
+      dif = (long) (seq - p);
+      if (dif == 0) {
+         if (LWPR_REC_CAS(&rec->head, p, p+1)) {
+            *pos = p;
+            return rec->slots + (p & mask)*rec->slotSize;
+         }
+      } else if (dif < 0) {
+         return NULL;   /* full */
+      }
+      p = LWPR_REC_LOAD(&rec->head);
+   }
+}
+
+static void lwpr_record_push_end(LWPR_Recorder *rec, unsigned long pos) {
+   LWPR_REC_STORE(&rec->slotSeq[pos & ((unsigned long) rec->capacity - 1)], pos + 1);
+}
+
+static double *lwpr_record_pop_begin(LWPR_Recorder *rec, unsigned long *pos) {
+   unsigned long mask = (unsigned long) rec->capacity - 1;
+   unsigned long p = LWPR_REC_LOAD(&rec->tail);
+
+   for (;;) {
+      unsigned long seq = LWPR_REC_LOAD(&rec->slotSeq[p & mask]);
+      long dif;
+
+      dif = (long) (seq - (p+1));
+      if (dif == 0) {
+         if (LWPR_REC_CAS(&rec->tail, p, p+1)) {
+            *pos = p;
+            return rec->slots + (p & mask)*rec->slotSize;
+         }
+      } else if (dif < 0) {
+         return NULL;   /* empty, or the oldest record is still being written */
+      }
+      p = LWPR_REC_LOAD(&rec->tail);
+   }
+}
+
+static void lwpr_record_pop_end(LWPR_Recorder *rec, unsigned long pos) {
+   LWPR_REC_STORE(&rec->slotSeq[pos & ((unsigned long) rec->capacity - 1)], pos + (unsigned long) rec->capacity);
+}
+
+static int lwpr_record_write_header(const LWPR_Recorder *rec, FILE *fp) {
+   int ok;
+
+   ok = (fwrite("LWRC", 1, 4, fp)==4) ? 1:0;
+   ok &= lwpr_io_write_int(fp, LWPR_RECORD_VERSION);
+   ok &= lwpr_io_write_int(fp, rec->nIn);
+   ok &= lwpr_io_write_int(fp, rec->nOut);
+   ok &= lwpr_io_write_int(fp, rec->n_data);
+   ok &= lwpr_io_write_int(fp, rec->flags);
+   ok &= lwpr_io_write_scalar(fp, rec->sample);
+   return ok;
+}
+
+/* Takes all complete records out of the buffer and writes them to fp (if not NULL).
+** Only one thread may do this at a time, see LWPR_Recorder.draining */
+static int lwpr_record_drain(LWPR_Recorder *rec, FILE *fp) {
+   int ok = 1;
+   unsigned long pos;
+   double *slot;
+
+   while ((slot = lwpr_record_pop_begin(rec, &pos)) != NULL) {
+      if (fp != NULL) {
+         LWPR_RecordHeader hdr;
+
+         memcpy(&hdr, slot, sizeof(hdr));
+         if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) ok = 0;
+         ok &= lwpr_io_write_vector(fp, lwpr_record_length(hdr.type, hdr.args, rec->nIn, rec->nOut), slot + LWPR_REC_HDR);
+      }
+      lwpr_record_pop_end(rec, pos);
+   }
+   return ok;
+}
+
+static void lwpr_record_lock_drain(LWPR_Recorder *rec) {
+   while (!LWPR_REC_CAS(&rec->draining, 0, 1)) lwpr_record_sleep(0.0001);
+}
+
+#if NUM_THREADS > 1
+static void *lwpr_record_T(void *ptr) {
+   LWPR_Recorder *rec = (LWPR_Recorder *) ptr;
+   struct LWPR_RecorderThread *T = rec->thread;
+
+   for (;;) {
+      /* Read the flag first, such that the last round sees all records */
+      int quit = LWPR_REC_LOAD(&T->quit);
+
+      if (LWPR_REC_CAS(&rec->draining, 0, 1)) {
+         unsigned long tail = LWPR_REC_LOAD(&rec->tail);
+
+         if (!lwpr_record_drain(rec, rec->fp)) rec->ok = 0;
+         if (tail != LWPR_REC_LOAD(&rec->tail) && fflush(rec->fp) != 0) rec->ok = 0;
+         LWPR_REC_STORE(&rec->draining, 0);
+      }
+      if (quit) break;
+      lwpr_record_sleep(0.001);
+   }
+   return NULL;
+}
+
+#ifdef WIN32
+static DWORD WINAPI lwpr_record_T_win32(LPVOID ptr) {
+   (void) lwpr_record_T(ptr);
+   return 0;
+}
+#endif
+
+static int lwpr_record_start_thread(LWPR_Recorder *rec) {
+   struct LWPR_RecorderThread *T;
+
+   T = (struct LWPR_RecorderThread *) LWPR_MALLOC(sizeof(struct LWPR_RecorderThread));
+   if (T == NULL) return 0;
+   T->quit = 0;
+   rec->thread = T;
+
+#ifdef WIN32
+   T->thread = CreateThread(NULL, 0, lwpr_record_T_win32, rec, 0, NULL);
+   if (T->thread != NULL) return 1;
+#else
+   if (pthread_create(&T->thread, NULL, lwpr_record_T, rec) == 0) return 1;
+#endif
+   rec->thread = NULL;
+   LWPR_FREE(T);
+   return 0;
+}
+
+static void lwpr_record_stop_thread(LWPR_Recorder *rec) {
+   struct LWPR_RecorderThread *T = rec->thread;
+
+   LWPR_REC_STORE(&T->quit, 1);
+#ifdef WIN32
+   WaitForSingleObject(T->thread, INFINITE);
+   CloseHandle(T->thread);
+#else
+   pthread_join(T->thread, NULL);
+#endif
+   rec->thread = NULL;
+   LWPR_FREE(T);
+}
+#endif
+
+static void lwpr_record_free(LWPR_Recorder *rec) {
+   LWPR_FREE(rec->slots);
+   LWPR_FREE((void *) rec->slotSeq);
+   rec->slots = NULL;
+   rec->slotSeq = NULL;
+}
+
+int lwpr_record_start(LWPR_Recorder *rec, LWPR_Model *model, const char *filename, const char *checkpoint,
+      int flags, double sample, int capacity) {
+   int i, cap;
+
+   if (model->rec != NULL || !(sample > 0.0 && sample <= 1.0) || !(flags & LWPR_RECORD_ALL)) return 0;
+   if (capacity < 1 || capacity > (1<<30)) return 0;
+   for (cap=1; cap<capacity; cap*=2);
+
+   rec->model = model;
+   rec->flags = flags & LWPR_RECORD_ALL;
+   rec->sample = sample;
+   rec->nIn = model->nInRaw;
+   rec->nOut = model->nOut;
+   rec->n_data = model->n_data;
+   rec->capacity = cap;
+   /* Largest record: lwpr_predict_J_sel with both masks */
+   rec->slotSize = LWPR_REC_HDR + 2*rec->nIn + rec->nOut;
+
+   rec->slots = (double *) LWPR_MALLOC((size_t) cap * rec->slotSize * sizeof(double));
+   rec->slotSeq = (volatile unsigned long *) LWPR_MALLOC((size_t) cap * sizeof(unsigned long));
+   if (rec->slots == NULL || rec->slotSeq == NULL) {
+      if (rec->slots != NULL) LWPR_FREE(rec->slots);
+      if (rec->slotSeq != NULL) LWPR_FREE((void *) rec->slotSeq);
+      return 0;
+   }
+   for (i=0;i<cap;i++) rec->slotSeq[i] = (unsigned long) i;
+   rec->head = rec->tail = 0;
+   rec->n_calls = rec->n_recorded = rec->n_dropped = rec->n_overwritten = 0;
+   rec->draining = 0;
+   rec->ok = 1;
+   rec->thread = NULL;
+   rec->checkpointStarted = 0;
+
+   rec->fp = NULL;
+   if (filename != NULL) {
+      rec->fp = fopen(filename, "wb");
+      if (rec->fp == NULL) {
+         lwpr_record_free(rec);
+         return 0;
+      }
+      if (!lwpr_record_write_header(rec, rec->fp)) {
+         fclose(rec->fp);
+         lwpr_record_free(rec);
+         return 0;
+      }
+   }
+
+   if (checkpoint != NULL) {
+      if (!lwpr_checkpoint_start(&rec->checkpoint, model, checkpoint, LWPR_CHECKPOINT_SYNC, NULL, NULL)) {
+         if (rec->fp != NULL) fclose(rec->fp);
+         lwpr_record_free(rec);
+         return 0;
+      }
+      rec->checkpointStarted = 1;
+   }
+
+#if NUM_THREADS > 1
+   /* Without a background thread, the calling threads write the buffer when it is full */
+   if (rec->fp != NULL) (void) lwpr_record_start_thread(rec);
+#endif
+
+   rec->t0 = lwpr_record_clock();
+   model->rec = rec;
+   return 1;
+}
+
+int lwpr_record_stop(LWPR_Recorder *rec) {
+   int ok;
+
+   rec->model->rec = NULL;
+#if NUM_THREADS > 1
+   if (rec->thread != NULL) lwpr_record_stop_thread(rec);
+#endif
+   if (rec->fp != NULL) {
+      if (!lwpr_record_drain(rec, rec->fp)) rec->ok = 0;
+      if (fclose(rec->fp) != 0) rec->ok = 0;
+      rec->fp = NULL;
+   }
+   ok = rec->ok;
+   if (rec->checkpointStarted) {
+      if (!lwpr_checkpoint_wait(&rec->checkpoint)) ok = 0;
+      rec->checkpointStarted = 0;
+   }
+   lwpr_record_free(rec);
+   return ok;
+}
+
+int lwpr_record_flush(LWPR_Recorder *rec) {
+   int ok;
+
+   if (rec->fp == NULL) return 0;
+   lwpr_record_lock_drain(rec);
+   if (!lwpr_record_drain(rec, rec->fp)) rec->ok = 0;
+   if (fflush(rec->fp) != 0) rec->ok = 0;
+   ok = rec->ok;
+   LWPR_REC_STORE(&rec->draining, 0);
+   return ok;
+}
+
+int lwpr_record_save(LWPR_Recorder *rec, const char *filename) {
+   FILE *fp;
+   int ok;
+
+   if (rec->fp != NULL) return 0;
+   fp = fopen(filename, "wb");
+   if (fp == NULL) return 0;
+
+   lwpr_record_lock_drain(rec);
+   ok = lwpr_record_write_header(rec, fp);
+   ok &= lwpr_record_drain(rec, fp);
+   LWPR_REC_STORE(&rec->draining, 0);
+
+   if (fclose(fp) != 0) ok = 0;
+   return ok;
+}
+
+/* Reserves a slot for a new record, making room if the buffer is full */
+static double *lwpr_record_reserve(LWPR_Recorder *rec, unsigned long *pos) {
+   double *slot;
+   int tries;
+
+   slot = lwpr_record_push_begin(rec, pos);
+   if (slot != NULL) return slot;
+
+   if (rec->fp == NULL) {
+      /* Flight recorder: discard the oldest records. Give up if those are still being
+      ** written by other threads, rather than waiting for them */
+      for (tries=0; tries<4 && slot==NULL; tries++) {
+         unsigned long old;
+
+         if (lwpr_record_pop_begin(rec, &old) != NULL) {
+            lwpr_record_pop_end(rec, old);
+            LWPR_REC_INC(&rec->n_overwritten);
+         }
+         slot = lwpr_record_push_begin(rec, pos);
+      }
+   } else if (rec->thread == NULL && LWPR_REC_CAS(&rec->draining, 0, 1)) {
+      /* No background writer: write out the buffer from here */
+      if (!lwpr_record_drain(rec, rec->fp)) rec->ok = 0;
+      LWPR_REC_STORE(&rec->draining, 0);
+      slot = lwpr_record_push_begin(rec, pos);
+   }
+   return slot;
+}
+
+void lwpr_record_call(LWPR_Recorder *rec, int type, int args, const double *x, double cutoff,
+      const double *a, const int *outMask, const int *inMask) {
+   int i;
+   int nIn = rec->nIn;
+   int nOut = rec->nOut;
+   unsigned long n, pos;
+   LWPR_RecordHeader hdr;
+   double *slot, *d;
+
+   if (!(rec->flags & ((type == LWPR_CALL_UPDATE) ? LWPR_RECORD_UPDATES : LWPR_RECORD_PREDICTIONS))) return;
+
+   n = LWPR_REC_INC(&rec->n_calls);
+   /* Deterministic sampling: record call n if floor(n*sample) increases */
+   if (rec->sample < 1.0 && floor((double) (n+1) * rec->sample) == floor((double) n * rec->sample)) return;
+
+   hdr.type = type;
+   hdr.args = args;
+   if (outMask != NULL) hdr.args |= LWPR_RECORD_ARG_OUTMASK;
+   if (inMask != NULL) hdr.args |= LWPR_RECORD_ARG_INMASK;
+   hdr.seq = (double) n;
+   hdr.time = lwpr_record_clock() - rec->t0;
+   hdr.cutoff = cutoff;
+
+   slot = lwpr_record_reserve(rec, &pos);
+   if (slot == NULL) {
+      LWPR_REC_INC(&rec->n_dropped);
+      return;
+   }
+
+   memcpy(slot, &hdr, sizeof(hdr));
+   d = slot + LWPR_REC_HDR;
+   memcpy(d, x, nIn*sizeof(double));
+   d += nIn;
+   switch (type) {
+      case LWPR_CALL_UPDATE:
+      case LWPR_CALL_PREDICT_VJP:
+         memcpy(d, a, nOut*sizeof(double));
+         break;
+      case LWPR_CALL_PREDICT_JVP:
+         memcpy(d, a, nIn*sizeof(double));
+         break;
+      default:
+         if (outMask != NULL) {
+            for (i=0;i<nOut;i++) d[i] = outMask[i] ? 1.0 : 0.0;
+            d += nOut;
+         }
+         if (inMask != NULL) {
+            for (i=0;i<nIn;i++) d[i] = inMask[i] ? 1.0 : 0.0;
+         }
+   }
+   lwpr_record_push_end(rec, pos);
+   LWPR_REC_INC(&rec->n_recorded);
+}
+
+
+int lwpr_replay_open(LWPR_Replay *rp, const char *filename) {
+   char magic[4];
+   int ok, version, nIn, nOut;
+
+   rp->fp = fopen(filename, "rb");
+   if (rp->fp == NULL) return 0;
+
+   ok = (fread(magic, 1, 4, rp->fp)==4 && memcmp(magic, "LWRC", 4)==0) ? 1:0;
+   ok = ok && lwpr_io_read_int(rp->fp, &version) && version == LWPR_RECORD_VERSION;
+   ok = ok && lwpr_io_read_int(rp->fp, &rp->nIn) && lwpr_io_read_int(rp->fp, &rp->nOut);
+   ok = ok && lwpr_io_read_int(rp->fp, &rp->n_data) && lwpr_io_read_int(rp->fp, &rp->flags);
+   ok = ok && lwpr_io_read_scalar(rp->fp, &rp->sample);
+   ok = ok && rp->nIn > 0 && rp->nOut > 0;
+   if (!ok) {
+      fclose(rp->fp);
+      return 0;
+   }
+   nIn = rp->nIn;
+   nOut = rp->nOut;
+
+   /* x and data, then the outputs y, conf, max_w, err, J, Jconf, H, Jv and uJ */
+   rp->storage = (double *) LWPR_MALLOC((size_t) (3*nIn + nOut
+         + 3*nOut + 1 + 2*nOut*nIn + nOut*nIn*nIn + nOut + nIn) * sizeof(double));
+   rp->maskStorage = (int *) LWPR_MALLOC((size_t) (nIn + nOut) * sizeof(int));
+   if (rp->storage == NULL || rp->maskStorage == NULL) {
+      if (rp->storage != NULL) LWPR_FREE(rp->storage);
+      if (rp->maskStorage != NULL) LWPR_FREE(rp->maskStorage);
+      fclose(rp->fp);
+      return 0;
+   }
+   rp->x = rp->storage;
+   rp->data = rp->x + nIn;
+   rp->out = rp->data + 2*nIn + nOut;
+   rp->outMask = rp->inMask = NULL;
+   memset(&rp->hdr, 0, sizeof(rp->hdr));
+   return 1;
+}
+
+int lwpr_replay_next(LWPR_Replay *rp) {
+   int i,n;
+   size_t got;
+
+   got = fread(&rp->hdr, 1, sizeof(LWPR_RecordHeader), rp->fp);
+   if (got == 0 && feof(rp->fp)) return 0;
+   if (got != sizeof(LWPR_RecordHeader)) return -1;
+
+   n = lwpr_record_length(rp->hdr.type, rp->hdr.args, rp->nIn, rp->nOut);
+   if (n < 0) return -1;
+   if (!lwpr_io_read_vector(rp->fp, rp->nIn, rp->x)) return -1;
+   if (n > rp->nIn && !lwpr_io_read_vector(rp->fp, n - rp->nIn, rp->data)) return -1;
+
+   rp->outMask = rp->inMask = NULL;
+   if (rp->hdr.type == LWPR_CALL_PREDICT_SEL || rp->hdr.type == LWPR_CALL_PREDICT_J_SEL) {
+      const double *d = rp->data;
+
+      if (rp->hdr.args & LWPR_RECORD_ARG_OUTMASK) {
+         rp->outMask = rp->maskStorage;
+         for (i=0;i<rp->nOut;i++) rp->outMask[i] = (d[i] != 0.0);
+         d += rp->nOut;
+      }
+      if (rp->hdr.args & LWPR_RECORD_ARG_INMASK) {
+         rp->inMask = rp->maskStorage + rp->nOut;
+         for (i=0;i<rp->nIn;i++) rp->inMask[i] = (d[i] != 0.0);
+      }
+   }
+   return 1;
+}
+
+int lwpr_replay_call(LWPR_Replay *rp, LWPR_Model *model) {
+   int nIn = rp->nIn;
+   int nOut = rp->nOut;
+   int args = rp->hdr.args;
+   double cutoff = rp->hdr.cutoff;
+   const double *x = rp->x;
+   double *y = rp->out;
+   double *c = y + nOut;
+   double *max_w = c + nOut;
+   double *err = max_w + nOut;
+   double *J = err + 1;
+   double *Jconf = J + nOut*nIn;
+   double *H = Jconf + nOut*nIn;
+   double *Jv = H + nOut*nIn*nIn;
+   double *uJ = Jv + nOut;
+   double *conf = (args & LWPR_RECORD_ARG_CONF) ? c : NULL;
+
+   if (!(args & LWPR_RECORD_ARG_MAXW)) max_w = NULL;
+   if (!(args & LWPR_RECORD_ARG_ERR)) err = NULL;
+
+   switch (rp->hdr.type) {
+      case LWPR_CALL_UPDATE:
+         return lwpr_update(model, x, rp->data, (args & LWPR_RECORD_ARG_YP) ? y : NULL, max_w);
+      case LWPR_CALL_PREDICT:
+         lwpr_predict(model, x, cutoff, y, conf, max_w);
+         break;
+      case LWPR_CALL_PREDICT_J:
+         lwpr_predict_J(model, x, cutoff, y, J);
+         break;
+      case LWPR_CALL_PREDICT_JCJ:
+         lwpr_predict_JcJ(model, x, cutoff, y, J, c, Jconf);
+         break;
+      case LWPR_CALL_PREDICT_JH:
+         lwpr_predict_JH(model, x, cutoff, y, J, H);
+         break;
+      case LWPR_CALL_PREDICT_SEL:
+         lwpr_predict_sel(model, x, cutoff, rp->outMask, y, conf, max_w);
+         break;
+      case LWPR_CALL_PREDICT_J_SEL:
+         lwpr_predict_J_sel(model, x, cutoff, rp->outMask, rp->inMask, y, J);
+         break;
+      case LWPR_CALL_PREDICT_JVP:
+         lwpr_predict_jvp(model, x, rp->data, cutoff, y, Jv);
+         break;
+      case LWPR_CALL_PREDICT_VJP:
+         lwpr_predict_vjp(model, x, rp->data, cutoff, y, uJ);
+         break;
+      case LWPR_CALL_PREDICT_CACHED:
+         (void) lwpr_predict_cached(model, x, cutoff, y, err);
+         break;
+   }
+   return 1;
+}
+
+int lwpr_replay_run(LWPR_Replay *rp, LWPR_Model *model, int flags, LWPR_ReplayStats *stats) {
+   LWPR_ReplayStats S;
+   double start, t, t_first = 0.0;
+   double next_seq = 0.0;
+   int first = 1;
+   int r;
+
+   if (model->nInRaw != rp->nIn || model->nOut != rp->nOut) return 0;
+   if (!(flags & LWPR_REPLAY_ANY_MODEL) && model->n_data != rp->n_data) return 0;
+
+   memset(&S, 0, sizeof(S));
+   start = lwpr_record_clock();
+
+   while ((r = lwpr_replay_next(rp)) > 0) {
+      if (rp->hdr.seq != next_seq) S.n_gaps++;
+      next_seq = rp->hdr.seq + 1.0;
+
+      if ((flags & LWPR_REPLAY_UPDATES_ONLY) && rp->hdr.type != LWPR_CALL_UPDATE) {
+         S.n_skipped++;
+         continue;
+      }
+
+      if (flags & LWPR_REPLAY_PACED) {
+         /* Keep the recorded distances in time to the first replayed call */
+         double due, now;
+
+         if (first) t_first = rp->hdr.time;
+         due = start + (rp->hdr.time - t_first);
+         now = lwpr_record_clock();
+         if (now < due) {
+            lwpr_record_sleep(due - now);
+         } else if (now - due > S.max_lag) {
+            S.max_lag = now - due;
+         }
+      }
+      first = 0;
+
+      t = lwpr_record_clock();
+      (void) lwpr_replay_call(rp, model);
+      S.time += lwpr_record_clock() - t;
+      S.n_calls[rp->hdr.type]++;
+   }
+   S.elapsed = lwpr_record_clock() - start;
+   if (stats != NULL) *stats = S;
+   return (r == 0) ? 1 : 0;
+}
+
+void lwpr_replay_close(LWPR_Replay *rp) {
+   fclose(rp->fp);
+   LWPR_FREE(rp->storage);
+   LWPR_FREE(rp->maskStorage);
+   rp->fp = NULL;
+   rp->storage = NULL;
+   rp->maskStorage = NULL;
+}
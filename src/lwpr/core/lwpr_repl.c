@@ -0,0 +1,823 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+#include <lwpr/core/lwpr.h>
+#include <lwpr/core/lwpr_aux.h>
+#include <lwpr/core/lwpr_mem.h>
+#include <lwpr/core/lwpr_binio.h>
+#include <lwpr/core/lwpr_repl.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#ifndef WIN32
+   #include <unistd.h>
+   #include <sys/socket.h>
+   #include <sys/un.h>
+#endif
+
+/* Every message starts with "LWRP", the type (int), the sequence number (double) and
+** the size of the payload in bytes (int, 0 for snapshots, which are self-delimiting) */
+#define LWPR_REPL_HEADER   (4 + 2*sizeof(int) + sizeof(double))
+
+
+/* Composing deltas */
+
+static int lwpr_repl_reserve(LWPR_Replicator *R, size_t n) {
+   if (R->size + n > R->capacity) {
+      size_t capacity = 2*R->capacity + n;
+      char *buffer = (char *) LWPR_REALLOC(R->buffer, capacity);
+
+      if (buffer == NULL) {
+         R->ok = 0;
+         return 0;
+      }
+      R->buffer = buffer;
+      R->capacity = capacity;
+   }
+   return 1;
+}
+
+static void lwpr_repl_put_int(LWPR_Replicator *R, int data) {
+   if (!lwpr_repl_reserve(R, sizeof(int))) return;
+   memcpy(R->buffer + R->size, &data, sizeof(int));
+   R->size += sizeof(int);
+}
+
+static void lwpr_repl_put_matrix(LWPR_Replicator *R, int M, int Ms, int N, const double *data) {
+   int n;
+
+   if (!lwpr_repl_reserve(R, (size_t) (M*N)*sizeof(double))) return;
+   for (n=0;n<N;n++) {
+      memcpy(R->buffer + R->size, data + n*Ms, M*sizeof(double));
+      R->size += M*sizeof(double);
+   }
+}
+
+static void lwpr_repl_put_vector(LWPR_Replicator *R, int N, const double *data) {
+   lwpr_repl_put_matrix(R, N, N, 1, data);
+}
+
+/* Sends a packed distance matrix of a RF (D, M, alpha, h, b), see LWPR_Model.metric_col */
+static void lwpr_repl_put_metric(LWPR_Replicator *R, const double *data) {
+   const LWPR_Model *model = R->model;
+   if (model->nBlocks > 1) {
+      lwpr_repl_put_vector(R, model->nMetric, data);
+   } else {
+      lwpr_repl_put_matrix(R, model->nIn, model->nInStore, model->nIn, data);
+   }
+}
+
+static void lwpr_repl_put_scalar(LWPR_Replicator *R, double data) {
+   lwpr_repl_put_matrix(R, 1, 1, 1, &data);
+}
+
+static void lwpr_repl_put_rf(LWPR_Replicator *R, const LWPR_ReceptiveField *RF, int flags) {
+   const LWPR_Model *model = R->model;
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+   int nReg = RF->nReg;
+
+   if (flags & LWPR_DELTA_STATS) {
+      lwpr_repl_put_int(R, nReg);
+      lwpr_repl_put_int(R, RF->trustworthy);
+      lwpr_repl_put_scalar(R, lwpr_rf_activation(RF));
+      lwpr_repl_put_scalar(R, RF->sum_e2);
+      lwpr_repl_put_scalar(R, RF->beta0);
+      lwpr_repl_put_scalar(R, RF->SSp);
+      lwpr_repl_put_vector(R, nReg, RF->beta);
+      lwpr_repl_put_vector(R, nReg, RF->SSs2);
+      lwpr_repl_put_vector(R, nReg, RF->SSYres);
+      lwpr_repl_put_vector(R, nReg, RF->H);
+      lwpr_repl_put_vector(R, nReg, RF->r);
+      lwpr_repl_put_vector(R, nReg, RF->sum_w);
+      lwpr_repl_put_vector(R, nReg, RF->sum_e_cv2);
+      lwpr_repl_put_vector(R, nReg, RF->n_data);
+      lwpr_repl_put_vector(R, nReg, RF->lambda);
+      lwpr_repl_put_vector(R, nReg, RF->s);
+      lwpr_repl_put_matrix(R, nIn, nInS, nReg, RF->SXresYres);
+      lwpr_repl_put_matrix(R, nIn, nInS, nReg, RF->SSXres);
+      lwpr_repl_put_matrix(R, nIn, nInS, nReg, RF->U);
+      lwpr_repl_put_matrix(R, nIn, nInS, nReg, RF->P);
+      lwpr_repl_put_vector(R, nIn, RF->mean_x);
+      lwpr_repl_put_vector(R, nIn, RF->var_x);
+   }
+   if (flags & LWPR_DELTA_METRIC) {
+      if (RF->L != NULL) {
+         lwpr_repl_put_matrix(R, nIn, nInS, model->rank+1, RF->L);
+         lwpr_repl_put_matrix(R, nIn, nInS, model->rank+1, RF->alpha);
+      } else {
+         /* D is only sent if it is formed, otherwise the follower forms it from M on demand */
+         lwpr_repl_put_int(R, RF->DReady);
+         if (RF->DReady) lwpr_repl_put_metric(R, RF->D);
+         lwpr_repl_put_metric(R, RF->M);
+         lwpr_repl_put_metric(R, RF->alpha);
+         lwpr_repl_put_metric(R, RF->h);
+         lwpr_repl_put_metric(R, RF->b);
+      }
+   }
+   if (flags & LWPR_DELTA_CENTRE) {
+      lwpr_repl_put_vector(R, nIn, RF->c);
+   }
+}
+
+static void lwpr_repl_compose(LWPR_Replicator *R) {
+   const LWPR_Model *model = R->model;
+   int nIn = model->nIn;
+   int dim,i,n;
+
+   R->size = 0;
+   lwpr_repl_put_int(R, nIn);
+   lwpr_repl_put_int(R, model->nOut);
+   lwpr_repl_put_int(R, model->n_data);
+   lwpr_repl_put_int(R, model->n_updates);
+   lwpr_repl_put_scalar(R, model->gate_run);
+   lwpr_repl_put_scalar(R, model->n_gate_seen);
+   lwpr_repl_put_scalar(R, model->n_gate_accepted);
+   lwpr_repl_put_vector(R, nIn, model->mean_x);
+   lwpr_repl_put_vector(R, nIn, model->var_x);
+   if (model->proj_P != NULL) {
+      int nInRaw = model->nInRaw;
+
+      lwpr_repl_put_int(R, nInRaw);
+      lwpr_repl_put_matrix(R, nIn, model->nInStore, nInRaw, model->proj_P);
+      lwpr_repl_put_vector(R, nInRaw, model->proj_mean);
+      lwpr_repl_put_vector(R, nInRaw*nInRaw, model->proj_cov);
+   } else {
+      lwpr_repl_put_int(R, 0);
+   }
+
+   for (dim=0;dim<model->nOut;dim++) {
+      const LWPR_SubModel *sub = &model->sub[dim];
+      LWPR_ReplLayout *L = &R->layout[dim];
+      size_t countAt;
+      int count;
+
+      lwpr_repl_put_int(R, sub->n_pruned);
+      if (L->numMoves == 0 && L->numBase == sub->numRFS) {
+         lwpr_repl_put_int(R, -1);
+      } else {
+         for (count=0, i=0;i<L->numMoves;i++) {
+            if (L->pos[i] < sub->numRFS) count++;
+         }
+         lwpr_repl_put_int(R, count);
+         lwpr_repl_put_int(R, sub->numRFS);
+         for (i=0;i<L->numMoves;i++) {
+            if (L->pos[i] >= sub->numRFS) continue;
+            lwpr_repl_put_int(R, L->pos[i]);
+            lwpr_repl_put_int(R, L->src[i]);
+         }
+      }
+      L->numMoves = 0;
+      L->numBase = sub->numRFS;
+
+      /* The number of RF records is filled in afterwards */
+      countAt = R->size;
+      lwpr_repl_put_int(R, 0);
+      for (count=0, n=0;n<sub->numRFS;n++) {
+         LWPR_ReceptiveField *RF = sub->rf[n];
+
+         if (RF->dirty == 0) continue;
+         lwpr_repl_put_int(R, n);
+         lwpr_repl_put_int(R, RF->dirty);
+         lwpr_repl_put_rf(R, RF, RF->dirty);
+         RF->dirty = 0;
+         count++;
+      }
+      if (R->ok) memcpy(R->buffer + countAt, &count, sizeof(int));
+      R->n_rfs += count;
+   }
+}
+
+static int lwpr_repl_write_header(FILE *fp, int type, double seq, int length) {
+   int ok;
+
+   ok = (fwrite("LWRP", 1, 4, fp) == 4) ? 1:0;
+   ok &= lwpr_io_write_int(fp, type);
+   ok &= lwpr_io_write_scalar(fp, seq);
+   ok &= lwpr_io_write_int(fp, length);
+   return ok;
+}
+
+static int lwpr_repl_write_snapshot(LWPR_Replicator *R, FILE *fp) {
+   const LWPR_Model *model = R->model;
+   int ok;
+
+   ok = lwpr_repl_write_header(fp, LWPR_REPL_SNAPSHOT, R->seq, 0);
+   ok &= lwpr_write_binary_fp(model, fp);
+   /* Counters that are not part of binary files */
+   ok &= lwpr_io_write_int(fp, model->n_updates);
+   ok &= lwpr_io_write_scalar(fp, model->gate_run);
+   ok &= lwpr_io_write_scalar(fp, model->n_gate_seen);
+   ok &= lwpr_io_write_scalar(fp, model->n_gate_accepted);
+   if (fflush(fp) != 0) ok = 0;
+   return ok;
+}
+
+static void lwpr_repl_remove_follower(LWPR_Replicator *R, int i) {
+   R->followers[i] = R->followers[--R->numFollowers];
+   R->n_lost++;
+}
+
+
+/* Leader */
+
+int lwpr_repl_start(LWPR_Replicator *R, LWPR_Model *model, int interval) {
+   int dim,n;
+
+   if (model->repl != NULL) return 0;
+
+   R->layout = (LWPR_ReplLayout *) LWPR_CALLOC((size_t) model->nOut, sizeof(LWPR_ReplLayout));
+   if (R->layout == NULL) return 0;
+
+   R->model = model;
+   R->interval = interval;
+   R->pending = 0;
+   R->seq = 0.0;
+   R->followers = NULL;
+   R->numFollowers = R->numFollowerPointers = 0;
+   R->buffer = NULL;
+   R->size = R->capacity = 0;
+   R->ok = 1;
+   R->n_deltas = R->n_bytes = R->n_rfs = 0.0;
+   R->n_lost = 0;
+
+   /* Followers start from a snapshot, so all changes up to now are known to them */
+   for (dim=0;dim<model->nOut;dim++) {
+      LWPR_SubModel *sub = &model->sub[dim];
+
+      R->layout[dim].numBase = sub->numRFS;
+      for (n=0;n<sub->numRFS;n++) sub->rf[n]->dirty = 0;
+   }
+   model->repl = R;
+   return 1;
+}
+
+int lwpr_repl_add_follower(LWPR_Replicator *R, FILE *fp) {
+   if (R->numFollowers == R->numFollowerPointers) {
+      FILE **newStore = (FILE **) LWPR_REALLOC(R->followers, (R->numFollowerPointers+4)*sizeof(FILE *));
+      if (newStore == NULL) return 0;
+
+      R->followers = newStore;
+      R->numFollowerPointers+=4;
+   }
+   /* The snapshot must not contain changes that the other followers have not seen yet */
+   if (lwpr_repl_publish(R) < 0) (void) lwpr_repl_resync(R);
+
+   if (!lwpr_repl_write_snapshot(R, fp)) return 0;
+   R->followers[R->numFollowers++] = fp;
+   return 1;
+}
+
+int lwpr_repl_publish(LWPR_Replicator *R) {
+   int i;
+
+   R->pending = 0;
+   lwpr_repl_compose(R);
+   if (!R->ok) {
+      R->ok = 1;
+      return -1;
+   }
+
+   R->seq += 1.0;
+   R->n_deltas += 1.0;
+   R->n_bytes += (double) (LWPR_REPL_HEADER + R->size);
+
+   for (i=R->numFollowers-1;i>=0;i--) {
+      FILE *fp = R->followers[i];
+      int ok;
+
+      ok = lwpr_repl_write_header(fp, LWPR_REPL_DELTA, R->seq, (int) R->size);
+      ok &= (fwrite(R->buffer, 1, R->size, fp) == R->size) ? 1:0;
+      if (fflush(fp) != 0) ok = 0;
+      if (!ok) lwpr_repl_remove_follower(R, i);
+   }
+   return R->numFollowers;
+}
+
+int lwpr_repl_resync(LWPR_Replicator *R) {
+   LWPR_Model *model = R->model;
+   int i,dim,n;
+
+   R->pending = 0;
+   for (dim=0;dim<model->nOut;dim++) {
+      LWPR_SubModel *sub = &model->sub[dim];
+
+      R->layout[dim].numMoves = 0;
+      R->layout[dim].numBase = sub->numRFS;
+      for (n=0;n<sub->numRFS;n++) sub->rf[n]->dirty = 0;
+   }
+
+   R->seq += 1.0;
+   for (i=R->numFollowers-1;i>=0;i--) {
+      if (!lwpr_repl_write_snapshot(R, R->followers[i])) lwpr_repl_remove_follower(R, i);
+   }
+   return R->numFollowers;
+}
+
+void lwpr_repl_stop(LWPR_Replicator *R) {
+   int dim;
+
+   R->model->repl = NULL;
+   for (dim=0;dim<R->model->nOut;dim++) {
+      if (R->layout[dim].pos != NULL) LWPR_FREE(R->layout[dim].pos);
+      if (R->layout[dim].src != NULL) LWPR_FREE(R->layout[dim].src);
+   }
+   LWPR_FREE(R->layout);
+   if (R->followers != NULL) LWPR_FREE(R->followers);
+   if (R->buffer != NULL) LWPR_FREE(R->buffer);
+   R->layout = NULL;
+   R->followers = NULL;
+   R->buffer = NULL;
+   R->numFollowers = 0;
+}
+
+void lwpr_repl_tick(LWPR_Replicator *R) {
+   if (R->interval > 0 && ++R->pending >= R->interval) {
+      if (lwpr_repl_publish(R) < 0) (void) lwpr_repl_resync(R);
+   }
+}
+
+static int lwpr_repl_find(const LWPR_ReplLayout *L, int pos) {
+   int i;
+   for (i=0;i<L->numMoves;i++) {
+      if (L->pos[i] == pos) return i;
+   }
+   return -1;
+}
+
+/* Records that the RF at position pos came from position src (-1: new),
+** or returns to its original position if src == pos */
+static int lwpr_repl_set(LWPR_ReplLayout *L, int pos, int src) {
+   int i = lwpr_repl_find(L, pos);
+
+   if (src == pos) {
+      if (i >= 0) {
+         L->numMoves--;
+         L->pos[i] = L->pos[L->numMoves];
+         L->src[i] = L->src[L->numMoves];
+      }
+      return 1;
+   }
+   if (i < 0) {
+      if (L->numMoves == L->numMovePointers) {
+         int *newPos = (int *) LWPR_REALLOC(L->pos, (L->numMovePointers+16)*sizeof(int));
+         int *newSrc;
+
+         if (newPos == NULL) return 0;
+         L->pos = newPos;
+         newSrc = (int *) LWPR_REALLOC(L->src, (L->numMovePointers+16)*sizeof(int));
+         if (newSrc == NULL) return 0;
+         L->src = newSrc;
+         L->numMovePointers+=16;
+      }
+      i = L->numMoves++;
+      L->pos[i] = pos;
+   }
+   L->src[i] = src;
+   return 1;
+}
+
+void lwpr_repl_note_add(LWPR_Replicator *R, int dim) {
+   LWPR_SubModel *sub = &R->model->sub[dim];
+   int pos = sub->numRFS-1;
+
+   sub->rf[pos]->dirty = LWPR_DELTA_ALL;
+   if (!lwpr_repl_set(&R->layout[dim], pos, -1)) R->ok = 0;
+}
+
+void lwpr_repl_note_prune(LWPR_Replicator *R, int dim, int pos) {
+   LWPR_ReplLayout *L = &R->layout[dim];
+   int last = R->model->sub[dim].numRFS-1;
+   int i = lwpr_repl_find(L, last);
+   int src = (i >= 0) ? L->src[i] : last;
+
+   /* The last position disappears, and its RF moves to pos */
+   if (i >= 0) (void) lwpr_repl_set(L, last, last);
+   if (pos < last && !lwpr_repl_set(L, pos, src)) R->ok = 0;
+}
+
+
+/* Follower */
+
+typedef struct {
+   const char *ptr;
+   const char *end;
+   int ok;
+} LWPR_ReplReader;
+
+static int lwpr_repl_get_int(LWPR_ReplReader *rd) {
+   int data = 0;
+
+   if (rd->ptr + sizeof(int) > rd->end) {
+      rd->ok = 0;
+      return 0;
+   }
+   memcpy(&data, rd->ptr, sizeof(int));
+   rd->ptr += sizeof(int);
+   return data;
+}
+
+static void lwpr_repl_get_matrix(LWPR_ReplReader *rd, int M, int Ms, int N, double *data) {
+   int n;
+
+   if (rd->ptr + (size_t) (M*N)*sizeof(double) > rd->end) {
+      rd->ok = 0;
+      return;
+   }
+   for (n=0;n<N;n++) {
+      memcpy(data + n*Ms, rd->ptr, M*sizeof(double));
+      rd->ptr += M*sizeof(double);
+   }
+}
+
+static void lwpr_repl_get_vector(LWPR_ReplReader *rd, int N, double *data) {
+   lwpr_repl_get_matrix(rd, N, N, 1, data);
+}
+
+static void lwpr_repl_get_metric(LWPR_ReplReader *rd, const LWPR_Model *model, double *data) {
+   if (model->nBlocks > 1) {
+      lwpr_repl_get_vector(rd, model->nMetric, data);
+   } else {
+      lwpr_repl_get_matrix(rd, model->nIn, model->nInStore, model->nIn, data);
+   }
+}
+
+static double lwpr_repl_get_scalar(LWPR_ReplReader *rd) {
+   double data = 0.0;
+   lwpr_repl_get_matrix(rd, 1, 1, 1, &data);
+   return data;
+}
+
+static int lwpr_replica_get_rf(LWPR_ReplReader *rd, LWPR_Model *model, LWPR_ReceptiveField *RF, int flags) {
+   int nIn = model->nIn;
+   int nInS = model->nInStore;
+
+   if ((flags & ~LWPR_DELTA_ALL) != 0) return 0;
+   if (RF->fixStorage == NULL && flags != LWPR_DELTA_ALL) return 0;
+
+   if (flags & LWPR_DELTA_STATS) {
+      int nReg = lwpr_repl_get_int(rd);
+
+      if (!rd->ok || nReg < 1 || nReg > nIn) return 0;
+      if (RF->fixStorage == NULL) {
+         int nRegStore = (nReg > LWPR_REGSTORE) ? nReg : LWPR_REGSTORE;
+         if (!lwpr_mem_alloc_rf(RF, model, nReg, nRegStore)) return 0;
+      } else if (nReg > RF->nRegStore) {
+         if (!lwpr_mem_realloc_rf(RF, nReg + LWPR_REGINCR)) return 0;
+      }
+      RF->nReg = nReg;
+      RF->trustworthy = lwpr_repl_get_int(rd);
+      RF->w = lwpr_repl_get_scalar(rd);
+      RF->w_stamp = model->n_updates;
+      RF->sum_e2 = lwpr_repl_get_scalar(rd);
+      RF->beta0 = lwpr_repl_get_scalar(rd);
+      RF->SSp = lwpr_repl_get_scalar(rd);
+      lwpr_repl_get_vector(rd, nReg, RF->beta);
+      lwpr_repl_get_vector(rd, nReg, RF->SSs2);
+      lwpr_repl_get_vector(rd, nReg, RF->SSYres);
+      lwpr_repl_get_vector(rd, nReg, RF->H);
+      lwpr_repl_get_vector(rd, nReg, RF->r);
+      lwpr_repl_get_vector(rd, nReg, RF->sum_w);
+      lwpr_repl_get_vector(rd, nReg, RF->sum_e_cv2);
+      lwpr_repl_get_vector(rd, nReg, RF->n_data);
+      lwpr_repl_get_vector(rd, nReg, RF->lambda);
+      lwpr_repl_get_vector(rd, nReg, RF->s);
+      lwpr_repl_get_matrix(rd, nIn, nInS, nReg, RF->SXresYres);
+      lwpr_repl_get_matrix(rd, nIn, nInS, nReg, RF->SSXres);
+      lwpr_repl_get_matrix(rd, nIn, nInS, nReg, RF->U);
+      lwpr_repl_get_matrix(rd, nIn, nInS, nReg, RF->P);
+      lwpr_repl_get_vector(rd, nIn, RF->mean_x);
+      lwpr_repl_get_vector(rd, nIn, RF->var_x);
+      RF->slopeReady = 0;
+   }
+   if (flags & LWPR_DELTA_METRIC) {
+      if (RF->L != NULL) {
+         lwpr_repl_get_matrix(rd, nIn, nInS, model->rank+1, RF->L);
+         lwpr_repl_get_matrix(rd, nIn, nInS, model->rank+1, RF->alpha);
+      } else {
+         RF->DReady = lwpr_repl_get_int(rd) ? 1:0;
+         if (RF->DReady) lwpr_repl_get_metric(rd, model, RF->D);
+         lwpr_repl_get_metric(rd, model, RF->M);
+         lwpr_repl_get_metric(rd, model, RF->alpha);
+         lwpr_repl_get_metric(rd, model, RF->h);
+         lwpr_repl_get_metric(rd, model, RF->b);
+      }
+      RF->boxReady = 0;
+      if (RF->cluster != NULL) RF->cluster->ready = 0;
+   }
+   if (flags & LWPR_DELTA_CENTRE) {
+      lwpr_repl_get_vector(rd, nIn, RF->c);
+      RF->boxReady = 0;
+   }
+   return rd->ok;
+}
+
+/* Moves the RFs of a SubModel around as the leader did, and allocates empty ones at new positions */
+static int lwpr_replica_layout(LWPR_Replica *F, LWPR_ReplReader *rd, LWPR_SubModel *sub, int count) {
+   int numOld = sub->numRFS;
+   int numNew = lwpr_repl_get_int(rd);
+   LWPR_ReceptiveField **old;
+   int i,n;
+
+   if (!rd->ok || count < 0 || numNew < 0 || rd->ptr + 2*count*sizeof(int) > rd->end) return 0;
+
+   if (numNew > sub->numPointers) {
+      LWPR_ReceptiveField **newStore = (LWPR_ReceptiveField **) LWPR_REALLOC(sub->rf, numNew*sizeof(LWPR_ReceptiveField *));
+      if (newStore == NULL) return 0;
+      sub->rf = newStore;
+      sub->numPointers = numNew;
+   }
+   if (numOld > F->numKeep) {
+      int *newKeep = (int *) LWPR_REALLOC(F->keep, numOld*sizeof(int));
+      if (newKeep == NULL) return 0;
+      F->keep = newKeep;
+      F->numKeep = numOld;
+   }
+   old = (LWPR_ReceptiveField **) LWPR_MALLOC((numOld+1)*sizeof(LWPR_ReceptiveField *));
+   if (old == NULL) return 0;
+   memcpy(old, sub->rf, numOld*sizeof(LWPR_ReceptiveField *));
+
+   for (n=0;n<numOld;n++) F->keep[n] = (n < numNew) ? 1:0;
+   for (n=numOld;n<numNew;n++) sub->rf[n] = NULL;
+
+   for (i=0;i<count;i++) {
+      int pos = lwpr_repl_get_int(rd);
+      int src = lwpr_repl_get_int(rd);
+
+      if (pos < 0 || pos >= numNew || src < -1 || src >= numOld) {
+         rd->ok = 0;
+         break;
+      }
+      if (pos < numOld) F->keep[pos]--;
+      if (src >= 0) {
+         F->keep[src]++;
+         sub->rf[pos] = old[src];
+      } else {
+         LWPR_ReceptiveField *RF = (LWPR_ReceptiveField *) LWPR_MALLOC(sizeof(LWPR_ReceptiveField));
+         if (RF == NULL) {
+            sub->rf[pos] = NULL;
+            rd->ok = 0;
+            break;
+         }
+         memset(RF, 0, sizeof(LWPR_ReceptiveField));
+         sub->rf[pos] = RF;
+      }
+   }
+   sub->numRFS = numNew;
+
+   /* Dispose of the RFs that were pruned */
+   for (n=0;n<numOld;n++) {
+      if (F->keep[n] > 0) continue;
+      if (old[n]->cluster != NULL) lwpr_aux_cluster_remove(sub, old[n]);
+      lwpr_mem_free_rf(old[n]);
+      LWPR_FREE(old[n]);
+   }
+   LWPR_FREE(old);
+
+   /* Positions that could not be filled are dropped, so that the model can still be disposed of */
+   for (i=0,n=0;n<numNew;n++) {
+      if (sub->rf[n] != NULL) sub->rf[i++] = sub->rf[n];
+   }
+   sub->numRFS = i;
+   lwpr_aux_invalidate_index(sub);
+   return rd->ok && i == numNew;
+}
+
+static int lwpr_replica_delta(LWPR_Replica *F, size_t length) {
+   LWPR_Model *model = F->model;
+   LWPR_ReplReader rd;
+   int nIn = model->nIn;
+   int dim,i,nInRaw;
+
+   rd.ptr = F->buffer;
+   rd.end = F->buffer + length;
+   rd.ok = 1;
+
+   if (lwpr_repl_get_int(&rd) != nIn || lwpr_repl_get_int(&rd) != model->nOut) return 0;
+   model->n_data = lwpr_repl_get_int(&rd);
+   model->n_updates = lwpr_repl_get_int(&rd);
+   model->gate_run = lwpr_repl_get_scalar(&rd);
+   model->n_gate_seen = lwpr_repl_get_scalar(&rd);
+   model->n_gate_accepted = lwpr_repl_get_scalar(&rd);
+   lwpr_repl_get_vector(&rd, nIn, model->mean_x);
+   lwpr_repl_get_vector(&rd, nIn, model->var_x);
+   nInRaw = lwpr_repl_get_int(&rd);
+   if (nInRaw > 0) {
+      if (model->proj_P == NULL || nInRaw != model->nInRaw) return 0;
+      lwpr_repl_get_matrix(&rd, nIn, model->nInStore, nInRaw, model->proj_P);
+      lwpr_repl_get_vector(&rd, nInRaw, model->proj_mean);
+      lwpr_repl_get_vector(&rd, nInRaw*nInRaw, model->proj_cov);
+   }
+
+   for (dim=0;dim<model->nOut && rd.ok;dim++) {
+      LWPR_SubModel *sub = &model->sub[dim];
+      int count, layout;
+
+      sub->n_pruned = lwpr_repl_get_int(&rd);
+      layout = lwpr_repl_get_int(&rd);
+      if (layout >= 0 && !lwpr_replica_layout(F, &rd, sub, layout)) return 0;
+
+      count = lwpr_repl_get_int(&rd);
+      for (i=0;i<count && rd.ok;i++) {
+         int pos = lwpr_repl_get_int(&rd);
+         int flags = lwpr_repl_get_int(&rd);
+
+         if (!rd.ok || pos < 0 || pos >= sub->numRFS) return 0;
+         if (!lwpr_replica_get_rf(&rd, model, sub->rf[pos], flags)) return 0;
+      }
+      if (layout > 0) {
+         /* New RFs are complete now, so they can join clusters */
+         int n;
+         for (n=0;n<sub->numRFS;n++) {
+            LWPR_ReceptiveField *RF = sub->rf[n];
+            if (RF->fixStorage == NULL) return 0;
+            if (sub->clusters != NULL && RF->cluster == NULL) {
+               if (!lwpr_aux_cluster_insert(sub, RF, model->ws[0].xc)) return 0;
+            }
+         }
+      }
+   }
+   return rd.ok && rd.ptr == rd.end;
+}
+
+static int lwpr_replica_snapshot(LWPR_Replica *F) {
+   LWPR_Model *model = F->model;
+   int cluster_size = 0, index_proj = 0;
+   double cluster_radius = 0.0, index_recall = 0.0;
+   int dim,n,ok;
+
+   if (F->ready) {
+      /* Acceleration structures of the follower are not part of the snapshot */
+      cluster_size = model->cluster_size;
+      cluster_radius = model->cluster_radius;
+      index_proj = model->index_proj;
+      index_recall = model->index_recall;
+      lwpr_free_model(model);
+      F->ready = 0;
+   }
+   if (!lwpr_read_binary_fp(model, F->fp)) return 0;
+
+   ok = lwpr_io_read_int(F->fp, &model->n_updates);
+   ok &= lwpr_io_read_scalar(F->fp, &model->gate_run);
+   ok &= lwpr_io_read_scalar(F->fp, &model->n_gate_seen);
+   ok &= lwpr_io_read_scalar(F->fp, &model->n_gate_accepted);
+   for (dim=0;dim<model->nOut;dim++) {
+      for (n=0;n<model->sub[dim].numRFS;n++) model->sub[dim].rf[n]->w_stamp = model->n_updates;
+   }
+   if (ok && cluster_size > 0) ok = lwpr_set_clusters(model, cluster_size, cluster_radius);
+   if (ok && index_proj > 0) ok = lwpr_set_index(model, index_proj, index_recall);
+   if (!ok) {
+      lwpr_free_model(model);
+      return 0;
+   }
+   F->ready = 1;
+   return 1;
+}
+
+void lwpr_replica_init(LWPR_Replica *F, LWPR_Model *model, FILE *fp) {
+   F->model = model;
+   F->fp = fp;
+   F->ready = 0;
+   F->seq = 0.0;
+   F->buffer = NULL;
+   F->capacity = 0;
+   F->keep = NULL;
+   F->numKeep = 0;
+   F->n_deltas = F->n_snapshots = F->n_bytes = 0.0;
+}
+
+int lwpr_replica_apply(LWPR_Replica *F) {
+   char str[5];
+   int type, length;
+   double seq;
+   size_t n;
+
+   n = fread(str, 1, 4, F->fp);
+   if (n == 0 && feof(F->fp)) return 0;
+   str[4] = 0;
+   if (n != 4 || strcmp(str, "LWRP") != 0) return -1;
+   if (!lwpr_io_read_int(F->fp, &type) || !lwpr_io_read_scalar(F->fp, &seq)
+         || !lwpr_io_read_int(F->fp, &length) || length < 0) return -1;
+   F->n_bytes += (double) (LWPR_REPL_HEADER + length);
+
+   if (type == LWPR_REPL_SNAPSHOT) {
+      if (!lwpr_replica_snapshot(F)) return -1;
+      F->seq = seq;
+      F->n_snapshots += 1.0;
+      return 1;
+   }
+   if (type != LWPR_REPL_DELTA) return -1;
+
+   if ((size_t) length > F->capacity) {
+      char *buffer = (char *) LWPR_REALLOC(F->buffer, (size_t) length);
+      if (buffer == NULL) return -1;
+      F->buffer = buffer;
+      F->capacity = (size_t) length;
+   }
+   if (fread(F->buffer, 1, (size_t) length, F->fp) != (size_t) length) return -1;
+
+   /* A delta can only be applied on top of the message before it */
+   if (!F->ready || seq != F->seq + 1.0) return -1;
+
+   if (!lwpr_replica_delta(F, (size_t) length)) {
+      lwpr_free_model(F->model);
+      F->ready = 0;
+      return -1;
+   }
+   F->seq = seq;
+   F->n_deltas += 1.0;
+   return 1;
+}
+
+void lwpr_replica_close(LWPR_Replica *F) {
+   if (F->buffer != NULL) LWPR_FREE(F->buffer);
+   if (F->keep != NULL) LWPR_FREE(F->keep);
+   F->buffer = NULL;
+   F->keep = NULL;
+   F->capacity = 0;
+   F->numKeep = 0;
+}
+
+
+/* Unix domain sockets */
+
+#ifndef WIN32
+static int lwpr_repl_unix_address(struct sockaddr_un *addr, const char *path) {
+   if (strlen(path) >= sizeof(addr->sun_path)) return 0;
+   memset(addr, 0, sizeof(struct sockaddr_un));
+   addr->sun_family = AF_UNIX;
+   strcpy(addr->sun_path, path);
+   return 1;
+}
+#endif
+
+int lwpr_repl_unix_listen(const char *path) {
+#ifdef WIN32
+   return -1;
+#else
+   struct sockaddr_un addr;
+   int sock;
+
+   if (!lwpr_repl_unix_address(&addr, path)) return -1;
+   sock = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (sock < 0) return -1;
+   (void) unlink(path);
+   if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(sock, 4) != 0) {
+      close(sock);
+      return -1;
+   }
+   return sock;
+#endif
+}
+
+FILE *lwpr_repl_unix_accept(int sock) {
+#ifdef WIN32
+   return NULL;
+#else
+   int fd = accept(sock, NULL, NULL);
+   FILE *fp;
+
+   if (fd < 0) return NULL;
+   fp = fdopen(fd, "wb");
+   if (fp == NULL) close(fd);
+   return fp;
+#endif
+}
+
+FILE *lwpr_repl_unix_connect(const char *path) {
+#ifdef WIN32
+   return NULL;
+#else
+   struct sockaddr_un addr;
+   int fd;
+   FILE *fp;
+
+   if (!lwpr_repl_unix_address(&addr, path)) return NULL;
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (fd < 0) return NULL;
+   if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+      close(fd);
+      return NULL;
+   }
+   fp = fdopen(fd, "rb");
+   if (fp == NULL) close(fd);
+   return fp;
+#endif
+}
@@ -0,0 +1,247 @@
+/*********************************************************************
+LWPR: A library for incremental online learning
+Copyright (C) 2007  Stefan Klanke, Sethu Vijayakumar
+Contact: sethu.vijayakumar@ed.ac.uk
+
+This library is free software; you can redistribute it and/or
+modify it under the terms of the GNU Lesser General Public
+License as published by the Free Software Foundation; either
+version 2.1 of the License, or (at your option) any later version.
+
+This library is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+Library General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public
+License along with this library; if not, write to the Free
+Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*********************************************************************/
+
+
+/** \file lwpr_repl.h
+   \brief Prototypes for replicating an LWPR model that is being trained to follower
+      models in other processes
+
+   While an LWPR_Replicator is attached to a model (the leader), lwpr_update marks the
+   receptive fields it changes, and notes which ones it adds and prunes. lwpr_repl_publish
+   turns these changes into a delta message and writes it to all followers. A delta holds
+   - the global statistics of the model (n_data, mean_x, var_x, the input projection, ...),
+   - for each output dimension whose receptive fields were added or pruned, the new number of
+     receptive fields and the positions whose contents moved or are new,
+   - for each changed receptive field, only the groups of fields that changed (see LWPR_DELTA_STATS,
+     LWPR_DELTA_METRIC, LWPR_DELTA_CENTRE).
+
+   Changes are accumulated between two deltas, so a receptive field that is updated many times
+   is sent once, and the size of a delta is proportional to the number of receptive fields that
+   changed. New followers first receive a snapshot of the whole model (as written by
+   lwpr_write_binary_fp), and then the deltas. Every message carries a sequence number, so a
+   follower detects lost messages.
+
+   On the follower side, an LWPR_Replica reads the messages from a stream and applies them to its
+   own LWPR_Model, which then equals the leader at the time of the last delta (a byte-identical
+   binary file can be written from it). The follower can use clusters or a random-projection index
+   (lwpr_set_clusters, lwpr_set_index) independently of the leader.
+
+   The messages are written to and read from stdio streams, so any reliable byte stream can be
+   used as transport: pipes, files, or local sockets, for which lwpr_repl_unix_listen,
+   lwpr_repl_unix_accept and lwpr_repl_unix_connect are provided. Writing to a follower that
+   disappeared raises SIGPIPE on POSIX systems for pipes, so applications that use pipes should
+   ignore that signal.
+
+   Only changes made by lwpr_update are tracked. After changing the model by other means
+   (e.g. lwpr_set_init_D, lwpr_prune_projections), call lwpr_repl_resync, which sends a fresh
+   snapshot to all followers. Publishing happens in the thread that calls lwpr_update (or
+   lwpr_repl_publish), and blocks while a follower does not read its stream.
+
+   \code
+   leader:                                     follower:
+   LWPR_Replicator R;                          LWPR_Replica F;
+   lwpr_repl_start(&R, &model, 100);           lwpr_replica_init(&F, &replica, fp);
+   lwpr_repl_add_follower(&R, fp);             while (lwpr_replica_apply(&F) == 1) {
+   ... lwpr_update ...                            ... lwpr_predict(&replica, ...) ...
+   lwpr_repl_stop(&R);                         }
+                                               lwpr_replica_close(&F);
+   \endcode
+   \ingroup LWPR_C
+*/
+
+#ifndef __LWPR_REPL_H
+#define __LWPR_REPL_H
+
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** \brief Flag of LWPR_ReceptiveField.dirty: the regression part (PLS statistics, means, activation,
+      nReg) changed */
+#define LWPR_DELTA_STATS      1
+/** \brief Flag of LWPR_ReceptiveField.dirty: the distance metric and its learning rates changed */
+#define LWPR_DELTA_METRIC     2
+/** \brief Flag of LWPR_ReceptiveField.dirty: the centre changed (only for new receptive fields) */
+#define LWPR_DELTA_CENTRE     4
+/** \brief All flags of LWPR_ReceptiveField.dirty */
+#define LWPR_DELTA_ALL        7
+
+/** \brief Type of a replication message: snapshot of the whole model */
+#define LWPR_REPL_SNAPSHOT    1
+/** \brief Type of a replication message: delta */
+#define LWPR_REPL_DELTA       2
+
+/** \brief Changes of the receptive field positions of one output dimension since the last delta
+   \ingroup LWPR_C
+*/
+typedef struct {
+   int numBase;               /**< \brief Number of receptive fields at the time of the last delta */
+   int numMoves;              /**< \brief Number of entries in pos and src */
+   int numMovePointers;       /**< \brief Number of entries that can be stored before a re-allocation is necessary */
+   int *pos;                  /**< \brief Positions whose receptive field changed */
+   int *src;                  /**< \brief Position the RF now at pos[i] had at the time of the last delta, or -1 for new RFs */
+} LWPR_ReplLayout;
+
+/** \brief State of a replication leader, see lwpr_repl_start. Do not touch its elements.
+   \ingroup LWPR_C
+*/
+typedef struct LWPR_Replicator {
+   struct LWPR_Model *model;  /**< \brief The replicated model */
+   int interval;              /**< \brief Number of updates between deltas that lwpr_update publishes (0 = only lwpr_repl_publish) */
+   int pending;               /**< \brief Number of updates since the last delta */
+   double seq;                /**< \brief Sequence number of the last message */
+   LWPR_ReplLayout *layout;   /**< \brief Changes of the RF positions, one per output dimension */
+   FILE **followers;          /**< \brief Streams of the followers */
+   int numFollowers;          /**< \brief Number of followers */
+   int numFollowerPointers;   /**< \brief Number of followers that can be stored before a re-allocation is necessary */
+   char *buffer;              /**< \brief Buffer for composing a delta */
+   size_t size;               /**< \brief Number of bytes in buffer */
+   size_t capacity;           /**< \brief Allocated size of buffer */
+   int ok;                    /**< \brief Set to 0 if memory for a delta could not be allocated */
+   double n_deltas;           /**< \brief Number of deltas published */
+   double n_bytes;            /**< \brief Total size of the deltas published (per follower) */
+   double n_rfs;              /**< \brief Total number of receptive field records in the deltas */
+   int n_lost;                /**< \brief Number of followers removed because writing to them failed */
+} LWPR_Replicator;
+
+/** \brief State of a replication follower, see lwpr_replica_init. Do not touch its elements.
+   \ingroup LWPR_C
+*/
+typedef struct {
+   struct LWPR_Model *model;  /**< \brief The follower model (uninitialised until the first snapshot) */
+   FILE *fp;                  /**< \brief Stream the messages are read from */
+   int ready;                 /**< \brief Indicates whether model holds a valid replica */
+   double seq;                /**< \brief Sequence number of the last message applied */
+   char *buffer;              /**< \brief Buffer for the payload of a delta */
+   size_t capacity;           /**< \brief Allocated size of buffer */
+   int *keep;                 /**< \brief Working memory for moving receptive fields around */
+   int numKeep;               /**< \brief Number of entries of keep */
+   double n_deltas;           /**< \brief Number of deltas applied */
+   double n_snapshots;        /**< \brief Number of snapshots applied */
+   double n_bytes;            /**< \brief Total size of the messages read */
+} LWPR_Replica;
+
+/** \brief Attaches a replication leader to a model
+   \param[out] R         Pointer to an (unused) LWPR_Replicator structure
+   \param[in,out] model  The model to replicate. Its LWPR_Model.repl is set to R.
+   \param[in] interval   lwpr_update publishes a delta after every <em>interval</em> updates
+                         (0 = only when lwpr_repl_publish is called)
+   \return
+      - 1 in case of success
+      - 0 if memory could not be allocated, or another replicator is attached to the model
+   \ingroup LWPR_C
+*/
+int lwpr_repl_start(LWPR_Replicator *R, struct LWPR_Model *model, int interval);
+
+/** \brief Adds a follower. Pending changes are published to the other followers first, then the
+      new follower receives a snapshot of the model.
+   \param[in,out] R   A replicator started with lwpr_repl_start
+   \param[in] fp      Stream opened for writing (binary mode). It is not closed by the replicator.
+   \return
+      - 1 in case of success
+      - 0 if the snapshot could not be written, in which case the follower is not added
+   \ingroup LWPR_C
+*/
+int lwpr_repl_add_follower(LWPR_Replicator *R, FILE *fp);
+
+/** \brief Writes a delta with all changes since the last one to all followers
+   \param[in,out] R   A replicator started with lwpr_repl_start
+   \return
+      - The number of followers that received the delta. Followers that could not be
+        written to are removed (and counted in LWPR_Replicator.n_lost).
+      - -1 if memory for the delta could not be allocated. The followers then need to be resynchronised.
+   \ingroup LWPR_C
+*/
+int lwpr_repl_publish(LWPR_Replicator *R);
+
+/** \brief Sends a snapshot of the model to all followers, e.g. after changing the model by other means than lwpr_update
+   \param[in,out] R   A replicator started with lwpr_repl_start
+   \return The number of followers that received the snapshot
+   \ingroup LWPR_C
+*/
+int lwpr_repl_resync(LWPR_Replicator *R);
+
+/** \brief Detaches a replicator from its model and releases its resources. Pending changes are not published.
+   \ingroup LWPR_C
+*/
+void lwpr_repl_stop(LWPR_Replicator *R);
+
+/** \brief Called by lwpr_update after every update. Publishes a delta every LWPR_Replicator.interval updates. */
+void lwpr_repl_tick(LWPR_Replicator *R);
+
+/** \brief Called after the last receptive field of output dimension <em>dim</em> was added */
+void lwpr_repl_note_add(LWPR_Replicator *R, int dim);
+
+/** \brief Called before the receptive field at position <em>pos</em> of output dimension <em>dim</em>
+      is pruned and replaced by the last one */
+void lwpr_repl_note_prune(LWPR_Replicator *R, int dim, int pos);
+
+/** \brief Initialises a replication follower
+   \param[out] F      Pointer to an (unused) LWPR_Replica structure
+   \param[out] model  Model that receives the replica. It must not be initialised;
+                      the first message (a snapshot) initialises it.
+   \param[in] fp      Stream opened for reading (binary mode). It is not closed by the follower.
+   \ingroup LWPR_C
+*/
+void lwpr_replica_init(LWPR_Replica *F, struct LWPR_Model *model, FILE *fp);
+
+/** \brief Reads one message from the stream and applies it to the follower model. Blocks until
+      the message is complete.
+   \param[in,out] F   A follower initialised with lwpr_replica_init
+   \return
+      - 1 if a snapshot or delta was applied
+      - 0 at the end of the stream
+      - -1 if the message was corrupt, out of sequence or could not be applied. The follower
+        model is not usable then (LWPR_Replica.ready is 0) until the next snapshot arrives.
+   \ingroup LWPR_C
+*/
+int lwpr_replica_apply(LWPR_Replica *F);
+
+/** \brief Releases the resources of a follower. The follower model is kept, and must be
+      disposed of with lwpr_free_model if LWPR_Replica.ready is set.
+   \ingroup LWPR_C
+*/
+void lwpr_replica_close(LWPR_Replica *F);
+
+/** \brief Creates a Unix domain socket that listens at <em>path</em> (which is removed first)
+   \return The socket descriptor, or -1 in case of errors (and on Windows)
+   \ingroup LWPR_C
+*/
+int lwpr_repl_unix_listen(const char *path);
+
+/** \brief Waits for a follower to connect to a socket created with lwpr_repl_unix_listen
+   \return A stream for lwpr_repl_add_follower, or NULL in case of errors
+   \ingroup LWPR_C
+*/
+FILE *lwpr_repl_unix_accept(int sock);
+
+/** \brief Connects to a leader that listens at <em>path</em>
+   \return A stream for lwpr_replica_init, or NULL in case of errors
+   \ingroup LWPR_C
+*/
+FILE *lwpr_repl_unix_connect(const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
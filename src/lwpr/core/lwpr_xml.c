@@ -21,6 +21,7 @@ Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <lwpr/core/lwpr_aux.h>
 #include <lwpr/core/lwpr_mem.h>
 #include <lwpr/core/lwpr_xml.h>
+#include <lwpr/core/lwpr_binio.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -58,6 +59,28 @@ void lwpr_xml_write_matrix(FILE *fp, int level, const char *name, int M, int Ms,
    fprintf(fp,"</matrix>\n");
 }
 
+/* Like lwpr_xml_write_matrix, for a packed distance matrix of a RF (D, M, alpha, h, b),
+** which is written as a dense nIn x nIn matrix with zeros outside the blocks */
+static void lwpr_xml_write_metric(FILE *fp, int level, const char *name, const LWPR_Model *model, const double *val) {
+   int m,n,l;
+   int nIn = model->nIn;
+   double abs0 = fabs(val[0]);
+   const char *format = (abs0 != 0.0 && (abs0 >= 1000 || abs0 < 0.01)) ? " %12.6e" : " %12.6f";
+
+   for (l=0;l<level;l++) fprintf(fp,"\t");
+   fprintf(fp,"<matrix name='%s' rows='%d' columns='%d'>\n",name,nIn,nIn);
+   for (m=0;m<nIn;m++) {
+      for (l=0;l<level;l++) fprintf(fp,"\t");
+      for (n=0;n<nIn;n++) {
+         int in = (m>=model->block_begin[n] && m<model->block_end[n]);
+         fprintf(fp,format,in ? val[m+model->metric_col[n]] : 0.0);
+      }
+      fprintf(fp,"\n");
+   }
+   for (l=0;l<level;l++) fprintf(fp,"\t");
+   fprintf(fp,"</matrix>\n");
+}
+
 void lwpr_xml_write_vector(FILE *fp, int level, const char *name, int N, const double *val) {
    int n,l;
    double abs0 = fabs(val[0]);
@@ -108,9 +131,14 @@ void lwpr_xml_write_rf(FILE *fp, const LWPR_ReceptiveField *RF) {
    int nReg = RF->nReg;
 
    fprintf(fp,"\t\t<ReceptiveField nReg='%d'>\n",RF->nReg);
-   lwpr_xml_write_matrix(fp,3,"D",nIn,nInS,nIn,RF->D);
-   lwpr_xml_write_matrix(fp,3,"M",nIn,nInS,nIn,RF->M);
-   lwpr_xml_write_matrix(fp,3,"alpha",nIn,nInS,nIn,RF->alpha);
+   if (RF->L != NULL) {
+      lwpr_xml_write_matrix(fp,3,"L",nIn,nInS,RF->model->rank+1,RF->L);
+      lwpr_xml_write_matrix(fp,3,"alpha",nIn,nInS,RF->model->rank+1,RF->alpha);
+   } else {
+      lwpr_xml_write_metric(fp,3,"D",RF->model,RF->D);
+      lwpr_xml_write_metric(fp,3,"M",RF->model,RF->M);
+      lwpr_xml_write_metric(fp,3,"alpha",RF->model,RF->alpha);
+   }
    lwpr_xml_write_scalar(fp,3,"beta0",RF->beta0);
    lwpr_xml_write_vector(fp,3,"beta",nReg,RF->beta);
    lwpr_xml_write_vector(fp,3,"c",nIn,RF->c);
@@ -122,8 +150,10 @@ void lwpr_xml_write_rf(FILE *fp, const LWPR_ReceptiveField *RF) {
    lwpr_xml_write_matrix(fp,3,"P",nIn,nInS,nReg,RF->P);
    lwpr_xml_write_vector(fp,3,"H",nReg,RF->H);
    lwpr_xml_write_vector(fp,3,"r",nReg,RF->r);
-   lwpr_xml_write_matrix(fp,3,"h",nIn,nInS,nIn,RF->h);
-   lwpr_xml_write_matrix(fp,3,"b",nIn,nInS,nIn,RF->b);
+   if (RF->L == NULL) {
+      lwpr_xml_write_metric(fp,3,"h",RF->model,RF->h);
+      lwpr_xml_write_metric(fp,3,"b",RF->model,RF->b);
+   }
    lwpr_xml_write_vector(fp,3,"sum_w",nReg,RF->sum_w);
    lwpr_xml_write_vector(fp,3,"sum_e_cv2",nReg,RF->sum_e_cv2);
    lwpr_xml_write_scalar(fp,3,"sum_e2",RF->sum_e2);
@@ -133,7 +163,7 @@ void lwpr_xml_write_rf(FILE *fp, const LWPR_ReceptiveField *RF) {
    lwpr_xml_write_vector(fp,3,"lambda",nReg,RF->lambda);
    lwpr_xml_write_vector(fp,3,"mean_x",nIn,RF->mean_x);
    lwpr_xml_write_vector(fp,3,"var_x",nIn,RF->var_x);
-   lwpr_xml_write_scalar(fp,3,"w",RF->w);
+   lwpr_xml_write_scalar(fp,3,"w",lwpr_rf_activation(RF));
    lwpr_xml_write_vector(fp,3,"s",nReg,RF->s);
    fprintf(fp,"\t\t</ReceptiveField>\n");
 }
@@ -143,6 +173,9 @@ void lwpr_write_xml_fp(const LWPR_Model *model, FILE *fp) {
    int dim;
    const char *kern_name;
 
+   /* Loading the training statistics completes the model without changing its predictions */
+   if (model->lazy != NULL) (void) lwpr_finish_loading((LWPR_Model *) model);
+
    switch(model->kernel) {
       case LWPR_GAUSSIAN_KERNEL:
          kern_name = "Gaussian";
@@ -157,12 +190,30 @@ void lwpr_write_xml_fp(const LWPR_Model *model, FILE *fp) {
    fprintf(fp,"<?xml version='1.0' encoding='US-ASCII' ?>\n");
 
    if (model->name != NULL) {
-      fprintf(fp,"<LWPR name='%s' nIn='%d' nOut='%d' kernel='%s'>\n",
+      fprintf(fp,"<LWPR name='%s' nIn='%d' nOut='%d' kernel='%s'",
          model->name,model->nIn,model->nOut,kern_name);
    } else {
-      fprintf(fp,"<LWPR nIn='%d' nOut='%d' kernel='%s'>\n",
+      fprintf(fp,"<LWPR nIn='%d' nOut='%d' kernel='%s'",
          model->nIn,model->nOut,kern_name);
    }
+   if (model->nBlocks > 1) {
+      /* Sizes of the diagonal blocks of the distance metrics */
+      int i;
+      fprintf(fp," blocks='");
+      for (i=0;i<model->nIn;i=model->block_end[i]) {
+         fprintf(fp,(i==0) ? "%d" : " %d",model->block_end[i] - i);
+      }
+      fprintf(fp,"'");
+   }
+   if (model->rank > 0) {
+      /* Rank of low-rank-plus-diagonal distance metrics */
+      fprintf(fp," rank='%d'",model->rank);
+   }
+   if (model->proj_P != NULL) {
+      /* Dimensionality of the raw inputs before the projection */
+      fprintf(fp," nInRaw='%d'",model->nInRaw);
+   }
+   fprintf(fp,">\n");
    lwpr_xml_write_int(fp,1,"n_data",model->n_data);
    lwpr_xml_write_vector(fp,1,"mean_x",model->nIn,model->mean_x);
    lwpr_xml_write_vector(fp,1,"var_x",model->nIn,model->var_x);
@@ -183,12 +234,19 @@ void lwpr_write_xml_fp(const LWPR_Model *model, FILE *fp) {
    lwpr_xml_write_scalar(fp,1,"tau_lambda",model->tau_lambda);
    lwpr_xml_write_scalar(fp,1,"init_S2",model->init_S2);
    lwpr_xml_write_scalar(fp,1,"add_threshold",model->add_threshold);
+   if (model->proj_P != NULL) {
+      lwpr_xml_write_int(fp,1,"proj_interval",model->proj_interval);
+      lwpr_xml_write_matrix(fp,1,"proj_P",model->nIn,model->nInStore,model->nInRaw,model->proj_P);
+      lwpr_xml_write_vector(fp,1,"proj_mean",model->nInRaw,model->proj_mean);
+      lwpr_xml_write_matrix(fp,1,"proj_cov",model->nInRaw,model->nInRaw,model->nInRaw,model->proj_cov);
+   }
    for (dim=0;dim<model->nOut;dim++) {
       int num;
       const LWPR_SubModel *sub = &model->sub[dim];
       fprintf(fp,"\t<SubModel out_dim='%d' numRFS='%d'>\n",dim,sub->numRFS);
       lwpr_xml_write_int(fp,2,"n_pruned",sub->n_pruned);
       for (num=0;num<sub->numRFS;num++) {
+         lwpr_aux_rf_sync_D(sub->rf[num]);
          lwpr_xml_write_rf(fp,sub->rf[num]);
       }
       fprintf(fp,"\t</SubModel>\n");
@@ -351,6 +409,7 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
    LWPR_ReceptiveField *RF=NULL;
 
    ud->readN = ud->readM = ud->N = ud->M = 0;
+   ud->packed = 0;
 
    if (model->sub!=NULL) {
       sub = &(model->sub[ud->curSub]);
@@ -387,6 +446,9 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
       if (!strcmp(name,"LWPR")) {
          int nIn = 0,nOut = 0;
          const char *model_name = NULL;
+         const char *blocks = NULL;
+         int rank = 0;
+         int nInRaw = 0;
          LWPR_Kernel kern = LWPR_GAUSSIAN_KERNEL;
          at = atts;
 
@@ -398,6 +460,12 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
                nIn = atoi(at[1]);
             } else if (!strcmp(at[0],"nOut")) {
                nOut = atoi(at[1]);
+            } else if (!strcmp(at[0],"blocks")) {
+               blocks = at[1];
+            } else if (!strcmp(at[0],"rank")) {
+               rank = atoi(at[1]);
+            } else if (!strcmp(at[0],"nInRaw")) {
+               nInRaw = atoi(at[1]);
             } else if (!strcmp(at[0],"kernel")) {
                kern = LWPR_GAUSSIAN_KERNEL;
                if (!strcmp(at[1],"BiSquare")) {
@@ -416,6 +484,31 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
          if (nIn>0 && nOut > 0) {
             lwpr_init_model(model,nIn,nOut,model_name);
             model->kernel = kern;
+            if (blocks != NULL) {
+               int *sizes = (int *) LWPR_MALLOC(nIn*sizeof(int));
+               int nBlocks = 0;
+               char *end;
+
+               while (sizes != NULL && nBlocks < nIn) {
+                  int size = (int) strtol(blocks,&end,10);
+                  if (end == blocks) break;
+                  sizes[nBlocks++] = size;
+                  blocks = end;
+               }
+               if (sizes == NULL || !lwpr_set_blocks(model,nBlocks,sizes)) {
+                  ud->numErrors++;
+                  if (ud->errFile) fprintf(ud->errFile,"Invalid block structure of distance metrics.\n");
+               }
+               LWPR_FREE(sizes);
+            }
+            if (rank != 0 && !lwpr_set_rank(model,rank)) {
+               ud->numErrors++;
+               if (ud->errFile) fprintf(ud->errFile,"Invalid rank of distance metrics.\n");
+            }
+            if (nInRaw != 0 && !lwpr_set_projection(model,nInRaw,NULL,0)) {
+               ud->numErrors++;
+               if (ud->errFile) fprintf(ud->errFile,"Invalid input projection.\n");
+            }
          } else {
             ud->numErrors++;
             if (ud->errFile) fprintf(ud->errFile,"Error parsing LWPR element.\n");
@@ -466,6 +559,8 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
                ud->curPtr = (void *) &(model->update_D);
             } else if (!strcmp(fieldName,"meta")) {
                ud->curPtr = (void *) &(model->meta);
+            } else if (!strcmp(fieldName,"proj_interval") && model->proj_P != NULL) {
+               ud->curPtr = (void *) &(model->proj_interval);
             } else {
                lwpr_xml_report_unknown(ud,fieldName);
             }
@@ -507,6 +602,9 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
             } else if (!strcmp(fieldName,"norm_out")) {
                ud->curPtr = (void *) model->norm_out;
                wishN = model->nOut;
+            } else if (!strcmp(fieldName,"proj_mean") && model->proj_P != NULL) {
+               ud->curPtr = (void *) model->proj_mean;
+               wishN = model->nInRaw;
             } else {
                lwpr_xml_report_unknown(ud,fieldName);
                break;
@@ -519,12 +617,19 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
             break;
          case 4:
             wishN = wishM = model->nIn;
+            ud->MS = model->nInStore;
             if (!strcmp(fieldName,"init_alpha")) {
                ud->curPtr = (void *) model->init_alpha;
             } else if (!strcmp(fieldName,"init_D")) {
                ud->curPtr = (void *) model->init_D;
             } else if (!strcmp(fieldName,"init_M")) {
                ud->curPtr = (void *) model->init_M;
+            } else if (!strcmp(fieldName,"proj_P") && model->proj_P != NULL) {
+               ud->curPtr = (void *) model->proj_P;
+               wishN = model->nInRaw;
+            } else if (!strcmp(fieldName,"proj_cov") && model->proj_P != NULL) {
+               ud->curPtr = (void *) model->proj_cov;
+               wishN = wishM = ud->MS = model->nInRaw;
             } else {
                lwpr_xml_report_unknown(ud,fieldName);
                break;
@@ -532,8 +637,8 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
             if (wishN != N || wishM != M) {
                lwpr_xml_dim_error(ud,fieldName,wishM,wishN);
             } else {
-               ud->M = ud->N = model->nIn;
-               ud->MS = model->nInStore;
+               ud->M = M;
+               ud->N = N;
             }
             break;
 
@@ -658,20 +763,32 @@ void lwpr_xml_start_element(void *userData, const char *name, const char **atts)
          case 4:
             ud->M = M;
             ud->N = N;
-            if (!strcmp(fieldName,"D")) {
+            ud->MS = model->nInStore;
+            /* Low-rank metrics store L instead of D, M, b and h */
+            if (!strcmp(fieldName,"D") && RF->D != NULL) {
                ud->curPtr = (void *) RF->D;
+               ud->packed = 1;
                wishM = wishN = model->nIn;
-            } else if (!strcmp(fieldName,"M")) {
+            } else if (!strcmp(fieldName,"M") && RF->M != NULL) {
                ud->curPtr = (void *) RF->M;
+               ud->packed = 1;
                wishM = wishN = model->nIn;
+            } else if (!strcmp(fieldName,"L") && RF->L != NULL) {
+               ud->curPtr = (void *) RF->L;
+               wishM = model->nIn;
+               wishN = model->rank + 1;
             } else if (!strcmp(fieldName,"alpha")) {
                ud->curPtr = (void *) RF->alpha;
-               wishM = wishN = model->nIn;
-            } else if (!strcmp(fieldName,"b")) {
+               ud->packed = (RF->L == NULL);
+               wishM = model->nIn;
+               wishN = (RF->L != NULL) ? model->rank + 1 : model->nIn;
+            } else if (!strcmp(fieldName,"b") && RF->b != NULL) {
                ud->curPtr = (void *) RF->b;
+               ud->packed = 1;
                wishM = wishN = model->nIn;
-            } else if (!strcmp(fieldName,"h")) {
+            } else if (!strcmp(fieldName,"h") && RF->h != NULL) {
                ud->curPtr = (void *) RF->h;
+               ud->packed = 1;
                wishM = wishN = model->nIn;
             } else if (!strcmp(fieldName,"SXresYres")) {
                ud->curPtr = (void *) RF->SXresYres;
@@ -816,7 +933,12 @@ void lwpr_xml_handle_data(void *userData, const char *s, int len) {
                lwpr_xml_error(ud,"Too many elemtents in matrix field.\n");
                break;
             }
-            dest[ud->readM + ud->readN*ud->MS] = dVal;
+            if (!ud->packed) {
+               dest[ud->readM + ud->readN*ud->MS] = dVal;
+            } else if (ud->readM >= ud->model->block_begin[ud->readN] && ud->readM < ud->model->block_end[ud->readN]) {
+               /* Elements outside the blocks are zero and not stored */
+               dest[ud->readM + ud->model->metric_col[ud->readN]] = dVal;
+            }
             if (++ud->readN == ud->N) {
                if (++ud->readM < ud->M) ud->readN=0;
             }